@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdlib.h>
 
 #include "chunk.h"
@@ -12,6 +13,11 @@ void initChunk(Chunk *chunk)
     chunk->lineCount = 0;
     chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->cacheCount = 0;
+    chunk->caches = NULL;
+    chunk->tryCount = 0;
+    chunk->tryCapacity = 0;
+    chunk->tries = NULL;
     initValueArray(&chunk->constants);
 }
 
@@ -19,6 +25,8 @@ void freeChunk(Chunk *chunk)
 {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    FREE_ARRAY(PropertyCache, chunk->caches, chunk->cacheCount);
+    FREE_ARRAY(TryRegion, chunk->tries, chunk->tryCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -63,6 +71,55 @@ int addConstant(Chunk *chunk, Value value)
     return chunk->constants.count - 1;
 }
 
+// Numbers, literals and interned strings are immutable, so equal ones can
+// share a slot of the pool
+int findConstant(Chunk *chunk, Value value)
+{
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value constant = chunk->constants.values[i];
+        if (IS_NUMBER(value))
+        {
+            if (IS_NUMBER(constant) && AS_NUMBER(constant) == AS_NUMBER(value) &&
+                signbit(AS_NUMBER(constant)) == signbit(AS_NUMBER(value)))
+                return i;
+        }
+        else if (IS_BOOL(value))
+        {
+            if (IS_BOOL(constant) && AS_BOOL(constant) == AS_BOOL(value))
+                return i;
+        }
+        else if (IS_NULL(value))
+        {
+            if (IS_NULL(constant))
+                return i;
+        }
+        else if (IS_STRING(value))
+        {
+            if (IS_STRING(constant) && AS_STRING(constant) == AS_STRING(value))
+                return i;
+        }
+        else
+            break;
+    }
+    return -1;
+}
+
+void addTryRegion(Chunk *chunk, int start, int end, int handler)
+{
+    if (chunk->tryCapacity < chunk->tryCount + 1)
+    {
+        int oldCapacity = chunk->tryCapacity;
+        chunk->tryCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->tries = GROW_ARRAY(chunk->tries, TryRegion, oldCapacity, chunk->tryCapacity);
+    }
+
+    TryRegion *region = &chunk->tries[chunk->tryCount++];
+    region->start = start;
+    region->end = end;
+    region->handler = handler;
+}
+
 int getLine(Chunk *chunk, int instruction)
 {
     int start = 0;
@@ -17,6 +17,31 @@ typedef struct
     int line;
 } LineStart;
 
+// Remembers the class last seen by a property instruction and the slot
+// the field was found in
+typedef struct
+{
+    uint32_t classId;
+    int slot;
+} PropertyCache;
+
+// Instructions in [start, end) are inside a try block whose catch code is at
+// 'handler'. Nested blocks are recorded before the ones enclosing them
+typedef struct
+{
+    int start;
+    int end;
+    int handler;
+} TryRegion;
+
+// How OP_CLOSURE fills each upvalue of the new closure
+typedef enum
+{
+    CAPTURE_UPVALUE, // Shares an upvalue of the enclosing closure
+    CAPTURE_LOCAL,   // References a local of the enclosing frame
+    CAPTURE_VALUE    // Copies a local that is never reassigned
+} CaptureKind;
+
 typedef struct
 {
     int count;
@@ -26,12 +51,19 @@ typedef struct
     int lineCount;
     int lineCapacity;
     LineStart *lines;
+    int cacheCount;
+    PropertyCache *caches;
+    int tryCount;
+    int tryCapacity;
+    TryRegion *tries;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+int findConstant(Chunk *chunk, Value value);
+void addTryRegion(Chunk *chunk, int start, int end, int handler);
 int getLine(Chunk *chunk, int instruction);
 
 #endif
@@ -40,7 +40,7 @@ static bool extendClass(int argCount)
                 if (IS_FUNCTION(item->item) || IS_CLOSURE(item->item))
                     tableSet(&klass->methods, copyString(item->key, strlen(item->key)), item->item);
                 else
-                    tableSet(&klass->fields, copyString(item->key, strlen(item->key)), item->item);
+                    updateClassField(klass, copyString(item->key, strlen(item->key)), item->item);
                 nCopy++;
             }
         }
@@ -115,9 +115,12 @@ static bool extendClass(int argCount)
                 }
             }
 
-            for (int i = 0; i <= other->fields.capacityMask; i++)
+            Table fields;
+            initTable(&fields);
+            instanceFields(other, &fields);
+            for (int i = 0; i <= fields.capacityMask; i++)
             {
-                Entry *entry = &other->fields.entries[i];
+                Entry *entry = &fields.entries[i];
                 if (entry->key != NULL)
                 {
                     if (!tableGet(&klass->fields, entry->key, &tmp))
@@ -127,6 +130,7 @@ static bool extendClass(int argCount)
                     }
                 }
             }
+            freeTable(&fields);
         }
         else
         {
@@ -662,6 +662,422 @@ static bool fromList(int argCount)
     return true;
 }
 
+typedef struct
+{
+    Value key;
+    Value value;
+} SortItem;
+
+typedef struct SortContext_t SortContext;
+typedef bool (*SortLess)(SortContext *ctx, Value a, Value b);
+
+struct SortContext_t
+{
+    SortLess less;
+    Value cmp;
+    bool reverse;
+    bool error;
+};
+
+static bool numberLess(SortContext *ctx, Value a, Value b)
+{
+    return AS_NUMBER(a) < AS_NUMBER(b);
+}
+
+static bool stringLess(SortContext *ctx, Value a, Value b)
+{
+    return strcmp(AS_CSTRING(a), AS_CSTRING(b)) < 0;
+}
+
+static bool sortNumber(Value value, double *number)
+{
+    if (IS_NUMBER(value))
+        *number = AS_NUMBER(value);
+    else if (IS_BOOL(value))
+        *number = AS_BOOL(value) ? 1 : 0;
+    else if (IS_ENUM_VALUE(value) && IS_NUMBER(AS_ENUM_VALUE(value)->value))
+        *number = AS_NUMBER(AS_ENUM_VALUE(value)->value);
+    else
+        return false;
+    return true;
+}
+
+static bool defaultLess(SortContext *ctx, Value a, Value b)
+{
+    double na, nb;
+    bool isNumA = sortNumber(a, &na);
+    bool isNumB = sortNumber(b, &nb);
+
+    if (isNumA && isNumB)
+        return na < nb;
+    if (IS_STRING(a) && IS_STRING(b))
+        return strcmp(AS_CSTRING(a), AS_CSTRING(b)) < 0;
+    // Numbers are ordered before strings
+    if (isNumA && IS_STRING(b))
+        return true;
+    if (IS_STRING(a) && isNumB)
+        return false;
+    if (IS_NULL(a) || IS_NULL(b))
+        return IS_NULL(a) && !IS_NULL(b);
+
+    if (!ctx->error)
+    {
+        char *typeA = valueType(a);
+        char *typeB = valueType(b);
+        runtimeError("Cannot compare '%s' and '%s' without a comparator", typeA, typeB);
+        mp_free(typeA);
+        mp_free(typeB);
+    }
+    ctx->error = true;
+    return false;
+}
+
+static bool callbackLess(SortContext *ctx, Value a, Value b)
+{
+    if (ctx->error)
+        return false;
+
+    Value args[2] = {a, b};
+    Value result;
+    if (!callFunction(ctx->cmp, 2, args, &result))
+    {
+        ctx->error = true;
+        return false;
+    }
+
+    // A comparator may be a predicate (a < b) or return a signed number
+    if (IS_NUMBER(result))
+        return AS_NUMBER(result) < 0;
+    return !isFalsey(result);
+}
+
+static inline bool itemLess(SortContext *ctx, SortItem *a, SortItem *b)
+{
+    if (ctx->reverse)
+        return ctx->less(ctx, b->key, a->key);
+    return ctx->less(ctx, a->key, b->key);
+}
+
+#define SORT_MIN_RUN 16
+
+static void insertionSort(SortContext *ctx, SortItem *items, int low, int high)
+{
+    for (int i = low + 1; i < high && !ctx->error; i++)
+    {
+        SortItem item = items[i];
+        int j = i;
+        while (j > low && itemLess(ctx, &item, &items[j - 1]))
+        {
+            items[j] = items[j - 1];
+            j--;
+        }
+        items[j] = item;
+    }
+}
+
+// Stable merge sort, small runs are sorted by insertion and
+// runs already in order are not merged
+static void mergeSort(SortContext *ctx, SortItem *items, SortItem *tmp, int low, int high)
+{
+    if (high - low <= SORT_MIN_RUN)
+    {
+        insertionSort(ctx, items, low, high);
+        return;
+    }
+
+    int mid = low + (high - low) / 2;
+    mergeSort(ctx, items, tmp, low, mid);
+    mergeSort(ctx, items, tmp, mid, high);
+
+    if (ctx->error || !itemLess(ctx, &items[mid], &items[mid - 1]))
+        return;
+
+    memcpy(tmp + low, items + low, sizeof(SortItem) * (mid - low));
+
+    int i = low, j = mid, k = low;
+    while (i < mid && j < high)
+    {
+        if (itemLess(ctx, &items[j], &tmp[i]))
+            items[k++] = items[j++];
+        else
+            items[k++] = tmp[i++];
+    }
+    while (i < mid)
+        items[k++] = tmp[i++];
+}
+
+static void initSortContext(SortContext *ctx, ObjList *list, Value cmp, bool reverse, SortItem *items)
+{
+    ctx->cmp = cmp;
+    ctx->reverse = reverse;
+    ctx->error = false;
+
+    if (!IS_NULL(cmp))
+    {
+        ctx->less = callbackLess;
+        return;
+    }
+
+    bool numbers = true, strings = true;
+    for (int i = 0; i < list->values.count && (numbers || strings); i++)
+    {
+        Value key = items != NULL ? items[i].key : list->values.values[i];
+        numbers = numbers && IS_NUMBER(key);
+        strings = strings && IS_STRING(key);
+    }
+
+    if (numbers)
+        ctx->less = numberLess;
+    else if (strings)
+        ctx->less = stringLess;
+    else
+        ctx->less = defaultLess;
+}
+
+static bool sortList(int argCount)
+{
+    if (argCount < 1 || argCount > 4)
+    {
+        runtimeError("sort() takes between 1 and 4 arguments (%d given)", argCount);
+        return false;
+    }
+
+    Value reverse = argCount > 3 ? pop() : FALSE_VAL;
+    Value cmp = argCount > 2 ? pop() : NULL_VAL;
+    Value key = argCount > 1 ? pop() : NULL_VAL;
+
+    // The list stays on the stack while callbacks run
+    ObjList *list = AS_LIST(peek(0));
+    int count = list->values.count;
+
+    // The items array is not seen by the GC, so the keys are also kept in a
+    // list that stays on the stack until the sort is done
+    ObjList *keys = initList();
+    push(OBJ_VAL(keys));
+
+    SortItem *items = ALLOCATE(SortItem, count + 1);
+    for (int i = 0; i < count; i++)
+    {
+        Value value = list->values.values[i];
+        items[i].value = value;
+        items[i].key = value;
+        if (!IS_NULL(key))
+        {
+            if (!callFunction(key, 1, &value, &items[i].key))
+            {
+                FREE_ARRAY(SortItem, items, count + 1);
+                pop();
+                return false;
+            }
+            push(items[i].key);
+            writeValueArray(&keys->values, items[i].key);
+            pop();
+        }
+    }
+
+    SortContext ctx;
+    initSortContext(&ctx, list, cmp, AS_BOOL(toBool(reverse)), items);
+
+    SortItem *tmp = ALLOCATE(SortItem, count + 1);
+    mergeSort(&ctx, items, tmp, 0, count);
+    FREE_ARRAY(SortItem, tmp, count + 1);
+
+    if (!ctx.error)
+    {
+        // The list may have been changed by a callback
+        for (int i = 0; i < count && i < list->values.count; i++)
+            list->values.values[i] = items[i].value;
+    }
+    FREE_ARRAY(SortItem, items, count + 1);
+    pop();
+
+    if (ctx.error)
+        return false;
+
+    pop();
+    push(OBJ_VAL(list));
+    return true;
+}
+
+static bool bisectList(int argCount)
+{
+    if (argCount < 2 || argCount > 3)
+    {
+        runtimeError("bisect() takes 2 or 3 arguments (%d given)", argCount);
+        return false;
+    }
+
+    bool right = argCount > 2 ? AS_BOOL(toBool(pop())) : false;
+    Value value = pop();
+    ObjList *list = AS_LIST(pop());
+
+    SortContext ctx;
+    ctx.cmp = NULL_VAL;
+    ctx.reverse = false;
+    ctx.error = false;
+    ctx.less = defaultLess;
+
+    int low = 0, high = list->values.count;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        bool before;
+        if (right)
+            before = !ctx.less(&ctx, value, list->values.values[mid]);
+        else
+            before = ctx.less(&ctx, list->values.values[mid], value);
+
+        if (ctx.error)
+            return false;
+
+        if (before)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    push(NUMBER_VAL(low));
+    return true;
+}
+
+static bool partitionList(int argCount)
+{
+    if (argCount != 2)
+    {
+        runtimeError("partition() takes 2 arguments (%d given)", argCount);
+        return false;
+    }
+
+    Value fn = pop();
+    ObjList *list = AS_LIST(peek(0));
+
+    // Stable partition: matching items keep their order at the front. Both
+    // sides stay on the stack and the list is only changed once every call
+    // succeeded, a callback that throws leaves it as it was
+    ObjList *accepted = initList();
+    push(OBJ_VAL(accepted));
+    ObjList *rejected = initList();
+    push(OBJ_VAL(rejected));
+
+    // The callback may change the list, so its length is read every time
+    for (int i = 0; i < list->values.count; i++)
+    {
+        Value value = list->values.values[i];
+        Value result;
+        if (!callFunction(fn, 1, &value, &result))
+        {
+            pop();
+            pop();
+            return false;
+        }
+
+        writeValueArray(!isFalsey(result) ? &accepted->values : &rejected->values, value);
+    }
+
+    list->values.count = 0;
+    for (int i = 0; i < accepted->values.count; i++)
+        writeValueArray(&list->values, accepted->values.values[i]);
+    for (int i = 0; i < rejected->values.count; i++)
+        writeValueArray(&list->values, rejected->values.values[i]);
+
+    int count = accepted->values.count;
+    pop();
+    pop();
+    pop();
+    push(NUMBER_VAL(count));
+    return true;
+}
+
+static bool nthElementList(int argCount)
+{
+    if (argCount < 2 || argCount > 3)
+    {
+        runtimeError("nth_element() takes 2 or 3 arguments (%d given)", argCount);
+        return false;
+    }
+
+    Value cmp = argCount > 2 ? pop() : NULL_VAL;
+
+    if (!IS_NUMBER(peek(0)))
+    {
+        runtimeError("nth_element() index must be a number");
+        return false;
+    }
+
+    int n = AS_NUMBER(pop());
+    ObjList *list = AS_LIST(peek(0));
+    int count = list->values.count;
+
+    if (n < 0)
+        n += count;
+    if (n < 0 || n >= count)
+    {
+        runtimeError("Index passed to nth_element() is out of bounds for the list given");
+        return false;
+    }
+
+    SortContext ctx;
+    initSortContext(&ctx, list, cmp, false, NULL);
+
+    // Quickselect with a median of three pivot
+    Value *values = list->values.values;
+    int low = 0, high = count - 1;
+    while (low < high && !ctx.error)
+    {
+        int mid = low + (high - low) / 2;
+        if (ctx.less(&ctx, values[mid], values[low]))
+        {
+            Value tmp = values[mid];
+            values[mid] = values[low];
+            values[low] = tmp;
+        }
+        if (ctx.less(&ctx, values[high], values[low]))
+        {
+            Value tmp = values[high];
+            values[high] = values[low];
+            values[low] = tmp;
+        }
+        if (ctx.less(&ctx, values[high], values[mid]))
+        {
+            Value tmp = values[high];
+            values[high] = values[mid];
+            values[mid] = tmp;
+        }
+
+        Value pivot = values[mid];
+        int i = low, j = high;
+        while (i <= j && !ctx.error)
+        {
+            while (i < high && ctx.less(&ctx, values[i], pivot) && !ctx.error)
+                i++;
+            while (j > low && ctx.less(&ctx, pivot, values[j]) && !ctx.error)
+                j--;
+            if (i <= j)
+            {
+                Value tmp = values[i];
+                values[i] = values[j];
+                values[j] = tmp;
+                i++;
+                j--;
+            }
+        }
+
+        if (n <= j)
+            high = j;
+        else if (n >= i)
+            low = i;
+        else
+            break;
+    }
+
+    if (ctx.error)
+        return false;
+
+    pop();
+    push(values[n]);
+    return true;
+}
+
 bool listMethods(char *method, int argCount)
 {
     if (strcmp(method, "push") == 0 || strcmp(method, "add") == 0)
@@ -696,6 +1112,14 @@ bool listMethods(char *method, int argCount)
         return joinListItems(argCount);
     else if (strcmp(method, "from") == 0)
         return fromList(argCount);
+    else if (strcmp(method, "sort") == 0)
+        return sortList(argCount);
+    else if (strcmp(method, "bisect") == 0)
+        return bisectList(argCount);
+    else if (strcmp(method, "partition") == 0)
+        return partitionList(argCount);
+    else if (strcmp(method, "nth_element") == 0)
+        return nthElementList(argCount);
 
     runtimeError("List has no method %s()", method);
     return false;
@@ -813,24 +1237,9 @@ static bool removeDictItem(int argCount)
     char *key = AS_CSTRING(pop());
     ObjDict *dict = AS_DICT(pop());
 
-    int index = hash(key) % dict->capacity;
-
-    while (dict->items[index] && strcmp(dict->items[index]->key, key) != 0)
+    if (deleteDict(dict, key))
     {
-        index++;
-        if (index == dict->capacity)
-            index = 0;
-    }
-
-    if (dict->items[index])
-    {
-        dict->items[index]->deleted = true;
-        dict->count--;
         push(NULL_VAL);
-
-        if (dict->capacity != 8 && dict->count * 100 / dict->capacity <= 35)
-            resizeDict(dict, false);
-
         return true;
     }
 
@@ -857,7 +1266,7 @@ static bool dictItemExists(int argCount)
 
     for (int i = 0; i < dict->capacity; ++i)
     {
-        if (!dict->items[i])
+        if (!dict->items[i] || dict->items[i]->deleted)
             continue;
 
         if (strcmp(dict->items[i]->key, key) == 0)
@@ -885,7 +1294,7 @@ bool dictContains(Value dictV, Value keyV, Value *result)
 
     for (int i = 0; i < dict->capacity; ++i)
     {
-        if (!dict->items[i])
+        if (!dict->items[i] || dict->items[i]->deleted)
             continue;
 
         if (strcmp(dict->items[i]->key, key) == 0)
@@ -1066,9 +1475,12 @@ static bool extendDict(int argCount)
                 }
             }
 
-            for (int i = 0; i <= other->fields.capacityMask; i++)
+            Table fields;
+            initTable(&fields);
+            instanceFields(other, &fields);
+            for (int i = 0; i <= fields.capacityMask; i++)
             {
-                Entry *entry = &other->fields.entries[i];
+                Entry *entry = &fields.entries[i];
                 if (entry->key != NULL)
                 {
                     dictContains(OBJ_VAL(dict), OBJ_VAL(entry->key), &tmp);
@@ -1079,6 +1491,7 @@ static bool extendDict(int argCount)
                     }
                 }
             }
+            freeTable(&fields);
         }
         else
         {
@@ -1115,4 +1528,726 @@ bool dictMethods(char *method, int argCount)
 
     runtimeError("Dict has no method %s()", method);
     return false;
-}
\ No newline at end of file
+}
+static int findSetSlot(ObjSet *set, Value value, uint32_t hash)
+{
+    if (set->capacity == 0)
+        return -1;
+
+    int mask = set->capacity - 1;
+    int slot = hash & mask;
+    for (;;)
+    {
+        SetEntry *entry = &set->entries[slot];
+        if (entry->index == SET_EMPTY)
+            return -1;
+        if (entry->index >= 0 && entry->hash == hash && valuesEqual(set->values.values[entry->index], value))
+            return slot;
+        slot = (slot + 1) & mask;
+    }
+}
+
+static void placeSetEntry(ObjSet *set, uint32_t hash, int index)
+{
+    int mask = set->capacity - 1;
+    int slot = hash & mask;
+    while (set->entries[slot].index >= 0)
+        slot = (slot + 1) & mask;
+    if (set->entries[slot].index == SET_EMPTY)
+        set->used++;
+    set->entries[slot].hash = hash;
+    set->entries[slot].index = index;
+}
+
+static void adjustSetCapacity(ObjSet *set, int capacity)
+{
+    SetEntry *old = set->entries;
+    int oldCapacity = set->capacity;
+
+    set->entries = ALLOCATE(SetEntry, capacity);
+    set->capacity = capacity;
+    set->used = 0;
+    for (int i = 0; i < capacity; i++)
+        set->entries[i].index = SET_EMPTY;
+
+    for (int i = 0; i < oldCapacity; i++)
+    {
+        if (old[i].index >= 0)
+            placeSetEntry(set, old[i].hash, old[i].index);
+    }
+
+    FREE_ARRAY(SetEntry, old, oldCapacity);
+}
+
+static bool unhashable(Value value)
+{
+    char *type = valueType(value);
+    runtimeError("Unhashable type '%s'.", type);
+    mp_free(type);
+    return false;
+}
+
+bool setAdd(ObjSet *set, Value value)
+{
+    uint32_t hash;
+    if (!hashValue(value, &hash))
+        return unhashable(value);
+
+    if (findSetSlot(set, value, hash) >= 0)
+        return true;
+
+    // Tombstones count towards the load, rebuilding in place clears them
+    if ((set->used + 1) * 4 > set->capacity * 3)
+    {
+        int capacity = set->capacity;
+        if ((set->values.count + 1) * 2 > capacity)
+            capacity = GROW_CAPACITY(capacity);
+        adjustSetCapacity(set, capacity);
+    }
+
+    placeSetEntry(set, hash, set->values.count);
+    writeValueArray(&set->values, value);
+    return true;
+}
+
+bool setContains(ObjSet *set, Value value)
+{
+    uint32_t hash;
+    if (!hashValue(value, &hash))
+        return false;
+    return findSetSlot(set, value, hash) >= 0;
+}
+
+bool setRemove(ObjSet *set, Value value)
+{
+    uint32_t hash;
+    if (!hashValue(value, &hash))
+        return false;
+
+    int slot = findSetSlot(set, value, hash);
+    if (slot < 0)
+        return false;
+
+    int index = set->entries[slot].index;
+    set->entries[slot].index = SET_TOMBSTONE;
+
+    // Keep the values dense by moving the last one into the hole
+    int last = set->values.count - 1;
+    if (index != last)
+    {
+        Value moved = set->values.values[last];
+        uint32_t movedHash;
+        hashValue(moved, &movedHash);
+
+        int mask = set->capacity - 1;
+        int movedSlot = movedHash & mask;
+        while (set->entries[movedSlot].index != last)
+            movedSlot = (movedSlot + 1) & mask;
+
+        set->entries[movedSlot].index = index;
+        set->values.values[index] = moved;
+    }
+    set->values.count--;
+    return true;
+}
+
+ObjSet *copySet(ObjSet *oldSet)
+{
+    ObjSet *set = initSet();
+    push(OBJ_VAL(set));
+    for (int i = 0; i < oldSet->values.count; i++)
+        writeValueArray(&set->values, oldSet->values.values[i]);
+
+    if (oldSet->capacity > 0)
+    {
+        set->entries = ALLOCATE(SetEntry, oldSet->capacity);
+        memcpy(set->entries, oldSet->entries, sizeof(SetEntry) * oldSet->capacity);
+        set->capacity = oldSet->capacity;
+        set->used = oldSet->used;
+    }
+    pop();
+    return set;
+}
+
+static ValueArray *setOperand(Value value, const char *method)
+{
+    if (IS_SET(value))
+        return &AS_SET(value)->values;
+    else if (IS_LIST(value))
+        return &AS_LIST(value)->values;
+
+    runtimeError("Argument passed to %s() must be a set or a list", method);
+    return NULL;
+}
+
+static bool addSetItem(int argCount)
+{
+    if (argCount != 2)
+    {
+        runtimeError("add() takes 2 arguments (%d given)", argCount);
+        return false;
+    }
+
+    Value item = pop();
+    ObjSet *set = AS_SET(pop());
+    if (!setAdd(set, item))
+        return false;
+    push(NULL_VAL);
+
+    return true;
+}
+
+static bool removeSetItem(int argCount)
+{
+    if (argCount != 2)
+    {
+        runtimeError("remove() takes 2 arguments (%d given)", argCount);
+        return false;
+    }
+
+    Value item = pop();
+    ObjSet *set = AS_SET(pop());
+    push(BOOL_VAL(setRemove(set, item)));
+
+    return true;
+}
+
+static bool containsSetItem(int argCount)
+{
+    if (argCount != 2)
+    {
+        runtimeError("contains() takes 2 arguments (%d given)", argCount);
+        return false;
+    }
+
+    Value item = pop();
+    ObjSet *set = AS_SET(pop());
+    push(BOOL_VAL(setContains(set, item)));
+
+    return true;
+}
+
+static bool clearSet(int argCount)
+{
+    if (argCount != 1)
+    {
+        runtimeError("clear() takes 1 argument (%d given)", argCount);
+        return false;
+    }
+
+    ObjSet *set = AS_SET(pop());
+    set->values.count = 0;
+    set->used = 0;
+    for (int i = 0; i < set->capacity; i++)
+        set->entries[i].index = SET_EMPTY;
+    push(NULL_VAL);
+
+    return true;
+}
+
+static bool copySetShallow(int argCount)
+{
+    if (argCount != 1)
+    {
+        runtimeError("copy() takes 1 argument (%d given)", argCount);
+        return false;
+    }
+
+    ObjSet *set = AS_SET(pop());
+    push(OBJ_VAL(copySet(set)));
+
+    return true;
+}
+
+static bool updateSet(int argCount)
+{
+    if (argCount != 2)
+    {
+        runtimeError("update() takes 2 arguments (%d given)", argCount);
+        return false;
+    }
+
+    ValueArray *other = setOperand(peek(0), "update");
+    if (other == NULL)
+        return false;
+
+    ObjSet *set = AS_SET(peek(1));
+    for (int i = 0; i < other->count; i++)
+    {
+        if (!setAdd(set, other->values[i]))
+            return false;
+    }
+
+    pop();
+    pop();
+    push(NULL_VAL);
+
+    return true;
+}
+
+static bool unionSet(int argCount)
+{
+    if (argCount != 2)
+    {
+        runtimeError("union() takes 2 arguments (%d given)", argCount);
+        return false;
+    }
+
+    ValueArray *other = setOperand(peek(0), "union");
+    if (other == NULL)
+        return false;
+
+    ObjSet *set = copySet(AS_SET(peek(1)));
+    push(OBJ_VAL(set));
+    for (int i = 0; i < other->count; i++)
+    {
+        if (!setAdd(set, other->values[i]))
+            return false;
+    }
+
+    pop();
+    pop();
+    pop();
+    push(OBJ_VAL(set));
+
+    return true;
+}
+
+static bool intersectionSet(int argCount)
+{
+    if (argCount != 2)
+    {
+        runtimeError("intersection() takes 2 arguments (%d given)", argCount);
+        return false;
+    }
+
+    ValueArray *other = setOperand(peek(0), "intersection");
+    if (other == NULL)
+        return false;
+
+    ObjSet *set = AS_SET(peek(1));
+    ObjSet *result = initSet();
+    push(OBJ_VAL(result));
+    for (int i = 0; i < other->count; i++)
+    {
+        if (setContains(set, other->values[i]))
+            setAdd(result, other->values[i]);
+    }
+
+    pop();
+    pop();
+    pop();
+    push(OBJ_VAL(result));
+
+    return true;
+}
+
+static bool differenceSet(int argCount)
+{
+    if (argCount != 2)
+    {
+        runtimeError("difference() takes 2 arguments (%d given)", argCount);
+        return false;
+    }
+
+    ValueArray *other = setOperand(peek(0), "difference");
+    if (other == NULL)
+        return false;
+
+    ObjSet *result = copySet(AS_SET(peek(1)));
+    push(OBJ_VAL(result));
+    for (int i = 0; i < other->count; i++)
+        setRemove(result, other->values[i]);
+
+    pop();
+    pop();
+    pop();
+    push(OBJ_VAL(result));
+
+    return true;
+}
+
+static bool subsetSet(int argCount)
+{
+    if (argCount != 2)
+    {
+        runtimeError("isSubset() takes 2 arguments (%d given)", argCount);
+        return false;
+    }
+
+    if (!IS_SET(peek(0)))
+    {
+        runtimeError("Argument passed to isSubset() must be a set");
+        return false;
+    }
+
+    ObjSet *other = AS_SET(pop());
+    ObjSet *set = AS_SET(pop());
+    bool subset = true;
+    for (int i = 0; i < set->values.count && subset; i++)
+        subset = setContains(other, set->values.values[i]);
+    push(BOOL_VAL(subset));
+
+    return true;
+}
+
+static bool listSet(int argCount)
+{
+    if (argCount != 1)
+    {
+        runtimeError("list() takes 1 argument (%d given)", argCount);
+        return false;
+    }
+
+    ObjSet *set = AS_SET(peek(0));
+    ObjList *list = initList();
+    push(OBJ_VAL(list));
+    for (int i = 0; i < set->values.count; i++)
+        writeValueArray(&list->values, set->values.values[i]);
+
+    pop();
+    pop();
+    push(OBJ_VAL(list));
+
+    return true;
+}
+
+bool setMethods(char *method, int argCount)
+{
+    if (strcmp(method, "add") == 0 || strcmp(method, "push") == 0)
+        return addSetItem(argCount);
+    else if (strcmp(method, "remove") == 0)
+        return removeSetItem(argCount);
+    else if (strcmp(method, "contains") == 0)
+        return containsSetItem(argCount);
+    else if (strcmp(method, "clear") == 0)
+        return clearSet(argCount);
+    else if (strcmp(method, "copy") == 0)
+        return copySetShallow(argCount);
+    else if (strcmp(method, "update") == 0)
+        return updateSet(argCount);
+    else if (strcmp(method, "union") == 0)
+        return unionSet(argCount);
+    else if (strcmp(method, "intersection") == 0)
+        return intersectionSet(argCount);
+    else if (strcmp(method, "difference") == 0)
+        return differenceSet(argCount);
+    else if (strcmp(method, "isSubset") == 0)
+        return subsetSet(argCount);
+    else if (strcmp(method, "list") == 0)
+        return listSet(argCount);
+
+    runtimeError("Set has no method %s()", method);
+    return false;
+}
+
+typedef enum
+{
+    STAGE_SELECT,
+    STAGE_WHERE,
+    STAGE_TAKE,
+    STAGE_SKIP,
+    STAGE_TAKE_WHILE,
+    STAGE_SKIP_WHILE,
+    STAGE_DISTINCT
+} StageKind;
+
+typedef struct
+{
+    StageKind kind;
+    Value fn;
+    int count;
+    bool active;
+    ObjSet *seen;
+} Stage;
+
+static bool parseStage(Value value, Stage *stage)
+{
+    if (!IS_LIST(value) || AS_LIST(value)->values.count != 2 || !IS_STRING(AS_LIST(value)->values.values[0]))
+    {
+        runtimeError("A pipeline stage must be a [name, argument] list");
+        return false;
+    }
+
+    char *name = AS_CSTRING(AS_LIST(value)->values.values[0]);
+    Value arg = AS_LIST(value)->values.values[1];
+    stage->fn = arg;
+    stage->count = 0;
+    stage->active = true;
+    stage->seen = NULL;
+
+    if (strcmp(name, "select") == 0)
+        stage->kind = STAGE_SELECT;
+    else if (strcmp(name, "where") == 0)
+        stage->kind = STAGE_WHERE;
+    else if (strcmp(name, "take") == 0)
+        stage->kind = STAGE_TAKE;
+    else if (strcmp(name, "skip") == 0)
+        stage->kind = STAGE_SKIP;
+    else if (strcmp(name, "takeWhile") == 0)
+        stage->kind = STAGE_TAKE_WHILE;
+    else if (strcmp(name, "skipWhile") == 0)
+        stage->kind = STAGE_SKIP_WHILE;
+    else if (strcmp(name, "distinct") == 0)
+    {
+        stage->kind = STAGE_DISTINCT;
+        stage->seen = initSet();
+        push(OBJ_VAL(stage->seen));
+    }
+    else
+    {
+        runtimeError("Unknown pipeline stage '%s'", name);
+        return false;
+    }
+
+    if ((stage->kind == STAGE_TAKE || stage->kind == STAGE_SKIP))
+    {
+        if (!IS_NUMBER(arg))
+        {
+            runtimeError("Pipeline stage '%s' expects a number", name);
+            return false;
+        }
+        stage->count = AS_NUMBER(arg);
+    }
+
+    return true;
+}
+
+typedef enum
+{
+    PIPE_NEXT,
+    PIPE_DROP,
+    PIPE_STOP,
+    PIPE_ERROR
+} PipeStep;
+
+// Runs one element through every stage, leaving the transformed value in *value
+static PipeStep pipeElement(Stage *stages, int count, Value *value)
+{
+    Value result;
+    for (int i = 0; i < count; i++)
+    {
+        Stage *stage = &stages[i];
+        switch (stage->kind)
+        {
+            case STAGE_SELECT:
+                if (!callFunction(stage->fn, 1, value, &result))
+                    return PIPE_ERROR;
+                *value = result;
+                break;
+
+            case STAGE_WHERE:
+                if (!callFunction(stage->fn, 1, value, &result))
+                    return PIPE_ERROR;
+                if (isFalsey(result))
+                    return PIPE_DROP;
+                break;
+
+            case STAGE_TAKE:
+                if (stage->count <= 0)
+                    return PIPE_STOP;
+                stage->count--;
+                break;
+
+            case STAGE_SKIP:
+                if (stage->count > 0)
+                {
+                    stage->count--;
+                    return PIPE_DROP;
+                }
+                break;
+
+            case STAGE_TAKE_WHILE:
+                if (!callFunction(stage->fn, 1, value, &result))
+                    return PIPE_ERROR;
+                if (isFalsey(result))
+                    return PIPE_STOP;
+                break;
+
+            case STAGE_SKIP_WHILE:
+                if (stage->active)
+                {
+                    if (!callFunction(stage->fn, 1, value, &result))
+                        return PIPE_ERROR;
+                    if (!isFalsey(result))
+                        return PIPE_DROP;
+                    stage->active = false;
+                }
+                break;
+
+            case STAGE_DISTINCT: {
+                Value key = *value;
+                if (!IS_NULL(stage->fn) && !callFunction(stage->fn, 1, value, &key))
+                    return PIPE_ERROR;
+                if (setContains(stage->seen, key))
+                    return PIPE_DROP;
+                if (!setAdd(stage->seen, key))
+                    return PIPE_ERROR;
+                break;
+            }
+        }
+    }
+    return PIPE_NEXT;
+}
+
+// Every stage reached after a take() that hit its limit can never emit again
+static bool pipeExhausted(Stage *stages, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (stages[i].kind == STAGE_TAKE && stages[i].count <= 0)
+            return true;
+    }
+    return false;
+}
+
+bool runPipeline(Value source, ObjList *stageList, const char *terminal, Value arg, Value *result)
+{
+    ValueArray *values = NULL;
+    ObjGenerator *generator = NULL;
+    if (IS_LIST(source))
+        values = &AS_LIST(source)->values;
+    else if (IS_SET(source))
+        values = &AS_SET(source)->values;
+    else if (IS_GENERATOR(source))
+        generator = AS_GENERATOR(source);
+    else
+    {
+        runtimeError("A pipeline source must be a list, a set or a generator");
+        return false;
+    }
+
+    enum
+    {
+        TERM_LIST,
+        TERM_FIRST,
+        TERM_ANY,
+        TERM_ALL,
+        TERM_COUNT
+    } term;
+
+    if (strcmp(terminal, "list") == 0)
+        term = TERM_LIST;
+    else if (strcmp(terminal, "first") == 0)
+        term = TERM_FIRST;
+    else if (strcmp(terminal, "any") == 0)
+        term = TERM_ANY;
+    else if (strcmp(terminal, "all") == 0)
+        term = TERM_ALL;
+    else if (strcmp(terminal, "count") == 0)
+        term = TERM_COUNT;
+    else
+    {
+        runtimeError("Unknown pipeline terminal '%s'", terminal);
+        return false;
+    }
+
+    Value *top = currentThread()->ctf->stackTop;
+    int count = stageList->values.count;
+    Stage *stages = ALLOCATE(Stage, count > 0 ? count : 1);
+    bool ok = true;
+    for (int i = 0; i < count && ok; i++)
+        ok = parseStage(stageList->values.values[i], &stages[i]);
+
+    ObjList *list = NULL;
+    if (term == TERM_LIST)
+    {
+        list = initList();
+        push(OBJ_VAL(list));
+    }
+
+    *result = NULL_VAL;
+    int matched = 0;
+    bool done = !ok;
+
+    // The source is read by index so callbacks that grow it don't invalidate the walk
+    // Generators are pulled one element at a time, so take() stops them early
+    for (int i = 0; !done; i++)
+    {
+        Value value;
+        if (generator != NULL)
+        {
+            bool produced;
+            if (!nextGenerator(generator, &produced))
+            {
+                ok = false;
+                break;
+            }
+            if (!produced)
+                break;
+            value = generator->current;
+        }
+        else if (i < values->count)
+            value = values->values[i];
+        else
+            break;
+
+        PipeStep step = pipeElement(stages, count, &value);
+        if (step == PIPE_ERROR)
+        {
+            ok = false;
+            break;
+        }
+        else if (step == PIPE_STOP)
+            break;
+        else if (step == PIPE_DROP)
+            continue;
+
+        if (term == TERM_ANY || term == TERM_ALL)
+        {
+            bool pass = true;
+            if (!IS_NULL(arg))
+            {
+                Value res;
+                if (!callFunction(arg, 1, &value, &res))
+                {
+                    ok = false;
+                    break;
+                }
+                pass = !isFalsey(res);
+            }
+            else
+                pass = !isFalsey(value);
+
+            if (term == TERM_ANY && pass)
+            {
+                matched = 1;
+                done = true;
+            }
+            else if (term == TERM_ALL && !pass)
+            {
+                matched = 1;
+                done = true;
+            }
+            continue;
+        }
+
+        matched++;
+        if (term == TERM_LIST)
+            writeValueArray(&list->values, value);
+        else if (term == TERM_FIRST)
+        {
+            *result = value;
+            done = true;
+        }
+
+        if (pipeExhausted(stages, count))
+            done = true;
+    }
+
+    FREE_ARRAY(Stage, stages, count > 0 ? count : 1);
+    currentThread()->ctf->stackTop = top;
+    if (!ok)
+        return false;
+
+    if (term == TERM_LIST)
+        *result = OBJ_VAL(list);
+    else if (term == TERM_ANY)
+        *result = BOOL_VAL(matched > 0);
+    else if (term == TERM_ALL)
+        *result = BOOL_VAL(matched == 0);
+    else if (term == TERM_COUNT)
+        *result = NUMBER_VAL(matched);
+
+    return true;
+}
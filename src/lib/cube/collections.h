@@ -11,6 +11,8 @@ bool listMethods(char *method, int argCount);
 
 bool dictMethods(char *method, int argCount);
 
+bool setMethods(char *method, int argCount);
+
 bool listContains(Value listV, Value search, Value *result);
 bool dictContains(Value dictV, Value keyV, Value *result);
 
@@ -22,4 +24,11 @@ void shrinkList(ObjList *list, int num);
 ObjList *copyList(ObjList *oldList, bool shallow);
 ObjDict *copyDict(ObjDict *oldDict, bool shallow);
 
+bool setAdd(ObjSet *set, Value value);
+bool setContains(ObjSet *set, Value value);
+bool setRemove(ObjSet *set, Value value);
+ObjSet *copySet(ObjSet *oldSet);
+
+bool runPipeline(Value source, ObjList *stages, const char *terminal, Value arg, Value *result);
+
 #endif
\ No newline at end of file
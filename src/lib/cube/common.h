@@ -31,7 +31,19 @@
 
 #define MAX_THREADS 1
 
-// #define USE_COMPUTED_GOTO
+#if MAX_THREADS > 1
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+#else
+#define THREAD_LOCAL
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define USE_COMPUTED_GOTO
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 #define UINT16_COUNT (UINT16_MAX + 1)
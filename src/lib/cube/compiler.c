@@ -14,6 +14,7 @@
 #include "gc.h"
 #include "memory.h"
 #include "mempool.h"
+#include "optimizer.h"
 #include "packer.h"
 #include "parser.h"
 #include "scanner.h"
@@ -24,8 +25,12 @@
 #endif
 
 static char *initString = "<CUBE>";
+// Follows initString in compiled files and changes with the chunk layout.
+// Files from before it was added hold their size there, which is never this
+#define BYTECODE_VERSION 1
 GlobalCompiler *gbcpl = NULL;
 bool printCode = false;
+bool optimizeCode = true;
 
 #define VAR_TYPES (TOKEN_IDENTIFIER | TOKEN_NULL | TOKEN_FUNC | TOKEN_CLASS | TOKEN_ENUM)
 
@@ -67,6 +72,7 @@ static void errorAt(Token *token, const char *message)
         return;
     gbcpl->parser.panicMode = true;
 
+    fflush(stdout);
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
@@ -169,8 +175,13 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
     emitByte(byte2);
 }
 
+static void markAssigned(Compiler *compiler, bool isLocal, uint16_t index);
+
 static void emitShort(uint8_t op, uint16_t value)
 {
+    if (op == OP_SET_LOCAL || op == OP_SET_UPVALUE)
+        markAssigned(gbcpl->current, op == OP_SET_LOCAL, value);
+
     emitByte(op);
     emitByte((value >> 8) & 0xFF);
     emitByte(value & 0xFF);
@@ -233,7 +244,9 @@ static void emitReturn()
 
 static uint16_t makeConstant(Value value)
 {
-    int constant = addConstant(currentChunk(), value);
+    int constant = findConstant(currentChunk(), value);
+    if (constant < 0)
+        constant = addConstant(currentChunk(), value);
     if (constant > UINT16_MAX)
     {
         error("Too many constants in one chunk.");
@@ -302,6 +315,10 @@ static void initCompiler(Compiler *compiler, FunctionType type)
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
     compiler->loopDepth = 0;
+    compiler->tryDepth = 0;
+    compiler->captures = NULL;
+    compiler->captureCount = 0;
+    compiler->captureCapacity = 0;
     compiler->function = newFunction(type == TYPE_STATIC);
     if (gbcpl->current != NULL)
         compiler->path = gbcpl->current->path;
@@ -320,6 +337,7 @@ static void initCompiler(Compiler *compiler, FunctionType type)
     Local *local = &gbcpl->current->locals[gbcpl->current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->isAssigned = false;
     if (type == TYPE_INITIALIZER || type == TYPE_METHOD || type == TYPE_EXTENSION || type == TYPE_STATIC)
     {
         local->name.start = "this";
@@ -332,10 +350,17 @@ static void initCompiler(Compiler *compiler, FunctionType type)
     }
 }
 
+static void resolveCaptures(int slot);
+
 static ObjFunction *endCompiler()
 {
     emitReturn();
+    resolveCaptures(0);
     ObjFunction *fn = gbcpl->current->function;
+
+    // The debugger stops on source lines, so it sees the code as written
+    if (optimizeCode && !vm.debug && !gbcpl->parser.hadError)
+        optimizeChunk(currentChunk());
     if (gbcpl->current->path == NULL)
         fn->path = NULL;
     else
@@ -361,6 +386,8 @@ static void freeCompilerInternals(Compiler *compiler)
 {
     mp_free(compiler->locals);
     mp_free(compiler->upvalues);
+    if (compiler->captures != NULL)
+        mp_free(compiler->captures);
 }
 
 static void beginScope()
@@ -368,6 +395,53 @@ static void beginScope()
     gbcpl->current->scopeDepth++;
 }
 
+// Captures of locals from 'slot' up are final: the ones never reassigned are
+// copied into the closure instead of referencing the stack
+static void resolveCaptures(int slot)
+{
+    Compiler *compiler = gbcpl->current;
+    int count = 0;
+    for (int i = 0; i < compiler->captureCount; i++)
+    {
+        Capture *capture = &compiler->captures[i];
+        if (capture->slot < slot)
+        {
+            compiler->captures[count++] = *capture;
+            continue;
+        }
+
+        if (!compiler->locals[capture->slot].isAssigned)
+            currentChunk()->code[capture->offset] = CAPTURE_VALUE;
+    }
+    compiler->captureCount = count;
+}
+
+static void addCapture(Compiler *compiler, int slot, int offset)
+{
+    if (compiler->captureCount == compiler->captureCapacity)
+    {
+        compiler->captureCapacity = compiler->captureCapacity < 8 ? 8 : compiler->captureCapacity * 2;
+        compiler->captures = (Capture *)mp_realloc(compiler->captures, sizeof(Capture) * compiler->captureCapacity);
+    }
+
+    compiler->captures[compiler->captureCount].slot = slot;
+    compiler->captures[compiler->captureCount].offset = offset;
+    compiler->captureCount++;
+}
+
+// Writes through an upvalue are traced back to the local that owns it
+static void markAssigned(Compiler *compiler, bool isLocal, uint16_t index)
+{
+    while (!isLocal)
+    {
+        Upvalue *upvalue = &compiler->upvalues[index];
+        isLocal = upvalue->isLocal;
+        index = upvalue->index;
+        compiler = compiler->enclosing;
+    }
+    compiler->locals[index].isAssigned = true;
+}
+
 static void endScope()
 {
     gbcpl->current->scopeDepth--;
@@ -375,7 +449,10 @@ static void endScope()
     while (gbcpl->current->localCount > 0 &&
            gbcpl->current->locals[gbcpl->current->localCount - 1].depth > gbcpl->current->scopeDepth)
     {
-        if (gbcpl->current->locals[gbcpl->current->localCount - 1].isCaptured)
+        resolveCaptures(gbcpl->current->localCount - 1);
+
+        Local *local = &gbcpl->current->locals[gbcpl->current->localCount - 1];
+        if (local->isCaptured && local->isAssigned)
         {
             emitByte(OP_CLOSE_UPVALUE);
         }
@@ -455,6 +532,9 @@ static int resolveUpvalue(Compiler *compiler, Token *name)
     int local = resolveLocal(compiler->enclosing, name, true);
     if (local != -1)
     {
+        // A local captured by its own initializer has no value to copy yet
+        if (compiler->enclosing->locals[local].depth == -1)
+            compiler->enclosing->locals[local].isAssigned = true;
         compiler->enclosing->locals[local].isCaptured = true;
         return addUpvalue(compiler, (uint16_t)local, true);
     }
@@ -480,6 +560,7 @@ static void addLocal(Token name)
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->isAssigned = false;
 }
 
 static uint16_t setVariablePop(Token name)
@@ -901,10 +982,27 @@ static void binary(bool canAssign)
     }
 }
 
+static Chunk *lastCallChunk = NULL;
+static int lastCallOffset = -1;
+
 static void call(bool canAssign)
 {
     uint8_t argCount = argumentList();
     emitBytes(OP_CALL, argCount);
+    lastCallChunk = currentChunk();
+    lastCallOffset = currentChunk()->count - 2;
+}
+
+// Returns the value on the stack. When it comes straight from a call the
+// call becomes a tail call, which reuses this frame unless a try block in
+// the function has to stay around to catch its errors
+static void emitValueReturn()
+{
+    if (lastCallChunk == currentChunk() && lastCallOffset == currentChunk()->count - 2 &&
+        currentChunk()->code[lastCallOffset] == OP_CALL && gbcpl->current->tryDepth == 0 &&
+        gbcpl->current->type != TYPE_INITIALIZER)
+        currentChunk()->code[lastCallOffset] = OP_TAIL_CALL;
+    emitByte(OP_RETURN);
 }
 
 static void emitPreviousAsString()
@@ -1163,9 +1261,16 @@ static void string(bool canAssign)
                 i++;
                 str[j++] = '{';
             }
+            else if (gbcpl->parser.previous.start[i + 1] == '\\' || gbcpl->parser.previous.start[i + 1] == '\'' ||
+                     gbcpl->parser.previous.start[i + 1] == '"')
+            {
+                i++;
+                str[j++] = gbcpl->parser.previous.start[i];
+            }
             else
             {
-                str[j++] == '\\';
+                // Unknown escapes keep their backslash, as in '\d'
+                str[j++] = '\\';
             }
         }
         else if (gbcpl->parser.previous.start[i] == '$' && i < gbcpl->parser.previous.length - 4 &&
@@ -1381,6 +1486,19 @@ static uint16_t createSyntheticVariable(const char *name, Token *token)
     return it;
 }
 
+static void emitClosure(Compiler *compiler, ObjFunction *fn)
+{
+    emitShort(OP_CLOSURE, makeConstant(OBJ_VAL(fn)));
+
+    for (int i = 0; i < fn->upvalueCount; i++)
+    {
+        if (compiler->upvalues[i].isLocal)
+            addCapture(gbcpl->current, compiler->upvalues[i].index, currentChunk()->count);
+        emitByte(compiler->upvalues[i].isLocal ? CAPTURE_LOCAL : CAPTURE_UPVALUE);
+        emitShortAlone(compiler->upvalues[i].index);
+    }
+}
+
 static void function(FunctionType type)
 {
     Compiler compiler;
@@ -1437,7 +1555,7 @@ static void function(FunctionType type)
             errorAtCurrent("Only scoped '{}' and short '=>' functions allowed.");
         expression();
         match(TOKEN_SEMICOLON);
-        emitByte(OP_RETURN);
+        emitValueReturn();
     }
     else
     {
@@ -1453,14 +1571,7 @@ static void function(FunctionType type)
 
     // Create the function object.
     ObjFunction *fn = endCompiler();
-
-    emitShort(OP_CLOSURE, makeConstant(OBJ_VAL(fn)));
-
-    for (int i = 0; i < fn->upvalueCount; i++)
-    {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitShortAlone(compiler.upvalues[i].index);
-    }
+    emitClosure(&compiler, fn);
 
     freeCompilerInternals(&compiler);
 }
@@ -1540,6 +1651,16 @@ static void lambda(bool canAssign)
 }
 
 static int expand_step = 0;
+static Chunk *lastExpandChunk = NULL;
+static int lastExpandOffset = -1;
+
+static void emitExpand()
+{
+    emitByte(OP_EXPAND);
+    lastExpandChunk = currentChunk();
+    lastExpandOffset = currentChunk()->count - 1;
+}
+
 static void expand(bool canAssign)
 {
     expand_step = 1;
@@ -1561,7 +1682,7 @@ static void expand(bool canAssign)
 
     emitByte(ex ? OP_TRUE : OP_FALSE);
 
-    emitByte(OP_EXPAND);
+    emitExpand();
 }
 
 static void expand_prefix(bool canAssign)
@@ -1586,7 +1707,7 @@ static void expand_prefix(bool canAssign)
 
     emitByte(ex ? OP_TRUE : OP_FALSE);
 
-    emitByte(OP_EXPAND);
+    emitExpand();
 }
 
 static void prefix(bool canAssign)
@@ -1683,6 +1804,22 @@ static void await(bool canAssign)
     emitByte(OP_AWAIT);
 }
 
+static void yield(bool canAssign)
+{
+    if (gbcpl->current->type == TYPE_SCRIPT)
+        error("Cannot yield from top-level code.");
+    else if (gbcpl->current->type == TYPE_INITIALIZER)
+        error("Cannot yield from an initializer.");
+
+    gbcpl->current->function->generator = true;
+
+    if (check(TOKEN_RIGHT_BRACE) || check(TOKEN_SEMICOLON))
+        emitByte(OP_NULL);
+    else
+        parsePrecedence(PREC_ASSIGNMENT);
+    emitByte(OP_YIELD);
+}
+
 static void async(bool canAssign)
 {
     consume(TOKEN_IDENTIFIER, "Expect a function call in async.");
@@ -1707,13 +1844,7 @@ static void async(bool canAssign)
 
     // Create the function object.
     ObjFunction *fn = endCompiler();
-    emitShort(OP_CLOSURE, makeConstant(OBJ_VAL(fn)));
-
-    for (int i = 0; i < fn->upvalueCount; i++)
-    {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitShortAlone(compiler.upvalues[i].index);
-    }
+    emitClosure(&compiler, fn);
 
     freeCompilerInternals(&compiler);
 
@@ -1817,6 +1948,7 @@ ParseRule rules[] = {
     {NULL, NULL, PREC_NULL},              // TOKEN_CATCH
     {NULL, NULL, PREC_NULL},              // TOKEN_ASSERT
     {NULL, NULL, PREC_NULL},              // TOKEN_SECURE
+    {yield, NULL, PREC_NULL},             // TOKEN_YIELD
     {NULL, NULL, PREC_NULL},              // TOKEN_DOC
     {NULL, NULL, PREC_NULL},              // TOKEN_PASS
     {NULL, NULL, PREC_NULL},              // TOKEN_CUBE
@@ -2573,7 +2705,8 @@ static void funDeclaration()
             global = 0;
         else
             global = identifierConstant(&gbcpl->parser.previous);
-        markInitialized();
+        // Initialized by defineVariable, so a recursive local function
+        // captures itself by reference
         function(TYPE_FUNCTION);
         defineVariable(global);
     }
@@ -2743,6 +2876,9 @@ static void forStatement()
                 defineVariable(var);
 
                 expression();
+                // A range that is the whole iterable is produced lazily instead of being expanded
+                if (lastExpandChunk == currentChunk() && lastExpandOffset == currentChunk()->count - 1)
+                    currentChunk()->code[lastExpandOffset] = OP_RANGE;
                 setVariablePop(valVar);
 
                 if (!hasIndex)
@@ -2807,16 +2943,9 @@ static void forStatement()
     }
     else if (in)
     {
-        beginSyntheticCall("len");
         getVariable(valVar);
-        endSyntheticCall(1);
-        setVariablePop(condVar);
-        emitByte(OP_POP);
-
         getVariable(loopVar);
-        getVariable(condVar);
-        // emitConstant(NUMBER_VAL(5));
-        emitByte(OP_LESS);
+        emitByte(OP_ITER);
         exitJump = emitJump(OP_JUMP_IF_FALSE);
         emitByte(OP_POP); // Condition.
     }
@@ -2934,6 +3063,7 @@ static void withStatement()
     Local *local = &gbcpl->current->locals[gbcpl->current->localCount++];
     local->depth = gbcpl->current->scopeDepth;
     local->isCaptured = false;
+    local->isAssigned = false;
     local->name = file;
 
     emitByte(OP_FILE);
@@ -2973,7 +3103,7 @@ static void returnStatement()
         expression();
         // consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
         match(TOKEN_SEMICOLON);
-        emitByte(OP_RETURN);
+        emitValueReturn();
     }
 }
 
@@ -3362,14 +3492,18 @@ static void switchStatement()
     emitByte(OP_POP); // The switch value.
 }
 
+// A try block costs nothing on entry: its range is recorded in the chunk
+// and only looked up when an error is raised
 static void tryStatement()
 {
-    int catch = emitJump(OP_TRY);
+    int start = currentChunk()->count;
 
+    gbcpl->current->tryDepth++;
     declaration(true);
+    gbcpl->current->tryDepth--;
 
-    int end = emitJump(OP_CLOSE_TRY);
-    patchJump(catch);
+    int end = emitJump(OP_JUMP);
+    addTryRegion(currentChunk(), start, end - 1, currentChunk()->count);
 
     if (match(TOKEN_CATCH))
     {
@@ -3599,13 +3733,23 @@ ObjFunction *compile(const char *source, const char *path)
     {
         char *src = (char *)source + strlen(initString);
 
-        uint32_t len = ((uint32_t *)src)[0];
+        uint32_t version = ((uint32_t *)src)[0];
         src += sizeof(uint32_t);
+        if (version != BYTECODE_VERSION)
+        {
+            fprintf(stderr, "'%s' was compiled by an incompatible version of cube, compile it again.\n",
+                    path != NULL ? path : "The code");
+        }
+        else
+        {
+            uint32_t len = ((uint32_t *)src)[0];
+            src += sizeof(uint32_t);
 
-        uint32_t pos = 0;
-        Value value = loadByteCode(src, &pos, len);
-        if (IS_FUNCTION(value))
-            fn = AS_FUNCTION(value);
+            uint32_t pos = 0;
+            Value value = loadByteCode(src, &pos, len);
+            if (IS_FUNCTION(value))
+                fn = AS_FUNCTION(value);
+        }
     }
     else
     {
@@ -3697,9 +3841,12 @@ bool writeByteCodeChunk(FILE *file, Chunk *chunk);
 
 bool initByteCode(FILE *file)
 {
+    uint32_t version = BYTECODE_VERSION;
     uint32_t sz = 0;
     if (fwrite(initString, sizeof(char), strlen(initString), file) != strlen(initString))
         return false;
+    if (fwrite(&version, sizeof(version), 1, file) != 1)
+        return false;
     if (fwrite(&sz, sizeof(sz), 1, file) != 1)
         return false;
     return true;
@@ -3828,6 +3975,8 @@ bool writeByteCode(FILE *file, Value value)
             return false;
         if (fwrite(&func->staticMethod, sizeof(func->staticMethod), 1, file) != 1)
             return false;
+        if (fwrite(&func->generator, sizeof(func->generator), 1, file) != 1)
+            return false;
         if (fwrite(&func->upvalueCount, sizeof(func->upvalueCount), 1, file) != 1)
             return false;
         if (!writeByteCodeChunk(file, &func->chunk))
@@ -3955,6 +4104,10 @@ bool writeByteCodeChunk(FILE *file, Chunk *chunk)
         if (!writeByteCode(file, chunk->constants.values[i]))
             return false;
     }
+    if (fwrite(&chunk->tryCount, sizeof(chunk->tryCount), 1, file) != 1)
+        return false;
+    if (fwrite(chunk->tries, sizeof(TryRegion), chunk->tryCount, file) != chunk->tryCount)
+        return false;
     return true;
 }
 
@@ -3964,7 +4117,7 @@ bool finishByteCode(FILE *file)
     uint32_t fileSize = ftell(file);
     rewind(file);
 
-    uint32_t pos = strlen(initString);
+    uint32_t pos = strlen(initString) + sizeof(uint32_t);
 
     fseek(file, pos, SEEK_SET);
     if (fwrite(&fileSize, sizeof(fileSize), 1, file) != 1)
@@ -4073,6 +4226,7 @@ Value loadByteCode(const char *source, uint32_t *pos, uint32_t total)
             func->name = AS_STRING(name);
             func->arity = READ(int);
             func->staticMethod = READ(bool);
+            func->generator = READ(bool);
             func->upvalueCount = READ(int);
             loadChunk(&func->chunk, source, pos, total);
 
@@ -4169,4 +4323,9 @@ void loadChunk(Chunk *chunk, const char *source, uint32_t *pos, uint32_t total)
         Value value = loadByteCode(source, pos, total);
         writeValueArray(&chunk->constants, value);
     }
+
+    chunk->tryCount = READ(int);
+    chunk->tryCapacity = chunk->tryCount;
+    chunk->tries = GROW_ARRAY(chunk->tries, TryRegion, 0, chunk->tryCapacity);
+    READ_ARRAY(TryRegion, chunk->tries, chunk->tryCount);
 }
\ No newline at end of file
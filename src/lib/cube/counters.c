@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "counters.h"
+#include "mempool.h"
+#include "util.h"
+
+// Executions and cumulative nanoseconds of one opcode, function, native or
+// builtin method
+typedef struct
+{
+    char *name;
+    ObjType type;
+    uint64_t count;
+    uint64_t time;
+} Counter;
+
+typedef struct
+{
+    Counter *items;
+    int count;
+    int capacity;
+} CounterList;
+
+static const char *opcodeNames[] = {
+#define OPCODE(name) #name,
+#include "opcodes.h"
+#undef OPCODE
+};
+
+#define OPCODE_COUNT ((int)(sizeof(opcodeNames) / sizeof(opcodeNames[0])))
+
+static Counter opcodes[OPCODE_COUNT];
+static CounterList functions = {NULL, 0, 0};
+static CounterList natives = {NULL, 0, 0};
+static CounterList methods = {NULL, 0, 0};
+
+// The instruction being timed, closed by the next call to countInstruction
+static int lastOpcode = -1;
+static int lastFunction = -1;
+static uint64_t lastTime = 0;
+
+static int addCounter(CounterList *list, const char *name, ObjType type)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity < 16 ? 16 : list->capacity * 2;
+        list->items = (Counter *)mp_realloc(list->items, sizeof(Counter) * list->capacity);
+    }
+
+    Counter *counter = &list->items[list->count];
+    counter->name = (char *)mp_malloc(strlen(name) + 1);
+    strcpy(counter->name, name);
+    counter->type = type;
+    counter->count = 0;
+    counter->time = 0;
+    return list->count++;
+}
+
+static void resetList(CounterList *list)
+{
+    for (int i = 0; i < list->count; i++)
+    {
+        list->items[i].count = 0;
+        list->items[i].time = 0;
+    }
+}
+
+static void freeList(CounterList *list)
+{
+    for (int i = 0; i < list->count; i++)
+        mp_free(list->items[i].name);
+    if (list->items != NULL)
+        mp_free(list->items);
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+// Objects keep the index of their counter, so the lists only grow and a
+// reset just zeroes them
+static int functionCounter(ObjFunction *function)
+{
+    if (function->counter < 0)
+    {
+        char name[512];
+        const char *path = function->path != NULL ? getFileName((char *)function->path) : "?";
+        if (function->name == NULL)
+            snprintf(name, sizeof(name), "<script> (%s)", path);
+        else
+            snprintf(name, sizeof(name), "%s (%s:%d)", function->name->chars, path, getLine(&function->chunk, 0));
+        function->counter = addCounter(&functions, name, OBJ_FUNCTION);
+    }
+    return function->counter;
+}
+
+static void closeInstruction(uint64_t now)
+{
+    if (lastOpcode < 0)
+        return;
+
+    opcodes[lastOpcode].time += now - lastTime;
+    if (lastFunction >= 0)
+        functions.items[lastFunction].time += now - lastTime;
+    lastOpcode = -1;
+}
+
+void startCounters()
+{
+    for (int i = 0; i < OPCODE_COUNT; i++)
+    {
+        opcodes[i].name = (char *)opcodeNames[i];
+        opcodes[i].count = 0;
+        opcodes[i].time = 0;
+    }
+    resetList(&functions);
+    resetList(&natives);
+    resetList(&methods);
+    lastOpcode = -1;
+    vm.counters = true;
+}
+
+void stopCounters()
+{
+    closeInstruction(cube_clock());
+    vm.counters = false;
+}
+
+// Called before each instruction while counting: the time since the
+// previous call goes to the previous opcode and to the function running it,
+// so function times exclude their callees
+void countInstruction(CallFrame *frame)
+{
+    uint64_t now = cube_clock();
+    closeInstruction(now);
+
+    lastOpcode = *frame->ip;
+    lastFunction = functionCounter(frame->closure->function);
+    opcodes[lastOpcode].count++;
+    lastTime = cube_clock();
+}
+
+void countCall(ObjFunction *function)
+{
+    int index = functionCounter(function);
+    functions.items[index].count++;
+}
+
+// Natives are timed including everything they call back into
+void countNative(int *counter, ObjString *lib, ObjString *name, uint64_t elapsed)
+{
+    if (*counter < 0)
+    {
+        char label[512];
+        if (lib != NULL)
+            snprintf(label, sizeof(label), "%s.%s", lib->chars, name != NULL ? name->chars : "?");
+        else
+            snprintf(label, sizeof(label), "%s", name != NULL ? name->chars : "?");
+        *counter = addCounter(&natives, label, OBJ_NATIVE);
+    }
+
+    natives.items[*counter].count++;
+    natives.items[*counter].time += elapsed;
+}
+
+void countMethod(ObjType type, ObjString *name, uint64_t elapsed)
+{
+    int index = -1;
+    for (int i = 0; i < methods.count; i++)
+    {
+        // Labels are "type.method"
+        if (methods.items[i].type == type &&
+            strcmp(methods.items[i].name + strlen(objTypeName(type)) + 1, name->chars) == 0)
+        {
+            index = i;
+            break;
+        }
+    }
+
+    if (index < 0)
+    {
+        char label[512];
+        snprintf(label, sizeof(label), "%s.%s", objTypeName(type), name->chars);
+        index = addCounter(&methods, label, type);
+    }
+
+    methods.items[index].count++;
+    methods.items[index].time += elapsed;
+}
+
+static ObjDict *listToDict(Counter *items, int count)
+{
+    ObjDict *dict = initDict();
+    for (int i = 0; i < count; i++)
+    {
+        if (items[i].count == 0)
+            continue;
+
+        ObjDict *item = initDict();
+        insertDict(item, "count", NUMBER_VAL(items[i].count));
+        insertDict(item, "time", NUMBER_VAL(items[i].time / 1e9));
+        insertDict(dict, items[i].name, OBJ_VAL(item));
+    }
+    return dict;
+}
+
+ObjDict *countersToDict()
+{
+    ObjDict *dict = initDict();
+    insertDict(dict, "opcodes", OBJ_VAL(listToDict(opcodes, OPCODE_COUNT)));
+    insertDict(dict, "functions", OBJ_VAL(listToDict(functions.items, functions.count)));
+    insertDict(dict, "natives", OBJ_VAL(listToDict(natives.items, natives.count)));
+    insertDict(dict, "methods", OBJ_VAL(listToDict(methods.items, methods.count)));
+    return dict;
+}
+
+static int compareCounters(const void *a, const void *b)
+{
+    const Counter *ca = *(const Counter **)a;
+    const Counter *cb = *(const Counter **)b;
+    if (ca->time != cb->time)
+        return ca->time < cb->time ? 1 : -1;
+    if (ca->count != cb->count)
+        return ca->count < cb->count ? 1 : -1;
+    return strcmp(ca->name, cb->name);
+}
+
+static void printList(FILE *file, const char *title, Counter *items, int count)
+{
+    Counter **sorted = (Counter **)mp_malloc(sizeof(Counter *) * (count > 0 ? count : 1));
+    int used = 0;
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (items[i].count == 0)
+            continue;
+        sorted[used++] = &items[i];
+        total += items[i].time;
+    }
+
+    if (used > 0)
+    {
+        qsort(sorted, used, sizeof(Counter *), compareCounters);
+        fprintf(file, "-----------------\n%s\n-----------------\n", title);
+        fprintf(file, "%14s %12s %7s  %s\n", "count", "time (ms)", "time%", "name");
+        for (int i = 0; i < used; i++)
+        {
+            fprintf(file, "%14llu %12.3f %6.2f%%  %s\n", (unsigned long long)sorted[i]->count, sorted[i]->time / 1e6,
+                    total > 0 ? 100.0 * sorted[i]->time / total : 0.0, sorted[i]->name);
+        }
+    }
+
+    mp_free(sorted);
+}
+
+void printCounters(FILE *file)
+{
+    printList(file, "Opcodes", opcodes, OPCODE_COUNT);
+    printList(file, "Functions", functions.items, functions.count);
+    printList(file, "Natives", natives.items, natives.count);
+    printList(file, "Methods", methods.items, methods.count);
+}
+
+void freeCounters()
+{
+    vm.counters = false;
+    freeList(&functions);
+    freeList(&natives);
+    freeList(&methods);
+}
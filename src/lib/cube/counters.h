@@ -0,0 +1,18 @@
+#ifndef CUBE_COUNTERS_h
+#define CUBE_COUNTERS_h
+#include <stdio.h>
+
+#include "object.h"
+#include "vm.h"
+
+void startCounters();
+void stopCounters();
+void countInstruction(CallFrame *frame);
+void countCall(ObjFunction *function);
+void countNative(int *counter, ObjString *lib, ObjString *name, uint64_t elapsed);
+void countMethod(ObjType type, ObjString *name, uint64_t elapsed);
+ObjDict *countersToDict();
+void printCounters(FILE *file);
+void freeCounters();
+
+#endif
@@ -8,12 +8,16 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "counters.h"
 #include "cube.h"
 #include "debug.h"
 #include "external/zip/zip.h"
+#include "gc.h"
 #include "linkedList.h"
 #include "mempool.h"
 #include "packer.h"
+#include "profiler.h"
+#include "std.h"
 #include "string.h"
 #include "util.h"
 #include "vm.h"
@@ -24,6 +28,7 @@ extern Value nativeToValue(cube_native_var *var, NativeTypes *nt);
 extern void valueToNative(cube_native_var *var, Value value);
 char *version_string;
 extern bool printCode;
+extern bool optimizeCode;
 
 void start(const char *path, const char *scriptName, const char *rootPath)
 {
@@ -34,6 +39,7 @@ void start(const char *path, const char *scriptName, const char *rootPath)
 #endif
 
     setupConsole();
+    initOutput();
 
     if (!mp_init())
     {
@@ -178,6 +184,11 @@ int runCube(int argc, const char *argv[])
     bool debug = false;
     bool forceInclude = false;
     bool zipPath = false;
+    const char *profilePath = NULL;
+    const char *profileTopPath = NULL;
+    int profileInterval = PROFILE_INTERVAL;
+    bool counters = false;
+    const char *snapshotPath = NULL;
     int argStart = 1;
     for (int i = 1; i < argc; i++)
     {
@@ -220,6 +231,11 @@ int runCube(int argc, const char *argv[])
             printCode = true;
             argStart++;
         }
+        else if (strcmp(argv[i], "--no-optimize") == 0)
+        {
+            optimizeCode = false;
+            argStart++;
+        }
         else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--include") == 0)
         {
             forceInclude = true;
@@ -262,6 +278,77 @@ int runCube(int argc, const char *argv[])
             zipPath = true;
             argStart++;
         }
+        else if (strcmp(argv[i], "--profile") == 0)
+        {
+            i++;
+            profilePath = argv[i];
+            argStart += 2;
+        }
+        else if (strcmp(argv[i], "--profile-top") == 0)
+        {
+            i++;
+            profileTopPath = argv[i];
+            argStart += 2;
+        }
+        else if (strcmp(argv[i], "--profile-interval") == 0)
+        {
+            i++;
+            profileInterval = atoi(argv[i]);
+            argStart += 2;
+        }
+        else if (strcmp(argv[i], "--counters") == 0)
+        {
+            counters = true;
+            argStart++;
+        }
+        else if (strcmp(argv[i], "--max-frames") == 0)
+        {
+            i++;
+            vm.maxFrames = atoi(argv[i]);
+            if (vm.maxFrames < FRAMES_MIN)
+                vm.maxFrames = FRAMES_MIN;
+            argStart += 2;
+        }
+        else if (strcmp(argv[i], "--gc-log") == 0)
+        {
+            i++;
+            gc_log(atof(argv[i]), stderr);
+            argStart += 2;
+        }
+        else if (strcmp(argv[i], "--heap-snapshot") == 0)
+        {
+            i++;
+            snapshotPath = argv[i];
+            argStart += 2;
+        }
+        else if (strcmp(argv[i], "--bench") == 0)
+        {
+            vm.bench.enabled = true;
+            argStart++;
+        }
+        else if (strcmp(argv[i], "--bench-runs") == 0)
+        {
+            i++;
+            vm.bench.runs = atoi(argv[i]);
+            if (vm.bench.runs < 1)
+            {
+                fprintf(stderr, "The --bench-runs option must be at least 1.\n");
+                return -1;
+            }
+            argStart += 2;
+        }
+        else if (strcmp(argv[i], "--bench-warmup") == 0)
+        {
+            i++;
+            vm.bench.warmup = atoi(argv[i]);
+            argStart += 2;
+        }
+        else if (strcmp(argv[i], "--bench-json") == 0)
+        {
+            i++;
+            vm.bench.output = argv[i];
+            argStart += 2;
+        }
     }
 
     vm.debug = debug;
@@ -269,6 +356,15 @@ int runCube(int argc, const char *argv[])
 
     loadArgs(argc, argv, argStart);
 
+    if (profilePath != NULL || profileTopPath != NULL)
+    {
+        if (!startProfiler(profileInterval))
+            fprintf(stderr, "Could not start the profiler.\n");
+    }
+
+    if (counters)
+        startCounters();
+
     if (argc == 1 || (argc == 2 && forceInclude) || (argc == 2 && debug))
     {
         rc = repl();
@@ -349,6 +445,24 @@ int runCube(int argc, const char *argv[])
             printf("\n");
     }
 
+    if (profilePath != NULL || profileTopPath != NULL)
+    {
+        stopProfiler();
+        if (profilePath != NULL && !saveProfile(profilePath, "folded"))
+            fprintf(stderr, "Could not write the profile to '%s'.\n", profilePath);
+        if (profileTopPath != NULL && !saveProfile(profileTopPath, "top"))
+            fprintf(stderr, "Could not write the profile to '%s'.\n", profileTopPath);
+    }
+
+    if (counters)
+    {
+        stopCounters();
+        printCounters(stderr);
+    }
+
+    if (snapshotPath != NULL && !gc_snapshot(snapshotPath))
+        fprintf(stderr, "Could not write the heap snapshot to '%s'.\n", snapshotPath);
+
     if (allocatedFileName)
     {
         mp_free(fileName);
@@ -420,6 +534,7 @@ int repl()
     char line[LINENOISE_MAX_LINE];
     for (;;)
     {
+        fflush(stdout);
         if (linenoise_read_line("> ", line))
         {
             printf("\n");
@@ -12,6 +12,12 @@ void disassembleChunk(Chunk *chunk, const char *name)
     {
         offset = disassembleInstruction(chunk, offset);
     }
+
+    for (int i = 0; i < chunk->tryCount; i++)
+    {
+        TryRegion *region = &chunk->tries[i];
+        printf("try %04d - %04d -> %04d\n", region->start, region->end, region->handler);
+    }
 }
 
 static int constantInstruction(const char *name, Chunk *chunk, int offset)
@@ -106,6 +112,12 @@ int disassembleInstruction(Chunk *chunk, int offset)
             return simpleInstruction("OP_FALSE", offset);
         case OP_EXPAND:
             return simpleInstruction("OP_EXPAND", offset);
+        case OP_RANGE:
+            return simpleInstruction("OP_RANGE", offset);
+        case OP_ITER:
+            return simpleInstruction("OP_ITER", offset);
+        case OP_YIELD:
+            return simpleInstruction("OP_YIELD", offset);
         case OP_NEW_LIST:
             return simpleInstruction("OP_NEW_LIST", offset);
         case OP_ADD_LIST:
@@ -200,6 +212,8 @@ int disassembleInstruction(Chunk *chunk, int offset)
             return jumpInstruction("OP_BREAK", 1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER:
@@ -215,9 +229,11 @@ int disassembleInstruction(Chunk *chunk, int offset)
             ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
             for (int j = 0; j < function->upvalueCount; j++)
             {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+                int kind = chunk->code[offset++];
+                int index = chunk->code[offset++] << 8;
+                index |= chunk->code[offset++];
+                printf("%04d      |                     %s %d\n", offset - 3,
+                       kind == CAPTURE_VALUE ? "value" : (kind == CAPTURE_LOCAL ? "local" : "upvalue"), index);
             }
 
             return offset;
@@ -261,10 +277,6 @@ int disassembleInstruction(Chunk *chunk, int offset)
             return simpleInstruction("OP_SUSPEND", offset);
         case OP_RESUME:
             return simpleInstruction("OP_RESUME", offset);
-        case OP_TRY:
-            return jumpInstruction("OP_TRY", 1, chunk, offset);
-        case OP_CLOSE_TRY:
-            return jumpInstruction("OP_CLOSE_TRY", 1, chunk, offset);
         case OP_NATIVE_FUNC:
             return simpleInstruction("OP_NATIVE_FUNC", offset);
         case OP_NATIVE_STRUCT:
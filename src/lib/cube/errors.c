@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "errors.h"
+#include "memory.h"
+#include "mempool.h"
+#include "strings.h"
+#include "vm.h"
+
+static char *copyText(const char *text)
+{
+    char *copy = (char *)mp_malloc(strlen(text) + 1);
+    strcpy(copy, text);
+    return copy;
+}
+
+// Keeps the message and where each frame was, so raising an error that is
+// caught and never printed costs no line lookups or formatting of the trace
+ErrorInfo *captureError(const char *format, va_list args)
+{
+    ThreadFrame *threadFrame = currentThread();
+    TaskFrame *ctf = threadFrame->ctf;
+    ErrorInfo *error = (ErrorInfo *)mp_malloc(sizeof(ErrorInfo));
+
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (length < 0)
+        length = 0;
+    error->message = (char *)mp_malloc(length + 1);
+    vsnprintf(error->message, length + 1, format, args);
+
+    error->scriptName = copyText(ctf->currentScriptName != NULL ? ctf->currentScriptName : "");
+    error->taskName = copyText(ctf->name);
+    error->trace = NULL;
+    error->frameCount = 0;
+    error->frames = NULL;
+    if (ctf->frameCount > 0)
+        error->frames = (ErrorFrame *)mp_malloc(sizeof(ErrorFrame) * ctf->frameCount);
+
+    // The trace stops at the script a module was loaded from
+    for (int i = ctf->frameCount - 1; i >= 0; i--)
+    {
+        CallFrame *frame = &ctf->frames[i];
+        ErrorFrame *errorFrame = &error->frames[error->frameCount++];
+        errorFrame->function = frame->closure->function;
+        errorFrame->module = frame->module;
+        // -1 because the IP is sitting on the next instruction to be
+        // executed.
+        errorFrame->instruction = (int)(frame->ip - frame->closure->function->chunk.code - 1);
+        if (errorFrame->function->name == NULL)
+            break;
+    }
+
+    return error;
+}
+
+typedef struct
+{
+    char *chars;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+static void append(Buffer *buffer, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length <= 0)
+        return;
+
+    if (buffer->length + length + 1 > buffer->capacity)
+    {
+        while (buffer->length + length + 1 > buffer->capacity)
+            buffer->capacity = buffer->capacity < 64 ? 64 : buffer->capacity * 2;
+        buffer->chars = (char *)mp_realloc(buffer->chars, buffer->capacity);
+    }
+
+    va_start(args, format);
+    vsnprintf(buffer->chars + buffer->length, length + 1, format, args);
+    va_end(args);
+    buffer->length += length;
+}
+
+const char *errorTrace(ErrorInfo *error)
+{
+    if (error->trace != NULL)
+        return error->trace;
+
+    Buffer buffer = {NULL, 0, 0};
+    if (error->frameCount == 0)
+        append(&buffer, "%s", error->message);
+
+    for (int i = 0; i < error->frameCount; i++)
+    {
+        if (i == TRACE_EDGE_FRAMES && error->frameCount > TRACE_EDGE_FRAMES * 2)
+        {
+            append(&buffer, "... %d more frames\n", error->frameCount - TRACE_EDGE_FRAMES * 2);
+            i = error->frameCount - TRACE_EDGE_FRAMES;
+        }
+
+        ErrorFrame *frame = &error->frames[i];
+        ObjFunction *function = frame->function;
+        int line = getLine(&function->chunk, frame->instruction < 0 ? 0 : frame->instruction);
+        append(&buffer, "[line %d] in ", line);
+
+        if (function->name == NULL)
+            append(&buffer, "%s: ", error->scriptName);
+        else if (frame->module != NULL)
+            append(&buffer, "%s.%s(): ", frame->module->name->chars, function->name->chars);
+        else
+            append(&buffer, "%s(): ", function->name->chars);
+
+        append(&buffer, "%s%s", error->message, i < error->frameCount - 1 ? "\n" : "");
+    }
+
+    append(&buffer, "\nTask[%s]", error->taskName);
+    error->trace = buffer.chars;
+    return error->trace;
+}
+
+void freeErrorInfo(ErrorInfo *error)
+{
+    mp_free(error->message);
+    mp_free(error->scriptName);
+    mp_free(error->taskName);
+    if (error->frames != NULL)
+        mp_free(error->frames);
+    if (error->trace != NULL)
+        mp_free(error->trace);
+    mp_free(error);
+}
+
+static bool messageError(int argCount)
+{
+    if (argCount != 1)
+    {
+        runtimeError("message() takes 1 arguments (%d given)", argCount);
+        return false;
+    }
+
+    ObjError *error = AS_ERROR(pop());
+    push(STRING_VAL(error->info->message));
+    return true;
+}
+
+static bool lineError(int argCount)
+{
+    if (argCount != 1)
+    {
+        runtimeError("line() takes 1 arguments (%d given)", argCount);
+        return false;
+    }
+
+    ObjError *error = AS_ERROR(pop());
+    if (error->info->frameCount == 0)
+    {
+        push(NULL_VAL);
+        return true;
+    }
+
+    ErrorFrame *frame = &error->info->frames[0];
+    push(NUMBER_VAL(getLine(&frame->function->chunk, frame->instruction < 0 ? 0 : frame->instruction)));
+    return true;
+}
+
+static bool traceError(int argCount)
+{
+    if (argCount != 1)
+    {
+        runtimeError("trace() takes 1 arguments (%d given)", argCount);
+        return false;
+    }
+
+    ObjError *error = AS_ERROR(pop());
+    push(STRING_VAL(errorTrace(error->info)));
+    return true;
+}
+
+bool errorMethods(char *method, int argCount)
+{
+    if (strcmp(method, "message") == 0)
+        return messageError(argCount);
+    else if (strcmp(method, "line") == 0)
+        return lineError(argCount);
+    else if (strcmp(method, "trace") == 0)
+        return traceError(argCount);
+
+    // Errors used to be caught as their trace string, so they still answer
+    // to the string methods
+    ThreadFrame *threadFrame = currentThread();
+    Value *receiver = threadFrame->ctf->stackTop - argCount;
+    *receiver = STRING_VAL(errorTrace(AS_ERROR(*receiver)->info));
+    return stringMethods(method, argCount);
+}
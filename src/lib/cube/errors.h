@@ -0,0 +1,16 @@
+#ifndef CUBE_ERRORS_h
+#define CUBE_ERRORS_h
+#include <stdarg.h>
+
+#include "object.h"
+#include "value.h"
+
+// Deep traces only show this many frames from each end
+#define TRACE_EDGE_FRAMES 16
+
+ErrorInfo *captureError(const char *format, va_list args);
+const char *errorTrace(ErrorInfo *error);
+void freeErrorInfo(ErrorInfo *error);
+bool errorMethods(char *method, int argCount);
+
+#endif
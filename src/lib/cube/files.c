@@ -45,8 +45,7 @@ static bool writeFile(int argCount, bool newLine)
     int wrote = 0;
     if (!FILE_IS_BINARY(file))
     {
-        ObjString *string = AS_STRING(toString(data));
-        wrote = fprintf(file->file, "%s", string->chars);
+        wrote = writeValueToFile(file->file, data, false);
         if (newLine)
             fprintf(file->file, "\n");
     }
@@ -220,6 +219,29 @@ static bool readLineFile(int argCount)
     return true;
 }
 
+static bool linesFile(int argCount)
+{
+    if (argCount != 1)
+    {
+        runtimeError("lines() takes 1 argument (%d given)", argCount);
+        return false;
+    }
+
+    ObjFile *file = AS_FILE(peek(0));
+
+    if (!FILE_CAN_READ(file))
+    {
+        runtimeError("File is not readable!");
+        return false;
+    }
+
+    ObjGenerator *generator = newGenerator(GENERATOR_LINES);
+    generator->file = file;
+    pop();
+    push(OBJ_VAL(generator));
+    return true;
+}
+
 static bool seekFile(int argCount)
 {
     if (argCount < 2 || argCount > 3)
@@ -372,6 +394,8 @@ bool fileMethods(char *method, int argCount)
         return readFile(argCount);
     else if (strcmp(method, "readLine") == 0)
         return readLineFile(argCount);
+    else if (strcmp(method, "lines") == 0)
+        return linesFile(argCount);
     else if (strcmp(method, "readBytes") == 0)
         return readFileBytes(argCount);
     else if (strcmp(method, "seek") == 0)
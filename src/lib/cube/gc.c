@@ -1,7 +1,12 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include "gc.h"
 #include "compiler.h"
 #include "memory.h"
+#include "mempool.h"
 #include "table.h"
+#include "util.h"
 #include "vm.h"
 
 void mark_roots();
@@ -10,6 +15,32 @@ void mark_object(Obj *obj);
 void mark_array(ValueArray *array);
 void sweep();
 
+static GCStats gcStats;
+
+static const char *pauseBuckets[GC_PAUSE_BUCKETS] = {"<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s"};
+
+// Periodic logging, a line per collection at most every 'logInterval' seconds
+static FILE *logFile = NULL;
+static double logInterval = 0;
+static uint64_t lastLog = 0;
+static size_t lastLogAllocated = 0;
+
+// While taking a heap snapshot every reference followed by the marker is
+// recorded, with 'from' NULL for the roots
+typedef struct
+{
+    Obj *from;
+    Obj *to;
+    const char *root;
+} HeapEdge;
+
+static bool snapshotting = false;
+static Obj *snapshotParent = NULL;
+static const char *snapshotRoot = NULL;
+static HeapEdge *edges = NULL;
+static size_t edgeCount = 0;
+static size_t edgeCapacity = 0;
+
 void gc_maybe_collect()
 {
     if (vm.bytesAllocated > vm.nextGC)
@@ -18,6 +49,82 @@ void gc_maybe_collect()
     }
 }
 
+static size_t live_objects()
+{
+    size_t live = 0;
+    ObjectStats stats;
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        getObjectStats((ObjType)i, &stats);
+        live += stats.live;
+    }
+    return live;
+}
+
+static void record_collection(size_t before, uint64_t pause)
+{
+    gcStats.collections++;
+    if (before > vm.bytesAllocated)
+        gcStats.reclaimed += before - vm.bytesAllocated;
+
+    gcStats.pauseTotal += pause;
+    gcStats.pauseLast = pause;
+    if (pause > gcStats.pauseMax)
+        gcStats.pauseMax = pause;
+
+    int bucket = 0;
+    uint64_t limit = 10000;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && pause >= limit)
+    {
+        bucket++;
+        limit *= 10;
+    }
+    gcStats.pauses[bucket]++;
+
+    if (logFile == NULL)
+        return;
+
+    uint64_t now = cube_clock();
+    if (now - lastLog < logInterval * 1e9)
+        return;
+
+    size_t allocated = allocatedBytes();
+    double elapsed = (now - lastLog) / 1e9;
+    fprintf(logFile, "[gc] #%zu pause %.3f ms, heap %zu -> %zu bytes, %zu live objects, %.1f KB/s allocated\n",
+            gcStats.collections, pause / 1e6, before, vm.bytesAllocated, live_objects(),
+            elapsed > 0 ? (allocated - lastLogAllocated) / elapsed / 1024 : 0.0);
+    fflush(logFile);
+    lastLog = now;
+    lastLogAllocated = allocated;
+}
+
+void gc_stats(GCStats *stats)
+{
+    *stats = gcStats;
+}
+
+void gc_reset_stats()
+{
+    memset(&gcStats, 0, sizeof(GCStats));
+    gcStats.start = cube_clock();
+    gcStats.allocated = allocatedBytes();
+}
+
+const char *gc_pause_bucket(int index)
+{
+    return pauseBuckets[index];
+}
+
+// Logs each collection to 'file', at most once every 'interval' seconds.
+// A NULL file stops logging
+void gc_log(double interval, FILE *file)
+{
+    logFile = file;
+    logInterval = interval;
+    lastLog = cube_clock();
+    lastLogAllocated = allocatedBytes();
+}
+
 void gc_collect()
 {
 #ifdef GC_DISABLED
@@ -28,13 +135,15 @@ void gc_collect()
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
 #endif
+    size_t before = vm.bytesAllocated;
+    uint64_t start = cube_clock();
 
     mark();
     sweep();
 
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    record_collection(before, cube_clock() - start);
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -81,6 +190,15 @@ void sweep()
     }
 }
 
+static void mark_error(ErrorInfo *error)
+{
+    for (int i = 0; i < error->frameCount; i++)
+    {
+        mark_object((Obj *)error->frames[i].function);
+        mark_object((Obj *)error->frames[i].module);
+    }
+}
+
 void mark_task_frame(TaskFrame *tf)
 {
     // Mark stack
@@ -103,10 +221,13 @@ void mark_task_frame(TaskFrame *tf)
 
     mark_value(tf->currentArgs);
     mark_value(tf->result);
+    if (tf->error != NULL)
+        mark_error(tf->error);
 }
 
 void mark_roots()
 {
+    snapshotRoot = "tasks";
     for (int i = 0; i < MAX_THREADS; i++)
     {
         TaskFrame *tf = vm.threadFrames[i].taskFrame;
@@ -124,9 +245,13 @@ void mark_roots()
     //     tf = tf->next;
     // }
 
+    snapshotRoot = "globals";
     markTable(&vm.globals);
+    snapshotRoot = "extensions";
     markTable(&vm.extensions);
+    snapshotRoot = "compiler";
     markCompilerRoots();
+    snapshotRoot = "vm";
     mark_object((Obj *)vm.initString);
     mark_object((Obj *)vm.paths);
     mark_object((Obj *)vm.modules);
@@ -141,11 +266,28 @@ void mark_value(Value val)
     mark_object(AS_OBJ(val));
 }
 
+static void record_edge(Obj *object)
+{
+    if (edgeCount == edgeCapacity)
+    {
+        edgeCapacity = edgeCapacity < 1024 ? 1024 : edgeCapacity * 2;
+        edges = (HeapEdge *)mp_realloc(edges, sizeof(HeapEdge) * edgeCapacity);
+    }
+
+    HeapEdge *edge = &edges[edgeCount++];
+    edge->from = snapshotParent;
+    edge->to = object;
+    edge->root = snapshotParent == NULL ? snapshotRoot : NULL;
+}
+
 void mark_object(Obj *object)
 {
     if (object == NULL)
         return;
 
+    if (snapshotting)
+        record_edge(object);
+
     if (object->isMarked)
         return;
 
@@ -157,6 +299,9 @@ void mark_object(Obj *object)
 
     object->isMarked = true;
 
+    Obj *parent = snapshotParent;
+    snapshotParent = object;
+
     switch (object->type)
     {
         case OBJ_BOUND_METHOD: {
@@ -174,6 +319,8 @@ void mark_object(Obj *object)
             markTable(&klass->methods);
             markTable(&klass->fields);
             markTable(&klass->staticFields);
+            markTable(&klass->slots);
+            mark_array(&klass->defaults);
 
             break;
         }
@@ -222,6 +369,7 @@ void mark_object(Obj *object)
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *)object;
             mark_object((Obj *)function->name);
+            mark_object((Obj *)function->shared);
             mark_array(&function->chunk.constants);
             break;
         }
@@ -236,6 +384,8 @@ void mark_object(Obj *object)
             ObjInstance *instance = (ObjInstance *)object;
             mark_object((Obj *)instance->klass);
             markTable(&instance->fields);
+            for (int i = 0; i < instance->slotCount; i++)
+                mark_value(instance->slots[i]);
             break;
         }
 
@@ -245,6 +395,32 @@ void mark_object(Obj *object)
             break;
         }
 
+        case OBJ_SET: {
+            ObjSet *set = (ObjSet *)object;
+            mark_array(&set->values);
+            break;
+        }
+
+        case OBJ_GENERATOR: {
+            ObjGenerator *generator = (ObjGenerator *)object;
+            mark_value(generator->current);
+            mark_value(generator->start);
+            mark_value(generator->step);
+            mark_value(generator->stop);
+            if (generator->file != NULL)
+                mark_object((Obj *)generator->file);
+            TaskFrame *task = (TaskFrame *)generator->task;
+            if (task != NULL)
+            {
+                for (Value *slot = task->stack; slot < task->stackTop; slot++)
+                    mark_value(*slot);
+                for (int i = 0; i < task->frameCount; i++)
+                    mark_object((Obj *)task->frames[i].closure);
+                mark_value(task->currentArgs);
+            }
+            break;
+        }
+
         case OBJ_DICT: {
             ObjDict *dict = (ObjDict *)object;
             for (int i = 0; i < dict->capacity; ++i)
@@ -257,6 +433,10 @@ void mark_object(Obj *object)
             break;
         }
 
+        case OBJ_NATIVE:
+            mark_object((Obj *)((ObjNative *)object)->name);
+            break;
+
         case OBJ_NATIVE_FUNC: {
             ObjNativeFunc *func = (ObjNativeFunc *)object;
             mark_object((Obj *)func->name);
@@ -282,9 +462,15 @@ void mark_object(Obj *object)
             mark_value(((ObjUpvalue *)object)->closed);
             break;
 
+        case OBJ_ERROR:
+            mark_error(((ObjError *)object)->info);
+            break;
+
         default:
             break;
     }
+
+    snapshotParent = parent;
 }
 
 void mark_array(ValueArray *array)
@@ -294,3 +480,231 @@ void mark_array(ValueArray *array)
         mark_value(array->values[i]);
     }
 }
+
+typedef struct
+{
+    Obj *object;
+    size_t id;
+} HeapNode;
+
+static int compare_nodes(const void *a, const void *b)
+{
+    uintptr_t na = (uintptr_t)((const HeapNode *)a)->object;
+    uintptr_t nb = (uintptr_t)((const HeapNode *)b)->object;
+    return na < nb ? -1 : (na > nb ? 1 : 0);
+}
+
+static int compare_edges(uintptr_t a1, uintptr_t a2, uintptr_t b1, uintptr_t b2)
+{
+    if (a1 != b1)
+        return a1 < b1 ? -1 : 1;
+    if (a2 != b2)
+        return a2 < b2 ? -1 : 1;
+    return 0;
+}
+
+// Edges from the roots also differ by the name of the root
+static int compare_roots(const HeapEdge *ea, const HeapEdge *eb)
+{
+    if (ea->root == eb->root)
+        return 0;
+    if (ea->root == NULL || eb->root == NULL)
+        return ea->root == NULL ? -1 : 1;
+    return strcmp(ea->root, eb->root);
+}
+
+static int compare_from(const void *a, const void *b)
+{
+    const HeapEdge *ea = (const HeapEdge *)a;
+    const HeapEdge *eb = (const HeapEdge *)b;
+    int order = compare_edges((uintptr_t)ea->from, (uintptr_t)ea->to, (uintptr_t)eb->from, (uintptr_t)eb->to);
+    return order != 0 ? order : compare_roots(ea, eb);
+}
+
+static int compare_to(const void *a, const void *b)
+{
+    const HeapEdge *ea = (const HeapEdge *)a;
+    const HeapEdge *eb = (const HeapEdge *)b;
+    int order = compare_edges((uintptr_t)ea->to, (uintptr_t)ea->from, (uintptr_t)eb->to, (uintptr_t)eb->from);
+    return order != 0 ? order : compare_roots(ea, eb);
+}
+
+static long find_node(HeapNode *nodes, size_t count, Obj *object)
+{
+    HeapNode key = {object, 0};
+    HeapNode *node = (HeapNode *)bsearch(&key, nodes, count, sizeof(HeapNode), compare_nodes);
+    return node != NULL ? (long)node->id : -1;
+}
+
+// First edge in a sorted list whose 'from' (or 'to') is 'object'
+static size_t first_edge(HeapEdge *list, size_t count, Obj *object, bool byTarget)
+{
+    size_t low = 0, high = count;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        Obj *key = byTarget ? list[middle].to : list[middle].from;
+        if ((uintptr_t)key < (uintptr_t)object)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+static ObjString *object_name(Obj *object)
+{
+    switch (object->type)
+    {
+        case OBJ_STRING:
+            return (ObjString *)object;
+        case OBJ_FUNCTION:
+            return ((ObjFunction *)object)->name;
+        case OBJ_CLOSURE:
+            return ((ObjClosure *)object)->function->name;
+        case OBJ_BOUND_METHOD:
+            return ((ObjBoundMethod *)object)->method->function->name;
+        case OBJ_CLASS:
+            return ((ObjClass *)object)->name;
+        case OBJ_INSTANCE:
+            return ((ObjInstance *)object)->klass->name;
+        case OBJ_ENUM:
+            return ((ObjEnum *)object)->name;
+        case OBJ_ENUM_VALUE:
+            return ((ObjEnumValue *)object)->name;
+        case OBJ_MODULE:
+            return ((ObjModule *)object)->name;
+        case OBJ_NATIVE:
+            return ((ObjNative *)object)->name;
+        case OBJ_NATIVE_FUNC:
+            return ((ObjNativeFunc *)object)->name;
+        case OBJ_NATIVE_LIB:
+            return ((ObjNativeLib *)object)->name;
+        case OBJ_TASK:
+            return ((ObjTask *)object)->name;
+        default:
+            return NULL;
+    }
+}
+
+#define SNAPSHOT_NAME_LIMIT 64
+
+static void write_name(FILE *file, ObjString *name)
+{
+    int length = name->length < SNAPSHOT_NAME_LIMIT ? name->length : SNAPSHOT_NAME_LIMIT;
+    fputc('"', file);
+    for (int i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)name->chars[i];
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    if (length < name->length)
+        fputs("...", file);
+    fputc('"', file);
+}
+
+// Writes the object graph as JSON: the roots and, for each object, its type,
+// shallow size, references and retainers (objects or root names). Objects
+// that are no longer reachable but were not collected yet are flagged
+bool gc_snapshot(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    edgeCount = 0;
+    snapshotParent = NULL;
+    snapshotting = true;
+    mark_roots();
+    snapshotting = false;
+
+    size_t count = 0;
+    for (Obj *object = vm.objects; object != NULL; object = object->next)
+        count++;
+
+    HeapNode *nodes = (HeapNode *)mp_malloc(sizeof(HeapNode) * (count > 0 ? count : 1));
+    size_t id = 0;
+    for (Obj *object = vm.objects; object != NULL; object = object->next, id++)
+    {
+        nodes[id].object = object;
+        nodes[id].id = id;
+    }
+    qsort(nodes, count, sizeof(HeapNode), compare_nodes);
+
+    // The same reference may be followed twice, e.g. a value stored under two
+    // keys. One object held by several roots keeps an edge for each root
+    qsort(edges, edgeCount, sizeof(HeapEdge), compare_from);
+    size_t unique = 0;
+    for (size_t i = 0; i < edgeCount; i++)
+    {
+        if (unique > 0 && compare_from(&edges[unique - 1], &edges[i]) == 0)
+            continue;
+        edges[unique++] = edges[i];
+    }
+    edgeCount = unique;
+
+    HeapEdge *retainers = (HeapEdge *)mp_malloc(sizeof(HeapEdge) * (edgeCount > 0 ? edgeCount : 1));
+    memcpy(retainers, edges, sizeof(HeapEdge) * edgeCount);
+    qsort(retainers, edgeCount, sizeof(HeapEdge), compare_to);
+
+    fprintf(file, "{\n\"roots\": [");
+    for (size_t i = 0; i < edgeCount && edges[i].from == NULL; i++)
+    {
+        fprintf(file, "%s{\"root\": \"%s\", \"id\": %ld}", i > 0 ? ", " : "", edges[i].root,
+                find_node(nodes, count, edges[i].to));
+    }
+    fprintf(file, "],\n\"objects\": [\n");
+
+    id = 0;
+    for (Obj *object = vm.objects; object != NULL; object = object->next, id++)
+    {
+        fprintf(file, "%s{\"id\": %zu, \"type\": \"%s\", \"size\": %zu", id > 0 ? ",\n" : "", id,
+                objTypeName(object->type), objectSize(object));
+
+        ObjString *name = object_name(object);
+        if (name != NULL)
+        {
+            fprintf(file, ", \"name\": ");
+            write_name(file, name);
+        }
+        fprintf(file, ", \"reachable\": %s, \"references\": [", object->isMarked ? "true" : "false");
+
+        bool first = true;
+        for (size_t i = first_edge(edges, edgeCount, object, false); i < edgeCount && edges[i].from == object; i++)
+        {
+            fprintf(file, "%s%ld", first ? "" : ", ", find_node(nodes, count, edges[i].to));
+            first = false;
+        }
+
+        fprintf(file, "], \"retainers\": [");
+        first = true;
+        for (size_t i = first_edge(retainers, edgeCount, object, true); i < edgeCount && retainers[i].to == object;
+             i++)
+        {
+            if (retainers[i].from == NULL)
+                fprintf(file, "%s\"%s\"", first ? "" : ", ", retainers[i].root);
+            else
+                fprintf(file, "%s%ld", first ? "" : ", ", find_node(nodes, count, retainers[i].from));
+            first = false;
+        }
+        fprintf(file, "]}");
+    }
+    fprintf(file, "\n]\n}\n");
+    fclose(file);
+
+    for (Obj *object = vm.objects; object != NULL; object = object->next)
+        object->isMarked = false;
+
+    mp_free(nodes);
+    mp_free(retainers);
+    mp_free(edges);
+    edges = NULL;
+    edgeCount = 0;
+    edgeCapacity = 0;
+    return true;
+}
@@ -1,11 +1,35 @@
 #ifndef _CUBE_GC_H_
 #define _CUBE_GC_H_
 
+#include <stdint.h>
+#include <stdio.h>
+
 #include "value.h"
 
+// Pause times are bucketed by powers of ten starting at 10us
+#define GC_PAUSE_BUCKETS 7
+
+typedef struct
+{
+    size_t collections;
+    size_t reclaimed;
+    uint64_t pauseTotal;
+    uint64_t pauseMax;
+    uint64_t pauseLast;
+    size_t pauses[GC_PAUSE_BUCKETS];
+    uint64_t start;
+    size_t allocated;
+} GCStats;
+
 void gc_maybe_collect();
 void gc_collect();
 void mark_value(Value val);
 void mark_object(Obj *obj);
 
+void gc_stats(GCStats *stats);
+void gc_reset_stats();
+const char *gc_pause_bucket(int index);
+void gc_log(double interval, FILE *file);
+bool gc_snapshot(const char *path);
+
 #endif
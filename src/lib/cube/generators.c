@@ -0,0 +1,76 @@
+#include "generators.h"
+#include "memory.h"
+#include "mempool.h"
+#include "vm.h"
+
+static bool nextGeneratorMethod(int argCount)
+{
+    if (argCount != 1)
+    {
+        runtimeError("next() takes 1 arguments (%d given)", argCount);
+        return false;
+    }
+
+    ObjGenerator *generator = AS_GENERATOR(peek(0));
+    bool produced;
+    if (!nextGenerator(generator, &produced))
+        return false;
+
+    pop();
+    push(produced ? generator->current : NULL_VAL);
+    return true;
+}
+
+static bool doneGenerator(int argCount)
+{
+    if (argCount != 1)
+    {
+        runtimeError("done() takes 1 arguments (%d given)", argCount);
+        return false;
+    }
+
+    ObjGenerator *generator = AS_GENERATOR(pop());
+    push(BOOL_VAL(generator->done));
+    return true;
+}
+
+static bool listGenerator(int argCount)
+{
+    if (argCount != 1)
+    {
+        runtimeError("list() takes 1 arguments (%d given)", argCount);
+        return false;
+    }
+
+    ObjGenerator *generator = AS_GENERATOR(peek(0));
+    ObjList *list = initList();
+    push(OBJ_VAL(list));
+
+    bool produced;
+    while (true)
+    {
+        if (!nextGenerator(generator, &produced))
+            return false;
+        if (!produced)
+            break;
+        writeValueArray(&list->values, generator->current);
+    }
+
+    pop();
+    pop();
+    push(OBJ_VAL(list));
+    return true;
+}
+
+bool generatorMethods(char *method, int argCount)
+{
+    if (strcmp(method, "next") == 0)
+        return nextGeneratorMethod(argCount);
+    else if (strcmp(method, "done") == 0)
+        return doneGenerator(argCount);
+    else if (strcmp(method, "list") == 0)
+        return listGenerator(argCount);
+
+    runtimeError("Generator has no method %s()", method);
+    return false;
+}
@@ -0,0 +1,8 @@
+#ifndef CUBE_GENERATORS_h
+#define CUBE_GENERATORS_h
+#include "object.h"
+#include "value.h"
+
+bool generatorMethods(char *method, int argCount);
+
+#endif
\ No newline at end of file
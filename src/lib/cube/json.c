@@ -0,0 +1,717 @@
+#include <locale.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+#include "memory.h"
+#include "mempool.h"
+#include "outbuffer.h"
+#include "vm.h"
+
+typedef struct
+{
+    const char *start;
+    const char *current;
+    const char *end;
+    int depth;
+    char *buffer; // Strings with escapes and keys are decoded here
+    int bufferLength;
+    int bufferCapacity;
+    char *error;
+    int errorSize;
+} JsonParser;
+
+typedef struct
+{
+    OutBuffer out;
+    int indent;
+    bool failed;
+    char *error;
+    int errorSize;
+} JsonWriter;
+
+static bool parseValue(JsonParser *parser, Value *value);
+
+static bool parseError(JsonParser *parser, const char *message)
+{
+    int line = 1;
+    int column = 1;
+    for (const char *c = parser->start; c < parser->current; c++)
+    {
+        if (*c == '\n')
+        {
+            line++;
+            column = 1;
+        }
+        else
+            column++;
+    }
+    snprintf(parser->error, parser->errorSize, "%s at line %d, column %d", message, line, column);
+    return false;
+}
+
+static inline bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline void skipWhitespace(JsonParser *parser)
+{
+    const char *c = parser->current;
+    while (c < parser->end && (*c == ' ' || *c == '\n' || *c == '\r' || *c == '\t'))
+        c++;
+    parser->current = c;
+}
+
+static bool match(JsonParser *parser, char expected)
+{
+    skipWhitespace(parser);
+    if (parser->current < parser->end && *parser->current == expected)
+    {
+        parser->current++;
+        return true;
+    }
+    return false;
+}
+
+static void appendBuffer(JsonParser *parser, const char *chars, int length)
+{
+    if (parser->bufferLength + length + 1 > parser->bufferCapacity)
+    {
+        int capacity = parser->bufferCapacity < 64 ? 64 : parser->bufferCapacity;
+        while (capacity < parser->bufferLength + length + 1)
+            capacity *= 2;
+        parser->buffer = (char *)mp_realloc(parser->buffer, capacity);
+        parser->bufferCapacity = capacity;
+    }
+
+    memcpy(parser->buffer + parser->bufferLength, chars, length);
+    parser->bufferLength += length;
+    parser->buffer[parser->bufferLength] = '\0';
+}
+
+static void appendUtf8(JsonParser *parser, uint32_t code)
+{
+    char bytes[4];
+    int length;
+    if (code < 0x80)
+    {
+        bytes[0] = (char)code;
+        length = 1;
+    }
+    else if (code < 0x800)
+    {
+        bytes[0] = (char)(0xC0 | (code >> 6));
+        bytes[1] = (char)(0x80 | (code & 0x3F));
+        length = 2;
+    }
+    else if (code < 0x10000)
+    {
+        bytes[0] = (char)(0xE0 | (code >> 12));
+        bytes[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        bytes[2] = (char)(0x80 | (code & 0x3F));
+        length = 3;
+    }
+    else
+    {
+        bytes[0] = (char)(0xF0 | (code >> 18));
+        bytes[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+        bytes[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+        bytes[3] = (char)(0x80 | (code & 0x3F));
+        length = 4;
+    }
+    appendBuffer(parser, bytes, length);
+}
+
+static bool readHex(JsonParser *parser, uint32_t *code)
+{
+    if (parser->end - parser->current < 4)
+        return false;
+
+    *code = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        char c = *parser->current++;
+        *code <<= 4;
+        if (c >= '0' && c <= '9')
+            *code |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            *code |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            *code |= c - 'A' + 10;
+        else
+            return false;
+    }
+    return true;
+}
+
+static bool parseEscape(JsonParser *parser)
+{
+    char c = *parser->current++;
+    switch (c)
+    {
+        case '"':
+        case '\\':
+        case '/':
+            appendBuffer(parser, &c, 1);
+            return true;
+        case 'b':
+            appendBuffer(parser, "\b", 1);
+            return true;
+        case 'f':
+            appendBuffer(parser, "\f", 1);
+            return true;
+        case 'n':
+            appendBuffer(parser, "\n", 1);
+            return true;
+        case 'r':
+            appendBuffer(parser, "\r", 1);
+            return true;
+        case 't':
+            appendBuffer(parser, "\t", 1);
+            return true;
+        case 'u': {
+            uint32_t code;
+            if (!readHex(parser, &code))
+                return parseError(parser, "Invalid unicode escape");
+
+            if (code >= 0xD800 && code <= 0xDBFF)
+            {
+                uint32_t low;
+                if (parser->end - parser->current < 2 || parser->current[0] != '\\' || parser->current[1] != 'u')
+                    return parseError(parser, "Unpaired unicode surrogate");
+                parser->current += 2;
+                if (!readHex(parser, &low) || low < 0xDC00 || low > 0xDFFF)
+                    return parseError(parser, "Unpaired unicode surrogate");
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            }
+            else if (code >= 0xDC00 && code <= 0xDFFF)
+                return parseError(parser, "Unpaired unicode surrogate");
+
+            appendUtf8(parser, code);
+            return true;
+        }
+        default:
+            parser->current--;
+            return parseError(parser, "Invalid escape");
+    }
+}
+
+// Leaves the string in 'chars'. Without escapes it points straight into the
+// text, unless a NUL terminated copy is required
+static bool parseString(JsonParser *parser, bool terminated, const char **chars, int *length)
+{
+    parser->current++;
+    parser->bufferLength = 0;
+    appendBuffer(parser, "", 0);
+
+    bool copied = false;
+    for (;;)
+    {
+        // Plain runs are taken in one go
+        const char *run = parser->current;
+        const char *end = parser->end;
+        const char *c = run;
+        while (c < end && *c != '"' && *c != '\\' && (unsigned char)*c >= 0x20)
+            c++;
+        parser->current = c;
+
+        if (c < end && *c == '"' && !copied && !terminated)
+        {
+            parser->current++;
+            *chars = run;
+            *length = (int)(c - run);
+            return true;
+        }
+
+        appendBuffer(parser, run, (int)(c - run));
+        copied = true;
+
+        if (c >= end)
+            return parseError(parser, "Unterminated string");
+
+        if (*c == '"')
+        {
+            parser->current++;
+            *chars = parser->buffer;
+            *length = parser->bufferLength;
+            return true;
+        }
+
+        if (*c != '\\')
+            return parseError(parser, "Control character in string");
+
+        parser->current++;
+        if (parser->current >= end)
+            return parseError(parser, "Unterminated string");
+        if (!parseEscape(parser))
+            return false;
+    }
+}
+
+static bool parseNumber(JsonParser *parser, Value *value)
+{
+    const char *start = parser->current;
+    const char *c = start;
+    const char *end = parser->end;
+
+    bool negative = c < end && *c == '-';
+    if (negative)
+        c++;
+    if (c >= end || !isDigit(*c))
+        return parseError(parser, "Invalid number");
+
+    // Integers that fit a double exactly skip strtod
+    double integer = 0;
+    int digits = 0;
+    if (*c == '0')
+        c++;
+    else
+    {
+        while (c < end && isDigit(*c))
+        {
+            integer = integer * 10 + (*c - '0');
+            digits++;
+            c++;
+        }
+    }
+
+    bool plain = true;
+    if (c < end && *c == '.')
+    {
+        plain = false;
+        c++;
+        if (c >= end || !isDigit(*c))
+        {
+            parser->current = c;
+            return parseError(parser, "Invalid number");
+        }
+        while (c < end && isDigit(*c))
+            c++;
+    }
+
+    if (c < end && (*c == 'e' || *c == 'E'))
+    {
+        plain = false;
+        c++;
+        if (c < end && (*c == '+' || *c == '-'))
+            c++;
+        if (c >= end || !isDigit(*c))
+        {
+            parser->current = c;
+            return parseError(parser, "Invalid number");
+        }
+        while (c < end && isDigit(*c))
+            c++;
+    }
+    parser->current = c;
+
+    if (plain && digits <= 15)
+    {
+        *value = NUMBER_VAL(negative ? -integer : integer);
+        return true;
+    }
+
+    // strtod follows the locale, so the decimal point is swapped for its one
+    int length = (int)(c - start);
+    char small[64];
+    char *number = length < (int)sizeof(small) ? small : (char *)mp_malloc(length + 1);
+    memcpy(number, start, length);
+    number[length] = '\0';
+    char point = localeconv()->decimal_point[0];
+    if (point != '.')
+    {
+        char *dot = strchr(number, '.');
+        if (dot != NULL)
+            *dot = point;
+    }
+    *value = NUMBER_VAL(strtod(number, NULL));
+    if (number != small)
+        mp_free(number);
+    return true;
+}
+
+static bool parseLiteral(JsonParser *parser, const char *literal, Value result, Value *value)
+{
+    int length = (int)strlen(literal);
+    if (parser->end - parser->current < length || memcmp(parser->current, literal, length) != 0)
+        return parseError(parser, "Unexpected character");
+    parser->current += length;
+    *value = result;
+    return true;
+}
+
+static bool parseArray(JsonParser *parser, Value *value)
+{
+    parser->current++;
+    ObjList *list = initList();
+    push(OBJ_VAL(list));
+
+    if (!match(parser, ']'))
+    {
+        do
+        {
+            Value item;
+            if (!parseValue(parser, &item))
+            {
+                pop();
+                return false;
+            }
+            writeValueArray(&list->values, item);
+        } while (match(parser, ','));
+
+        if (!match(parser, ']'))
+        {
+            pop();
+            return parseError(parser, "Expected ',' or ']'");
+        }
+    }
+
+    pop();
+    *value = OBJ_VAL(list);
+    return true;
+}
+
+static bool parseObject(JsonParser *parser, Value *value)
+{
+    parser->current++;
+    ObjDict *dict = initDict();
+    push(OBJ_VAL(dict));
+
+    if (!match(parser, '}'))
+    {
+        do
+        {
+            skipWhitespace(parser);
+            if (parser->current >= parser->end || *parser->current != '"')
+            {
+                pop();
+                return parseError(parser, "Expected a string key");
+            }
+
+            const char *chars;
+            int length;
+            if (!parseString(parser, true, &chars, &length))
+            {
+                pop();
+                return false;
+            }
+
+            // The value reuses the decoding buffer
+            char small[128];
+            char *key = length < (int)sizeof(small) ? small : (char *)mp_malloc(length + 1);
+            memcpy(key, chars, length + 1);
+
+            Value item;
+            bool ok = match(parser, ':') ? parseValue(parser, &item) : parseError(parser, "Expected ':'");
+            if (ok)
+                insertDict(dict, key, item);
+            if (key != small)
+                mp_free(key);
+            if (!ok)
+            {
+                pop();
+                return false;
+            }
+        } while (match(parser, ','));
+
+        if (!match(parser, '}'))
+        {
+            pop();
+            return parseError(parser, "Expected ',' or '}'");
+        }
+    }
+
+    pop();
+    *value = OBJ_VAL(dict);
+    return true;
+}
+
+static bool parseValue(JsonParser *parser, Value *value)
+{
+    skipWhitespace(parser);
+    if (parser->current >= parser->end)
+        return parseError(parser, "Unexpected end of input");
+
+    switch (*parser->current)
+    {
+        case '{':
+        case '[': {
+            if (parser->depth >= JSON_MAX_DEPTH)
+                return parseError(parser, "Too deeply nested");
+            parser->depth++;
+            bool ok = *parser->current == '{' ? parseObject(parser, value) : parseArray(parser, value);
+            parser->depth--;
+            return ok;
+        }
+        case '"': {
+            const char *chars;
+            int length;
+            if (!parseString(parser, false, &chars, &length))
+                return false;
+            *value = OBJ_VAL(copyString(chars, length));
+            return true;
+        }
+        case 't':
+            return parseLiteral(parser, "true", TRUE_VAL, value);
+        case 'f':
+            return parseLiteral(parser, "false", FALSE_VAL, value);
+        case 'n':
+            return parseLiteral(parser, "null", NULL_VAL, value);
+        default:
+            if (*parser->current == '-' || isDigit(*parser->current))
+                return parseNumber(parser, value);
+            return parseError(parser, "Unexpected character");
+    }
+}
+
+// Builds the dicts, lists and strings straight from the text, which must be
+// NUL terminated at 'length'
+bool parseJson(const char *text, int length, Value *value, char *error, int errorSize)
+{
+    JsonParser parser;
+    parser.start = text;
+    parser.current = text;
+    parser.end = text + length;
+    parser.depth = 0;
+    parser.buffer = NULL;
+    parser.bufferLength = 0;
+    parser.bufferCapacity = 0;
+    parser.error = error;
+    parser.errorSize = errorSize;
+
+    bool ok = parseValue(&parser, value);
+    if (ok)
+    {
+        skipWhitespace(&parser);
+        if (parser.current < parser.end)
+            ok = parseError(&parser, "Unexpected data after the value");
+    }
+
+    if (parser.buffer != NULL)
+        mp_free(parser.buffer);
+    if (!ok)
+        *value = NULL_VAL;
+    return ok;
+}
+
+static void fileError(JsonWriter *writer)
+{
+    if (!writer->failed)
+        snprintf(writer->error, writer->errorSize, "Could not write to the file");
+    writer->failed = true;
+}
+
+static void flushWriter(JsonWriter *writer)
+{
+    if (!flushOutBuffer(&writer->out))
+        fileError(writer);
+}
+
+static void writeChars(JsonWriter *writer, const char *chars, int length)
+{
+    if (!writeOutBuffer(&writer->out, chars, length))
+        fileError(writer);
+}
+
+static void writeNewLine(JsonWriter *writer, int depth)
+{
+    if (writer->indent <= 0)
+        return;
+
+    writeChars(writer, "\n", 1);
+    for (int i = 0; i < depth * writer->indent; i++)
+        writeChars(writer, " ", 1);
+}
+
+static void writeString(JsonWriter *writer, const char *chars, int length)
+{
+    writeChars(writer, "\"", 1);
+
+    const char *run = chars;
+    const char *end = chars + length;
+    for (const char *c = chars; c < end; c++)
+    {
+        unsigned char ch = (unsigned char)*c;
+        if (ch >= 0x20 && ch != '"' && ch != '\\')
+            continue;
+
+        writeChars(writer, run, (int)(c - run));
+        run = c + 1;
+
+        char escape[8];
+        switch (ch)
+        {
+            case '"':
+                writeChars(writer, "\\\"", 2);
+                break;
+            case '\\':
+                writeChars(writer, "\\\\", 2);
+                break;
+            case '\n':
+                writeChars(writer, "\\n", 2);
+                break;
+            case '\r':
+                writeChars(writer, "\\r", 2);
+                break;
+            case '\t':
+                writeChars(writer, "\\t", 2);
+                break;
+            case '\b':
+                writeChars(writer, "\\b", 2);
+                break;
+            case '\f':
+                writeChars(writer, "\\f", 2);
+                break;
+            default:
+                snprintf(escape, sizeof(escape), "\\u%04x", ch);
+                writeChars(writer, escape, 6);
+                break;
+        }
+    }
+    writeChars(writer, run, (int)(end - run));
+
+    writeChars(writer, "\"", 1);
+}
+
+// JSON has no NaN or infinity, those become null. Other numbers use the
+// shortest form that reads back the same
+static void writeNumber(JsonWriter *writer, double number)
+{
+    char text[32];
+    int length;
+    if (isnan(number) || isinf(number))
+        length = snprintf(text, sizeof(text), "null");
+    else if (number == floor(number) && fabs(number) < 1e15)
+        length = snprintf(text, sizeof(text), "%.0f", number);
+    else
+    {
+        length = snprintf(text, sizeof(text), "%.15g", number);
+        if (strtod(text, NULL) != number)
+            length = snprintf(text, sizeof(text), "%.17g", number);
+        for (int i = 0; i < length; i++)
+        {
+            if (text[i] == ',')
+                text[i] = '.';
+        }
+    }
+    writeChars(writer, text, length);
+}
+
+static bool writeValue(JsonWriter *writer, Value value, int depth)
+{
+    if (writer->failed)
+        return false;
+
+    if (depth > JSON_MAX_DEPTH)
+    {
+        snprintf(writer->error, writer->errorSize, "Too deeply nested, the value may contain itself");
+        writer->failed = true;
+        return false;
+    }
+
+    if (IS_NULL(value))
+        writeChars(writer, "null", 4);
+    else if (IS_BOOL(value))
+    {
+        if (AS_BOOL(value))
+            writeChars(writer, "true", 4);
+        else
+            writeChars(writer, "false", 5);
+    }
+    else if (IS_NUMBER(value))
+        writeNumber(writer, AS_NUMBER(value));
+    else if (IS_STRING(value))
+        writeString(writer, AS_STRING(value)->chars, AS_STRING(value)->length);
+    else if (IS_ENUM_VALUE(value))
+        return writeValue(writer, AS_ENUM_VALUE(value)->value, depth);
+    else if (IS_LIST(value) || IS_SET(value))
+    {
+        ValueArray *values = IS_LIST(value) ? &AS_LIST(value)->values : &AS_SET(value)->values;
+        writeChars(writer, "[", 1);
+        for (int i = 0; i < values->count; i++)
+        {
+            if (i > 0)
+                writeChars(writer, ",", 1);
+            writeNewLine(writer, depth + 1);
+            if (!writeValue(writer, values->values[i], depth + 1))
+                return false;
+        }
+        if (values->count > 0)
+            writeNewLine(writer, depth);
+        writeChars(writer, "]", 1);
+    }
+    else if (IS_DICT(value))
+    {
+        ObjDict *dict = AS_DICT(value);
+        writeChars(writer, "{", 1);
+        bool first = true;
+        for (int i = 0; i < dict->capacity; i++)
+        {
+            dictItem *item = dict->items[i];
+            if (item == NULL || item->deleted)
+                continue;
+
+            if (!first)
+                writeChars(writer, ",", 1);
+            first = false;
+            writeNewLine(writer, depth + 1);
+            writeString(writer, item->key, (int)strlen(item->key));
+            if (writer->indent > 0)
+                writeChars(writer, ": ", 2);
+            else
+                writeChars(writer, ":", 1);
+            if (!writeValue(writer, item->item, depth + 1))
+                return false;
+        }
+        if (!first)
+            writeNewLine(writer, depth);
+        writeChars(writer, "}", 1);
+    }
+    else
+    {
+        // Anything else is written as its text
+        char *text = valueToString(value, false);
+        writeString(writer, text, (int)strlen(text));
+        mp_free(text);
+    }
+
+    return !writer->failed;
+}
+
+static void initWriter(JsonWriter *writer, FILE *file, int indent, char *error, int errorSize)
+{
+    initOutBuffer(&writer->out, file, NULL, 0, 0);
+    writer->indent = indent;
+    writer->failed = false;
+    writer->error = error;
+    writer->errorSize = errorSize;
+}
+
+// Returns NULL when the value cannot be written, with the reason in 'error'
+ObjString *jsonToString(Value value, int indent, char *error, int errorSize)
+{
+    JsonWriter writer;
+    initWriter(&writer, NULL, indent, error, errorSize);
+
+    ObjString *result = NULL;
+    if (writeValue(&writer, value, 0))
+        result = copyString(writer.out.length > 0 ? (char *)writer.out.bytes : "", writer.out.length);
+
+    freeOutBuffer(&writer.out);
+    return result;
+}
+
+// Streams the value to the file, holding at most OUT_FLUSH_SIZE bytes
+bool jsonToFile(Value value, int indent, FILE *file, char *error, int errorSize)
+{
+    JsonWriter writer;
+    initWriter(&writer, file, indent, error, errorSize);
+
+    if (writeValue(&writer, value, 0))
+        flushWriter(&writer);
+
+    freeOutBuffer(&writer.out);
+    return !writer.failed;
+}
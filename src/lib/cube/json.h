@@ -0,0 +1,13 @@
+#ifndef CUBE_JSON_h
+#define CUBE_JSON_h
+#include <stdio.h>
+
+#include "object.h"
+
+#define JSON_MAX_DEPTH 512
+
+bool parseJson(const char *text, int length, Value *value, char *error, int errorSize);
+ObjString *jsonToString(Value value, int indent, char *error, int errorSize);
+bool jsonToFile(Value value, int indent, FILE *file, char *error, int errorSize);
+
+#endif
@@ -0,0 +1,486 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "json.h"
+#include "kvstore.h"
+#include "memory.h"
+#include "mempool.h"
+#include "serializer.h"
+#include "util.h"
+#include "vm.h"
+
+#define KV_HEADER_SIZE 5
+#define KV_RECORD_HEADER_SIZE 8
+
+typedef enum
+{
+    KV_PUT = 1,
+    KV_DELETE = 2
+} KvOperation;
+
+// The whole log, mapped when the platform allows it
+typedef struct
+{
+    const unsigned char *data;
+    size_t length;
+    bool mapped;
+} KvFile;
+
+typedef struct
+{
+    unsigned char *bytes;
+    int length;
+    int capacity;
+} KvBuffer;
+
+static uint32_t checksum(const unsigned char *bytes, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void writeUint32(unsigned char *bytes, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        bytes[i] = (unsigned char)(value >> (i * 8));
+}
+
+static uint32_t readUint32(const unsigned char *bytes)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= (uint32_t)bytes[i] << (i * 8);
+    return value;
+}
+
+static void reserveBuffer(KvBuffer *buffer, int length)
+{
+    if (buffer->length + length <= buffer->capacity)
+        return;
+
+    int capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+    while (capacity < buffer->length + length)
+        capacity *= 2;
+    buffer->bytes = (unsigned char *)mp_realloc(buffer->bytes, capacity);
+    buffer->capacity = capacity;
+}
+
+static void writeBuffer(KvBuffer *buffer, const void *bytes, int length)
+{
+    reserveBuffer(buffer, length);
+    memcpy(buffer->bytes + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+static void appendKey(KvBuffer *buffer, const char *key, int length)
+{
+    unsigned char varint[5];
+    int size = 0;
+    uint32_t number = (uint32_t)length;
+    do
+    {
+        varint[size] = number & 0x7F;
+        number >>= 7;
+        if (number != 0)
+            varint[size] |= 0x80;
+        size++;
+    } while (number != 0);
+
+    writeBuffer(buffer, varint, size);
+    writeBuffer(buffer, key, length);
+}
+
+// Frames one record. A null value means a delete
+static bool appendRecord(KvBuffer *buffer, const char *key, int keyLength, Value *value, char *error, int errorSize)
+{
+    int start = buffer->length;
+    reserveBuffer(buffer, KV_RECORD_HEADER_SIZE);
+    buffer->length += KV_RECORD_HEADER_SIZE;
+
+    unsigned char operation = value == NULL ? KV_DELETE : KV_PUT;
+    writeBuffer(buffer, &operation, 1);
+    appendKey(buffer, key, keyLength);
+    if (value != NULL &&
+        !binaryEncodeAppend(*value, &buffer->bytes, &buffer->length, &buffer->capacity, error, errorSize))
+        return false;
+
+    unsigned char *payload = buffer->bytes + start + KV_RECORD_HEADER_SIZE;
+    int payloadLength = buffer->length - start - KV_RECORD_HEADER_SIZE;
+    writeUint32(buffer->bytes + start, (uint32_t)payloadLength);
+    writeUint32(buffer->bytes + start + 4, checksum(payload, payloadLength));
+    return true;
+}
+
+static bool writeAll(FILE *file, KvBuffer *buffer, bool sync)
+{
+    if (buffer->length > 0 && fwrite(buffer->bytes, 1, buffer->length, file) != (size_t)buffer->length)
+        return false;
+    if (fflush(file) != 0)
+        return false;
+    if (sync)
+    {
+#ifdef _WIN32
+        return _commit(_fileno(file)) == 0;
+#else
+        return fsync(fileno(file)) == 0;
+#endif
+    }
+    return true;
+}
+
+// False when the file could not be read, 'missing' is set when it does not
+// exist
+static bool mapFile(const char *path, KvFile *file, bool *missing)
+{
+    file->data = NULL;
+    file->length = 0;
+    file->mapped = false;
+    *missing = false;
+
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        *missing = errno == ENOENT;
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    file->length = (size_t)info.st_size;
+    if (file->length > 0)
+    {
+        void *data = mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            file->data = (const unsigned char *)data;
+            file->mapped = true;
+        }
+    }
+    close(fd);
+    if (file->mapped || file->length == 0)
+        return true;
+#endif
+
+    // Records hold NUL bytes, so the length is what was read and not strlen
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL)
+    {
+        *missing = errno == ENOENT;
+        return false;
+    }
+
+    fseek(stream, 0L, SEEK_END);
+    long size = ftell(stream);
+    rewind(stream);
+    if (size < 0)
+    {
+        fclose(stream);
+        return false;
+    }
+
+    unsigned char *bytes = (unsigned char *)mp_malloc((size_t)size + 1);
+    size_t bytesRead = fread(bytes, 1, (size_t)size, stream);
+    fclose(stream);
+    if (bytesRead < (size_t)size)
+    {
+        mp_free(bytes);
+        return false;
+    }
+    file->data = bytes;
+    file->length = bytesRead;
+    return true;
+}
+
+static void unmapFile(KvFile *file)
+{
+    if (file->data == NULL)
+        return;
+#ifndef _WIN32
+    if (file->mapped)
+    {
+        munmap((void *)file->data, file->length);
+        return;
+    }
+#endif
+    mp_free((void *)file->data);
+}
+
+// Applies one record to the data, false when it does not decode
+static bool replayRecord(ObjDict *data, const unsigned char *payload, int length, char *error, int errorSize)
+{
+    if (length < 2)
+        return false;
+
+    unsigned char operation = payload[0];
+    int position = 1;
+    uint32_t keyLength = 0;
+    for (int shift = 0; position < length; shift += 7)
+    {
+        unsigned char byte = payload[position++];
+        keyLength |= (uint32_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            break;
+        if (shift > 28)
+            return false;
+    }
+    if (keyLength > (uint32_t)(length - position))
+        return false;
+
+    char small[128];
+    char *key = keyLength < sizeof(small) ? small : (char *)mp_malloc(keyLength + 1);
+    memcpy(key, payload + position, keyLength);
+    key[keyLength] = '\0';
+    position += keyLength;
+
+    bool ok = true;
+    if (operation == KV_PUT)
+    {
+        Value value;
+        ok = binaryDecode(payload + position, length - position, &value, error, errorSize);
+        if (ok)
+            insertDict(data, key, value);
+    }
+    else if (operation == KV_DELETE)
+        deleteDict(data, key);
+    else
+        ok = false;
+
+    if (key != small)
+        mp_free(key);
+    return ok;
+}
+
+// Files written before the log format are JSON objects, they are read once
+// and rewritten as a log
+static bool readLegacy(KvFile *file, ObjDict **data)
+{
+    char *text = (char *)mp_malloc(file->length + 1);
+    memcpy(text, file->data, file->length);
+    text[file->length] = '\0';
+
+    char error[256];
+    Value value;
+    bool ok = parseJson(text, (int)file->length, &value, error, sizeof(error)) && IS_DICT(value);
+    mp_free(text);
+    if (ok)
+        *data = AS_DICT(value);
+    return ok;
+}
+
+// Rebuilds the data from the log at 'path', creating the file when it does
+// not exist. 'records' is how many records the log holds, live or not
+bool kvOpen(const char *path, ObjDict **data, int *records, char *error, int errorSize)
+{
+    *data = initDict();
+    *records = 0;
+    push(OBJ_VAL(*data));
+
+    KvFile file;
+    bool missing;
+    if (!mapFile(path, &file, &missing))
+    {
+        pop();
+        if (missing)
+            return kvCompact(path, *data, false, error, errorSize);
+        snprintf(error, errorSize, "Could not read '%s'", path);
+        return false;
+    }
+
+    bool rewrite = false;
+    bool ok = true;
+    if (file.length == 0)
+        rewrite = true;
+    else if (file.length < KV_HEADER_SIZE || memcmp(file.data, KV_MAGIC, 4) != 0)
+    {
+        rewrite = readLegacy(&file, data);
+        if (!rewrite)
+        {
+            snprintf(error, errorSize, "'%s' is not a storage file", path);
+            ok = false;
+        }
+    }
+    else if (file.data[4] != KV_VERSION)
+    {
+        snprintf(error, errorSize, "Unsupported storage version %d", file.data[4]);
+        ok = false;
+    }
+    else
+    {
+        size_t position = KV_HEADER_SIZE;
+        char recordError[256];
+        while (position < file.length)
+        {
+            if (file.length - position < KV_RECORD_HEADER_SIZE)
+            {
+                rewrite = true;
+                break;
+            }
+
+            uint32_t length = readUint32(file.data + position);
+            uint32_t sum = readUint32(file.data + position + 4);
+            const unsigned char *payload = file.data + position + KV_RECORD_HEADER_SIZE;
+            size_t left = file.length - position - KV_RECORD_HEADER_SIZE;
+            bool valid = length <= left && checksum(payload, length) == sum;
+            if (!valid && length >= left)
+            {
+                // The last write did not finish, it is dropped
+                rewrite = true;
+                break;
+            }
+            if (!valid)
+            {
+                // Damage in the middle of the log is not a torn write, the
+                // file is left as it is
+                snprintf(error, errorSize, "Corrupt record at offset %zu in '%s'", position, path);
+                ok = false;
+                break;
+            }
+            if (!replayRecord(*data, payload, length, recordError, sizeof(recordError)))
+            {
+                snprintf(error, errorSize, "Invalid record at offset %zu in '%s'", position, path);
+                ok = false;
+                break;
+            }
+
+            position += KV_RECORD_HEADER_SIZE + length;
+            (*records)++;
+        }
+    }
+
+    unmapFile(&file);
+    if (ok && rewrite)
+    {
+        ok = kvCompact(path, *data, true, error, errorSize);
+        *records = (*data)->count;
+    }
+    pop();
+    return ok;
+}
+
+// Writes every operation, [key, value] for a put and [key] for a delete,
+// with one write and at most one sync
+bool kvAppend(const char *path, ObjList *operations, bool sync, char *error, int errorSize)
+{
+    KvBuffer buffer = {NULL, 0, 0};
+    bool ok = true;
+    for (int i = 0; i < operations->values.count && ok; i++)
+    {
+        Value operation = operations->values.values[i];
+        if (!IS_LIST(operation) || AS_LIST(operation)->values.count < 1 ||
+            !IS_STRING(AS_LIST(operation)->values.values[0]))
+        {
+            snprintf(error, errorSize, "Invalid storage operation");
+            ok = false;
+            break;
+        }
+
+        ValueArray *values = &AS_LIST(operation)->values;
+        ObjString *key = AS_STRING(values->values[0]);
+        ok = appendRecord(&buffer, key->chars, key->length, values->count > 1 ? &values->values[1] : NULL, error,
+                          errorSize);
+    }
+
+    if (ok)
+    {
+        FILE *file = fopen(path, "ab");
+        if (file == NULL)
+        {
+            snprintf(error, errorSize, "Could not open '%s'", path);
+            ok = false;
+        }
+        else
+        {
+            if (!writeAll(file, &buffer, sync))
+            {
+                snprintf(error, errorSize, "Could not write to '%s'", path);
+                ok = false;
+            }
+            fclose(file);
+        }
+    }
+
+    if (buffer.bytes != NULL)
+        mp_free(buffer.bytes);
+    return ok;
+}
+
+// Writes the live data to a new log next to 'path' and moves it over the
+// old one, so a crash leaves one of the two complete
+bool kvCompact(const char *path, ObjDict *data, bool sync, char *error, int errorSize)
+{
+    KvBuffer buffer = {NULL, 0, 0};
+    writeBuffer(&buffer, KV_MAGIC, 4);
+    unsigned char version = KV_VERSION;
+    writeBuffer(&buffer, &version, 1);
+
+    bool ok = true;
+    for (int i = 0; i < data->capacity && ok; i++)
+    {
+        dictItem *item = data->items[i];
+        if (item == NULL || item->deleted)
+            continue;
+        ok = appendRecord(&buffer, item->key, (int)strlen(item->key), &item->item, error, errorSize);
+    }
+
+    int tempLength = (int)strlen(path) + 6;
+    char *temp = (char *)mp_malloc(tempLength);
+    snprintf(temp, tempLength, "%s.tmp", path);
+
+    if (ok)
+    {
+        FILE *file = fopen(temp, "wb");
+        if (file == NULL)
+        {
+            snprintf(error, errorSize, "Could not open '%s'", temp);
+            ok = false;
+        }
+        else
+        {
+            ok = writeAll(file, &buffer, sync);
+            fclose(file);
+            if (!ok)
+                snprintf(error, errorSize, "Could not write to '%s'", temp);
+        }
+    }
+
+    if (ok)
+    {
+#ifdef _WIN32
+        remove(path);
+#endif
+        if (rename(temp, path) != 0)
+        {
+            snprintf(error, errorSize, "Could not replace '%s'", path);
+            ok = false;
+        }
+    }
+    else
+        remove(temp);
+
+    mp_free(temp);
+    if (buffer.bytes != NULL)
+        mp_free(buffer.bytes);
+    return ok;
+}
@@ -0,0 +1,22 @@
+#ifndef CUBE_KVSTORE_h
+#define CUBE_KVSTORE_h
+
+#include "object.h"
+
+// Append-only key value log behind stdlib/storage. The file starts with
+// the magic "CUKV" and a version byte, followed by records:
+//
+//   uint32 payload length, uint32 FNV-1a checksum of the payload
+//   payload: operation byte, varint key length, key, [encoded value]
+//
+// Puts carry the value in the binary encoding of serializer.h, deletes
+// carry none. Replaying the log in order rebuilds the data, a torn or
+// damaged tail is dropped by rewriting the file.
+#define KV_MAGIC "CUKV"
+#define KV_VERSION 1
+
+bool kvOpen(const char *path, ObjDict **data, int *records, char *error, int errorSize);
+bool kvAppend(const char *path, ObjList *operations, bool sync, char *error, int errorSize);
+bool kvCompact(const char *path, ObjDict *data, bool sync, char *error, int errorSize);
+
+#endif
@@ -8,6 +8,7 @@ linked_list *linked_list_create()
     llist->data = NULL;
     llist->next = NULL;
     llist->previous = NULL;
+    return llist;
 }
 
 void linked_list_destroy_intern(linked_list *llist, bool freeData)
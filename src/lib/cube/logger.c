@@ -0,0 +1,604 @@
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "logger.h"
+
+// A sink writes what it has gathered once it grows past this
+#define LOG_BATCH_SIZE 65536
+// Console lines up to this size are formatted without malloc
+#define LOG_LINE_SIZE 512
+
+// THREAD_LOCAL is empty when the VM runs a single thread, but native
+// libraries may log from threads of their own
+#ifdef _MSC_VER
+#define LOG_THREAD_LOCAL __declspec(thread)
+#else
+#define LOG_THREAD_LOCAL __thread
+#endif
+
+typedef enum
+{
+    SINK_FREE,
+    SINK_OPEN,
+    SINK_CLOSING
+} SinkState;
+
+typedef struct
+{
+    int state; // Shared with the writer, set last when the sink opens
+    int level;
+    FILE *file;
+    char *path;
+    bool console;
+    bool colors;
+    long size;
+    long maxSize;
+    int maxFiles;
+
+    // Owned by the writer
+    char *batch;
+    int batchLength;
+    int batchCapacity;
+} LogSink;
+
+// Bounded multi producer queue: a slot is free for the position equal to its
+// sequence and ready for the writer once the sequence is one past it
+typedef struct
+{
+    size_t sequence;
+    int sink;
+    char *line; // NULL asks the writer to close the sink
+    int length;
+} LogSlot;
+
+// Lines cross threads, so they come from malloc and not the VM pool
+static LogSink sinks[LOG_MAX_SINKS];
+static LogSlot *ring = NULL;
+static size_t enqueuePosition = 0;
+static size_t dequeuePosition = 0;
+
+// Guarded by the lock
+static size_t writtenPosition = 0;
+static bool wakeRequested = false;
+static bool stopping = false;
+
+// Set under the lock once the writer thread runs, read without it
+static bool running = false;
+static bool registered = false;
+
+// Per calling thread, the writer never touches them
+static LOG_THREAD_LOCAL time_t stampSecond = -1;
+static LOG_THREAD_LOCAL char stamp[32];
+static LOG_THREAD_LOCAL int stampLength = 0;
+
+static const char *levelNames[] = {"DEBUG", "INFO", "ERROR"};
+static const char *levelColors[] = {"\033[0;m", "\033[0;34m", "\033[0;31m"};
+
+#ifdef _WIN32
+static HANDLE writerThread = NULL;
+static CRITICAL_SECTION logLock;
+static CONDITION_VARIABLE wakeCondition;
+static CONDITION_VARIABLE drainedCondition;
+static INIT_ONCE lockOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK initLockOnce(PINIT_ONCE once, PVOID parameter, PVOID *context)
+{
+    InitializeCriticalSection(&logLock);
+    InitializeConditionVariable(&wakeCondition);
+    InitializeConditionVariable(&drainedCondition);
+    return TRUE;
+}
+
+static void initLock()
+{
+    InitOnceExecuteOnce(&lockOnce, initLockOnce, NULL, NULL);
+}
+
+static void lockLog()
+{
+    EnterCriticalSection(&logLock);
+}
+
+static void unlockLog()
+{
+    LeaveCriticalSection(&logLock);
+}
+
+static void waitWake(int ms)
+{
+    SleepConditionVariableCS(&wakeCondition, &logLock, ms);
+}
+
+static void signalWake()
+{
+    WakeConditionVariable(&wakeCondition);
+}
+
+static void waitDrained()
+{
+    SleepConditionVariableCS(&drainedCondition, &logLock, INFINITE);
+}
+
+static void signalDrained()
+{
+    WakeAllConditionVariable(&drainedCondition);
+}
+
+static void yieldWriter()
+{
+    SwitchToThread();
+}
+#else
+static pthread_t writerThread;
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeCondition = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drainedCondition = PTHREAD_COND_INITIALIZER;
+
+static void initLock()
+{
+}
+
+static void lockLog()
+{
+    pthread_mutex_lock(&logLock);
+}
+
+static void unlockLog()
+{
+    pthread_mutex_unlock(&logLock);
+}
+
+static void waitWake(int ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)ms * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&wakeCondition, &logLock, &deadline);
+}
+
+static void signalWake()
+{
+    pthread_cond_signal(&wakeCondition);
+}
+
+static void waitDrained()
+{
+    pthread_cond_wait(&drainedCondition, &logLock);
+}
+
+static void signalDrained()
+{
+    pthread_cond_broadcast(&drainedCondition);
+}
+
+static void yieldWriter()
+{
+    sched_yield();
+}
+#endif
+
+static void wakeWriter()
+{
+    lockLog();
+    wakeRequested = true;
+    signalWake();
+    unlockLog();
+}
+
+static void enqueue(int sink, char *line, int length)
+{
+    size_t position = __atomic_load_n(&enqueuePosition, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        LogSlot *slot = &ring[position & (LOG_RING_SIZE - 1)];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0)
+        {
+            if (__atomic_compare_exchange_n(&enqueuePosition, &position, position + 1, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                slot->sink = sink;
+                slot->line = line;
+                slot->length = length;
+                __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            // Full, wait for the writer instead of dropping lines
+            wakeWriter();
+            yieldWriter();
+            position = __atomic_load_n(&enqueuePosition, __ATOMIC_RELAXED);
+        }
+        else
+            position = __atomic_load_n(&enqueuePosition, __ATOMIC_RELAXED);
+    }
+
+    // Half full, the writer should not wait for the interval
+    if (position + 1 - __atomic_load_n(&dequeuePosition, __ATOMIC_ACQUIRE) == LOG_RING_SIZE / 2)
+        wakeWriter();
+}
+
+static bool dequeue(LogSlot *message)
+{
+    LogSlot *slot = &ring[dequeuePosition & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != dequeuePosition + 1)
+        return false;
+
+    message->sink = slot->sink;
+    message->line = slot->line;
+    message->length = slot->length;
+    __atomic_store_n(&slot->sequence, dequeuePosition + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    __atomic_store_n(&dequeuePosition, dequeuePosition + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void writeBatch(LogSink *sink)
+{
+    if (sink->batchLength == 0)
+        return;
+    if (sink->file != NULL)
+    {
+        fwrite(sink->batch, 1, sink->batchLength, sink->file);
+        fflush(sink->file);
+    }
+    sink->size += sink->batchLength;
+    sink->batchLength = 0;
+}
+
+// path.N is dropped, the others move one up and the current file becomes
+// path.1
+static void rotate(LogSink *sink)
+{
+    if (sink->file != NULL)
+        fclose(sink->file);
+
+    int length = (int)strlen(sink->path) + 16;
+    char *from = (char *)malloc(length);
+    char *to = (char *)malloc(length);
+    if (sink->maxFiles > 0)
+    {
+        snprintf(to, length, "%s.%d", sink->path, sink->maxFiles);
+        remove(to);
+        for (int i = sink->maxFiles - 1; i > 0; i--)
+        {
+            snprintf(from, length, "%s.%d", sink->path, i);
+            snprintf(to, length, "%s.%d", sink->path, i + 1);
+            rename(from, to);
+        }
+        snprintf(to, length, "%s.1", sink->path);
+        rename(sink->path, to);
+    }
+    else
+        remove(sink->path);
+    free(from);
+    free(to);
+
+    sink->file = fopen(sink->path, "ab");
+    sink->size = 0;
+}
+
+static void closeSink(LogSink *sink)
+{
+    writeBatch(sink);
+    if (!sink->console && sink->file != NULL)
+        fclose(sink->file);
+    sink->file = NULL;
+    free(sink->path);
+    sink->path = NULL;
+    free(sink->batch);
+    sink->batch = NULL;
+    sink->batchLength = 0;
+    sink->batchCapacity = 0;
+    __atomic_store_n(&sink->state, SINK_FREE, __ATOMIC_RELEASE);
+}
+
+static void appendBatch(LogSink *sink, const char *line, int length)
+{
+    if (sink->batchLength + length > sink->batchCapacity)
+    {
+        int capacity = sink->batchCapacity < 4096 ? 4096 : sink->batchCapacity;
+        while (capacity < sink->batchLength + length)
+            capacity *= 2;
+        sink->batch = (char *)realloc(sink->batch, capacity);
+        sink->batchCapacity = capacity;
+    }
+    memcpy(sink->batch + sink->batchLength, line, length);
+    sink->batchLength += length;
+}
+
+static void drain()
+{
+    LogSlot message;
+    while (dequeue(&message))
+    {
+        LogSink *sink = &sinks[message.sink];
+        if (message.line == NULL)
+        {
+            closeSink(sink);
+            continue;
+        }
+
+        long pending = sink->size + sink->batchLength;
+        if (sink->maxSize > 0 && pending > 0 && pending + message.length > sink->maxSize)
+        {
+            writeBatch(sink);
+            rotate(sink);
+        }
+
+        appendBatch(sink, message.line, message.length);
+        free(message.line);
+        if (sink->batchLength >= LOG_BATCH_SIZE)
+            writeBatch(sink);
+    }
+
+    for (int i = 0; i < LOG_MAX_SINKS; i++)
+        writeBatch(&sinks[i]);
+}
+
+static void writerLoop()
+{
+    lockLog();
+    for (;;)
+    {
+        bool stop = stopping;
+        unlockLog();
+        drain();
+        lockLog();
+
+        writtenPosition = dequeuePosition;
+        signalDrained();
+        if (stop)
+            break;
+
+        if (!wakeRequested && !stopping)
+            waitWake(LOG_FLUSH_INTERVAL);
+        wakeRequested = false;
+    }
+    unlockLog();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI writerMain(LPVOID data)
+{
+    writerLoop();
+    return 0;
+}
+#else
+static void *writerMain(void *data)
+{
+    writerLoop();
+    return NULL;
+}
+#endif
+
+// Any thread may be first to log to a file, the writer is started once
+// under the lock
+static bool startWriter()
+{
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+        return true;
+
+    initLock();
+    lockLog();
+    bool started = running;
+    if (!started)
+    {
+        if (ring == NULL)
+        {
+            ring = (LogSlot *)calloc(LOG_RING_SIZE, sizeof(LogSlot));
+            for (size_t i = 0; i < LOG_RING_SIZE; i++)
+                ring[i].sequence = i;
+        }
+
+        stopping = false;
+#ifdef _WIN32
+        writerThread = CreateThread(NULL, 0, writerMain, NULL, 0, NULL);
+        started = writerThread != NULL;
+#else
+        started = pthread_create(&writerThread, NULL, writerMain, NULL) == 0;
+#endif
+        if (started)
+        {
+            __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+            if (!registered)
+            {
+                atexit(logShutdown);
+                registered = true;
+            }
+        }
+    }
+    unlockLog();
+    return started;
+}
+
+int logOpen(const char *path, int level, long maxSize, int maxFiles, char *error, int errorSize)
+{
+    bool console = path == NULL || strcmp(path, "stderr") == 0;
+    if (!console && !startWriter())
+    {
+        snprintf(error, errorSize, "Could not start the log writer");
+        return -1;
+    }
+
+    int id = 0;
+    while (id < LOG_MAX_SINKS && __atomic_load_n(&sinks[id].state, __ATOMIC_ACQUIRE) != SINK_FREE)
+        id++;
+    if (id == LOG_MAX_SINKS)
+    {
+        snprintf(error, errorSize, "Too many open logs");
+        return -1;
+    }
+
+    LogSink *sink = &sinks[id];
+    sink->console = console;
+    if (console)
+    {
+        sink->file = path == NULL ? stdout : stderr;
+        sink->path = NULL;
+        sink->size = 0;
+        sink->maxSize = 0;
+        sink->colors = isatty(fileno(sink->file));
+    }
+    else
+    {
+        sink->file = fopen(path, "ab");
+        if (sink->file == NULL)
+        {
+            snprintf(error, errorSize, "Could not open '%s'", path);
+            return -1;
+        }
+        fseek(sink->file, 0, SEEK_END);
+        sink->size = ftell(sink->file);
+        sink->path = (char *)malloc(strlen(path) + 1);
+        strcpy(sink->path, path);
+        sink->maxSize = maxSize;
+        sink->colors = false;
+    }
+    sink->level = level;
+    sink->maxFiles = maxFiles;
+    __atomic_store_n(&sink->state, SINK_OPEN, __ATOMIC_RELEASE);
+    return id;
+}
+
+bool logValid(int sink)
+{
+    return sink >= 0 && sink < LOG_MAX_SINKS && __atomic_load_n(&sinks[sink].state, __ATOMIC_ACQUIRE) == SINK_OPEN;
+}
+
+bool logEnabled(int sink, int level)
+{
+    return logValid(sink) && level >= sinks[sink].level && level < LOG_NONE;
+}
+
+int logGetLevel(int sink)
+{
+    return sinks[sink].level;
+}
+
+void logSetLevel(int sink, int level)
+{
+    sinks[sink].level = level;
+}
+
+// The timestamp is formatted once a second per thread
+void logWrite(int sink, int level, const char *message, int length)
+{
+    if (!logEnabled(sink, level))
+        return;
+
+    LogSink *target = &sinks[sink];
+    if (!target->console && !startWriter())
+        return;
+
+    time_t now = time(NULL);
+    if (now != stampSecond)
+    {
+        struct tm local;
+#ifdef _WIN32
+        localtime_s(&local, &now);
+#else
+        localtime_r(&now, &local);
+#endif
+        stampLength = (int)strftime(stamp, sizeof(stamp), "%d/%m/%Y %H:%M:%S", &local);
+        stampSecond = now;
+    }
+
+    // Console lines are written right away and most fit on the stack
+    char local[LOG_LINE_SIZE];
+    int capacity = stampLength + length + 32;
+    char *line = target->console && capacity <= LOG_LINE_SIZE ? local : (char *)malloc(capacity);
+    int size;
+    if (target->colors)
+        size = sprintf(line, "\033[0;32m%s: %s", stamp, levelColors[level]);
+    else
+        size = sprintf(line, "%s %s: ", stamp, levelNames[level]);
+    memcpy(line + size, message, length);
+    size += length;
+    if (target->colors)
+    {
+        memcpy(line + size, "\033[0;m", 5);
+        size += 5;
+    }
+    line[size++] = '\n';
+
+    // Through the same stream as print, so the line keeps its place among the
+    // prints and follows the output mode
+    if (target->console)
+    {
+        fwrite(line, 1, size, target->file);
+        if (line != local)
+            free(line);
+    }
+    else
+        enqueue(sink, line, size);
+}
+
+void logFlush()
+{
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+        return;
+
+    size_t target = __atomic_load_n(&enqueuePosition, __ATOMIC_ACQUIRE);
+    lockLog();
+    while (writtenPosition < target)
+    {
+        wakeRequested = true;
+        signalWake();
+        waitDrained();
+    }
+    unlockLog();
+}
+
+void logClose(int sink)
+{
+    if (!logValid(sink))
+        return;
+    if (sinks[sink].console)
+    {
+        // Nothing of it is left in the ring
+        __atomic_store_n(&sinks[sink].state, SINK_FREE, __ATOMIC_RELEASE);
+        return;
+    }
+    if (!startWriter())
+        return;
+    __atomic_store_n(&sinks[sink].state, SINK_CLOSING, __ATOMIC_RELEASE);
+    enqueue(sink, NULL, 0);
+}
+
+void logShutdown()
+{
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+        return;
+
+    lockLog();
+    stopping = true;
+    signalWake();
+    unlockLog();
+
+#ifdef _WIN32
+    WaitForSingleObject(writerThread, INFINITE);
+    CloseHandle(writerThread);
+#else
+    pthread_join(writerThread, NULL);
+#endif
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+}
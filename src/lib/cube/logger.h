@@ -0,0 +1,38 @@
+#ifndef CUBE_LOGGER_h
+#define CUBE_LOGGER_h
+#include <stdbool.h>
+
+// Logging behind stdlib/logger. Lines are formatted by the caller. Console
+// lines go straight to stdout or stderr, in order with print. File lines are
+// handed to a background writer through a bounded lock-free ring. The writer
+// wakes every LOG_FLUSH_INTERVAL ms, or sooner when the ring fills up, and
+// writes everything pending with one call per sink. Files rotate to path.1
+// ... path.N once they grow past their size limit.
+#define LOG_RING_SIZE 8192 // Slots, a power of two
+#define LOG_MAX_SINKS 64
+#define LOG_FLUSH_INTERVAL 50
+
+// The levels of the Level enum in stdlib/logger.cube
+typedef enum
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_ERROR,
+    LOG_NONE
+} LogLevel;
+
+// A null path logs to stdout, "stderr" to stderr. Returns the sink, -1 when
+// the file can not be opened
+int logOpen(const char *path, int level, long maxSize, int maxFiles, char *error, int errorSize);
+bool logValid(int sink);
+bool logEnabled(int sink, int level);
+int logGetLevel(int sink);
+void logSetLevel(int sink, int level);
+void logWrite(int sink, int level, const char *message, int length);
+// Waits for every line logged so far to be written
+void logFlush();
+void logClose(int sink);
+// Writes what is pending and stops the writer, it starts again when needed
+void logShutdown();
+
+#endif
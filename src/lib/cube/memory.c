@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "errors.h"
 #include "gc.h"
 #include "memory.h"
 #include "mempool.h"
@@ -20,9 +21,14 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+// Bytes ever allocated, for the allocation rate reported by gc stats
+static size_t totalAllocated = 0;
+
 void *reallocate(void *previous, size_t oldSize, size_t newSize)
 {
     vm.bytesAllocated += newSize - oldSize;
+    if (newSize > oldSize)
+        totalAllocated += newSize - oldSize;
 
     if (vm.autoGC && newSize > oldSize)
     {
@@ -42,8 +48,149 @@ void *reallocate(void *previous, size_t oldSize, size_t newSize)
     return mp_realloc(previous, newSize);
 }
 
+// Small fixed-size objects are carved out of slabs with one free list per
+// size class. Blocks are recycled through the free list of the thread that
+// releases them and slabs are kept for the lifetime of the process.
+#define SLAB_GRANULARITY 16
+#define SLAB_CLASSES 8
+#define SLAB_BLOCKS 256
+
+typedef struct SlabBlock_t
+{
+    struct SlabBlock_t *next;
+} SlabBlock;
+
+static THREAD_LOCAL SlabBlock *slabCache[SLAB_CLASSES];
+static size_t slabs = 0;
+static size_t slabBytes = 0;
+
+static ObjectStats objectStats[OBJ_TYPE_COUNT];
+static size_t objectSizes[OBJ_TYPE_COUNT];
+
+static bool useSlab(ObjType type)
+{
+    switch (type)
+    {
+        case OBJ_STRING:
+        case OBJ_LIST:
+        case OBJ_INSTANCE:
+        case OBJ_CLOSURE:
+        case OBJ_UPVALUE:
+        case OBJ_BOUND_METHOD:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int slabClass(size_t size)
+{
+    int index = (int)((size + SLAB_GRANULARITY - 1) / SLAB_GRANULARITY) - 1;
+    return index < SLAB_CLASSES ? index : -1;
+}
+
+static bool refillSlab(int index)
+{
+    size_t blockSize = (index + 1) * SLAB_GRANULARITY;
+    char *slab = (char *)mp_malloc(blockSize * SLAB_BLOCKS);
+    if (slab == NULL)
+        return false;
+
+    for (int i = SLAB_BLOCKS - 1; i >= 0; i--)
+    {
+        SlabBlock *block = (SlabBlock *)(slab + i * blockSize);
+        block->next = slabCache[index];
+        slabCache[index] = block;
+    }
+
+    slabs++;
+    slabBytes += blockSize * SLAB_BLOCKS;
+    return true;
+}
+
+void *allocateObjectMemory(size_t size, ObjType type)
+{
+    ObjectStats *stats = &objectStats[type];
+    stats->allocated++;
+    stats->live++;
+    stats->bytes += size;
+    objectSizes[type] = size;
+
+    int index = useSlab(type) ? slabClass(size) : -1;
+    if (index < 0)
+        return reallocate(NULL, 0, size);
+
+    stats->slab = true;
+    vm.bytesAllocated += size;
+    totalAllocated += size;
+    if (vm.autoGC)
+    {
+#ifdef DEBUG_STRESS_GC
+        gc_collect();
+#else
+        gc_maybe_collect();
+#endif
+    }
+
+    if (slabCache[index] == NULL && !refillSlab(index))
+        return NULL;
+
+    SlabBlock *block = slabCache[index];
+    slabCache[index] = block->next;
+    return block;
+}
+
+void freeObjectMemory(Obj *object, size_t size)
+{
+    int index = useSlab(object->type) ? slabClass(size) : -1;
+    if (index < 0)
+    {
+        reallocate(object, size, 0);
+        return;
+    }
+
+    vm.bytesAllocated -= size;
+    SlabBlock *block = (SlabBlock *)object;
+    block->next = slabCache[index];
+    slabCache[index] = block;
+}
+
+void getObjectStats(ObjType type, ObjectStats *stats)
+{
+    *stats = objectStats[type];
+}
+
+size_t allocatedBytes()
+{
+    return totalAllocated;
+}
+
+size_t objectSize(Obj *object)
+{
+    if (object->type == OBJ_INSTANCE)
+        return INSTANCE_SIZE(((ObjInstance *)object)->slotCount);
+    if (object->type == OBJ_CLOSURE)
+        return CLOSURE_SIZE(((ObjClosure *)object)->upvalueCount);
+    return objectSizes[object->type];
+}
+
+size_t slabCount()
+{
+    return slabs;
+}
+
+size_t slabCapacity()
+{
+    return slabBytes;
+}
+
 void freeObject(Obj *object)
 {
+    ObjectStats *stats = &objectStats[object->type];
+    stats->freed++;
+    stats->live--;
+    stats->bytes -= objectSize(object);
+
 #if defined(DEBUG_LOG_GC) && defined(DEBUG_LOG_GC_DETAILS)
     printf("%p free ", object);
     printValue(OBJ_VAL(object));
@@ -54,7 +201,12 @@ void freeObject(Obj *object)
     switch (object->type)
     {
         case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
+            FREE_OBJ(ObjBoundMethod, object);
+            break;
+
+        case OBJ_ERROR:
+            freeErrorInfo(((ObjError *)object)->info);
+            FREE_OBJ(ObjError, object);
             break;
 
         case OBJ_CLASS: {
@@ -62,6 +214,8 @@ void freeObject(Obj *object)
             freeTable(&klass->methods);
             freeTable(&klass->fields);
             freeTable(&klass->staticFields);
+            freeTable(&klass->slots);
+            freeValueArray(&klass->defaults);
             FREE(ObjClass, object);
             break;
         }
@@ -81,8 +235,7 @@ void freeObject(Obj *object)
 
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *)object;
-            FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            freeObjectMemory(object, CLOSURE_SIZE(closure->upvalueCount));
             break;
         }
 
@@ -102,7 +255,7 @@ void freeObject(Obj *object)
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *)object;
             freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            freeObjectMemory(object, INSTANCE_SIZE(instance->slotCount));
             break;
         }
 
@@ -114,14 +267,14 @@ void freeObject(Obj *object)
             ObjString *string = (ObjString *)object;
             FREE_ARRAY(char, string->chars, string->length + 1);
             string->chars = NULL;
-            FREE(ObjString, object);
+            FREE_OBJ(ObjString, object);
             break;
         }
 
         case OBJ_LIST: {
             ObjList *list = (ObjList *)object;
             freeValueArray(&list->values);
-            FREE(ObjList, list);
+            FREE_OBJ(ObjList, list);
             break;
         }
 
@@ -155,6 +308,21 @@ void freeObject(Obj *object)
             break;
         }
 
+        case OBJ_SET: {
+            ObjSet *set = (ObjSet *)object;
+            freeValueArray(&set->values);
+            FREE_ARRAY(SetEntry, set->entries, set->capacity);
+            FREE(ObjSet, set);
+            break;
+        }
+
+        case OBJ_GENERATOR: {
+            ObjGenerator *generator = (ObjGenerator *)object;
+            freeGenerator(generator);
+            FREE(ObjGenerator, generator);
+            break;
+        }
+
         case OBJ_FILE: {
             ObjFile *file = (ObjFile *)object;
             freeFile(file);
@@ -191,7 +359,7 @@ void freeObject(Obj *object)
         }
 
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+            FREE_OBJ(ObjUpvalue, object);
             break;
     }
 }
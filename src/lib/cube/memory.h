@@ -14,7 +14,25 @@
 
 #define FREE_ARRAY(type, pointer, oldCount) reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+#define FREE_OBJ(type, pointer) freeObjectMemory((Obj *)(pointer), sizeof(type))
+
+typedef struct
+{
+    size_t allocated;
+    size_t freed;
+    size_t live;
+    size_t bytes;
+    bool slab;
+} ObjectStats;
+
 void *reallocate(void *previous, size_t oldSize, size_t newSize);
+void *allocateObjectMemory(size_t size, ObjType type);
+void freeObjectMemory(Obj *object, size_t size);
+void getObjectStats(ObjType type, ObjectStats *stats);
+size_t allocatedBytes();
+size_t objectSize(Obj *object);
+size_t slabCount();
+size_t slabCapacity();
 /*
 void markObject(Obj* object);
 void markValue(Value value);
@@ -214,6 +214,7 @@ void native_callback(void *fn, cube_native_var *argsNative)
 
     CallFrame *frame = &tf->frames[tf->frameCount++];
     frame->closure = closure;
+    frame->constants = closure->function->chunk.constants.values;
     frame->ip = closure->function->chunk.code;
     frame->module = threadFrame->frame->module;
     frame->type = CALL_FRAME_TYPE_FUNCTION;
@@ -14,6 +14,7 @@
 #endif
 
 #include "collections.h"
+#include "errors.h"
 #include "memory.h"
 #include "mempool.h"
 #include "object.h"
@@ -25,7 +26,7 @@
 
 static Obj *allocateObject(size_t size, ObjType type)
 {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
+    Obj *object = (Obj *)allocateObjectMemory(size, type);
     object->type = type;
     object->isMarked = false;
 
@@ -57,6 +58,9 @@ ObjClass *newClass(ObjString *name)
     initTable(&klass->methods);
     initTable(&klass->fields);
     initTable(&klass->staticFields);
+    initTable(&klass->slots);
+    initValueArray(&klass->defaults);
+    klass->id = ++vm.classCount;
     return klass;
 }
 
@@ -85,6 +89,13 @@ ObjTask *newTask(ObjString *name)
     return task;
 }
 
+ObjError *newError(ErrorInfo *info)
+{
+    ObjError *error = ALLOCATE_OBJ(ObjError, OBJ_ERROR);
+    error->info = info;
+    return error;
+}
+
 ObjModule *newModule(ObjString *name)
 {
     ObjModule *module = ALLOCATE_OBJ(ObjModule, OBJ_MODULE);
@@ -97,16 +108,13 @@ ObjModule *newModule(ObjString *name)
 
 ObjClosure *newClosure(ObjFunction *function)
 {
-    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
+    ObjClosure *closure = (ObjClosure *)allocateObject(CLOSURE_SIZE(function->upvalueCount), OBJ_CLOSURE);
+    closure->function = function;
+    closure->upvalueCount = function->upvalueCount;
     for (int i = 0; i < function->upvalueCount; i++)
     {
-        upvalues[i] = NULL;
+        closure->upvalues[i] = NULL;
     }
-
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
     closure->module = NULL;
     closure->instance = NULL;
     closure->args = NULL;
@@ -122,28 +130,123 @@ ObjFunction *newFunction(bool isStatic)
     function->upvalueCount = 0;
     function->name = NULL;
     function->staticMethod = isStatic;
+    function->generator = false;
     function->path = NULL;
     function->doc = NULL;
+    function->counter = -1;
+    function->shared = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
+// Fields the class gains after instances exist are appended as new slots,
+// so the slots of older instances never move
+static void updateShape(ObjClass *klass)
+{
+    int i = 0;
+    Entry entry;
+    Value slot;
+    while (iterateTable(&klass->fields, &entry, &i))
+    {
+        if (entry.key == NULL || tableGet(&klass->slots, entry.key, &slot))
+            continue;
+
+        tableSet(&klass->slots, entry.key, NUMBER_VAL(klass->defaults.count));
+        writeValueArray(&klass->defaults, entry.value);
+    }
+
+    // A new id drops the slots cached by property instructions
+    klass->id = ++vm.classCount;
+}
+
 ObjInstance *newInstance(ObjClass *klass)
 {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    if (klass->fields.count != klass->defaults.count)
+        updateShape(klass);
+
+    int slotCount = klass->defaults.count;
+    ObjInstance *instance = (ObjInstance *)allocateObject(INSTANCE_SIZE(slotCount), OBJ_INSTANCE);
     instance->klass = klass;
+    instance->slotCount = slotCount;
     initTable(&instance->fields);
-    tableAddAll(&klass->fields, &instance->fields);
+    if (slotCount > 0)
+        memcpy(instance->slots, klass->defaults.values, sizeof(Value) * slotCount);
     return instance;
 }
 
-ObjNative *newNative(NativeFn function)
+int classSlot(ObjClass *klass, ObjString *name)
+{
+    Value slot;
+    if (!tableGet(&klass->slots, name, &slot))
+        return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+void updateClassField(ObjClass *klass, ObjString *name, Value value)
+{
+    tableSet(&klass->fields, name, value);
+    int slot = classSlot(klass, name);
+    if (slot >= 0)
+        klass->defaults.values[slot] = value;
+}
+
+bool getInstanceField(ObjInstance *instance, ObjString *name, Value *value)
+{
+    int slot = classSlot(instance->klass, name);
+    if (slot >= 0 && slot < instance->slotCount)
+    {
+        *value = instance->slots[slot];
+        return true;
+    }
+    return tableGet(&instance->fields, name, value);
+}
+
+void setInstanceField(ObjInstance *instance, ObjString *name, Value value)
+{
+    int slot = classSlot(instance->klass, name);
+    if (slot >= 0 && slot < instance->slotCount)
+        instance->slots[slot] = value;
+    else
+        tableSet(&instance->fields, name, value);
+}
+
+// Gathers every field of the instance into a table, for the places that
+// need to walk them all
+void instanceFields(ObjInstance *instance, Table *fields)
+{
+    int i = 0;
+    Entry entry;
+    while (iterateTable(&instance->klass->fields, &entry, &i))
+    {
+        if (entry.key == NULL)
+            continue;
+        int slot = classSlot(instance->klass, entry.key);
+        if (slot >= 0 && slot < instance->slotCount)
+            tableSet(fields, entry.key, instance->slots[slot]);
+    }
+    tableAddAll(&instance->fields, fields);
+}
+
+ObjNative *newNative(NativeFn function, ObjString *name)
 {
     ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->name = name;
+    native->counter = -1;
     return native;
 }
 
+// Indexed by ObjType
+static const char *objTypeNames[OBJ_TYPE_COUNT] = {
+    "method", "class",  "enum",       "enumvalue",    "module",    "func", "function", "instance",
+    "native", "str",    "list",       "dict",         "file",      "bytes", "nativefunc", "nativestruct",
+    "nativelib", "task", "request",   "process",      "upvalue",   "set",  "generator", "error"};
+
+const char *objTypeName(ObjType type)
+{
+    return objTypeNames[type];
+}
+
 ObjRequest *newRequest()
 {
     ObjRequest *request = ALLOCATE_OBJ(ObjRequest, OBJ_REQUEST);
@@ -194,6 +297,7 @@ ObjProcess *newProcess(ObjString *path, int argCount, Value *args)
     pipe(pipe2);
     // pipe(pipe3);
 
+    fflush(stdout);
     if ((child = fork()) == 0)
     {
         // In child
@@ -305,6 +409,31 @@ ObjList *initList()
     return list;
 }
 
+ObjSet *initSet()
+{
+    ObjSet *set = ALLOCATE_OBJ(ObjSet, OBJ_SET);
+    initValueArray(&set->values);
+    set->capacity = 0;
+    set->used = 0;
+    set->entries = NULL;
+    return set;
+}
+
+ObjGenerator *newGenerator(GeneratorType type)
+{
+    ObjGenerator *generator = ALLOCATE_OBJ(ObjGenerator, OBJ_GENERATOR);
+    generator->type = type;
+    generator->done = false;
+    generator->current = NULL_VAL;
+    generator->task = NULL;
+    generator->start = NULL_VAL;
+    generator->step = NULL_VAL;
+    generator->stop = NULL_VAL;
+    generator->exclusive = false;
+    generator->file = NULL;
+    return generator;
+}
+
 ObjBytes *initBytes()
 {
     ObjBytes *bytes = ALLOCATE_OBJ(ObjBytes, OBJ_BYTES);
@@ -334,6 +463,7 @@ ObjNativeFunc *initNativeFunc()
     nativeFunc->name = NULL;
     nativeFunc->returnType = NULL;
     nativeFunc->lib = NULL;
+    nativeFunc->counter = -1;
     return nativeFunc;
 }
 
@@ -441,6 +571,90 @@ static void printFunction(ObjFunction *function)
     printf("<fn %s>", function->name->chars);
 }
 
+// Containers are written element by element into the one buffer, so the
+// output is built in linear time
+void appendObject(OutBuffer *buffer, Value value, bool literal)
+{
+    switch (OBJ_TYPE(value))
+    {
+        case OBJ_STRING: {
+            ObjString *string = AS_STRING(value);
+            if (literal)
+                writeOutBuffer(buffer, "\"", 1);
+            writeOutBuffer(buffer, string->chars, string->length);
+            if (literal)
+                writeOutBuffer(buffer, "\"", 1);
+            return;
+        }
+
+        case OBJ_ENUM_VALUE: {
+            ObjEnumValue *enumValue = AS_ENUM_VALUE(value);
+            writeOutBuffer(buffer, enumValue->enume->name->chars, enumValue->enume->name->length);
+            writeOutBuffer(buffer, ".", 1);
+            writeOutBuffer(buffer, enumValue->name->chars, enumValue->name->length);
+            writeOutBuffer(buffer, "<", 1);
+            appendValue(buffer, enumValue->value, false);
+            writeOutBuffer(buffer, ">", 1);
+            return;
+        }
+
+        case OBJ_LIST: {
+            ObjList *list = AS_LIST(value);
+            writeOutBuffer(buffer, "[", 1);
+            for (int i = 0; i < list->values.count; ++i)
+            {
+                if (i > 0)
+                    writeOutBuffer(buffer, ", ", 2);
+                appendValue(buffer, list->values.values[i], true);
+            }
+            writeOutBuffer(buffer, "]", 1);
+            return;
+        }
+
+        case OBJ_DICT: {
+            ObjDict *dict = AS_DICT(value);
+            bool first = true;
+            writeOutBuffer(buffer, "{", 1);
+            for (int i = 0; i < dict->capacity; ++i)
+            {
+                dictItem *item = dict->items[i];
+                if (!item || item->deleted)
+                    continue;
+
+                if (!first)
+                    writeOutBuffer(buffer, ", ", 2);
+                first = false;
+                writeOutBuffer(buffer, "\"", 1);
+                writeOutBuffer(buffer, item->key, strlen(item->key));
+                writeOutBuffer(buffer, "\": ", 3);
+                appendValue(buffer, item->item, true);
+            }
+            writeOutBuffer(buffer, "}", 1);
+            return;
+        }
+
+        case OBJ_SET: {
+            ObjSet *set = AS_SET(value);
+            writeOutBuffer(buffer, "{", 1);
+            for (int i = 0; i < set->values.count; ++i)
+            {
+                if (i > 0)
+                    writeOutBuffer(buffer, ", ", 2);
+                appendValue(buffer, set->values.values[i], true);
+            }
+            writeOutBuffer(buffer, "}", 1);
+            return;
+        }
+
+        default: {
+            char *string = objectToString(value, literal);
+            writeOutBuffer(buffer, string, strlen(string));
+            mp_free(string);
+            return;
+        }
+    }
+}
+
 char *objectToString(Value value, bool literal)
 {
     Obj *obj = AS_OBJ(value);
@@ -462,19 +676,6 @@ char *objectToString(Value value, bool literal)
             return enumString;
         }
 
-        case OBJ_ENUM_VALUE: {
-            ObjEnumValue *enumValue = AS_ENUM_VALUE(value);
-            int len = enumValue->enume->name->length + 10;
-            len += enumValue->name->length;
-            char *valueStr = valueToString(enumValue->value, false);
-            len += strlen(valueStr);
-            char *enumValueString = mp_malloc(sizeof(char) * len);
-            snprintf(enumValueString, len - 1, "%s.%s<%s>", enumValue->enume->name->chars, enumValue->name->chars,
-                     valueStr);
-            mp_free(valueStr);
-            return enumValueString;
-        }
-
         case OBJ_TASK: {
             ObjClass *klass = AS_CLASS(value);
             char *classString = mp_malloc(sizeof(char) * (klass->name->length + 10));
@@ -547,16 +748,6 @@ char *objectToString(Value value, bool literal)
             return nativeString;
         }
 
-        case OBJ_STRING: {
-            ObjString *stringObj = AS_STRING(value);
-            char *string = mp_malloc(sizeof(char) * stringObj->length + 4);
-            if (literal)
-                snprintf(string, stringObj->length + 3, "\"%s\"", stringObj->chars);
-            else
-                snprintf(string, stringObj->length + 3, "%s", stringObj->chars);
-            return string;
-        }
-
         case OBJ_FILE: {
             ObjFile *file = AS_FILE(value);
             char *fileString = mp_malloc(sizeof(char) * (strlen(file->path) + 10));
@@ -678,140 +869,31 @@ char *objectToString(Value value, bool literal)
             return bytesString;
         }
 
-        case OBJ_LIST: {
-            int size = 50;
-            ObjList *list = AS_LIST(value);
-            char *listString = mp_malloc(sizeof(char) * size);
-            snprintf(listString, 2, "%s", "[");
-
-            int listStringSize;
-
-            for (int i = 0; i < list->values.count; ++i)
-            {
-                char *element = valueToString(list->values.values[i], true);
-
-                int elementSize = strlen(element);
-                listStringSize = strlen(listString);
-
-            resize:
-                if ((elementSize + 12) >= (size - listStringSize - 1))
-                {
-                    if (elementSize > size * 2)
-                        size += elementSize * 2;
-                    else
-                        size *= 2;
-
-                    char *newB = mp_realloc(listString, sizeof(char) * size);
-
-                    if (newB == NULL)
-                    {
-                        printf("Unable to allocate memory\n");
-                        exit(71);
-                    }
-
-                    listString = newB;
-                    goto resize;
-                }
-
-                strncat(listString, element, size - listStringSize - 1);
-
-                mp_free(element);
-
-                if (i != list->values.count - 1)
-                    strncat(listString, ", ", size - listStringSize - 1);
-            }
-
-            listStringSize = strlen(listString);
-            strncat(listString, "]", size - listStringSize - 1);
-            return listString;
-        }
-
-        case OBJ_DICT: {
-            int count = 0;
-            int size = 50;
-            ObjDict *dict = AS_DICT(value);
-            char *dictString = mp_malloc(sizeof(char) * size);
-            snprintf(dictString, 2, "%s", "{");
-
-            for (int i = 0; i < dict->capacity; ++i)
-            {
-                dictItem *item = dict->items[i];
-                if (!item || item->deleted)
-                    continue;
-
-                count++;
-
-                int keySize = strlen(item->key);
-                int dictStringSize = strlen(dictString);
-
-            resizeKey:
-                if ((keySize + 6) >= (size - dictStringSize - 1))
-                {
-                    if (keySize > size * 2)
-                        size += keySize * 2;
-                    else
-                        size *= 2;
-
-                    char *newB = mp_realloc(dictString, sizeof(char) * size);
-
-                    if (newB == NULL)
-                    {
-                        printf("Unable to allocate memory\n");
-                        exit(71);
-                    }
-
-                    dictString = newB;
-                    goto resizeKey;
-                }
-
-                char *dictKeyString = mp_malloc(sizeof(char) * (strlen(item->key) + 5));
-                snprintf(dictKeyString, (strlen(item->key) + 5), "\"%s\": ", item->key);
-
-                strncat(dictString, dictKeyString, size - dictStringSize - 1);
-                mp_free(dictKeyString);
-
-                dictStringSize = strlen(dictString);
-
-                char *element = valueToString(item->item, true);
-                int elementSize = strlen(element);
-
-            resizeElement:
-                if (elementSize + 8 >= (size - dictStringSize - 1))
-                {
-                    if (elementSize > size * 2)
-                        size += elementSize * 2;
-                    else
-                        size *= 2;
-
-                    char *newB = mp_realloc(dictString, sizeof(char) * size);
-
-                    if (newB == NULL)
-                    {
-                        printf("Unable to allocate memory\n");
-                        exit(71);
-                    }
-
-                    dictString = newB;
-                    goto resizeElement;
-                }
-
-                strncat(dictString, element, size - dictStringSize - 1);
-
-                mp_free(element);
-
-                if (count != dict->count)
-                    strncat(dictString, ", ", size - dictStringSize - 1);
-            }
-
-            strncat(dictString, "}", size - strlen(dictString) - 1);
-            return dictString;
-        }
+        case OBJ_ENUM_VALUE:
+        case OBJ_STRING:
+        case OBJ_LIST:
+        case OBJ_DICT:
+        case OBJ_SET:
+            return valueToString(value, literal);
 
         case OBJ_UPVALUE: {
             char *nativeString = mp_malloc(sizeof(char) * 8);
             snprintf(nativeString, 8, "%s", "upvalue");
             return nativeString;
         }
+
+        case OBJ_GENERATOR: {
+            char *generatorString = mp_malloc(sizeof(char) * 12);
+            snprintf(generatorString, 12, "%s", "<generator>");
+            return generatorString;
+        }
+
+        case OBJ_ERROR: {
+            const char *trace = errorTrace(AS_ERROR(value)->info);
+            char *errorString = mp_malloc(sizeof(char) * (strlen(trace) + 1));
+            strcpy(errorString, trace);
+            return errorString;
+        }
     }
 
     char *unknown = mp_malloc(sizeof(char) * 9);
@@ -926,6 +1008,18 @@ char *objectType(Value value)
             return str;
         }
 
+        case OBJ_SET: {
+            char *str = mp_malloc(sizeof(char) * 5);
+            snprintf(str, 4, "set");
+            return str;
+        }
+
+        case OBJ_GENERATOR: {
+            char *str = mp_malloc(sizeof(char) * 11);
+            snprintf(str, 10, "generator");
+            return str;
+        }
+
         case OBJ_UPVALUE: {
             char *str = mp_malloc(sizeof(char) * 9);
             snprintf(str, 8, "upvalue");
@@ -949,6 +1043,12 @@ char *objectType(Value value)
             sprintf(str, "nativelib");
             return str;
         }
+
+        case OBJ_ERROR: {
+            char *str = mp_malloc(sizeof(char) * 6);
+            sprintf(str, "error");
+            return str;
+        }
     }
 
     char *unknown = mp_malloc(sizeof(char) * 9);
@@ -1007,6 +1107,23 @@ bool listComparison(Value a, Value b)
     return true;
 }
 
+bool setComparison(Value a, Value b)
+{
+    ObjSet *set = AS_SET(a);
+    ObjSet *setB = AS_SET(b);
+
+    if (set->values.count != setB->values.count)
+        return false;
+
+    for (int i = 0; i < set->values.count; ++i)
+    {
+        if (!setContains(setB, set->values.values[i]))
+            return false;
+    }
+
+    return true;
+}
+
 static bool bytesComparison(Value a, Value b)
 {
     ObjBytes *A = AS_BYTES(a);
@@ -1038,6 +1155,10 @@ bool objectComparison(Value a, Value b)
     {
         return listComparison(a, b);
     }
+    else if (IS_SET(a) && IS_SET(b))
+    {
+        return setComparison(a, b);
+    }
     else if (IS_BYTES(a) && IS_BYTES(b))
     {
         return bytesComparison(a, b);
@@ -1065,6 +1186,11 @@ Value copyObject(Value value)
         ObjDict *newDict = copyDict(AS_DICT(value), true);
         return OBJ_VAL(newDict);
     }
+    else if (IS_SET(value))
+    {
+        ObjSet *newSet = copySet(AS_SET(value));
+        return OBJ_VAL(newSet);
+    }
     else if (IS_BYTES(value))
     {
         ObjBytes *oldBytes = AS_BYTES(value);
@@ -24,6 +24,8 @@
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_LIST(value) isObjType(value, OBJ_LIST)
 #define IS_DICT(value) isObjType(value, OBJ_DICT)
+#define IS_SET(value) isObjType(value, OBJ_SET)
+#define IS_GENERATOR(value) isObjType(value, OBJ_GENERATOR)
 #define IS_FILE(value) isObjType(value, OBJ_FILE)
 #define IS_BYTES(value) isObjType(value, OBJ_BYTES)
 #define IS_NATIVE_FUNC(value) isObjType(value, OBJ_NATIVE_FUNC)
@@ -32,6 +34,7 @@
 #define IS_TASK(value) isObjType(value, OBJ_TASK)
 #define IS_REQUEST(value) isObjType(value, OBJ_REQUEST)
 #define IS_PROCESS(value) isObjType(value, OBJ_PROCESS)
+#define IS_ERROR(value) isObjType(value, OBJ_ERROR)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
@@ -46,6 +49,8 @@
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 #define AS_LIST(value) ((ObjList *)AS_OBJ(value))
 #define AS_DICT(value) ((ObjDict *)AS_OBJ(value))
+#define AS_SET(value) ((ObjSet *)AS_OBJ(value))
+#define AS_GENERATOR(value) ((ObjGenerator *)AS_OBJ(value))
 #define AS_FILE(value) ((ObjFile *)AS_OBJ(value))
 #define AS_BYTES(value) ((ObjBytes *)AS_OBJ(value))
 #define AS_CBYTES(value) (((ObjBytes *)AS_OBJ(value))->bytes)
@@ -55,6 +60,7 @@
 #define AS_TASK(value) ((ObjTask *)AS_OBJ(value))
 #define AS_REQUEST(value) ((ObjRequest *)AS_OBJ(value))
 #define AS_PROCESS(value) ((ObjProcess *)AS_OBJ(value))
+#define AS_ERROR(value) ((ObjError *)AS_OBJ(value))
 
 #define STRING_VAL(str) (OBJ_VAL(copyString(str, strlen(str))))
 #define BYTES_VAL(data, len) (OBJ_VAL(copyBytes(data, len)))
@@ -84,9 +90,14 @@ typedef enum
     OBJ_TASK,
     OBJ_REQUEST,
     OBJ_PROCESS,
-    OBJ_UPVALUE
+    OBJ_UPVALUE,
+    OBJ_SET,
+    OBJ_GENERATOR,
+    OBJ_ERROR
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_ERROR + 1)
+
 struct sObj
 {
     ObjType type;
@@ -110,8 +121,12 @@ typedef struct
     Chunk chunk;
     ObjString *name;
     bool staticMethod;
+    bool generator;
     const char *path;
     Documentation *doc;
+    int counter;
+    // Reused by every evaluation of a function without upvalues
+    struct sObjClosure *shared;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value *args);
@@ -120,6 +135,8 @@ typedef struct
 {
     Obj obj;
     NativeFn function;
+    ObjString *name;
+    int counter;
 } ObjNative;
 
 typedef struct
@@ -162,6 +179,25 @@ struct sObjDict
     int dataSize;
 };
 
+#define SET_EMPTY -1
+#define SET_TOMBSTONE -2
+
+typedef struct
+{
+    uint32_t hash;
+    int index;
+} SetEntry;
+
+// Values are kept dense in insertion order, entries index into them
+typedef struct
+{
+    Obj obj;
+    ValueArray values;
+    int capacity;
+    int used;
+    SetEntry *entries;
+} ObjSet;
+
 #define FILE_MODE_READ 0x1
 #define FILE_MODE_WRITE 0x2
 #define FILE_MODE_BINARY 0x4
@@ -211,28 +247,40 @@ typedef struct sObjClass
     Table methods;
     Table fields;
     Table staticFields;
+    Table slots;
+    ValueArray defaults;
+    uint32_t id;
     struct sObjClass *super;
 } ObjClass;
 
+// Declared fields live in slots laid out by the class, fields added later
+// on a single instance go to its own table
 typedef struct
 {
     Obj obj;
     ObjClass *klass;
     Table fields;
+    int slotCount;
+    Value slots[];
 } ObjInstance;
 
-typedef struct
+#define INSTANCE_SIZE(slotCount) (sizeof(ObjInstance) + sizeof(Value) * (slotCount))
+
+// The upvalues are stored inline, so creating a closure is one allocation
+typedef struct sObjClosure
 {
     Obj obj;
     ObjFunction *function;
-    ObjUpvalue **upvalues;
-    int upvalueCount;
     ObjModule *module;
     ObjInstance *instance;
     ObjList *args;
     Value decorator;
+    int upvalueCount;
+    ObjUpvalue *upvalues[];
 } ObjClosure;
 
+#define CLOSURE_SIZE(upvalueCount) (sizeof(ObjClosure) + sizeof(ObjUpvalue *) * (upvalueCount))
+
 typedef struct
 {
     Obj obj;
@@ -256,6 +304,28 @@ typedef struct
     ObjClosure *method;
 } ObjBoundMethod;
 
+typedef enum
+{
+    GENERATOR_FUNCTION,
+    GENERATOR_RANGE,
+    GENERATOR_LINES
+} GeneratorType;
+
+// Lazy sequence consumed one value at a time by for-in and next()
+typedef struct
+{
+    Obj obj;
+    GeneratorType type;
+    bool done;
+    Value current;
+    void *task;
+    Value start;
+    Value step;
+    Value stop;
+    bool exclusive;
+    ObjFile *file;
+} ObjGenerator;
+
 typedef struct
 {
     Obj obj;
@@ -274,6 +344,7 @@ typedef struct
     ObjNativeLib *lib;
     ValueArray params;
     ValueArray hasDefaults, defaults;
+    int counter;
 } ObjNativeFunc;
 
 typedef struct
@@ -299,15 +370,47 @@ typedef struct
     bool running, closed, protected;
 } ObjProcess;
 
+typedef struct
+{
+    ObjFunction *function;
+    ObjModule *module;
+    int instruction;
+} ErrorFrame;
+
+// A runtime error as raised: the message and the raw call stack, only
+// rendered into the '[line N] in ...' trace when it is printed
+typedef struct
+{
+    char *message;
+    char *scriptName;
+    char *taskName;
+    ErrorFrame *frames;
+    int frameCount;
+    char *trace;
+} ErrorInfo;
+
+typedef struct
+{
+    Obj obj;
+    ErrorInfo *info;
+} ObjError;
+
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
 ObjClass *newClass(ObjString *name);
 ObjEnum *newEnum(ObjString *name);
 ObjEnumValue *newEnumValue(ObjEnum *enume, ObjString *name, Value value);
 ObjTask *newTask(ObjString *name);
+ObjError *newError(ErrorInfo *info);
 ObjClosure *newClosure(ObjFunction *function);
 ObjFunction *newFunction(bool isStatic);
 ObjInstance *newInstance(ObjClass *klass);
-ObjNative *newNative(NativeFn function);
+int classSlot(ObjClass *klass, ObjString *name);
+void updateClassField(ObjClass *klass, ObjString *name, Value value);
+bool getInstanceField(ObjInstance *instance, ObjString *name, Value *value);
+void setInstanceField(ObjInstance *instance, ObjString *name, Value value);
+void instanceFields(ObjInstance *instance, Table *fields);
+ObjNative *newNative(NativeFn function, ObjString *name);
+const char *objTypeName(ObjType type);
 ObjRequest *newRequest();
 ObjModule *newModule(ObjString *name);
 ObjNativeFunc *initNativeFunc();
@@ -317,6 +420,8 @@ ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
 ObjList *initList();
 ObjDict *initDict();
+ObjSet *initSet();
+ObjGenerator *newGenerator(GeneratorType type);
 ObjFile *initFile();
 ObjBytes *initBytes();
 ObjUpvalue *newUpvalue(Value *slot);
@@ -329,11 +434,13 @@ ObjBytes *transferBytes(void *bytes);
 void appendBytes(ObjBytes *dest, ObjBytes *src);
 
 char *objectToString(Value value, bool literal);
+void appendObject(OutBuffer *buffer, Value value, bool literal);
 char *objectType(Value value);
 ObjBytes *objectToBytes(Value value);
 
 bool dictComparison(Value a, Value b);
 bool listComparison(Value a, Value b);
+bool setComparison(Value a, Value b);
 bool objectComparison(Value a, Value b);
 
 Value copyObject(Value value);
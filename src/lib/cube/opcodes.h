@@ -57,6 +57,7 @@ OPCODE(FROM_MODULE)
 OPCODE(REMOVE_VAR)
 OPCODE(REQUIRE)
 OPCODE(CALL)
+OPCODE(TAIL_CALL)
 OPCODE(INVOKE)
 OPCODE(SUPER)
 OPCODE(CLOSURE)
@@ -74,8 +75,6 @@ OPCODE(AWAIT)
 OPCODE(ABORT)
 OPCODE(SUSPEND)
 OPCODE(RESUME)
-OPCODE(TRY)
-OPCODE(CLOSE_TRY)
 OPCODE(NATIVE_FUNC)
 OPCODE(NATIVE_STRUCT)
 OPCODE(NATIVE)
@@ -89,4 +88,7 @@ OPCODE(SWAP)
 OPCODE(PACK)
 OPCODE(UNPACK)
 OPCODE(CLONE)
-OPCODE(MOVE)
\ No newline at end of file
+OPCODE(MOVE)
+OPCODE(YIELD)
+OPCODE(ITER)
+OPCODE(RANGE)
\ No newline at end of file
@@ -0,0 +1,621 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "mempool.h"
+#include "object.h"
+#include "optimizer.h"
+#include "vm.h"
+
+// Per byte state of the chunk being optimized
+#define INSTRUCTION_START 1
+#define JUMP_TARGET 2
+#define REACHABLE 4
+#define REMOVED 8
+#define PINNED 16 // Catch handlers, read directly by the error handling
+
+#define MAX_PASSES 4
+#define MAX_JUMP_CHAIN 8
+
+typedef struct
+{
+    Chunk *chunk;
+    uint8_t *flags;
+    int count;
+} Optimizer;
+
+static int instructionLength(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+        case OP_CONSTANT:
+        case OP_STRING:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_FORCED:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_NO_POP:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_BREAK:
+        case OP_INCLUDE:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_PROPERTY:
+        case OP_ENUM:
+            return 3;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MOD:
+        case OP_POW:
+        case OP_IN:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_PACK:
+        case OP_CLONE:
+        case OP_MOVE:
+            return 2;
+        case OP_INVOKE:
+        case OP_SUPER:
+            return 4;
+        case OP_EXTENSION:
+            return 5;
+        case OP_CLOSURE: {
+            uint16_t constant = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+            if (constant >= chunk->constants.count || !IS_FUNCTION(chunk->constants.values[constant]))
+                return -1;
+            return 3 + 3 * AS_FUNCTION(chunk->constants.values[constant])->upvalueCount;
+        }
+        default:
+            return 1;
+    }
+}
+
+static bool isJump(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP || op == OP_BREAK;
+}
+
+static int jumpTarget(Chunk *chunk, int offset)
+{
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    if (chunk->code[offset] == OP_LOOP)
+        return offset + 3 - jump;
+    return offset + 3 + jump;
+}
+
+// Unconditional jumps pick their direction from the target
+static bool setJumpTarget(Chunk *chunk, int offset, int target)
+{
+    int jump = target - (offset + 3);
+    if (chunk->code[offset] == OP_JUMP_IF_FALSE)
+    {
+        if (jump < 0)
+            return false;
+    }
+    else
+        chunk->code[offset] = jump < 0 ? OP_LOOP : OP_JUMP;
+
+    if (jump < 0)
+        jump = -jump;
+    if (jump > UINT16_MAX)
+        return false;
+
+    chunk->code[offset + 1] = (jump >> 8) & 0xff;
+    chunk->code[offset + 2] = jump & 0xff;
+    return true;
+}
+
+static void removeBytes(Optimizer *opt, int offset, int length)
+{
+    for (int i = 0; i < length; i++)
+        opt->flags[offset + i] |= REMOVED;
+}
+
+static void removeInstruction(Optimizer *opt, int offset)
+{
+    removeBytes(opt, offset, instructionLength(opt->chunk, offset));
+}
+
+// Jumps into removed code land on whatever runs next
+static int liveOffset(Optimizer *opt, int offset)
+{
+    while (offset < opt->count && (opt->flags[offset] & REMOVED))
+        offset++;
+    return offset;
+}
+
+static int nextInstruction(Optimizer *opt, int offset)
+{
+    return liveOffset(opt, offset + instructionLength(opt->chunk, offset));
+}
+
+static bool readConstant(Chunk *chunk, int offset, Value *value)
+{
+    switch (chunk->code[offset])
+    {
+        case OP_NULL:
+            *value = NULL_VAL;
+            return true;
+        case OP_TRUE:
+            *value = TRUE_VAL;
+            return true;
+        case OP_FALSE:
+            *value = FALSE_VAL;
+            return true;
+        case OP_CONSTANT: {
+            uint16_t constant = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+            *value = chunk->constants.values[constant];
+            return IS_NUMBER(*value) || IS_STRING(*value);
+        }
+        default:
+            return false;
+    }
+}
+
+// Replaces the constant pushed at 'offset', which must not grow
+static bool writeConstant(Optimizer *opt, int offset, Value value)
+{
+    Chunk *chunk = opt->chunk;
+    int length = instructionLength(chunk, offset);
+
+    if (IS_NULL(value) || IS_BOOL(value))
+    {
+        chunk->code[offset] = IS_NULL(value) ? OP_NULL : (AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+        removeBytes(opt, offset + 1, length - 1);
+        return true;
+    }
+
+    if (length < 3)
+        return false;
+
+    int constant = findConstant(chunk, value);
+    if (constant < 0)
+        constant = addConstant(chunk, value);
+    if (constant > UINT16_MAX)
+        return false;
+
+    chunk->code[offset] = OP_CONSTANT;
+    chunk->code[offset + 1] = (constant >> 8) & 0xff;
+    chunk->code[offset + 2] = constant & 0xff;
+    return true;
+}
+
+// Mirrors what the interpreter does with the operands, for the cases that
+// can neither fail nor call into user code
+static bool foldBinary(uint8_t op, Value a, Value b, Value *result)
+{
+    if (op == OP_EQUAL || op == OP_NOT_EQUAL)
+    {
+        bool equal = valuesEqual(a, b);
+        *result = BOOL_VAL(op == OP_EQUAL ? equal : !equal);
+        return true;
+    }
+
+    if (op == OP_ADD && IS_STRING(a) && IS_STRING(b))
+    {
+        ObjString *first = AS_STRING(a);
+        ObjString *second = AS_STRING(b);
+        int length = first->length + second->length;
+        char *chars = ALLOCATE(char, length + 1);
+        memcpy(chars, first->chars, first->length);
+        memcpy(chars + first->length, second->chars, second->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(takeString(chars, length));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op)
+    {
+        case OP_GREATER:
+            *result = BOOL_VAL(x > y);
+            return true;
+        case OP_GREATER_EQUAL:
+            *result = BOOL_VAL(x >= y);
+            return true;
+        case OP_LESS:
+            *result = BOOL_VAL(x < y);
+            return true;
+        case OP_LESS_EQUAL:
+            *result = BOOL_VAL(x <= y);
+            return true;
+        case OP_ADD:
+            *result = NUMBER_VAL(x + y);
+            return true;
+        case OP_SUBTRACT:
+            *result = NUMBER_VAL(x - y);
+            return true;
+        case OP_MULTIPLY:
+            *result = NUMBER_VAL(x * y);
+            return true;
+        case OP_DIVIDE:
+            *result = NUMBER_VAL(x / y);
+            return true;
+        case OP_MOD:
+            *result = NUMBER_VAL(fmod(x, y));
+            return true;
+        case OP_POW:
+            *result = NUMBER_VAL(pow(x, y));
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isBinary(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+            return true;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MOD:
+        case OP_POW:
+            // The element-wise forms are left to the interpreter
+            return chunk->code[offset + 1] == OP_FALSE;
+        default:
+            return false;
+    }
+}
+
+// An instruction only ever reached by falling through from the previous one
+static bool isPlain(Optimizer *opt, int offset)
+{
+    return !(opt->flags[offset] & (JUMP_TARGET | PINNED));
+}
+
+// Tries to rewrite the last instructions kept, returns how many of them were
+// dropped or -1 if nothing changed
+static int foldLast(Optimizer *opt, int *kept, int count)
+{
+    Chunk *chunk = opt->chunk;
+    int last = kept[count - 1];
+    uint8_t op = chunk->code[last];
+    Value a, b, result;
+
+    if (count >= 3 && isBinary(chunk, last) && isPlain(opt, last) && isPlain(opt, kept[count - 2]) &&
+        !(opt->flags[kept[count - 3]] & PINNED) && readConstant(chunk, kept[count - 3], &a) &&
+        readConstant(chunk, kept[count - 2], &b) && foldBinary(op, a, b, &result) &&
+        writeConstant(opt, kept[count - 3], result))
+    {
+        removeInstruction(opt, kept[count - 2]);
+        removeInstruction(opt, last);
+        return 2;
+    }
+
+    if (count < 2 || !isPlain(opt, last) || (opt->flags[kept[count - 2]] & PINNED) ||
+        !readConstant(chunk, kept[count - 2], &a))
+        return -1;
+
+    switch (op)
+    {
+        case OP_NOT:
+            writeConstant(opt, kept[count - 2], BOOL_VAL(isFalsey(a)));
+            removeInstruction(opt, last);
+            return 1;
+
+        case OP_NEGATE:
+            if (!IS_NUMBER(a) || !writeConstant(opt, kept[count - 2], NUMBER_VAL(-AS_NUMBER(a))))
+                return -1;
+            removeInstruction(opt, last);
+            return 1;
+
+        case OP_POP:
+            removeInstruction(opt, kept[count - 2]);
+            removeInstruction(opt, last);
+            return 2;
+
+        case OP_JUMP_IF_FALSE: {
+            if (!isFalsey(a))
+            {
+                removeInstruction(opt, last);
+                return 1;
+            }
+
+            // Always taken. The branch usually starts by popping the
+            // condition, which then needs no pushing at all
+            int target = jumpTarget(chunk, last);
+            chunk->code[last] = OP_JUMP;
+            if (target < opt->count && chunk->code[target] == OP_POP)
+            {
+                setJumpTarget(chunk, last, target + 1);
+                opt->flags[target + 1] |= JUMP_TARGET;
+                removeInstruction(opt, kept[count - 2]);
+                kept[count - 2] = last;
+                return 1;
+            }
+            return 0;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+static bool foldConstants(Optimizer *opt)
+{
+    bool changed = false;
+    int *kept = (int *)mp_malloc(sizeof(int) * (opt->count + 1));
+    int count = 0;
+
+    for (int offset = 0; offset < opt->count; offset++)
+    {
+        if (!(opt->flags[offset] & INSTRUCTION_START) || (opt->flags[offset] & REMOVED))
+            continue;
+
+        kept[count++] = offset;
+        int dropped;
+        while (count > 0 && (dropped = foldLast(opt, kept, count)) >= 0)
+        {
+            count -= dropped;
+            changed = true;
+        }
+    }
+
+    mp_free(kept);
+    return changed;
+}
+
+// Jumps landing on other jumps go straight to the final target, and the ones
+// left jumping to the next instruction are dropped
+static bool threadJumps(Optimizer *opt)
+{
+    Chunk *chunk = opt->chunk;
+    bool changed = false;
+
+    for (int offset = 0; offset < opt->count; offset++)
+    {
+        if (!(opt->flags[offset] & INSTRUCTION_START) || (opt->flags[offset] & REMOVED) ||
+            !isJump(chunk->code[offset]))
+            continue;
+
+        int target = liveOffset(opt, jumpTarget(chunk, offset));
+        for (int i = 0; i < MAX_JUMP_CHAIN && target < opt->count && target != offset; i++)
+        {
+            uint8_t op = chunk->code[target];
+            if (op != OP_JUMP && op != OP_BREAK && op != OP_LOOP)
+                break;
+
+            int next = liveOffset(opt, jumpTarget(chunk, target));
+            if (chunk->code[offset] == OP_JUMP_IF_FALSE && next < offset + 3)
+                break;
+            target = next;
+        }
+
+        if (target == nextInstruction(opt, offset))
+        {
+            removeInstruction(opt, offset);
+            changed = true;
+        }
+        else if (target != jumpTarget(chunk, offset))
+        {
+            uint8_t op = chunk->code[offset];
+            uint8_t jump[2] = {chunk->code[offset + 1], chunk->code[offset + 2]};
+            if (setJumpTarget(chunk, offset, target))
+            {
+                opt->flags[target] |= JUMP_TARGET;
+                changed = true;
+            }
+            else
+            {
+                chunk->code[offset] = op;
+                chunk->code[offset + 1] = jump[0];
+                chunk->code[offset + 2] = jump[1];
+            }
+        }
+    }
+
+    return changed;
+}
+
+// Removes everything that cannot run, starting from the entry point and the
+// catch handlers
+static bool removeUnreachable(Optimizer *opt)
+{
+    Chunk *chunk = opt->chunk;
+    int *pending = (int *)mp_malloc(sizeof(int) * (opt->count + chunk->tryCount + 1));
+    int count = 0;
+
+    for (int i = 0; i < opt->count; i++)
+        opt->flags[i] &= ~REACHABLE;
+
+    pending[count++] = liveOffset(opt, 0);
+    for (int i = 0; i < chunk->tryCount; i++)
+        pending[count++] = chunk->tries[i].handler;
+
+    while (count > 0)
+    {
+        int offset = pending[--count];
+        while (offset < opt->count && !(opt->flags[offset] & REACHABLE))
+        {
+            opt->flags[offset] |= REACHABLE;
+
+            uint8_t op = chunk->code[offset];
+            if (isJump(op))
+            {
+                int target = liveOffset(opt, jumpTarget(chunk, offset));
+                if (target < opt->count && !(opt->flags[target] & REACHABLE))
+                    pending[count++] = target;
+            }
+
+            if (op == OP_JUMP || op == OP_BREAK || op == OP_LOOP || op == OP_RETURN)
+                break;
+            offset = nextInstruction(opt, offset);
+        }
+    }
+
+    bool changed = false;
+    for (int offset = 0; offset < opt->count; offset++)
+    {
+        if ((opt->flags[offset] & INSTRUCTION_START) && !(opt->flags[offset] & (REMOVED | REACHABLE)))
+        {
+            removeInstruction(opt, offset);
+            changed = true;
+        }
+    }
+
+    mp_free(pending);
+    return changed;
+}
+
+// Moves the remaining code together, fixing every offset that points into it
+static void compact(Optimizer *opt)
+{
+    Chunk *chunk = opt->chunk;
+    int *moved = (int *)mp_malloc(sizeof(int) * (opt->count + 1));
+
+    int size = 0;
+    for (int offset = 0; offset < opt->count; offset++)
+    {
+        moved[offset] = size;
+        if (!(opt->flags[offset] & REMOVED))
+            size++;
+    }
+    moved[opt->count] = size;
+
+    if (size == opt->count)
+    {
+        mp_free(moved);
+        return;
+    }
+
+    for (int offset = 0; offset < opt->count; offset++)
+    {
+        if ((opt->flags[offset] & INSTRUCTION_START) && !(opt->flags[offset] & REMOVED) &&
+            isJump(chunk->code[offset]))
+        {
+            int from = moved[offset] + 3;
+            int to = moved[jumpTarget(chunk, offset)];
+            int jump = chunk->code[offset] == OP_LOOP ? from - to : to - from;
+            chunk->code[offset + 1] = (jump >> 8) & 0xff;
+            chunk->code[offset + 2] = jump & 0xff;
+        }
+    }
+
+    for (int offset = 0; offset < opt->count; offset++)
+    {
+        if (!(opt->flags[offset] & REMOVED))
+            chunk->code[moved[offset]] = chunk->code[offset];
+    }
+
+    for (int i = 0; i < chunk->tryCount; i++)
+    {
+        TryRegion *region = &chunk->tries[i];
+        region->start = moved[region->start];
+        region->end = moved[region->end];
+        region->handler = moved[region->handler];
+    }
+
+    // Lines left without code are dropped and equal neighbours merged
+    int lines = 0;
+    for (int i = 0; i < chunk->lineCount; i++)
+    {
+        int start = moved[chunk->lines[i].offset];
+        int end = i + 1 < chunk->lineCount ? moved[chunk->lines[i + 1].offset] : size;
+        if (start == end)
+            continue;
+
+        if (lines > 0 && chunk->lines[lines - 1].line == chunk->lines[i].line)
+            continue;
+
+        chunk->lines[lines].offset = lines == 0 ? 0 : start;
+        chunk->lines[lines].line = chunk->lines[i].line;
+        lines++;
+    }
+    chunk->lineCount = lines;
+    chunk->count = size;
+
+    mp_free(moved);
+}
+
+// Folds operations on constants, threads jumps and drops unreachable code.
+// Jump offsets, try regions and lines are remapped to the compacted code
+void optimizeChunk(Chunk *chunk)
+{
+    if (chunk->count == 0 || chunk->caches != NULL)
+        return;
+
+    Optimizer opt;
+    opt.chunk = chunk;
+    opt.count = chunk->count;
+    opt.flags = (uint8_t *)mp_malloc(chunk->count + 1);
+    memset(opt.flags, 0, chunk->count + 1);
+
+    // Anything not understood leaves the chunk as it is
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        int length = instructionLength(chunk, offset);
+        if (length < 0)
+            break;
+        opt.flags[offset] |= INSTRUCTION_START;
+        offset += length;
+    }
+    bool valid = offset == chunk->count;
+
+    for (offset = 0; valid && offset < chunk->count; offset++)
+    {
+        if ((opt.flags[offset] & INSTRUCTION_START) && isJump(chunk->code[offset]))
+        {
+            int target = jumpTarget(chunk, offset);
+            if (target < 0 || target >= chunk->count || !(opt.flags[target] & INSTRUCTION_START))
+                valid = false;
+            else
+                opt.flags[target] |= JUMP_TARGET;
+        }
+    }
+
+    for (int i = 0; valid && i < chunk->tryCount; i++)
+    {
+        TryRegion *region = &chunk->tries[i];
+        if (region->handler < 0 || region->handler >= chunk->count ||
+            !(opt.flags[region->handler] & INSTRUCTION_START) || region->start < 0 || region->start > region->end ||
+            region->end > chunk->count)
+            valid = false;
+        else
+        {
+            opt.flags[region->start] |= JUMP_TARGET;
+            opt.flags[region->end] |= JUMP_TARGET;
+            opt.flags[region->handler] |= JUMP_TARGET | PINNED;
+        }
+    }
+
+    if (valid)
+    {
+        foldConstants(&opt);
+        for (int pass = 0; pass < MAX_PASSES; pass++)
+        {
+            bool changed = threadJumps(&opt);
+            changed = removeUnreachable(&opt) || changed;
+            if (!changed)
+                break;
+        }
+        compact(&opt);
+    }
+
+    mp_free(opt.flags);
+}
@@ -0,0 +1,8 @@
+#ifndef CUBE_OPTIMIZER_h
+#define CUBE_OPTIMIZER_h
+
+#include "chunk.h"
+
+void optimizeChunk(Chunk *chunk);
+
+#endif
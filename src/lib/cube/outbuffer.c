@@ -0,0 +1,65 @@
+#include "outbuffer.h"
+#include "mempool.h"
+
+void initOutBuffer(OutBuffer *out, FILE *file, unsigned char *bytes, int length, int capacity)
+{
+    out->bytes = bytes;
+    out->length = length;
+    out->capacity = capacity;
+    out->file = file;
+    out->written = 0;
+    out->failed = false;
+}
+
+void freeOutBuffer(OutBuffer *out)
+{
+    if (out->bytes != NULL)
+        mp_free(out->bytes);
+    out->bytes = NULL;
+    out->length = 0;
+    out->capacity = 0;
+}
+
+bool flushOutBuffer(OutBuffer *out)
+{
+    if (out->file != NULL && out->length > 0)
+    {
+        size_t written = fwrite(out->bytes, 1, out->length, out->file);
+        out->written += (int)written;
+        if (written != (size_t)out->length)
+            out->failed = true;
+        out->length = 0;
+    }
+    return !out->failed;
+}
+
+// The slow path of writeOutBuffer, flushes to the file or grows the buffer
+bool spillOutBuffer(OutBuffer *out, const void *bytes, int length)
+{
+    if (out->file != NULL && out->length + length > OUT_FLUSH_SIZE)
+    {
+        if (!flushOutBuffer(out))
+            return false;
+        if (length > OUT_FLUSH_SIZE)
+        {
+            size_t written = fwrite(bytes, 1, length, out->file);
+            out->written += (int)written;
+            if (written != (size_t)length)
+                out->failed = true;
+            return !out->failed;
+        }
+    }
+
+    if (out->length + length > out->capacity)
+    {
+        int capacity = out->capacity < 256 ? 256 : out->capacity;
+        while (capacity < out->length + length)
+            capacity *= 2;
+        out->bytes = (unsigned char *)mp_realloc(out->bytes, capacity);
+        out->capacity = capacity;
+    }
+
+    memcpy(out->bytes + out->length, bytes, length);
+    out->length += length;
+    return true;
+}
@@ -0,0 +1,41 @@
+#ifndef CUBE_OUTBUFFER_h
+#define CUBE_OUTBUFFER_h
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Buffered output is written to the file once it grows past this
+#define OUT_FLUSH_SIZE 65536
+
+// The growable mp_malloc'd buffer behind the value, JSON and binary writers.
+// With a file it holds at most OUT_FLUSH_SIZE bytes and larger writes go
+// straight to the file, without one it keeps everything
+typedef struct
+{
+    unsigned char *bytes;
+    int length;
+    int capacity;
+    FILE *file;
+    int written; // Bytes that reached the file
+    bool failed; // A write to the file failed
+} OutBuffer;
+
+// Starts from 'bytes', which may be NULL, and takes it over
+void initOutBuffer(OutBuffer *out, FILE *file, unsigned char *bytes, int length, int capacity);
+void freeOutBuffer(OutBuffer *out);
+// Writes what is buffered to the file, false once a write has failed
+bool flushOutBuffer(OutBuffer *out);
+bool spillOutBuffer(OutBuffer *out, const void *bytes, int length);
+
+// Returns false when the bytes could not be written to the file
+static inline bool writeOutBuffer(OutBuffer *out, const void *bytes, int length)
+{
+    if (out->length + length > out->capacity || (out->file != NULL && out->length + length > OUT_FLUSH_SIZE))
+        return spillOutBuffer(out, bytes, length);
+
+    memcpy(out->bytes + out->length, bytes, length);
+    out->length += length;
+    return true;
+}
+
+#endif
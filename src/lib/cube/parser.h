@@ -49,6 +49,7 @@ typedef struct
     Token name;
     int depth;
     bool isCaptured;
+    bool isAssigned;
 } Local;
 
 typedef struct
@@ -57,6 +58,14 @@ typedef struct
     bool isLocal;
 } Upvalue;
 
+// An OP_CLOSURE operand capturing the local at 'slot', patched once the
+// local goes out of scope and it is known whether it was ever reassigned
+typedef struct
+{
+    int slot;
+    int offset;
+} Capture;
+
 typedef enum
 {
     TYPE_FUNCTION,
@@ -82,6 +91,11 @@ typedef struct Compiler
     Upvalue *upvalues;
     int scopeDepth;
     int loopDepth;
+    int tryDepth;
+
+    Capture *captures;
+    int captureCount;
+    int captureCapacity;
 
     const char *path;
 } Compiler;
@@ -0,0 +1,420 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mempool.h"
+#include "profiler.h"
+#include "util.h"
+
+// Samples are folded into unique call stacks ("task;caller;callee") with a
+// hit count, which is the format flame graph tools read directly
+typedef struct
+{
+    char *stack;
+    uint32_t hash;
+    int count;
+} ProfileEntry;
+
+typedef struct
+{
+    char *name;
+    int flat;
+    int cum;
+    int mark;
+} ProfileFunction;
+
+typedef struct
+{
+    ProfileEntry *entries;
+    int capacity;
+    int count;
+    int samples;
+    int interval;
+    bool running;
+} Profile;
+
+volatile int profileTick = 0;
+static Profile profile = {NULL, 0, 0, 0, PROFILE_INTERVAL, false};
+
+#ifdef _WIN32
+static HANDLE profileTimer = NULL;
+static CRITICAL_SECTION profileLock;
+static bool profileLockReady = false;
+
+static void lockProfile()
+{
+    if (!profileLockReady)
+    {
+        InitializeCriticalSection(&profileLock);
+        profileLockReady = true;
+    }
+    EnterCriticalSection(&profileLock);
+}
+
+static void unlockProfile()
+{
+    LeaveCriticalSection(&profileLock);
+}
+
+static VOID CALLBACK profileTimerCallback(PVOID param, BOOLEAN fired)
+{
+    profileTick = 1;
+}
+
+// Windows has no CPU time timer signal, so samples follow wall time
+static bool startTimer(int interval)
+{
+    DWORD ms = interval < 1000 ? 1 : interval / 1000;
+    return CreateTimerQueueTimer(&profileTimer, NULL, profileTimerCallback, NULL, ms, ms, WT_EXECUTEDEFAULT) != 0;
+}
+
+static void stopTimer()
+{
+    if (profileTimer != NULL)
+    {
+        DeleteTimerQueueTimer(NULL, profileTimer, NULL);
+        profileTimer = NULL;
+    }
+}
+#else
+static pthread_mutex_t profileLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lockProfile()
+{
+    pthread_mutex_lock(&profileLock);
+}
+
+static void unlockProfile()
+{
+    pthread_mutex_unlock(&profileLock);
+}
+
+static void profileSignal(int sig)
+{
+    profileTick = 1;
+}
+
+// ITIMER_PROF counts CPU time, so sleeping or waiting scripts are not sampled
+static bool startTimer(int interval)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profileSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0)
+        return false;
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+static void stopTimer()
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+}
+#endif
+
+static uint32_t hashStack(const char *stack, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)stack[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static ProfileEntry *findEntry(ProfileEntry *entries, int capacity, const char *stack, uint32_t hash)
+{
+    uint32_t index = hash & (capacity - 1);
+    for (;;)
+    {
+        ProfileEntry *entry = &entries[index];
+        if (entry->stack == NULL || (entry->hash == hash && strcmp(entry->stack, stack) == 0))
+            return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void growEntries()
+{
+    int capacity = profile.capacity < 64 ? 64 : profile.capacity * 2;
+    ProfileEntry *entries = (ProfileEntry *)mp_calloc(capacity, sizeof(ProfileEntry));
+    for (int i = 0; i < profile.capacity; i++)
+    {
+        ProfileEntry *entry = &profile.entries[i];
+        if (entry->stack == NULL)
+            continue;
+        *findEntry(entries, capacity, entry->stack, entry->hash) = *entry;
+    }
+    if (profile.entries != NULL)
+        mp_free(profile.entries);
+    profile.entries = entries;
+    profile.capacity = capacity;
+}
+
+// Takes ownership of the stack string
+static void addStack(char *stack, int length)
+{
+    if (profile.count + 1 > profile.capacity * 3 / 4)
+        growEntries();
+
+    uint32_t hash = hashStack(stack, length);
+    ProfileEntry *entry = findEntry(profile.entries, profile.capacity, stack, hash);
+    if (entry->stack == NULL)
+    {
+        entry->stack = stack;
+        entry->hash = hash;
+        entry->count = 0;
+        profile.count++;
+    }
+    else
+        mp_free(stack);
+    entry->count++;
+    profile.samples++;
+}
+
+// Frames are separated by ';', so it can't show up inside a label
+static void appendLabel(char **stack, int *length, int *capacity, const char *label)
+{
+    int size = (int)strlen(label);
+    if (*length + size + 2 > *capacity)
+    {
+        *capacity = (*length + size + 2) * 2;
+        *stack = (char *)mp_realloc(*stack, *capacity);
+    }
+
+    if (*length > 0)
+        (*stack)[(*length)++] = ';';
+    for (int i = 0; i < size; i++)
+        (*stack)[(*length)++] = label[i] == ';' ? ',' : label[i];
+    (*stack)[*length] = '\0';
+}
+
+static void frameLabel(char *label, int size, CallFrame *frame)
+{
+    ObjFunction *function = frame->closure->function;
+    // A frame that was just pushed has not run its first instruction yet
+    int instruction = (int)(frame->ip - function->chunk.code - 1);
+    int line = getLine(&function->chunk, instruction < 0 ? 0 : instruction);
+    const char *path = function->path != NULL ? getFileName((char *)function->path) : "?";
+
+    if (function->name == NULL)
+        snprintf(label, size, "<script> (%s:%d)", path, line);
+    else if (frame->module != NULL)
+        snprintf(label, size, "%s.%s (%s:%d)", frame->module->name->chars, function->name->chars, path, line);
+    else
+        snprintf(label, size, "%s (%s:%d)", function->name->chars, path, line);
+}
+
+bool startProfiler(int interval)
+{
+    if (profile.running)
+        return true;
+
+    clearProfile();
+    profile.interval = interval > 0 ? interval : PROFILE_INTERVAL;
+    profileTick = 0;
+    if (!startTimer(profile.interval))
+        return false;
+    profile.running = true;
+    return true;
+}
+
+int stopProfiler()
+{
+    if (profile.running)
+    {
+        stopTimer();
+        profile.running = false;
+        profileTick = 0;
+    }
+    return profile.samples;
+}
+
+bool isProfiling()
+{
+    return profile.running;
+}
+
+void clearProfile()
+{
+    lockProfile();
+    for (int i = 0; i < profile.capacity; i++)
+    {
+        if (profile.entries[i].stack != NULL)
+            mp_free(profile.entries[i].stack);
+    }
+    if (profile.entries != NULL)
+        mp_free(profile.entries);
+    profile.entries = NULL;
+    profile.capacity = 0;
+    profile.count = 0;
+    profile.samples = 0;
+    unlockProfile();
+}
+
+// Records the call stack of the task that was running when the timer fired,
+// with the native being executed, if any, as the innermost frame
+void sampleProfile(TaskFrame *ctf, ObjString *native)
+{
+    profileTick = 0;
+    if (!profile.running || ctf == NULL)
+        return;
+
+    char label[512];
+    char *stack = NULL;
+    int length = 0;
+    int capacity = 0;
+
+    appendLabel(&stack, &length, &capacity, ctf->name != NULL ? ctf->name : "?");
+    for (int i = 0; i < ctf->frameCount; i++)
+    {
+        frameLabel(label, sizeof(label), &ctf->frames[i]);
+        appendLabel(&stack, &length, &capacity, label);
+    }
+    if (native != NULL)
+    {
+        snprintf(label, sizeof(label), "%s [native]", native->chars);
+        appendLabel(&stack, &length, &capacity, label);
+    }
+
+    lockProfile();
+    addStack(stack, length);
+    unlockProfile();
+}
+
+static void saveFolded(FILE *file)
+{
+    for (int i = 0; i < profile.capacity; i++)
+    {
+        ProfileEntry *entry = &profile.entries[i];
+        if (entry->stack != NULL)
+            fprintf(file, "%s %d\n", entry->stack, entry->count);
+    }
+}
+
+static int findFunction(ProfileFunction **functions, int *count, const char *name, int length)
+{
+    for (int i = 0; i < *count; i++)
+    {
+        if ((int)strlen((*functions)[i].name) == length && strncmp((*functions)[i].name, name, length) == 0)
+            return i;
+    }
+
+    *functions = (ProfileFunction *)mp_realloc(*functions, sizeof(ProfileFunction) * (*count + 1));
+    ProfileFunction *function = &(*functions)[*count];
+    function->name = (char *)mp_malloc(length + 1);
+    memcpy(function->name, name, length);
+    function->name[length] = '\0';
+    function->flat = 0;
+    function->cum = 0;
+    function->mark = -1;
+    return (*count)++;
+}
+
+static int compareFunctions(const void *a, const void *b)
+{
+    const ProfileFunction *fa = (const ProfileFunction *)a;
+    const ProfileFunction *fb = (const ProfileFunction *)b;
+    if (fa->flat != fb->flat)
+        return fb->flat - fa->flat;
+    if (fa->cum != fb->cum)
+        return fb->cum - fa->cum;
+    return strcmp(fa->name, fb->name);
+}
+
+// Flat and cumulative samples per function, in the layout of 'pprof -top'
+static void saveTop(FILE *file)
+{
+    ProfileFunction *functions = NULL;
+    int count = 0;
+
+    for (int i = 0; i < profile.capacity; i++)
+    {
+        ProfileEntry *entry = &profile.entries[i];
+        if (entry->stack == NULL)
+            continue;
+
+        // The first frame is the task, not a function
+        const char *frame = strchr(entry->stack, ';');
+        int last = -1;
+        while (frame != NULL)
+        {
+            frame++;
+            const char *end = strchr(frame, ';');
+            const char *location = strstr(frame, " (");
+            int length = end != NULL ? (int)(end - frame) : (int)strlen(frame);
+            if (location != NULL && (end == NULL || location < end))
+                length = (int)(location - frame);
+
+            last = findFunction(&functions, &count, frame, length);
+            // Recursive calls count once towards the cumulative samples
+            if (functions[last].mark != i)
+            {
+                functions[last].mark = i;
+                functions[last].cum += entry->count;
+            }
+            frame = end;
+        }
+
+        if (last >= 0)
+            functions[last].flat += entry->count;
+    }
+
+    if (count > 0)
+        qsort(functions, count, sizeof(ProfileFunction), compareFunctions);
+
+    fprintf(file, "Total: %d samples, %d us interval\n", profile.samples, profile.interval);
+    fprintf(file, "%10s %7s %7s %10s %7s  %s\n", "flat", "flat%", "sum%", "cum", "cum%", "function");
+    double total = profile.samples > 0 ? profile.samples : 1;
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+    {
+        sum += functions[i].flat;
+        fprintf(file, "%10d %6.2f%% %6.2f%% %10d %6.2f%%  %s\n", functions[i].flat, 100 * functions[i].flat / total,
+                100 * sum / total, functions[i].cum, 100 * functions[i].cum / total, functions[i].name);
+        mp_free(functions[i].name);
+    }
+
+    if (functions != NULL)
+        mp_free(functions);
+}
+
+bool saveProfile(const char *path, const char *format)
+{
+    bool top = format != NULL && strcmp(format, "top") == 0;
+    if (format != NULL && !top && strcmp(format, "folded") != 0)
+        return false;
+
+    char *fullPath = fixPath(path);
+    FILE *file = fopen(fullPath, "w");
+    mp_free(fullPath);
+    if (file == NULL)
+        return false;
+
+    lockProfile();
+    if (top)
+        saveTop(file);
+    else
+        saveFolded(file);
+    unlockProfile();
+
+    fclose(file);
+    return true;
+}
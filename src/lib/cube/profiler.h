@@ -0,0 +1,18 @@
+#ifndef CUBE_PROFILER_h
+#define CUBE_PROFILER_h
+#include "object.h"
+#include "vm.h"
+
+#define PROFILE_INTERVAL 1000
+
+// Set by the profiler timer, checked by the interpreter before each instruction
+extern volatile int profileTick;
+
+bool startProfiler(int interval);
+int stopProfiler();
+bool isProfiling();
+void clearProfile();
+void sampleProfile(TaskFrame *ctf, ObjString *native);
+bool saveProfile(const char *path, const char *format);
+
+#endif
@@ -534,6 +534,8 @@ static TokenType identifierType(Scanner *scanner)
             break;
         case 'p':
             return checkKeyword(scanner, 1, 3, "ass", TOKEN_PASS);
+        case 'y':
+            return checkKeyword(scanner, 1, 4, "ield", TOKEN_YIELD);
     }
 
     return TOKEN_IDENTIFIER;
@@ -776,7 +778,8 @@ bool isOperator(TokenType type)
            type == TOKEN_POW || type == TOKEN_BANG || type == TOKEN_BANG_EQUAL || type == TOKEN_EQUAL_EQUAL ||
            type == TOKEN_LESS || type == TOKEN_GREATER || type == TOKEN_LESS_EQUAL || type == TOKEN_GREATER_EQUAL ||
            type == TOKEN_SHIFT_LEFT || type == TOKEN_SHIFT_RIGHT || type == TOKEN_BINARY_AND ||
-           type == TOKEN_BINARY_OR || type == TOKEN_INC || type == TOKEN_DEC || type == TOKEN_EQUAL;
+           type == TOKEN_BINARY_OR || type == TOKEN_INC || type == TOKEN_DEC || type == TOKEN_EQUAL ||
+           type == TOKEN_DOT;
 }
 
 bool setLanguage(Scanner *scanner, const char *languageSource)
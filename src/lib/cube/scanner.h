@@ -108,6 +108,7 @@ typedef enum
     TOKEN_CATCH,
     TOKEN_ASSERT,
     TOKEN_SECURE,
+    TOKEN_YIELD,
 
     TOKEN_DOC,
     TOKEN_PASS,
@@ -0,0 +1,752 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "collections.h"
+#include "memory.h"
+#include "mempool.h"
+#include "outbuffer.h"
+#include "serializer.h"
+#include "vm.h"
+
+// Files are read in blocks of this size
+#define BINARY_READ_SIZE 65536
+// Integers beyond this are not exact in a double, so they go as numbers
+#define BINARY_MAX_INTEGER 9007199254740992.0
+
+typedef enum
+{
+    BIN_NULL,
+    BIN_FALSE,
+    BIN_TRUE,
+    BIN_INTEGER,
+    BIN_NUMBER,
+    BIN_STRING,
+    BIN_BYTES,
+    BIN_LIST,
+    BIN_DICT,
+    BIN_SET,
+    BIN_ENUM_VALUE,
+    BIN_INSTANCE,
+    BIN_REFERENCE
+} BinaryTag;
+
+// Containers already written, by address, so repeats become references
+typedef struct
+{
+    Obj **keys;
+    int *indexes;
+    int count;
+    int capacity;
+} SeenTable;
+
+typedef struct
+{
+    OutBuffer out;
+    SeenTable seen;
+    bool failed;
+    char *error;
+    int errorSize;
+} BinaryWriter;
+
+typedef struct
+{
+    const unsigned char *data;
+    int length;
+    int position;
+    FILE *file;
+    unsigned char *buffer; // Refilled from the file when reading one
+    char *scratch;         // Names and dict keys are decoded here
+    int scratchCapacity;
+    ObjList *containers;   // Every container decoded, for references
+    int depth;
+    char *error;
+    int errorSize;
+} BinaryReader;
+
+static uint32_t hashPointer(Obj *obj)
+{
+    uintptr_t key = (uintptr_t)obj;
+    key ^= key >> 17;
+    key *= 0xed5ad4bb;
+    key ^= key >> 11;
+    return (uint32_t)key;
+}
+
+static void freeSeen(SeenTable *seen)
+{
+    if (seen->keys != NULL)
+        mp_free(seen->keys);
+    if (seen->indexes != NULL)
+        mp_free(seen->indexes);
+}
+
+static int findSeen(SeenTable *seen, Obj *obj)
+{
+    if (seen->capacity == 0)
+        return -1;
+
+    uint32_t index = hashPointer(obj) & (seen->capacity - 1);
+    while (seen->keys[index] != NULL)
+    {
+        if (seen->keys[index] == obj)
+            return seen->indexes[index];
+        index = (index + 1) & (seen->capacity - 1);
+    }
+    return -1;
+}
+
+static void insertSeen(SeenTable *seen, Obj *obj, int value)
+{
+    if ((seen->count + 1) * 4 > seen->capacity * 3)
+    {
+        SeenTable grown;
+        grown.capacity = seen->capacity < 16 ? 16 : seen->capacity * 2;
+        grown.count = 0;
+        grown.keys = (Obj **)mp_malloc(sizeof(Obj *) * grown.capacity);
+        grown.indexes = (int *)mp_malloc(sizeof(int) * grown.capacity);
+        memset(grown.keys, 0, sizeof(Obj *) * grown.capacity);
+        for (int i = 0; i < seen->capacity; i++)
+        {
+            if (seen->keys[i] != NULL)
+                insertSeen(&grown, seen->keys[i], seen->indexes[i]);
+        }
+        freeSeen(seen);
+        *seen = grown;
+    }
+
+    uint32_t index = hashPointer(obj) & (seen->capacity - 1);
+    while (seen->keys[index] != NULL)
+        index = (index + 1) & (seen->capacity - 1);
+    seen->keys[index] = obj;
+    seen->indexes[index] = value;
+    seen->count++;
+}
+
+static bool writeError(BinaryWriter *writer, const char *message, const char *detail)
+{
+    if (!writer->failed)
+        snprintf(writer->error, writer->errorSize, message, detail);
+    writer->failed = true;
+    return false;
+}
+
+static void flushWriter(BinaryWriter *writer)
+{
+    if (!flushOutBuffer(&writer->out))
+        writeError(writer, "Could not write to the file%s", "");
+}
+
+static void writeBytes(BinaryWriter *writer, const void *bytes, int length)
+{
+    if (!writeOutBuffer(&writer->out, bytes, length))
+        writeError(writer, "Could not write to the file%s", "");
+}
+
+static void writeByte(BinaryWriter *writer, unsigned char byte)
+{
+    writeBytes(writer, &byte, 1);
+}
+
+static void writeVarint(BinaryWriter *writer, uint64_t number)
+{
+    unsigned char bytes[10];
+    int length = 0;
+    do
+    {
+        unsigned char byte = number & 0x7F;
+        number >>= 7;
+        if (number != 0)
+            byte |= 0x80;
+        bytes[length++] = byte;
+    } while (number != 0);
+    writeBytes(writer, bytes, length);
+}
+
+static void writeChars(BinaryWriter *writer, const char *chars, int length)
+{
+    writeVarint(writer, (uint64_t)length);
+    writeBytes(writer, chars, length);
+}
+
+static void writeNumber(BinaryWriter *writer, double number)
+{
+    if (number == floor(number) && fabs(number) <= BINARY_MAX_INTEGER && !(number == 0 && signbit(number)))
+    {
+        int64_t integer = (int64_t)number;
+        writeByte(writer, BIN_INTEGER);
+        writeVarint(writer, ((uint64_t)integer << 1) ^ (uint64_t)(integer >> 63));
+        return;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++)
+        bytes[i] = (unsigned char)(bits >> (i * 8));
+    writeByte(writer, BIN_NUMBER);
+    writeBytes(writer, bytes, 8);
+}
+
+static bool writeValue(BinaryWriter *writer, Value value, int depth);
+
+// Lists, dicts, sets and instances are numbered in the order they are first
+// written. Returns true when the value was already written as a reference
+static bool writeReference(BinaryWriter *writer, Obj *obj)
+{
+    int index = findSeen(&writer->seen, obj);
+    if (index >= 0)
+    {
+        writeByte(writer, BIN_REFERENCE);
+        writeVarint(writer, (uint64_t)index);
+        return true;
+    }
+    insertSeen(&writer->seen, obj, writer->seen.count);
+    return false;
+}
+
+static bool writeValues(BinaryWriter *writer, ValueArray *values, int depth)
+{
+    writeVarint(writer, (uint64_t)values->count);
+    for (int i = 0; i < values->count; i++)
+    {
+        if (!writeValue(writer, values->values[i], depth + 1))
+            return false;
+    }
+    return true;
+}
+
+static bool writeInstance(BinaryWriter *writer, ObjInstance *instance, int depth)
+{
+    Table fields;
+    initTable(&fields);
+    instanceFields(instance, &fields);
+
+    writeByte(writer, BIN_INSTANCE);
+    writeChars(writer, instance->klass->name->chars, instance->klass->name->length);
+    writeVarint(writer, (uint64_t)fields.count);
+
+    bool ok = true;
+    int i = 0;
+    Entry entry;
+    while (ok && iterateTable(&fields, &entry, &i))
+    {
+        if (entry.key == NULL)
+            continue;
+        writeChars(writer, entry.key->chars, entry.key->length);
+        ok = writeValue(writer, entry.value, depth + 1);
+    }
+
+    freeTable(&fields);
+    return ok;
+}
+
+static bool writeValue(BinaryWriter *writer, Value value, int depth)
+{
+    if (writer->failed)
+        return false;
+
+    if (depth > BINARY_MAX_DEPTH)
+        return writeError(writer, "Too deeply nested%s", "");
+
+    if (IS_NULL(value))
+        writeByte(writer, BIN_NULL);
+    else if (IS_BOOL(value))
+        writeByte(writer, AS_BOOL(value) ? BIN_TRUE : BIN_FALSE);
+    else if (IS_NUMBER(value))
+        writeNumber(writer, AS_NUMBER(value));
+    else if (IS_STRING(value))
+    {
+        writeByte(writer, BIN_STRING);
+        writeChars(writer, AS_STRING(value)->chars, AS_STRING(value)->length);
+    }
+    else if (IS_BYTES(value))
+    {
+        ObjBytes *bytes = AS_BYTES(value);
+        if (bytes->length < 0)
+            return writeError(writer, "Unsafe bytes can not be encoded%s", "");
+        writeByte(writer, BIN_BYTES);
+        writeChars(writer, (const char *)bytes->bytes, bytes->length);
+    }
+    else if (IS_ENUM_VALUE(value))
+    {
+        ObjEnumValue *enumValue = AS_ENUM_VALUE(value);
+        writeByte(writer, BIN_ENUM_VALUE);
+        writeChars(writer, enumValue->enume->name->chars, enumValue->enume->name->length);
+        writeChars(writer, enumValue->name->chars, enumValue->name->length);
+    }
+    else if (IS_LIST(value) || IS_SET(value))
+    {
+        if (writeReference(writer, AS_OBJ(value)))
+            return !writer->failed;
+        writeByte(writer, IS_LIST(value) ? BIN_LIST : BIN_SET);
+        return writeValues(writer, IS_LIST(value) ? &AS_LIST(value)->values : &AS_SET(value)->values, depth);
+    }
+    else if (IS_DICT(value))
+    {
+        if (writeReference(writer, AS_OBJ(value)))
+            return !writer->failed;
+
+        ObjDict *dict = AS_DICT(value);
+        writeByte(writer, BIN_DICT);
+        writeVarint(writer, (uint64_t)dict->count);
+        for (int i = 0; i < dict->capacity; i++)
+        {
+            dictItem *item = dict->items[i];
+            if (item == NULL || item->deleted)
+                continue;
+            writeChars(writer, item->key, (int)strlen(item->key));
+            if (!writeValue(writer, item->item, depth + 1))
+                return false;
+        }
+    }
+    else if (IS_INSTANCE(value))
+    {
+        if (writeReference(writer, AS_OBJ(value)))
+            return !writer->failed;
+        return writeInstance(writer, AS_INSTANCE(value), depth);
+    }
+    else
+    {
+        char *type = valueType(value);
+        writeError(writer, "A %s can not be encoded", type);
+        mp_free(type);
+        return false;
+    }
+
+    return !writer->failed;
+}
+
+static void initWriter(BinaryWriter *writer, FILE *file, unsigned char *bytes, int length, int capacity, char *error,
+                       int errorSize)
+{
+    initOutBuffer(&writer->out, file, bytes, length, capacity);
+    writer->seen.keys = NULL;
+    writer->seen.indexes = NULL;
+    writer->seen.count = 0;
+    writer->seen.capacity = 0;
+    writer->failed = false;
+    writer->error = error;
+    writer->errorSize = errorSize;
+
+    writeBytes(writer, BINARY_MAGIC, 4);
+    writeByte(writer, BINARY_VERSION);
+}
+
+static void freeWriter(BinaryWriter *writer)
+{
+    freeSeen(&writer->seen);
+    freeOutBuffer(&writer->out);
+}
+
+// Appends the encoding to a growable mp_malloc'd buffer, which stays with
+// the caller
+bool binaryEncodeAppend(Value value, unsigned char **buffer, int *length, int *capacity, char *error, int errorSize)
+{
+    BinaryWriter writer;
+    initWriter(&writer, NULL, *buffer, *length, *capacity, error, errorSize);
+
+    bool ok = writeValue(&writer, value, 0);
+    *buffer = writer.out.bytes;
+    *length = writer.out.length;
+    *capacity = writer.out.capacity;
+    writer.out.bytes = NULL;
+    freeWriter(&writer);
+    return ok;
+}
+
+// Returns NULL when the value cannot be encoded, with the reason in 'error'
+ObjBytes *binaryEncode(Value value, char *error, int errorSize)
+{
+    BinaryWriter writer;
+    initWriter(&writer, NULL, NULL, 0, 0, error, errorSize);
+
+    ObjBytes *bytes = NULL;
+    if (writeValue(&writer, value, 0))
+        bytes = copyBytes(writer.out.bytes, writer.out.length);
+
+    freeWriter(&writer);
+    return bytes;
+}
+
+// Streams the encoding to the file, holding at most OUT_FLUSH_SIZE bytes
+bool binaryEncodeToFile(Value value, FILE *file, char *error, int errorSize)
+{
+    BinaryWriter writer;
+    initWriter(&writer, file, NULL, 0, 0, error, errorSize);
+
+    if (writeValue(&writer, value, 0))
+        flushWriter(&writer);
+
+    freeWriter(&writer);
+    return !writer.failed;
+}
+
+static bool readError(BinaryReader *reader, const char *message)
+{
+    snprintf(reader->error, reader->errorSize, "%s", message);
+    return false;
+}
+
+// Makes 'count' bytes available at 'data + position', refilling the buffer
+// from the file when there is one
+static bool ensureBytes(BinaryReader *reader, int count)
+{
+    if (reader->length - reader->position >= count)
+        return true;
+    if (reader->file == NULL)
+        return readError(reader, "Unexpected end of data");
+
+    int left = reader->length - reader->position;
+    int capacity = count > BINARY_READ_SIZE ? count : BINARY_READ_SIZE;
+    unsigned char *buffer = (unsigned char *)mp_malloc(capacity);
+    if (left > 0)
+        memcpy(buffer, reader->data + reader->position, left);
+    if (reader->buffer != NULL)
+        mp_free(reader->buffer);
+
+    int length = left + (int)fread(buffer + left, 1, capacity - left, reader->file);
+    reader->buffer = buffer;
+    reader->data = buffer;
+    reader->length = length;
+    reader->position = 0;
+
+    if (length < count)
+        return readError(reader, "Unexpected end of data");
+    return true;
+}
+
+static bool readByte(BinaryReader *reader, unsigned char *byte)
+{
+    if (!ensureBytes(reader, 1))
+        return false;
+    *byte = reader->data[reader->position++];
+    return true;
+}
+
+static bool readVarint(BinaryReader *reader, uint64_t *number)
+{
+    *number = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        unsigned char byte;
+        if (!readByte(reader, &byte))
+            return false;
+        *number |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return readError(reader, "Invalid varint");
+}
+
+static bool readLength(BinaryReader *reader, int *length)
+{
+    uint64_t number;
+    if (!readVarint(reader, &number))
+        return false;
+    if (number > INT32_MAX)
+        return readError(reader, "Invalid length");
+    *length = (int)number;
+    return true;
+}
+
+// Reads a length prefixed run into the scratch buffer, NUL terminated
+static bool readChars(BinaryReader *reader, char **chars, int *length)
+{
+    if (!readLength(reader, length))
+        return false;
+
+    if (*length + 1 > reader->scratchCapacity)
+    {
+        int capacity = reader->scratchCapacity < 64 ? 64 : reader->scratchCapacity;
+        while (capacity < *length + 1)
+            capacity *= 2;
+        reader->scratch = (char *)mp_realloc(reader->scratch, capacity);
+        reader->scratchCapacity = capacity;
+    }
+
+    if (!ensureBytes(reader, *length))
+        return false;
+    memcpy(reader->scratch, reader->data + reader->position, *length);
+    reader->scratch[*length] = '\0';
+    reader->position += *length;
+    *chars = reader->scratch;
+    return true;
+}
+
+static bool readValue(BinaryReader *reader, Value *value);
+
+static bool readValues(BinaryReader *reader, Value container, ValueArray *values)
+{
+    int count;
+    if (!readLength(reader, &count))
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        Value item;
+        if (!readValue(reader, &item))
+            return false;
+        if (IS_SET(container))
+            setAdd(AS_SET(container), item);
+        else
+            writeValueArray(values, item);
+    }
+    return true;
+}
+
+static bool findGlobal(BinaryReader *reader, const char *name, int length, Value *value)
+{
+    ObjString *key = copyString(name, length);
+    if (!tableGet(&vm.globals, key, value))
+    {
+        snprintf(reader->error, reader->errorSize, "Unknown name '%s'", name);
+        return false;
+    }
+    return true;
+}
+
+static bool readEnumValue(BinaryReader *reader, Value *value)
+{
+    char *chars;
+    int length;
+    if (!readChars(reader, &chars, &length))
+        return false;
+
+    Value enume;
+    if (!findGlobal(reader, chars, length, &enume))
+        return false;
+    if (!IS_ENUM(enume))
+        return readError(reader, "Expected an enum");
+
+    if (!readChars(reader, &chars, &length))
+        return false;
+    if (!tableGet(&AS_ENUM(enume)->members, copyString(chars, length), value))
+    {
+        snprintf(reader->error, reader->errorSize, "Unknown enum member '%s'", chars);
+        return false;
+    }
+    return true;
+}
+
+// The instance is made without calling init, its fields come from the data
+static bool readInstance(BinaryReader *reader, Value *value)
+{
+    char *chars;
+    int length;
+    if (!readChars(reader, &chars, &length))
+        return false;
+
+    Value klass;
+    if (!findGlobal(reader, chars, length, &klass))
+        return false;
+    if (!IS_CLASS(klass))
+        return readError(reader, "Expected a class");
+
+    ObjInstance *instance = newInstance(AS_CLASS(klass));
+    *value = OBJ_VAL(instance);
+    writeValueArray(&reader->containers->values, *value);
+
+    int count;
+    if (!readLength(reader, &count))
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (!readChars(reader, &chars, &length))
+            return false;
+        ObjString *name = copyString(chars, length);
+        push(OBJ_VAL(name));
+
+        Value field;
+        bool ok = readValue(reader, &field);
+        if (ok)
+            setInstanceField(instance, name, field);
+        pop();
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+static bool readDict(BinaryReader *reader, Value *value)
+{
+    ObjDict *dict = initDict();
+    *value = OBJ_VAL(dict);
+    writeValueArray(&reader->containers->values, *value);
+
+    int count;
+    if (!readLength(reader, &count))
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        char *chars;
+        int length;
+        if (!readChars(reader, &chars, &length))
+            return false;
+
+        // The value reuses the scratch buffer
+        char small[128];
+        char *key = length < (int)sizeof(small) ? small : (char *)mp_malloc(length + 1);
+        memcpy(key, chars, length + 1);
+
+        Value item;
+        bool ok = readValue(reader, &item);
+        if (ok)
+            insertDict(dict, key, item);
+        if (key != small)
+            mp_free(key);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+static bool readValue(BinaryReader *reader, Value *value)
+{
+    unsigned char tag;
+    if (!readByte(reader, &tag))
+        return false;
+
+    switch (tag)
+    {
+        case BIN_NULL:
+            *value = NULL_VAL;
+            return true;
+        case BIN_FALSE:
+            *value = FALSE_VAL;
+            return true;
+        case BIN_TRUE:
+            *value = TRUE_VAL;
+            return true;
+        case BIN_INTEGER: {
+            uint64_t number;
+            if (!readVarint(reader, &number))
+                return false;
+            int64_t integer = (int64_t)(number >> 1) ^ -(int64_t)(number & 1);
+            *value = NUMBER_VAL((double)integer);
+            return true;
+        }
+        case BIN_NUMBER: {
+            if (!ensureBytes(reader, 8))
+                return false;
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; i++)
+                bits |= (uint64_t)reader->data[reader->position + i] << (i * 8);
+            reader->position += 8;
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            *value = NUMBER_VAL(number);
+            return true;
+        }
+        case BIN_STRING:
+        case BIN_BYTES: {
+            char *chars;
+            int length;
+            if (!readChars(reader, &chars, &length))
+                return false;
+            if (tag == BIN_STRING)
+                *value = OBJ_VAL(copyString(chars, length));
+            else
+                *value = OBJ_VAL(copyBytes(chars, length));
+            return true;
+        }
+        case BIN_ENUM_VALUE:
+            return readEnumValue(reader, value);
+        case BIN_REFERENCE: {
+            uint64_t index;
+            if (!readVarint(reader, &index))
+                return false;
+            if (index >= (uint64_t)reader->containers->values.count)
+                return readError(reader, "Invalid reference");
+            *value = reader->containers->values.values[index];
+            return true;
+        }
+        case BIN_LIST:
+        case BIN_SET:
+        case BIN_DICT:
+        case BIN_INSTANCE: {
+            if (reader->depth >= BINARY_MAX_DEPTH)
+                return readError(reader, "Too deeply nested");
+            reader->depth++;
+
+            bool ok;
+            if (tag == BIN_DICT)
+                ok = readDict(reader, value);
+            else if (tag == BIN_INSTANCE)
+                ok = readInstance(reader, value);
+            else
+            {
+                *value = tag == BIN_LIST ? OBJ_VAL(initList()) : OBJ_VAL(initSet());
+                writeValueArray(&reader->containers->values, *value);
+                ok = readValues(reader, *value, tag == BIN_LIST ? &AS_LIST(*value)->values : NULL);
+            }
+
+            reader->depth--;
+            return ok;
+        }
+        default:
+            return readError(reader, "Invalid tag");
+    }
+}
+
+static bool decode(BinaryReader *reader, Value *value)
+{
+    // Keeps every container reachable while the rest is decoded
+    reader->containers = initList();
+    push(OBJ_VAL(reader->containers));
+
+    bool ok = ensureBytes(reader, 5);
+    if (ok && memcmp(reader->data + reader->position, BINARY_MAGIC, 4) != 0)
+        ok = readError(reader, "Not an encoded Cube value");
+    if (ok && reader->data[reader->position + 4] != BINARY_VERSION)
+        ok = readError(reader, "Unsupported encoding version");
+    if (ok)
+    {
+        reader->position += 5;
+        ok = readValue(reader, value);
+    }
+    if (ok && reader->file == NULL && reader->position != reader->length)
+        ok = readError(reader, "Unexpected data after the value");
+
+    pop();
+    if (reader->scratch != NULL)
+        mp_free(reader->scratch);
+    if (reader->buffer != NULL)
+        mp_free(reader->buffer);
+    if (!ok)
+        *value = NULL_VAL;
+    return ok;
+}
+
+static void initReader(BinaryReader *reader, const unsigned char *data, int length, FILE *file, char *error,
+                       int errorSize)
+{
+    reader->data = data;
+    reader->length = length;
+    reader->position = 0;
+    reader->file = file;
+    reader->buffer = NULL;
+    reader->scratch = NULL;
+    reader->scratchCapacity = 0;
+    reader->containers = NULL;
+    reader->depth = 0;
+    reader->error = error;
+    reader->errorSize = errorSize;
+}
+
+bool binaryDecode(const unsigned char *data, int length, Value *value, char *error, int errorSize)
+{
+    BinaryReader reader;
+    initReader(&reader, data, length, NULL, error, errorSize);
+    return decode(&reader, value);
+}
+
+// Reads the file in BINARY_READ_SIZE blocks, larger only for long strings
+bool binaryDecodeFromFile(FILE *file, Value *value, char *error, int errorSize)
+{
+    BinaryReader reader;
+    initReader(&reader, NULL, 0, file, error, errorSize);
+    return decode(&reader, value);
+}
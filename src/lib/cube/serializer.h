@@ -0,0 +1,33 @@
+#ifndef CUBE_SERIALIZER_h
+#define CUBE_SERIALIZER_h
+#include <stdio.h>
+
+#include "object.h"
+
+// Binary encoding of Cube values. A stream starts with the magic "CUBV"
+// and a version byte, followed by one value:
+//
+//   null, false, true     tag only
+//   integer               tag, zigzag varint (integral numbers up to 2^53)
+//   number                tag, 8 bytes little endian IEEE 754
+//   str, bytes            tag, varint length, raw bytes
+//   list, set             tag, varint count, values
+//   dict                  tag, varint count, (key, value) pairs
+//   enum value            tag, enum name, member name
+//   instance              tag, class name, varint count, (field, value) pairs
+//   reference             tag, varint index of a list, dict, set or
+//                         instance already in the stream
+//
+// References keep shared and cyclic containers intact. Enums and classes
+// are found again by name among the globals when decoding.
+#define BINARY_MAGIC "CUBV"
+#define BINARY_VERSION 1
+#define BINARY_MAX_DEPTH 512
+
+ObjBytes *binaryEncode(Value value, char *error, int errorSize);
+bool binaryEncodeAppend(Value value, unsigned char **buffer, int *length, int *capacity, char *error, int errorSize);
+bool binaryEncodeToFile(Value value, FILE *file, char *error, int errorSize);
+bool binaryDecode(const unsigned char *data, int length, Value *value, char *error, int errorSize);
+bool binaryDecodeFromFile(FILE *file, Value *value, char *error, int errorSize);
+
+#endif
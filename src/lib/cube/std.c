@@ -19,16 +19,22 @@
 #include "ansi_escapes.h"
 #include "collections.h"
 #include "compiler.h"
-#include "external/cJSON/cJSON.h"
+#include "counters.h"
 #include "files.h"
 #include "gc.h"
+#include "json.h"
+#include "kvstore.h"
+#include "logger.h"
 #include "memory.h"
 #include "mempool.h"
 #include "object.h"
 #include "packer.h"
+#include "profiler.h"
+#include "serializer.h"
 #include "std.h"
 #include "strings.h"
 #include "system.h"
+#include "xml.h"
 #include "util.h"
 #include "version.h"
 #include "vm.h"
@@ -59,6 +65,20 @@ char *textPrintValue = NULL;
 int textPrintLen = 0;
 int textPrintCapacity = 0;
 
+#define OUTPUT_BUFFER_SIZE 65536
+
+// How often print() output reaches stdout. Line mode flushes at the end of
+// every print, full mode only when the buffer fills or on flushOutput()
+typedef enum
+{
+    OUTPUT_NONE,
+    OUTPUT_LINE,
+    OUTPUT_FULL
+} OutputMode;
+
+static const char *outputModeNames[] = {"none", "line", "full"};
+OutputMode outputMode = OUTPUT_LINE;
+
 Value hashNative(int argCount, Value *args)
 {
     int code = 0;
@@ -129,10 +149,7 @@ Value getTextPrintNative(int argCount, Value *args)
     if (textPrintValue == NULL)
         ret = STRING_VAL("");
     else
-    {
-        ret = STRING_VAL(textPrintValue);
-        textPrintValue[0] = '\0';
-    }
+        ret = OBJ_VAL(copyString(textPrintValue, textPrintLen));
     textPrintLen = 0;
     return ret;
 }
@@ -140,19 +157,63 @@ Value getTextPrintNative(int argCount, Value *args)
 void printToText(char *text)
 {
     int len = strlen(text);
-    while ((textPrintLen + len) > textPrintCapacity)
+    while ((textPrintLen + len + 1) > textPrintCapacity)
     {
         if (textPrintCapacity == 0)
             textPrintCapacity = 256;
         else
             textPrintCapacity *= 2;
         textPrintValue = mp_realloc(textPrintValue, textPrintCapacity);
-        if (textPrintCapacity == 256)
-            textPrintValue[0] = '\0';
     }
 
+    memcpy(textPrintValue + textPrintLen, text, len + 1);
     textPrintLen += len;
-    strcat(textPrintValue, text);
+}
+
+static void setOutputMode(OutputMode mode)
+{
+    static const int bufferModes[] = {_IONBF, _IOLBF, _IOFBF};
+    fflush(stdout);
+    setvbuf(stdout, NULL, bufferModes[mode], OUTPUT_BUFFER_SIZE);
+    outputMode = mode;
+}
+
+// Terminals see each print as it happens, pipes and files are written in
+// big blocks
+void initOutput()
+{
+    setOutputMode(IsTerminal(stdout) ? OUTPUT_LINE : OUTPUT_FULL);
+}
+
+Value flushOutputNative(int argCount, Value *args)
+{
+    fflush(stdout);
+    return NULL_VAL;
+}
+
+// outputMode(|mode|): returns the current mode, 'none', 'line' or 'full',
+// after switching to 'mode' when given
+Value outputModeNative(int argCount, Value *args)
+{
+    if (argCount > 0)
+    {
+        if (!IS_STRING(args[0]))
+        {
+            runtimeError("The output mode must be 'none', 'line' or 'full'.");
+            return NULL_VAL;
+        }
+
+        int mode = 0;
+        while (mode <= OUTPUT_FULL && strcmp(outputModeNames[mode], AS_CSTRING(args[0])) != 0)
+            mode++;
+        if (mode > OUTPUT_FULL)
+        {
+            runtimeError("The output mode must be 'none', 'line' or 'full'.");
+            return NULL_VAL;
+        }
+        setOutputMode((OutputMode)mode);
+    }
+    return STRING_VAL(outputModeNames[outputMode]);
 }
 
 Value printNative(int argCount, Value *args)
@@ -179,7 +240,8 @@ Value printNative(int argCount, Value *args)
                 printValue(value);
         }
     }
-    fflush(stdout);
+    if (outputMode == OUTPUT_LINE)
+        fflush(stdout);
     vm.print = true;
     vm.newLine = true;
     vm.repl = NULL_VAL;
@@ -192,7 +254,11 @@ Value printlnNative(int argCount, Value *args)
     if (textPrintEnabled)
         printToText("\n");
     else
-        printf("\n");
+    {
+        putchar('\n');
+        if (outputMode == OUTPUT_LINE)
+            fflush(stdout);
+    }
     vm.newLine = false;
     return NULL_VAL;
 }
@@ -206,16 +272,20 @@ Value throwNative(int argCount, Value *args)
     for (int i = 0; i < argCount; i++)
     {
         char *str = valueToString(args[i], false);
-        if (len + strlen(error) + 1 >= sz)
+        int strLen = strlen(str);
+        if (len + strLen + 1 > sz)
         {
-            error = GROW_ARRAY(error, char, sz, sz * 2);
-            sz *= 2;
+            int newSize = sz;
+            while (len + strLen + 1 > newSize)
+                newSize *= 2;
+            error = GROW_ARRAY(error, char, sz, newSize);
+            sz = newSize;
         }
-        strcat(error + len, str);
+        memcpy(error + len, str, strLen + 1);
         mp_free(str);
-        len = strlen(error);
+        len += strLen;
     }
-    runtimeError(error);
+    runtimeError("%s", error);
     FREE_ARRAY(char, error, sz);
     return NULL_VAL;
 }
@@ -223,6 +293,7 @@ Value throwNative(int argCount, Value *args)
 Value inputNative(int argCount, Value *args)
 {
     printNative(argCount, args);
+    fflush(stdout);
 
     char str[MAX_STRING_INPUT];
     fgets(str, MAX_STRING_INPUT, stdin);
@@ -1571,6 +1642,23 @@ Value listNative(int argCount, Value *args)
                 }
             }
         }
+        else if (IS_SET(arg))
+        {
+            ObjSet *set = AS_SET(arg);
+            list = initList();
+            for (int i = 0; i < set->values.count; i++)
+                writeValueArray(&list->values, copyValue(set->values.values[i]));
+        }
+        else if (IS_GENERATOR(arg))
+        {
+            ObjGenerator *generator = AS_GENERATOR(arg);
+            list = initList();
+            push(OBJ_VAL(list));
+            bool produced;
+            while (nextGenerator(generator, &produced) && produced)
+                writeValueArray(&list->values, generator->current);
+            pop();
+        }
         else if (IS_ENUM(arg))
         {
             ObjEnum *enume = AS_ENUM(arg);
@@ -1630,41 +1718,642 @@ Value listNative(int argCount, Value *args)
     return OBJ_VAL(list);
 }
 
-Value jsonToValue(cJSON *json)
+// Native JSON, parsed straight into VM values
+Value jsonParseNative(int argCount, Value *args)
 {
-    if (cJSON_IsTrue(json))
-        return TRUE_VAL;
-    else if (cJSON_IsFalse(json))
+    if (argCount != 1 || !IS_STRING(args[0]))
+    {
+        runtimeError("jsonParse expects a string.");
+        return NULL_VAL;
+    }
+
+    char error[256];
+    Value value;
+    if (!parseJson(AS_CSTRING(args[0]), AS_STRING(args[0])->length, &value, error, sizeof(error)))
+    {
+        runtimeError("Invalid JSON: %s.", error);
+        return NULL_VAL;
+    }
+    return value;
+}
+
+static bool jsonIndent(int argCount, Value *args, int index, int *indent)
+{
+    *indent = 0;
+    if (argCount <= index || IS_NULL(args[index]))
+        return true;
+    if (!IS_NUMBER(args[index]))
+    {
+        runtimeError("The JSON indent must be a number.");
+        return false;
+    }
+    *indent = (int)AS_NUMBER(args[index]);
+    return true;
+}
+
+Value jsonStringNative(int argCount, Value *args)
+{
+    int indent;
+    if (argCount < 1 || argCount > 2)
+    {
+        runtimeError("jsonString expects a value and an optional indent.");
+        return NULL_VAL;
+    }
+    if (!jsonIndent(argCount, args, 1, &indent))
+        return NULL_VAL;
+
+    char error[256];
+    ObjString *string = jsonToString(args[0], indent, error, sizeof(error));
+    if (string == NULL)
+    {
+        runtimeError("Could not write JSON: %s.", error);
+        return NULL_VAL;
+    }
+    return OBJ_VAL(string);
+}
+
+Value jsonLoadNative(int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_STRING(args[0]))
+    {
+        runtimeError("jsonLoad expects a path.");
+        return NULL_VAL;
+    }
+
+    char *path = fixPath(AS_CSTRING(args[0]));
+    char *text = readFile(path, false);
+    mp_free(path);
+    if (text == NULL)
+    {
+        runtimeError("Could not read '%s'.", AS_CSTRING(args[0]));
+        return NULL_VAL;
+    }
+
+    char error[256];
+    Value value;
+    bool ok = parseJson(text, (int)strlen(text), &value, error, sizeof(error));
+    mp_free(text);
+    if (!ok)
+    {
+        runtimeError("Invalid JSON in '%s': %s.", AS_CSTRING(args[0]), error);
+        return NULL_VAL;
+    }
+    return value;
+}
+
+Value jsonSaveNative(int argCount, Value *args)
+{
+    int indent;
+    if (argCount < 2 || argCount > 3 || !IS_STRING(args[0]))
+    {
+        runtimeError("jsonSave expects a path, a value and an optional indent.");
+        return NULL_VAL;
+    }
+    if (!jsonIndent(argCount, args, 2, &indent))
+        return NULL_VAL;
+
+    char *path = fixPath(AS_CSTRING(args[0]));
+    FILE *file = fopen(path, "wb");
+    mp_free(path);
+    if (file == NULL)
+    {
+        runtimeError("Could not open '%s'.", AS_CSTRING(args[0]));
+        return NULL_VAL;
+    }
+
+    char error[256];
+    bool ok = jsonToFile(args[1], indent, file, error, sizeof(error));
+    fclose(file);
+    if (!ok)
+    {
+        runtimeError("Could not write JSON: %s.", error);
+        return NULL_VAL;
+    }
+    return TRUE_VAL;
+}
+
+// Binary encoding of values, see serializer.h for the format
+Value binaryEncodeNative(int argCount, Value *args)
+{
+    if (argCount != 1)
+    {
+        runtimeError("binaryEncode expects a value.");
+        return NULL_VAL;
+    }
+
+    char error[256];
+    ObjBytes *bytes = binaryEncode(args[0], error, sizeof(error));
+    if (bytes == NULL)
+    {
+        runtimeError("Could not encode: %s.", error);
+        return NULL_VAL;
+    }
+    return OBJ_VAL(bytes);
+}
+
+Value binaryDecodeNative(int argCount, Value *args)
+{
+    const unsigned char *data;
+    int length;
+    if (argCount == 1 && IS_BYTES(args[0]) && AS_BYTES(args[0])->length >= 0)
+    {
+        data = AS_BYTES(args[0])->bytes;
+        length = AS_BYTES(args[0])->length;
+    }
+    else if (argCount == 1 && IS_STRING(args[0]))
+    {
+        data = (const unsigned char *)AS_STRING(args[0])->chars;
+        length = AS_STRING(args[0])->length;
+    }
+    else
+    {
+        runtimeError("binaryDecode expects bytes.");
+        return NULL_VAL;
+    }
+
+    char error[256];
+    Value value;
+    if (!binaryDecode(data, length, &value, error, sizeof(error)))
+    {
+        runtimeError("Could not decode: %s.", error);
+        return NULL_VAL;
+    }
+    return value;
+}
+
+Value binaryLoadNative(int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_STRING(args[0]))
+    {
+        runtimeError("binaryLoad expects a path.");
+        return NULL_VAL;
+    }
+
+    char *path = fixPath(AS_CSTRING(args[0]));
+    FILE *file = fopen(path, "rb");
+    mp_free(path);
+    if (file == NULL)
+    {
+        runtimeError("Could not open '%s'.", AS_CSTRING(args[0]));
+        return NULL_VAL;
+    }
+
+    char error[256];
+    Value value;
+    bool ok = binaryDecodeFromFile(file, &value, error, sizeof(error));
+    fclose(file);
+    if (!ok)
+    {
+        runtimeError("Could not decode '%s': %s.", AS_CSTRING(args[0]), error);
+        return NULL_VAL;
+    }
+    return value;
+}
+
+Value binarySaveNative(int argCount, Value *args)
+{
+    if (argCount != 2 || !IS_STRING(args[0]))
+    {
+        runtimeError("binarySave expects a path and a value.");
+        return NULL_VAL;
+    }
+
+    char *path = fixPath(AS_CSTRING(args[0]));
+    FILE *file = fopen(path, "wb");
+    mp_free(path);
+    if (file == NULL)
+    {
+        runtimeError("Could not open '%s'.", AS_CSTRING(args[0]));
+        return NULL_VAL;
+    }
+
+    char error[256];
+    bool ok = binaryEncodeToFile(args[1], file, error, sizeof(error));
+    fclose(file);
+    if (!ok)
+    {
+        runtimeError("Could not encode: %s.", error);
+        return NULL_VAL;
+    }
+    return TRUE_VAL;
+}
+
+// Log structured storage, see kvstore.h
+Value kvOpenNative(int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_STRING(args[0]))
+    {
+        runtimeError("kvOpen expects a path.");
+        return NULL_VAL;
+    }
+
+    char error[256];
+    ObjDict *data;
+    int records;
+    char *path = fixPath(AS_CSTRING(args[0]));
+    bool ok = kvOpen(path, &data, &records, error, sizeof(error));
+    mp_free(path);
+    if (!ok)
+    {
+        runtimeError("Could not open the storage: %s.", error);
+        return NULL_VAL;
+    }
+
+    push(OBJ_VAL(data));
+    ObjDict *state = initDict();
+    insertDict(state, "data", OBJ_VAL(data));
+    insertDict(state, "records", NUMBER_VAL(records));
+    pop();
+    return OBJ_VAL(state);
+}
+
+Value kvAppendNative(int argCount, Value *args)
+{
+    if (argCount < 2 || argCount > 3 || !IS_STRING(args[0]) || !IS_LIST(args[1]))
+    {
+        runtimeError("kvAppend expects a path, a list of operations and an optional sync flag.");
+        return NULL_VAL;
+    }
+
+    char error[256];
+    bool sync = argCount > 2 && !IS_NULL(args[2]) && AS_BOOL(toBool(args[2]));
+    char *path = fixPath(AS_CSTRING(args[0]));
+    bool ok = kvAppend(path, AS_LIST(args[1]), sync, error, sizeof(error));
+    mp_free(path);
+    if (!ok)
+    {
+        runtimeError("Could not write the storage: %s.", error);
+        return NULL_VAL;
+    }
+    return TRUE_VAL;
+}
+
+Value kvCompactNative(int argCount, Value *args)
+{
+    if (argCount < 2 || argCount > 3 || !IS_STRING(args[0]) || !IS_DICT(args[1]))
+    {
+        runtimeError("kvCompact expects a path, a dict and an optional sync flag.");
+        return NULL_VAL;
+    }
+
+    char error[256];
+    bool sync = argCount > 2 && !IS_NULL(args[2]) && AS_BOOL(toBool(args[2]));
+    char *path = fixPath(AS_CSTRING(args[0]));
+    bool ok = kvCompact(path, AS_DICT(args[1]), sync, error, sizeof(error));
+    mp_free(path);
+    if (!ok)
+    {
+        runtimeError("Could not compact the storage: %s.", error);
+        return NULL_VAL;
+    }
+    return TRUE_VAL;
+}
+
+// Native XML, see xml.h. The tags that never close are an optional list
+static bool xmlUnclose(int argCount, Value *args, int index, ObjList **unclose)
+{
+    *unclose = NULL;
+    if (argCount <= index || IS_NULL(args[index]))
+        return true;
+    if (!IS_LIST(args[index]))
+    {
+        runtimeError("The unclosed XML tags must be a list.");
+        return false;
+    }
+    *unclose = AS_LIST(args[index]);
+    return true;
+}
+
+Value xmlParseNative(int argCount, Value *args)
+{
+    ObjList *unclose;
+    if (argCount < 2 || argCount > 3 || !IS_STRING(args[0]) || !IS_CLASS(args[1]))
+    {
+        runtimeError("xmlParse expects a string, an element class and an optional list of unclosed tags.");
+        return NULL_VAL;
+    }
+    if (!xmlUnclose(argCount, args, 2, &unclose))
+        return NULL_VAL;
+
+    char error[256];
+    Value document;
+    if (!parseXml(AS_CSTRING(args[0]), AS_STRING(args[0])->length, AS_CLASS(args[1]), unclose, &document, error,
+                  sizeof(error)))
+    {
+        runtimeError("Invalid XML: %s.", error);
+        return NULL_VAL;
+    }
+    return document;
+}
+
+Value xmlLoadNative(int argCount, Value *args)
+{
+    ObjList *unclose;
+    if (argCount < 2 || argCount > 3 || !IS_STRING(args[0]) || !IS_CLASS(args[1]))
+    {
+        runtimeError("xmlLoad expects a path, an element class and an optional list of unclosed tags.");
+        return NULL_VAL;
+    }
+    if (!xmlUnclose(argCount, args, 2, &unclose))
+        return NULL_VAL;
+
+    char *path = fixPath(AS_CSTRING(args[0]));
+    char *text = readFile(path, false);
+    mp_free(path);
+    if (text == NULL)
+    {
+        runtimeError("Could not read '%s'.", AS_CSTRING(args[0]));
+        return NULL_VAL;
+    }
+
+    char error[256];
+    Value document;
+    bool ok = parseXml(text, (int)strlen(text), AS_CLASS(args[1]), unclose, &document, error, sizeof(error));
+    mp_free(text);
+    if (!ok)
+    {
+        runtimeError("Invalid XML in '%s': %s.", AS_CSTRING(args[0]), error);
+        return NULL_VAL;
+    }
+    return document;
+}
+
+// Returns false when a callback stopped the reading
+Value xmlStreamNative(int argCount, Value *args)
+{
+    ObjList *unclose;
+    if (argCount < 4 || argCount > 5 || !IS_STRING(args[0]))
+    {
+        runtimeError("xmlStream expects a path, the start, end and text callbacks and an optional list of "
+                     "unclosed tags.");
+        return NULL_VAL;
+    }
+    if (!xmlUnclose(argCount, args, 4, &unclose))
+        return NULL_VAL;
+
+    char *path = fixPath(AS_CSTRING(args[0]));
+    FILE *file = fopen(path, "rb");
+    mp_free(path);
+    if (file == NULL)
+    {
+        runtimeError("Could not open '%s'.", AS_CSTRING(args[0]));
+        return NULL_VAL;
+    }
+
+    char error[256];
+    bool stopped;
+    bool ok = streamXml(file, args[1], args[2], args[3], unclose, &stopped, error, sizeof(error));
+    fclose(file);
+    if (!ok)
+    {
+        if (error[0] != '\0')
+            runtimeError("Invalid XML in '%s': %s.", AS_CSTRING(args[0]), error);
+        return NULL_VAL;
+    }
+    return BOOL_VAL(!stopped);
+}
+
+Value xmlEscapeNative(int argCount, Value *args)
+{
+    if (argCount < 1 || argCount > 2)
+    {
+        runtimeError("xmlEscape expects a value and an optional attribute flag.");
+        return NULL_VAL;
+    }
+
+    bool attribute = argCount > 1 && !IS_NULL(args[1]) && AS_BOOL(toBool(args[1]));
+    if (IS_STRING(args[0]))
+        return OBJ_VAL(escapeXml(AS_STRING(args[0]), attribute));
+
+    Value text = toString(args[0]);
+    push(text);
+    ObjString *escaped = escapeXml(AS_STRING(text), attribute);
+    pop();
+    return OBJ_VAL(escaped);
+}
+
+// Asynchronous logging, see logger.h. Levels are numbers or members of
+// the Level enum
+static bool logLevelArg(Value value, int *level)
+{
+    if (IS_ENUM_VALUE(value))
+        value = AS_ENUM_VALUE(value)->value;
+    if (!IS_NUMBER(value) || AS_NUMBER(value) < LOG_DEBUG || AS_NUMBER(value) > LOG_NONE)
+    {
+        runtimeError("Invalid log level.");
+        return false;
+    }
+    *level = (int)AS_NUMBER(value);
+    return true;
+}
+
+static bool logSinkArg(Value value, int *sink)
+{
+    if (!IS_NUMBER(value) || !logValid((int)AS_NUMBER(value)))
+    {
+        runtimeError("The log is not open.");
+        return false;
+    }
+    *sink = (int)AS_NUMBER(value);
+    return true;
+}
+
+// logOpen(|target, level, maxSize, maxFiles|): the target is null or
+// 'stdout', 'stderr' or a file. Files rotate past maxSize bytes when it is
+// given, keeping maxFiles (5 by default) old ones
+Value logOpenNative(int argCount, Value *args)
+{
+    if (argCount > 4 || (argCount > 0 && !IS_NULL(args[0]) && !IS_STRING(args[0])) ||
+        (argCount > 2 && !IS_NULL(args[2]) && !IS_NUMBER(args[2])) ||
+        (argCount > 3 && !IS_NULL(args[3]) && !IS_NUMBER(args[3])))
+    {
+        runtimeError("logOpen expects an optional target, level, maximum size and number of files.");
+        return NULL_VAL;
+    }
+
+    int level = LOG_DEBUG;
+    if (argCount > 1 && !IS_NULL(args[1]) && !logLevelArg(args[1], &level))
+        return NULL_VAL;
+    long maxSize = argCount > 2 && !IS_NULL(args[2]) ? (long)AS_NUMBER(args[2]) : 0;
+    int maxFiles = argCount > 3 && !IS_NULL(args[3]) ? (int)AS_NUMBER(args[3]) : 5;
+
+    char *path = NULL;
+    if (argCount > 0 && IS_STRING(args[0]) && strcmp(AS_CSTRING(args[0]), "stdout") != 0)
+        path = strcmp(AS_CSTRING(args[0]), "stderr") == 0 ? AS_CSTRING(args[0]) : fixPath(AS_CSTRING(args[0]));
+
+    char error[256];
+    int sink = logOpen(path, level, maxSize, maxFiles, error, sizeof(error));
+    if (path != NULL && path != AS_CSTRING(args[0]))
+        mp_free(path);
+    if (sink < 0)
+    {
+        runtimeError("%s.", error);
+        return NULL_VAL;
+    }
+    return NUMBER_VAL(sink);
+}
+
+Value logLevelNative(int argCount, Value *args)
+{
+    int sink, level;
+    if (argCount < 1 || argCount > 2)
+    {
+        runtimeError("logLevel expects a log and an optional level.");
+        return NULL_VAL;
+    }
+    if (!logSinkArg(args[0], &sink))
+        return NULL_VAL;
+    if (argCount > 1)
+    {
+        if (!logLevelArg(args[1], &level))
+            return NULL_VAL;
+        logSetLevel(sink, level);
+    }
+    return NUMBER_VAL(logGetLevel(sink));
+}
+
+// logWrite(log, level, values): the values are joined by spaces as print
+// shows them. Functions are only called, and nothing is formatted, when
+// the level is enabled
+Value logWriteNative(int argCount, Value *args)
+{
+    int sink, level;
+    if (argCount != 3)
+    {
+        runtimeError("logWrite expects a log, a level and a list of values.");
+        return NULL_VAL;
+    }
+    if (!logSinkArg(args[0], &sink) || !logLevelArg(args[1], &level))
+        return NULL_VAL;
+    if (!logEnabled(sink, level))
         return FALSE_VAL;
-    else if (cJSON_IsNull(json))
+
+    int count = IS_LIST(args[2]) ? AS_LIST(args[2])->values.count : 1;
+    Value *values = IS_LIST(args[2]) ? AS_LIST(args[2])->values.values : &args[2];
+
+    int length = 0;
+    int capacity = 128;
+    char *message = (char *)mp_malloc(capacity);
+    for (int i = 0; i < count; i++)
+    {
+        Value value = values[i];
+        if (IS_CLOSURE(value) && !callFunction(value, 0, NULL, &value))
+        {
+            mp_free(message);
+            return NULL_VAL;
+        }
+
+        char *text = IS_STRING(value) ? AS_CSTRING(value) : valueToString(value, true);
+        int size = (int)strlen(text);
+        if (length + size + 2 > capacity)
+        {
+            while (length + size + 2 > capacity)
+                capacity *= 2;
+            message = (char *)mp_realloc(message, capacity);
+        }
+        if (i > 0)
+            message[length++] = ' ';
+        memcpy(message + length, text, size);
+        length += size;
+        if (!IS_STRING(value))
+            mp_free(text);
+    }
+
+    logWrite(sink, level, message, length);
+    mp_free(message);
+    return TRUE_VAL;
+}
+
+Value logFlushNative(int argCount, Value *args)
+{
+    logFlush();
+    return NULL_VAL;
+}
+
+Value logCloseNative(int argCount, Value *args)
+{
+    int sink;
+    if (argCount != 1)
+    {
+        runtimeError("logClose expects a log.");
+        return NULL_VAL;
+    }
+    if (!logSinkArg(args[0], &sink))
         return NULL_VAL;
-    else if (cJSON_IsNumber(json))
-        return NUMBER_VAL(json->valuedouble);
-    else if (cJSON_IsString(json))
-        return STRING_VAL(json->valuestring);
-    else if (cJSON_IsArray(json))
+    logClose(sink);
+    return NULL_VAL;
+}
+
+Value setOfNative(int argCount, Value *args)
+{
+    ObjSet *set = initSet();
+    push(OBJ_VAL(set));
+
+    bool ok = true;
+    if (argCount == 1 && (IS_LIST(args[0]) || IS_SET(args[0])))
+    {
+        ValueArray *values = IS_LIST(args[0]) ? &AS_LIST(args[0])->values : &AS_SET(args[0])->values;
+        for (int i = 0; i < values->count && ok; i++)
+            ok = setAdd(set, values->values[i]);
+    }
+    else if (argCount == 1 && IS_STRING(args[0]))
     {
-        ObjList *list = initList();
-        cJSON *child = json->child;
-        while (child != NULL)
+        ObjString *str = AS_STRING(args[0]);
+        for (int i = 0; i < str->length; i++)
+            setAdd(set, OBJ_VAL(copyString(str->chars + i, 1)));
+    }
+    else if (argCount == 1 && IS_DICT(args[0]))
+    {
+        ObjDict *dict = AS_DICT(args[0]);
+        for (int i = 0; i < dict->capacity; i++)
         {
-            addList(list, jsonToValue(child));
-            child = child->next;
+            dictItem *item = dict->items[i];
+            if (!item || item->deleted)
+                continue;
+            setAdd(set, STRING_VAL(item->key));
         }
-        return OBJ_VAL(list);
     }
-    else if (cJSON_IsObject(json))
+    else
+    {
+        for (int i = 0; i < argCount && ok; i++)
+            ok = setAdd(set, args[i]);
+    }
+
+    pop();
+    if (!ok)
+        return NULL_VAL;
+    return OBJ_VAL(set);
+}
+
+Value pipelineNative(int argCount, Value *args)
+{
+    if (argCount < 2 || argCount > 4)
+    {
+        runtimeError("pipeline() takes between 2 and 4 arguments (%d given).", argCount);
+        return NULL_VAL;
+    }
+
+    if (!IS_LIST(args[1]))
+    {
+        runtimeError("pipeline() stages must be a list.");
+        return NULL_VAL;
+    }
+
+    char *terminal = "list";
+    if (argCount > 2 && !IS_NULL(args[2]))
     {
-        ObjDict *dict = initDict();
-        cJSON *child = json->child;
-        while (child != NULL)
+        if (!IS_STRING(args[2]))
         {
-            insertDict(dict, child->string, jsonToValue(child));
-            child = child->next;
+            runtimeError("pipeline() terminal must be a string.");
+            return NULL_VAL;
         }
-        return OBJ_VAL(dict);
+        terminal = AS_CSTRING(args[2]);
     }
-    return NULL_VAL;
+
+    Value result;
+    if (!runPipeline(args[0], AS_LIST(args[1]), terminal, argCount > 3 ? args[3] : NULL_VAL, &result))
+        return NULL_VAL;
+    return result;
 }
 
 Value dictNative(int argCount, Value *args)
@@ -1723,17 +2412,14 @@ Value dictNative(int argCount, Value *args)
             }
             else if (IS_STRING(args[0]))
             {
-                char *str = AS_CSTRING(args[0]);
-                cJSON *json = cJSON_Parse(str);
-                if (json == NULL || !cJSON_IsObject(json))
+                char error[256];
+                Value value;
+                if (!parseJson(AS_CSTRING(args[0]), AS_STRING(args[0])->length, &value, error, sizeof(error)) ||
+                    !IS_DICT(value))
                 {
                     runtimeError("Invalid dict string.");
                     return NULL_VAL;
                 }
-
-                Value value = jsonToValue(json);
-
-                cJSON_Delete(json);
                 return value;
             }
         }
@@ -2158,6 +2844,8 @@ Value lenNative(int argCount, Value *args)
         return NUMBER_VAL(AS_LIST(args[0])->values.count);
     else if (IS_DICT(args[0]))
         return NUMBER_VAL(AS_DICT(args[0])->count);
+    else if (IS_SET(args[0]))
+        return NUMBER_VAL(AS_SET(args[0])->values.count);
     else if (IS_ENUM(args[0]))
         return NUMBER_VAL(AS_ENUM(args[0])->members.count);
     else if (IS_INSTANCE(args[0]))
@@ -2215,9 +2903,12 @@ Value varsNative(int argCount, Value *args)
     Table *tables[10];
     char *titles[10];
     Table *table;
+    Table fields;
     bool isGlobal = false;
     bool showLocals = false;
 
+    initTable(&fields);
+
     if (argCount > 0 && IS_MODULE(args[0]))
     {
         tables[K++] = &(AS_MODULE(args[0])->symbols);
@@ -2234,7 +2925,8 @@ Value varsNative(int argCount, Value *args)
     }
     else if (argCount > 0 && IS_INSTANCE(args[0]))
     {
-        tables[K++] = &(AS_INSTANCE(args[0])->fields);
+        instanceFields(AS_INSTANCE(args[0]), &fields);
+        tables[K++] = &fields;
         titles[K - 1] = "Fields";
         tables[K++] = &(AS_INSTANCE(args[0])->klass->staticFields);
         titles[K - 1] = "Static fields";
@@ -2319,6 +3011,7 @@ Value varsNative(int argCount, Value *args)
             }
         }
     }
+    freeTable(&fields);
 
     vm.print = true;
     vm.newLine = false;
@@ -2333,9 +3026,12 @@ Value dirNative(int argCount, Value *args)
     int K = 0;
     Table *tables[10];
     Table *table;
+    Table fields;
     bool isGlobal = false;
     ObjList *list = initList();
 
+    initTable(&fields);
+
     if (argCount > 0 && IS_MODULE(args[0]))
     {
         tables[K++] = &(AS_MODULE(args[0])->symbols);
@@ -2348,7 +3044,8 @@ Value dirNative(int argCount, Value *args)
     }
     else if (argCount > 0 && IS_INSTANCE(args[0]))
     {
-        tables[K++] = &(AS_INSTANCE(args[0])->fields);
+        instanceFields(AS_INSTANCE(args[0]), &fields);
+        tables[K++] = &fields;
         tables[K++] = &(AS_INSTANCE(args[0])->klass->staticFields);
         tables[K++] = &(AS_INSTANCE(args[0])->klass->methods);
     }
@@ -2388,6 +3085,7 @@ Value dirNative(int argCount, Value *args)
             writeValueArray(&list->values, STRING_VAL(entry.key->chars));
         }
     }
+    freeTable(&fields);
 
     return OBJ_VAL(list);
 }
@@ -2669,6 +3367,7 @@ Value execNative(int argCount, Value *args)
 
     strcat(cmd, "");
 
+    fflush(stdout);
     if (system(cmd) != 0)
         success = false;
 
@@ -2769,6 +3468,125 @@ Value memNative(int argCount, Value *args)
     return ret;
 }
 
+static void insertObjectStats(ObjDict *dict)
+{
+    ObjectStats stats;
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        getObjectStats((ObjType)i, &stats);
+        if (stats.allocated == 0)
+            continue;
+
+        ObjDict *item = initDict();
+        insertDict(item, "allocated", NUMBER_VAL(stats.allocated));
+        insertDict(item, "freed", NUMBER_VAL(stats.freed));
+        insertDict(item, "live", NUMBER_VAL(stats.live));
+        insertDict(item, "bytes", NUMBER_VAL(stats.bytes));
+        insertDict(item, "slab", BOOL_VAL(stats.slab));
+        insertDict(dict, (char *)objTypeName((ObjType)i), OBJ_VAL(item));
+    }
+}
+
+Value memStatsNative(int argCount, Value *args)
+{
+    ObjDict *dict = initDict();
+    insertObjectStats(dict);
+
+    ObjDict *slab = initDict();
+    insertDict(slab, "count", NUMBER_VAL(slabCount()));
+    insertDict(slab, "bytes", NUMBER_VAL(slabCapacity()));
+    insertDict(dict, "slabs", OBJ_VAL(slab));
+    return OBJ_VAL(dict);
+}
+
+// startProfile(interval = 1000): starts sampling the call stacks every
+// 'interval' microseconds of CPU time, dropping the previous samples
+Value startProfileNative(int argCount, Value *args)
+{
+    int interval = PROFILE_INTERVAL;
+    if (argCount > 0)
+    {
+        if (!IS_NUMBER(args[0]))
+        {
+            runtimeError("startProfile() interval must be a number");
+            return NULL_VAL;
+        }
+        interval = (int)AS_NUMBER(args[0]);
+    }
+    return BOOL_VAL(startProfiler(interval));
+}
+
+Value stopProfileNative(int argCount, Value *args)
+{
+    return NUMBER_VAL(stopProfiler());
+}
+
+// saveProfile(path, format = 'folded'): 'folded' writes collapsed stacks for
+// flame graph tools, 'top' a flat/cumulative report per function
+Value saveProfileNative(int argCount, Value *args)
+{
+    if (argCount == 0 || !IS_STRING(args[0]))
+    {
+        runtimeError("saveProfile() requires a file name");
+        return NULL_VAL;
+    }
+
+    const char *format = "folded";
+    if (argCount > 1)
+    {
+        if (!IS_STRING(args[1]))
+        {
+            runtimeError("saveProfile() format must be a string");
+            return NULL_VAL;
+        }
+        format = AS_CSTRING(args[1]);
+    }
+
+    if (strcmp(format, "folded") != 0 && strcmp(format, "top") != 0)
+    {
+        runtimeError("Unknown profile format '%s'", format);
+        return NULL_VAL;
+    }
+
+    return BOOL_VAL(saveProfile(AS_CSTRING(args[0]), format));
+}
+
+// startCounters(): counts executions and time of every opcode, function,
+// native and builtin method until stopCounters() is called
+Value startCountersNative(int argCount, Value *args)
+{
+    startCounters();
+    return NULL_VAL;
+}
+
+Value stopCountersNative(int argCount, Value *args)
+{
+    stopCounters();
+    return NULL_VAL;
+}
+
+Value countersNative(int argCount, Value *args)
+{
+    return OBJ_VAL(countersToDict());
+}
+
+// benchOptions(): the settings given to 'cube --bench', and whether this
+// interpreter was built with optimizations
+Value benchOptionsNative(int argCount, Value *args)
+{
+    ObjDict *dict = initDict();
+    insertDict(dict, "enabled", BOOL_VAL(vm.bench.enabled));
+    insertDict(dict, "runs", NUMBER_VAL(vm.bench.runs));
+    insertDict(dict, "warmup", NUMBER_VAL(vm.bench.warmup));
+    insertDict(dict, "output", vm.bench.output != NULL ? STRING_VAL(vm.bench.output) : NULL_VAL);
+#if defined(NDEBUG) || defined(__OPTIMIZE__)
+    insertDict(dict, "optimized", TRUE_VAL);
+#else
+    insertDict(dict, "optimized", FALSE_VAL);
+#endif
+    return OBJ_VAL(dict);
+}
+
 Value gcCollectNative(int argCount, Value *args)
 {
     gc_collect();
@@ -2784,6 +3602,99 @@ Value autoGCNative(int argCount, Value *args)
     return BOOL_VAL(vm.autoGC);
 }
 
+// Collections, pause times (in seconds) and allocation since the last
+// gcResetStats(), plus the live objects and bytes of each type
+Value gcStatsNative(int argCount, Value *args)
+{
+    GCStats stats;
+    gc_stats(&stats);
+
+    double elapsed = (cube_clock() - stats.start) / 1e9;
+    size_t allocated = allocatedBytes() - stats.allocated;
+
+    ObjDict *dict = initDict();
+    insertDict(dict, "collections", NUMBER_VAL(stats.collections));
+    insertDict(dict, "bytes", NUMBER_VAL(vm.bytesAllocated));
+    insertDict(dict, "nextGC", NUMBER_VAL(vm.nextGC));
+    insertDict(dict, "allocated", NUMBER_VAL(allocated));
+    insertDict(dict, "reclaimed", NUMBER_VAL(stats.reclaimed));
+    insertDict(dict, "elapsed", NUMBER_VAL(elapsed));
+    insertDict(dict, "allocationRate", NUMBER_VAL(elapsed > 0 ? allocated / elapsed : 0));
+
+    ObjDict *pause = initDict();
+    insertDict(pause, "total", NUMBER_VAL(stats.pauseTotal / 1e9));
+    insertDict(pause, "max", NUMBER_VAL(stats.pauseMax / 1e9));
+    insertDict(pause, "last", NUMBER_VAL(stats.pauseLast / 1e9));
+    insertDict(pause, "mean", NUMBER_VAL(stats.collections > 0 ? stats.pauseTotal / 1e9 / stats.collections : 0));
+    ObjDict *histogram = initDict();
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+        insertDict(histogram, (char *)gc_pause_bucket(i), NUMBER_VAL(stats.pauses[i]));
+    insertDict(pause, "histogram", OBJ_VAL(histogram));
+    insertDict(dict, "pause", OBJ_VAL(pause));
+
+    ObjDict *types = initDict();
+    insertObjectStats(types);
+    insertDict(dict, "types", OBJ_VAL(types));
+    return OBJ_VAL(dict);
+}
+
+Value gcResetStatsNative(int argCount, Value *args)
+{
+    gc_reset_stats();
+    return NULL_VAL;
+}
+
+// gcLog(interval = 0): prints a line to stderr per collection, at most every
+// 'interval' seconds. gcLog(false) stops logging
+Value gcLogNative(int argCount, Value *args)
+{
+    if (argCount > 0 && IS_BOOL(args[0]) && !AS_BOOL(args[0]))
+    {
+        gc_log(0, NULL);
+        return BOOL_VAL(false);
+    }
+
+    double interval = 0;
+    if (argCount > 0)
+    {
+        if (!IS_NUMBER(args[0]))
+        {
+            runtimeError("gcLog() interval must be a number");
+            return NULL_VAL;
+        }
+        interval = AS_NUMBER(args[0]);
+    }
+    gc_log(interval, stderr);
+    return BOOL_VAL(true);
+}
+
+// maxFrames(limit): sets how deep calls can nest before a stack overflow and
+// returns the limit in use
+Value maxFramesNative(int argCount, Value *args)
+{
+    if (argCount > 0)
+    {
+        if (!IS_NUMBER(args[0]))
+        {
+            runtimeError("maxFrames() limit must be a number");
+            return NULL_VAL;
+        }
+        int limit = (int)AS_NUMBER(args[0]);
+        vm.maxFrames = limit < FRAMES_MIN ? FRAMES_MIN : limit;
+    }
+    return NUMBER_VAL(vm.maxFrames);
+}
+
+Value heapSnapshotNative(int argCount, Value *args)
+{
+    if (argCount == 0 || !IS_STRING(args[0]))
+    {
+        runtimeError("heapSnapshot() requires a file name");
+        return NULL_VAL;
+    }
+    return BOOL_VAL(gc_snapshot(AS_CSTRING(args[0])));
+}
+
 Value systemInfoNative(int argCount, Value *args)
 {
     ObjDict *dict = initDict();
@@ -3258,7 +4169,7 @@ static Value getFieldNative(int argCount, Value *args)
     {
         ObjInstance *instance = AS_INSTANCE(args[0]);
         Value value = NULL_VAL;
-        if (!tableGet(&instance->fields, AS_STRING(args[1]), &value))
+        if (!getInstanceField(instance, AS_STRING(args[1]), &value))
         {
             Value values[2];
             values[0] = OBJ_VAL(instance->klass);
@@ -3299,7 +4210,7 @@ static Value setFieldNative(int argCount, Value *args)
     if (IS_INSTANCE(args[0]))
     {
         ObjInstance *instance = AS_INSTANCE(args[0]);
-        tableSet(&instance->fields, AS_STRING(args[1]), args[2]);
+        setInstanceField(instance, AS_STRING(args[1]), args[2]);
         return args[2];
     }
     else if (IS_CLASS(args[0]))
@@ -3366,14 +4277,17 @@ static Value getFieldsNative(int argCount, Value *args)
             ObjInstance *instance = AS_INSTANCE(args[0]);
             int i = 0;
             Entry entry;
-            Table *table = &instance->fields;
-            while (iterateTable(table, &entry, &i))
+            Table fields;
+            initTable(&fields);
+            instanceFields(instance, &fields);
+            while (iterateTable(&fields, &entry, &i))
             {
                 if (entry.key == NULL)
                     continue;
 
                 writeValueArray(&list->values, STRING_VAL(entry.key->chars));
             }
+            freeTable(&fields);
         }
         else if (IS_CLASS(args[0]))
         {
@@ -3850,6 +4764,8 @@ void initStd()
     ADD_STD("println", printlnNative);
     ADD_STD("textPrint", textPrintNative);
     ADD_STD("getTextPrint", getTextPrintNative);
+    ADD_STD("flushOutput", flushOutputNative);
+    ADD_STD("outputMode", outputModeNative);
     ADD_STD("throw", throwNative);
     ADD_STD("rand", randNative);
     ADD_STD("randn", randnNative);
@@ -3882,6 +4798,28 @@ void initStd()
     ADD_STD("char", charNative);
     ADD_STD("list", listNative);
     ADD_STD("dict", dictNative);
+    ADD_STD("setOf", setOfNative);
+    ADD_STD("jsonParse", jsonParseNative);
+    ADD_STD("jsonString", jsonStringNative);
+    ADD_STD("jsonLoad", jsonLoadNative);
+    ADD_STD("jsonSave", jsonSaveNative);
+    ADD_STD("binaryEncode", binaryEncodeNative);
+    ADD_STD("binaryDecode", binaryDecodeNative);
+    ADD_STD("binaryLoad", binaryLoadNative);
+    ADD_STD("binarySave", binarySaveNative);
+    ADD_STD("kvOpen", kvOpenNative);
+    ADD_STD("kvAppend", kvAppendNative);
+    ADD_STD("kvCompact", kvCompactNative);
+    ADD_STD("logOpen", logOpenNative);
+    ADD_STD("logLevel", logLevelNative);
+    ADD_STD("logWrite", logWriteNative);
+    ADD_STD("logFlush", logFlushNative);
+    ADD_STD("logClose", logCloseNative);
+    ADD_STD("xmlParse", xmlParseNative);
+    ADD_STD("xmlLoad", xmlLoadNative);
+    ADD_STD("xmlStream", xmlStreamNative);
+    ADD_STD("xmlEscape", xmlEscapeNative);
+    ADD_STD("pipeline", pipelineNative);
     ADD_STD("bytes", bytesNative);
     ADD_STD("color", colorNative);
     ADD_STD("date", dateNative);
@@ -3914,8 +4852,21 @@ void initStd()
     ADD_STD("copy", copyNative);
     ADD_STD("eval", evalNative);
     ADD_STD("mem", memNative);
+    ADD_STD("memStats", memStatsNative);
+    ADD_STD("startProfile", startProfileNative);
+    ADD_STD("stopProfile", stopProfileNative);
+    ADD_STD("saveProfile", saveProfileNative);
+    ADD_STD("startCounters", startCountersNative);
+    ADD_STD("stopCounters", stopCountersNative);
+    ADD_STD("counters", countersNative);
+    ADD_STD("benchOptions", benchOptionsNative);
     ADD_STD("gcCollect", gcCollectNative);
     ADD_STD("enableAutoGC", autoGCNative);
+    ADD_STD("gcStats", gcStatsNative);
+    ADD_STD("gcResetStats", gcResetStatsNative);
+    ADD_STD("gcLog", gcLogNative);
+    ADD_STD("heapSnapshot", heapSnapshotNative);
+    ADD_STD("maxFrames", maxFramesNative);
     ADD_STD("systemInfo", systemInfoNative);
     ADD_STD("printStack", printStackNative);
     ADD_STD("isdigit", isdigitNative);
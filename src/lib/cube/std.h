@@ -16,6 +16,7 @@ typedef struct
 } std_fn;
 
 void initStd();
+void initOutput();
 void destroyStd();
 
 #endif
@@ -8,9 +8,11 @@
 
 #ifdef _WIN32
 #include <direct.h>
+#include <io.h>
 #define GetCurrentDir _getcwd
 #define MakeDir(path, mode) _mkdir(path)
 #define RmDir _rmdir
+#define IsTerminal(file) _isatty(_fileno(file))
 #else
 #include <dirent.h>
 #include <sys/stat.h>
@@ -19,6 +21,7 @@
 #define GetCurrentDir getcwd
 #define MakeDir(path, mode) mkdir(path, mode)
 #define RmDir rmdir
+#define IsTerminal(file) isatty(fileno(file))
 #endif
 
 int readFd(int fd, int size, char *buff);
@@ -38,13 +38,51 @@ void freeValueArray(ValueArray *array)
     initValueArray(array);
 }
 
+// Probes for 'key', skipping removed items. Returns its index or -1, with
+// the first reusable slot on the way in 'free'
+static int findDictIndex(ObjDict *dict, const char *key, uint32_t hashValue, int *free)
+{
+    int index = hashValue % dict->capacity;
+    *free = -1;
+    for (int i = 0; i < dict->capacity; i++)
+    {
+        dictItem *item = dict->items[index];
+        if (!item)
+        {
+            if (*free < 0)
+                *free = index;
+            return -1;
+        }
+
+        if (item->deleted)
+        {
+            if (*free < 0)
+                *free = index;
+        }
+        else if (item->hash == hashValue && strcmp(item->key, key) == 0)
+            return index;
+
+        index++;
+        if (index == dict->capacity)
+            index = 0;
+    }
+    return -1;
+}
+
 void insertDict(ObjDict *dict, char *key, Value value)
 {
     if (dict->count * 100 / dict->capacity >= 60)
         resizeDict(dict, true);
 
     uint32_t hashValue = hash(key);
-    int index = hashValue % dict->capacity;
+    int free;
+    int index = findDictIndex(dict, key, hashValue, &free);
+    if (index >= 0)
+    {
+        dict->items[index]->item = value;
+        return;
+    }
+
     char *key_m = ALLOCATE(char, strlen(key) + 1);
 
     if (!key_m)
@@ -68,24 +106,28 @@ void insertDict(ObjDict *dict, char *key, Value value)
     item->deleted = false;
     item->hash = hashValue;
 
-    while (dict->items[index] && !dict->items[index]->deleted && strcmp(dict->items[index]->key, key) != 0)
-    {
-        index++;
-        if (index == dict->capacity)
-            index = 0;
-    }
-
-    if (dict->items[index])
-    {
-        mp_free(dict->items[index]->key);
-        mp_free(dict->items[index]);
-        dict->count--;
-    }
+    if (dict->items[free])
+        freeDictValue(dict->items[free]);
 
-    dict->items[index] = item;
+    dict->items[free] = item;
     dict->count++;
 }
 
+bool deleteDict(ObjDict *dict, char *key)
+{
+    int free;
+    int index = findDictIndex(dict, key, hash(key), &free);
+    if (index < 0)
+        return false;
+
+    dict->items[index]->deleted = true;
+    dict->count--;
+
+    if (dict->capacity != 8 && dict->count * 100 / dict->capacity <= 35)
+        resizeDict(dict, false);
+    return true;
+}
+
 void resizeDict(ObjDict *dict, bool grow)
 {
     int newSize;
@@ -129,27 +171,11 @@ void resizeDict(ObjDict *dict, bool grow)
 
 Value searchDict(ObjDict *dict, char *key)
 {
-    int index = hash(key) % dict->capacity;
-
-    if (!dict->items[index])
+    int free;
+    int index = findDictIndex(dict, key, hash(key), &free);
+    if (index < 0)
         return NULL_VAL;
-
-    while (index < dict->capacity && dict->items[index] && !dict->items[index]->deleted &&
-           strcmp(dict->items[index]->key, key) != 0)
-    {
-        index++;
-        if (index == dict->capacity)
-        {
-            index = 0;
-        }
-    }
-
-    if (dict->items[index] && !dict->items[index]->deleted)
-    {
-        return dict->items[index]->item;
-    }
-
-    return NULL_VAL;
+    return dict->items[index]->item;
 }
 
 char *searchDictKey(ObjDict *dict, int index)
@@ -171,44 +197,53 @@ char *searchDictKey(ObjDict *dict, int index)
     return NULL;
 }
 
-// Calling function needs to free memory
-char *valueToString(Value value, bool literal)
+void appendValue(OutBuffer *buffer, Value value, bool literal)
 {
     if (IS_BOOL(value))
     {
-        char *str = AS_BOOL(value) ? "true" : "false";
-        char *boolString = mp_malloc(sizeof(char) * (strlen(str) + 1));
-        snprintf(boolString, strlen(str) + 1, "%s", str);
-        return boolString;
+        if (AS_BOOL(value))
+            writeOutBuffer(buffer, "true", 4);
+        else
+            writeOutBuffer(buffer, "false", 5);
     }
     else if (IS_NULL(value))
-    {
-        char *nilString = mp_malloc(sizeof(char) * 5);
-        snprintf(nilString, 5, "%s", "null");
-        return nilString;
-    }
+        writeOutBuffer(buffer, "null", 4);
     else if (IS_NUMBER(value))
     {
-        double number = AS_NUMBER(value);
-        int numberStringLength = snprintf(NULL, 0, "%.15g", number) + 1;
-        char *numberString = mp_malloc(sizeof(char) * numberStringLength);
-        snprintf(numberString, numberStringLength, "%.15g", number);
-        int l = strlen(numberString);
-        for (int i = 0; i < l; i++)
+        char numberString[32];
+        int length = snprintf(numberString, sizeof(numberString), "%.15g", AS_NUMBER(value));
+        for (int i = 0; i < length; i++)
         {
             if (numberString[i] == ',')
                 numberString[i] = '.';
         }
-        return numberString;
+        writeOutBuffer(buffer, numberString, length);
     }
     else if (IS_OBJ(value))
-    {
-        return objectToString(value, literal);
-    }
+        appendObject(buffer, value, literal);
+    else
+        writeOutBuffer(buffer, "unknown", 7);
+}
 
-    char *unknown = mp_malloc(sizeof(char) * 8);
-    snprintf(unknown, 8, "%s", "unknown");
-    return unknown;
+// Returns how many chars went to the file
+int writeValueToFile(FILE *file, Value value, bool literal)
+{
+    OutBuffer buffer;
+    initOutBuffer(&buffer, file, NULL, 0, 0);
+    appendValue(&buffer, value, literal);
+    flushOutBuffer(&buffer);
+    freeOutBuffer(&buffer);
+    return buffer.written;
+}
+
+// Calling function needs to free memory
+char *valueToString(Value value, bool literal)
+{
+    OutBuffer buffer;
+    initOutBuffer(&buffer, NULL, NULL, 0, 0);
+    appendValue(&buffer, value, literal);
+    writeOutBuffer(&buffer, "", 1);
+    return (char *)buffer.bytes;
 }
 
 Value toBytes(Value value)
@@ -293,9 +328,7 @@ char *valueType(Value value)
 
 void printValue(Value value)
 {
-    char *output = valueToString(value, true);
-    printf("%s", output);
-    mp_free(output);
+    writeValueToFile(stdout, value, true);
 }
 
 bool valuesEqual(Value a, Value b)
@@ -350,6 +383,69 @@ bool valuesEqual(Value a, Value b)
 #endif
 }
 
+static uint32_t hashBits(uint64_t bits)
+{
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static uint32_t hashNumber(double number)
+{
+    // -0 and 0 compare equal, so they must hash the same
+    if (number == 0)
+        number = 0;
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return hashBits(bits);
+}
+
+// Computes a hash consistent with valuesEqual(), returns false for unhashable values
+bool hashValue(Value value, uint32_t *hash)
+{
+    if (IS_NULL(value))
+        *hash = 0x9e3779b9u;
+    else if (IS_BOOL(value))
+        *hash = AS_BOOL(value) ? 0x85ebca6bu : 0xc2b2ae35u;
+    else if (IS_NUMBER(value))
+        *hash = hashNumber(AS_NUMBER(value));
+    else if (IS_STRING(value))
+        *hash = AS_STRING(value)->hash;
+    else if (IS_BYTES(value))
+    {
+        ObjBytes *bytes = AS_BYTES(value);
+        uint32_t h = 2166136261u;
+        for (int i = 0; i < bytes->length; i++)
+        {
+            h ^= bytes->bytes[i];
+            h *= 16777619;
+        }
+        *hash = h;
+    }
+    else if (IS_LIST(value))
+    {
+        // Lists hash by content so they can be used as tuples
+        ObjList *list = AS_LIST(value);
+        uint32_t h = 0x345678u;
+        for (int i = 0; i < list->values.count; i++)
+        {
+            uint32_t item;
+            if (!hashValue(list->values.values[i], &item))
+                return false;
+            h = (h ^ item) * 1000003u;
+        }
+        *hash = h ^ (uint32_t)list->values.count;
+    }
+    else if (IS_ENUM_VALUE(value) && IS_NUMBER(AS_ENUM_VALUE(value)->value))
+        *hash = hashNumber(AS_NUMBER(AS_ENUM_VALUE(value)->value));
+    else if (IS_DICT(value) || IS_SET(value))
+        return false;
+    else
+        *hash = hashBits((uint64_t)(uintptr_t)AS_OBJ(value));
+    return true;
+}
+
 Value toBool(Value value)
 {
     if (IS_NULL(value))
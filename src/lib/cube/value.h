@@ -1,7 +1,10 @@
 #ifndef CLOX_value_h
 #define CLOX_value_h
 
+#include <stdio.h>
+
 #include "common.h"
+#include "outbuffer.h"
 
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
@@ -118,10 +121,12 @@ typedef struct
 } ValueArray;
 
 bool valuesEqual(Value a, Value b);
+bool hashValue(Value value, uint32_t *hash);
 void initValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value);
 
 void insertDict(ObjDict *dict, char *key, Value value);
+bool deleteDict(ObjDict *dict, char *key);
 void resizeDict(ObjDict *dict, bool grow);
 Value searchDict(ObjDict *dict, char *key);
 char *searchDictKey(ObjDict *dict, int index);
@@ -130,6 +135,9 @@ void freeDict(ObjDict *dict);
 void freeValueArray(ValueArray *array);
 void printValue(Value value);
 char *valueToString(Value value, bool literal);
+// Text output for values, written out in chunks when the buffer has a file
+void appendValue(OutBuffer *buffer, Value value, bool literal);
+int writeValueToFile(FILE *file, Value value, bool literal);
 char *valueType(Value value);
 
 Value copyValue(Value value);
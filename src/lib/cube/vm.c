@@ -18,19 +18,24 @@
 #include "collections.h"
 #include "common.h"
 #include "compiler.h"
+#include "counters.h"
 #include "debug.h"
 #include "enums.h"
+#include "errors.h"
 #include "files.h"
 #include "gc.h"
+#include "logger.h"
 #include "memory.h"
 #include "mempool.h"
 #include "native.h"
 #include "object.h"
 #include "processes.h"
+#include "profiler.h"
 #include "scanner.h"
 #include "std.h"
 #include "strings.h"
 #include "tasks.h"
+#include "generators.h"
 #include "threads.h"
 #include "util.h"
 #include "vm.h"
@@ -39,7 +44,11 @@ VM vm; // [one]
 
 void *threadFn(void *data);
 bool hasTask(ThreadFrame *threadFrame);
+InterpretResult run();
+static void closeUpvalues(Value *last);
 static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount, ObjInstance *instance);
+static bool startGenerator(CallFrame *frame);
+static Value increment(Value start, Value step, Value stop, bool ex);
 
 #define PEEK_BYTE() (*frame->ip)
 #define READ_BYTE() (*frame->ip++)
@@ -47,8 +56,8 @@ static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount, ObjI
 #define PEEK_SHORT() ((uint16_t)((frame->ip[0] << 8) | frame->ip[1]))
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 
-#define PEEK_CONSTANT() (frame->closure->function->chunk.constants.values[PEEK_SHORT()])
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_SHORT()])
+#define PEEK_CONSTANT() (frame->constants[PEEK_SHORT()])
+#define READ_CONSTANT() (frame->constants[READ_SHORT()])
 
 #define PEEK_STRING() AS_STRING(PEEK_CONSTANT())
 #define READ_STRING() AS_STRING(READ_CONSTANT())
@@ -182,19 +191,21 @@ TaskFrame *createTaskFrame(const char *name)
     taskFrame->result = NULL_VAL;
     taskFrame->eval = false;
     taskFrame->stackTop = taskFrame->stack;
+    taskFrame->frames = (CallFrame *)mp_calloc(FRAMES_MIN, sizeof(CallFrame));
     taskFrame->frameCount = 0;
+    taskFrame->frameCapacity = FRAMES_MIN;
     taskFrame->openUpvalues = NULL;
     taskFrame->currentFrameCount = 0;
     taskFrame->startTime = 0;
     taskFrame->endTime = 0;
     taskFrame->busy = false;
     taskFrame->secure = false;
-    taskFrame->tryFrame = NULL;
     taskFrame->error = NULL;
     taskFrame->currentArgs = NULL_VAL;
     taskFrame->threadFrame = threadFrame;
     taskFrame->autoDestroy = false;
     taskFrame->unpackCount = 0;
+    taskFrame->callbackFrameCount = 0;
 
     TaskFrame *tf = threadFrame->taskFrame;
     // TaskFrame *tf = threadFrame->taskFrame;
@@ -365,24 +376,6 @@ void resumeTaskFrame(const char *name)
     }
 }
 
-static void pushTry(CallFrame *frame, uint16_t offset)
-{
-    ThreadFrame *threadFrame = currentThread();
-    TryFrame *try = (TryFrame *)mp_malloc(sizeof(TryFrame));
-    try->next = threadFrame->ctf->tryFrame;
-    try->ip = frame->ip + offset;
-    try->frame = frame;
-    threadFrame->ctf->tryFrame = try;
-}
-
-static void popTry()
-{
-    ThreadFrame *threadFrame = currentThread();
-    TryFrame *try = threadFrame->ctf->tryFrame;
-    threadFrame->ctf->tryFrame = try->next;
-    mp_free(try);
-}
-
 static void resetStack()
 {
     ThreadFrame *threadFrame = currentThread();
@@ -395,54 +388,20 @@ static void resetStack()
 void runtimeError(const char *format, ...)
 {
     ThreadFrame *threadFrame = currentThread();
-    char *str = (char *)mp_malloc(sizeof(char) * 1024);
-    str[0] = '\0';
-    for (int i = threadFrame->ctf->frameCount - 1; i >= 0; i--)
-    {
-        CallFrame *frame = &threadFrame->ctf->frames[i];
-
-        ObjFunction *function = frame->closure->function;
-
-        // -1 because the IP is sitting on the next instruction to be
-        // executed.
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        int line = getLine(&function->chunk, instruction);
-        sprintf(str + strlen(str), "[line %d] in ", line);
-
-        if (function->name == NULL)
-        {
-            sprintf(str + strlen(str), "%s: ", threadFrame->ctf->currentScriptName);
-            i = -1;
-        }
-        else
-        {
-            if (frame->module != NULL)
-            {
-                sprintf(str + strlen(str), "%s.", frame->module->name->chars);
-            }
-
-            sprintf(str + strlen(str), "%s(): ", function->name->chars);
-        }
-
-        va_list args;
-        va_start(args, format);
-        vsprintf(str + strlen(str), format, args);
-        if (i > 0)
-            sprintf(str + strlen(str), "\n");
-        va_end(args);
-    }
-
-    // sprintf(str + strlen(str), "\nThread[%d] Task[%s]", vm.id, threadFrame->ctf->name);
-    sprintf(str + strlen(str), "\nTask[%s]", threadFrame->ctf->name);
+    if (threadFrame->ctf->error != NULL)
+        freeErrorInfo(threadFrame->ctf->error);
 
-    threadFrame->ctf->error = str;
+    va_list args;
+    va_start(args, format);
+    threadFrame->ctf->error = captureError(format, args);
+    va_end(args);
 }
 
 static void defineNative(const char *name, NativeFn function, ObjModule *module)
 {
     ThreadFrame *threadFrame = currentThread();
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
+    push(OBJ_VAL(newNative(function, AS_STRING(peek(0)))));
     tableSet(&vm.globals, AS_STRING(threadFrame->ctf->stack[0]), threadFrame->ctf->stack[1]);
     if (module != NULL)
     {
@@ -455,6 +414,12 @@ static void defineNative(const char *name, NativeFn function, ObjModule *module)
 void initVM(const char *path, const char *scriptName)
 {
     vm.debug = false;
+    vm.counters = false;
+    vm.maxFrames = FRAMES_MAX;
+    vm.bench.enabled = false;
+    vm.bench.runs = 10;
+    vm.bench.warmup = 3;
+    vm.bench.output = NULL;
     vm.forceInclude = false;
     vm.ready = false;
     vm.exitCode = 0;
@@ -490,6 +455,8 @@ void initVM(const char *path, const char *scriptName)
     vm.objects = NULL;
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.classCount = 0;
+    gc_reset_stats();
 
     initTable(&vm.globals);
     initTable(&vm.strings);
@@ -538,6 +505,10 @@ void initVM(const char *path, const char *scriptName)
 void freeVM()
 {
     vm.ready = false;
+    stopProfiler();
+    clearProfile();
+    freeCounters();
+    logShutdown();
     vm.running = false;
     freeTable(&vm.globals);
     freeTable(&vm.strings);
@@ -614,6 +585,36 @@ Value peek(int distance)
     return threadFrame->ctf->stackTop[-1 - distance];
 }
 
+// Makes room for one more frame on the task. The frames move when they grow,
+// so the thread's current frame is carried over to the new array
+static bool reserveFrame(TaskFrame *ctf)
+{
+    if (ctf->frameCount >= vm.maxFrames)
+    {
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
+    if (ctf->frameCount < ctf->frameCapacity)
+        return true;
+
+    ThreadFrame *threadFrame = (ThreadFrame *)ctf->threadFrame;
+    int current = -1;
+    if (threadFrame != NULL && threadFrame->ctf == ctf && threadFrame->frame != NULL)
+        current = (int)(threadFrame->frame - ctf->frames);
+
+    int capacity = ctf->frameCapacity * 2;
+    if (capacity > vm.maxFrames)
+        capacity = vm.maxFrames;
+    ctf->frames = (CallFrame *)mp_realloc(ctf->frames, sizeof(CallFrame) * capacity);
+    memset(ctf->frames + ctf->frameCapacity, 0, sizeof(CallFrame) * (capacity - ctf->frameCapacity));
+    ctf->frameCapacity = capacity;
+
+    if (current >= 0 && current < ctf->frameCount)
+        threadFrame->frame = &ctf->frames[current];
+    return true;
+}
+
 static bool call(ObjClosure *closure, int argCount, ObjInstance *instance, ObjClass *klass)
 {
 
@@ -637,14 +638,20 @@ static bool call(ObjClosure *closure, int argCount, ObjInstance *instance, ObjCl
     }
 
     ThreadFrame *threadFrame = currentThread();
-    if (threadFrame->ctf->frameCount == FRAMES_MAX)
+    if (threadFrame->ctf->stackTop - threadFrame->ctf->stack > STACK_MAX - UINT16_COUNT)
     {
         runtimeError("Stack overflow.");
         return false;
     }
+    if (!reserveFrame(threadFrame->ctf))
+        return false;
+
+    if (vm.counters)
+        countCall(closure->function);
 
     CallFrame *frame = &(threadFrame->ctf)->frames[threadFrame->ctf->frameCount++];
     frame->closure = closure;
+    frame->constants = closure->function->chunk.constants.values;
     frame->ip = closure->function->chunk.code;
     frame->type = CALL_FRAME_TYPE_FUNCTION;
     frame->module = closure->module ? closure->module : (threadFrame->frame ? threadFrame->frame->module : NULL);
@@ -688,12 +695,15 @@ static bool call(ObjClosure *closure, int argCount, ObjInstance *instance, ObjCl
         }
     }
 
+    if (closure->function->generator)
+        return startGenerator(frame);
+
     return true;
 }
 
 static bool findField(ObjInstance *instance, ObjString *name, Value *field)
 {
-    if (!tableGet(&instance->fields, name, field))
+    if (!getInstanceField(instance, name, field))
     {
         if (!tableGet(&instance->klass->staticFields, name, field) || IS_CLOSURE(*field))
         {
@@ -704,6 +714,52 @@ static bool findField(ObjInstance *instance, ObjString *name, Value *field)
     return true;
 }
 
+// Property instructions remember the slot of the last class they saw, so a
+// field access on the same kind of object is an indexed load
+static int cachedSlot(CallFrame *frame, ObjInstance *instance, ObjString *name)
+{
+    Chunk *chunk = &frame->closure->function->chunk;
+    int offset = (int)(frame->ip - chunk->code) - 1;
+
+    if (chunk->caches == NULL)
+    {
+        chunk->caches = ALLOCATE(PropertyCache, chunk->count);
+        memset(chunk->caches, 0, sizeof(PropertyCache) * chunk->count);
+        chunk->cacheCount = chunk->count;
+    }
+
+    if (offset < 0 || offset >= chunk->cacheCount)
+        return classSlot(instance->klass, name);
+
+    PropertyCache *cache = &chunk->caches[offset];
+    if (cache->classId != instance->klass->id)
+    {
+        cache->classId = instance->klass->id;
+        cache->slot = classSlot(instance->klass, name);
+    }
+    return cache->slot;
+}
+
+static bool getCachedField(CallFrame *frame, ObjInstance *instance, ObjString *name, Value *value)
+{
+    int slot = cachedSlot(frame, instance, name);
+    if (slot >= 0 && slot < instance->slotCount)
+    {
+        *value = instance->slots[slot];
+        return true;
+    }
+    return tableGet(&instance->fields, name, value);
+}
+
+static void setCachedField(CallFrame *frame, ObjInstance *instance, ObjString *name, Value value)
+{
+    int slot = cachedSlot(frame, instance, name);
+    if (slot >= 0 && slot < instance->slotCount)
+        instance->slots[slot] = value;
+    else
+        tableSet(&instance->fields, name, value);
+}
+
 static bool findClassField(ObjClass *klass, ObjString *name, Value *field)
 {
     if (!tableGet(&klass->staticFields, name, field))
@@ -776,8 +832,13 @@ static bool callValue(Value callee, int argCount, ObjInstance *instance, ObjClas
                 return call(AS_CLOSURE(callee), argCount, instance, klass);
 
             case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, threadFrame->ctf->stackTop - argCount);
+                ObjNative *native = (ObjNative *)AS_OBJ(callee);
+                uint64_t start = vm.counters ? cube_clock() : 0;
+                Value result = native->function(argCount, threadFrame->ctf->stackTop - argCount);
+                if (profileTick)
+                    sampleProfile(threadFrame->ctf, native->name);
+                if (vm.counters && start > 0)
+                    countNative(&native->counter, NULL, native->name, cube_clock() - start);
                 if (IS_REQUEST(result))
                 {
                     ObjRequest *request = AS_REQUEST(result);
@@ -785,6 +846,10 @@ static bool callValue(Value callee, int argCount, ObjInstance *instance, ObjClas
                     ObjInstance *ins = AS_INSTANCE(*(threadFrame->ctf->stackTop - argCount));
                     if (ins != NULL)
                         instance = ins;
+                    // Drop the native and the popped arguments so the result lands in the native's slot
+                    Value *base = threadFrame->ctf->stackTop - argCount - 1;
+                    memmove(base, base + request->pops, sizeof(Value) * (argCount + 1 - request->pops));
+                    threadFrame->ctf->stackTop -= request->pops;
                     return callValue(request->fn, argCount - request->pops, instance, klass);
                 }
                 else
@@ -797,7 +862,16 @@ static bool callValue(Value callee, int argCount, ObjInstance *instance, ObjClas
 
             case OBJ_NATIVE_FUNC: {
                 ObjNativeFunc *func = AS_NATIVE_FUNC(callee);
+                uint64_t start = vm.counters ? cube_clock() : 0;
                 Value result = callNative(func, argCount, threadFrame->ctf->stackTop - argCount);
+                if (profileTick)
+                    sampleProfile(threadFrame->ctf, func->name);
+                if (vm.counters && start > 0)
+                    countNative(&func->counter, func->lib != NULL ? func->lib->name : NULL, func->name,
+                                cube_clock() - start);
+                // A library that fails to load raises an error the caller must handle
+                if (threadFrame->ctf->error != NULL)
+                    return false;
                 threadFrame->ctf->stackTop -= argCount + 1;
                 push(result);
                 return true;
@@ -835,6 +909,320 @@ static bool callValue(Value callee, int argCount, ObjInstance *instance, ObjClas
     return false;
 }
 
+// Calls a value from native code and runs it until it returns.
+// The current task is kept secure while the callee runs, so no other task
+// is scheduled in the middle of the native that requested the call.
+bool callFunction(Value callee, int argCount, Value *args, Value *result)
+{
+    ThreadFrame *threadFrame = currentThread();
+    TaskFrame *ctf = threadFrame->ctf;
+    // An index, as the frames may be reallocated by the callee
+    int callerFrame = threadFrame->frame != NULL ? (int)(threadFrame->frame - ctf->frames) : -1;
+    Value *stackTop = ctf->stackTop;
+    Value currentArgs = ctf->currentArgs;
+    int frameCount = ctf->frameCount;
+    int callbackFrameCount = ctf->callbackFrameCount;
+    bool secure = ctf->secure;
+
+    push(callee);
+    for (int i = 0; i < argCount; i++)
+        push(args[i]);
+
+    ObjInstance *instance = NULL;
+    if (IS_BOUND_METHOD(callee) && IS_INSTANCE(AS_BOUND_METHOD(callee)->receiver))
+        instance = AS_INSTANCE(AS_BOUND_METHOD(callee)->receiver);
+
+    if (!callValue(callee, argCount, instance, NULL))
+    {
+        ctf->stackTop = stackTop;
+        return false;
+    }
+
+    bool ok = true;
+    if (ctf->frameCount > frameCount)
+    {
+        ctf->callbackFrameCount = frameCount;
+        ctf->secure = true;
+
+        InterpretResult rc = run();
+
+        ctf->secure = secure;
+        ctf->callbackFrameCount = callbackFrameCount;
+        threadFrame->frame = callerFrame >= 0 ? &ctf->frames[callerFrame] : NULL;
+
+        if (rc != INTERPRET_OK || ctf->frameCount > frameCount)
+        {
+            closeUpvalues(stackTop);
+            ctf->frameCount = frameCount;
+            ok = false;
+        }
+    }
+
+    if (ctf->error != NULL)
+        ok = false;
+
+    if (ok)
+        *result = pop();
+    ctf->stackTop = stackTop;
+    ctf->currentArgs = currentArgs;
+    return ok;
+}
+
+// Generators run on a private task frame that is not scheduled, so
+// suspending one keeps its frame and stack intact until it is resumed
+static bool startGenerator(CallFrame *frame)
+{
+    ThreadFrame *threadFrame = currentThread();
+    TaskFrame *ctf = threadFrame->ctf;
+
+    TaskFrame *task = (TaskFrame *)mp_calloc(1, sizeof(TaskFrame));
+    if (task == NULL)
+    {
+        ctf->frameCount--;
+        runtimeError("Could not allocate the generator.");
+        return false;
+    }
+
+    task->name = (char *)mp_malloc(sizeof(char) * 10);
+    strcpy(task->name, "generator");
+    task->result = NULL_VAL;
+    task->currentArgs = ctf->currentArgs;
+    task->currentScriptName = ctf->currentScriptName;
+    task->currentFrameCount = -1;
+    task->threadFrame = threadFrame;
+    task->secure = true;
+    task->generator = true;
+
+    int count = ctf->stackTop - frame->slots;
+    memcpy(task->stack, frame->slots, sizeof(Value) * count);
+    task->stackTop = task->stack + count;
+    task->frames = (CallFrame *)mp_calloc(FRAMES_MIN, sizeof(CallFrame));
+    task->frameCapacity = FRAMES_MIN;
+    task->frames[0] = *frame;
+    task->frames[0].slots = task->stack;
+    task->frameCount = 1;
+
+    ctf->frameCount--;
+    ctf->stackTop = frame->slots;
+
+    ObjGenerator *generator = newGenerator(GENERATOR_FUNCTION);
+    generator->task = task;
+    push(OBJ_VAL(generator));
+    return true;
+}
+
+void freeGenerator(ObjGenerator *generator)
+{
+    TaskFrame *task = (TaskFrame *)generator->task;
+    if (task == NULL)
+        return;
+
+    while (task->openUpvalues != NULL)
+    {
+        ObjUpvalue *upvalue = task->openUpvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        task->openUpvalues = upvalue->next;
+    }
+
+    if (task->error != NULL)
+        freeErrorInfo(task->error);
+    mp_free(task->frames);
+    mp_free(task->name);
+    mp_free(task);
+    generator->task = NULL;
+}
+
+static bool resumeGenerator(ObjGenerator *generator, bool *produced)
+{
+    TaskFrame *task = (TaskFrame *)generator->task;
+    ThreadFrame *threadFrame = currentThread();
+    TaskFrame *caller = threadFrame->ctf;
+    CallFrame *callerFrame = threadFrame->frame;
+
+    if (caller == task)
+    {
+        runtimeError("Generator is already running.");
+        return false;
+    }
+
+    threadFrame->ctf = task;
+    threadFrame->frame = &task->frames[task->frameCount - 1];
+
+    InterpretResult rc = run();
+
+    threadFrame->ctf = caller;
+    threadFrame->frame = callerFrame;
+
+    if (rc != INTERPRET_OK || task->error != NULL)
+    {
+        // Hand the error over so the caller's try/catch can handle it
+        if (task->error != NULL)
+        {
+            caller->error = task->error;
+            task->error = NULL;
+        }
+        else
+            runtimeError("Generator failed.");
+        generator->done = true;
+        generator->current = NULL_VAL;
+        freeGenerator(generator);
+        return false;
+    }
+
+    if (task->finished)
+    {
+        generator->done = true;
+        generator->current = NULL_VAL;
+        freeGenerator(generator);
+        *produced = false;
+        return true;
+    }
+
+    generator->current = task->result;
+    *produced = true;
+    return true;
+}
+
+static bool nextLine(ObjGenerator *generator, bool *produced)
+{
+    ObjFile *file = generator->file;
+    if (!file->isOpen || !FILE_CAN_READ(file))
+    {
+        runtimeError("File is not readable!");
+        return false;
+    }
+
+    int size = 128;
+    int length = 0;
+    char *line = (char *)mp_malloc(sizeof(char) * size);
+    int c;
+    while ((c = fgetc(file->file)) != EOF)
+    {
+        if (length + 1 >= size)
+        {
+            size *= 2;
+            line = (char *)mp_realloc(line, sizeof(char) * size);
+        }
+        if (c == '\n')
+            break;
+        line[length++] = c;
+    }
+
+    if (c == EOF && length == 0)
+    {
+        mp_free(line);
+        generator->done = true;
+        generator->current = NULL_VAL;
+        *produced = false;
+        return true;
+    }
+
+    if (length > 0 && line[length - 1] == '\r')
+        length--;
+    generator->current = OBJ_VAL(copyString(line, length));
+    mp_free(line);
+    *produced = true;
+    return true;
+}
+
+bool nextGenerator(ObjGenerator *generator, bool *produced)
+{
+    *produced = false;
+    if (generator->done)
+        return true;
+
+    switch (generator->type)
+    {
+        case GENERATOR_FUNCTION:
+            return resumeGenerator(generator, produced);
+
+        case GENERATOR_RANGE:
+            if (IS_NULL(generator->start))
+            {
+                generator->done = true;
+                generator->current = NULL_VAL;
+                return true;
+            }
+            generator->current = generator->start;
+            generator->start = increment(generator->start, generator->step, generator->stop, generator->exclusive);
+            *produced = true;
+            return true;
+
+        case GENERATOR_LINES:
+            return nextLine(generator, produced);
+    }
+
+    return true;
+}
+
+static bool iterate(Value container, Value indexValue, bool *has)
+{
+    if (IS_GENERATOR(container))
+        return nextGenerator(AS_GENERATOR(container), has);
+
+    if (!IS_NUMBER(indexValue))
+    {
+        runtimeError("Iteration index must be a number.");
+        return false;
+    }
+
+    double index = AS_NUMBER(indexValue);
+    double length;
+    if (IS_LIST(container))
+        length = AS_LIST(container)->values.count;
+    else if (IS_STRING(container))
+        length = AS_STRING(container)->length;
+    else if (IS_DICT(container))
+        length = AS_DICT(container)->count;
+    else if (IS_SET(container))
+        length = AS_SET(container)->values.count;
+    else if (IS_BYTES(container))
+        length = AS_BYTES(container)->length;
+    else if (IS_ENUM(container))
+        length = AS_ENUM(container)->members.count;
+    else if (IS_INSTANCE(container) || IS_CLASS(container))
+    {
+        // User sequences keep the len() and [] protocol
+        Value method;
+        ObjString *name = AS_STRING(STRING_VAL("len"));
+        Value callee = NULL_VAL;
+        if (IS_INSTANCE(container))
+        {
+            ObjInstance *instance = AS_INSTANCE(container);
+            if (tableGet(&instance->klass->methods, name, &method))
+                callee = OBJ_VAL(newBoundMethod(container, AS_CLOSURE(method)));
+            else if (tableGet(&instance->klass->staticFields, name, &method))
+                callee = method;
+        }
+        else if (tableGet(&AS_CLASS(container)->staticFields, name, &method))
+            callee = method;
+
+        if (IS_NULL(callee))
+            length = 1;
+        else
+        {
+            Value result;
+            if (!callFunction(callee, 0, NULL, &result))
+                return false;
+            if (!IS_NUMBER(result))
+            {
+                runtimeError("len() must return a number.");
+                return false;
+            }
+            length = AS_NUMBER(result);
+        }
+    }
+    else if (IS_NULL(container))
+        length = 0;
+    else
+        // Same as len(): a single value iterates once
+        length = 1;
+
+    *has = index < length;
+    return true;
+}
+
 static bool hasExtension(Value receiver, ObjString *name)
 {
     char *typeStr = valueType(receiver);
@@ -902,6 +1290,47 @@ static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount, ObjI
     return call(AS_CLOSURE(method), argCount, instance, selected);
 }
 
+typedef bool (*MethodsFn)(char *method, int argCount);
+
+// Methods of the builtin types, implemented in C
+static MethodsFn builtinMethods(Value receiver)
+{
+    if (!IS_OBJ(receiver))
+        return NULL;
+
+    switch (OBJ_TYPE(receiver))
+    {
+        case OBJ_LIST:
+            return listMethods;
+        case OBJ_DICT:
+            return dictMethods;
+        case OBJ_SET:
+            return setMethods;
+        case OBJ_STRING:
+            return stringMethods;
+        case OBJ_BYTES:
+            return bytesMethods;
+        case OBJ_FILE:
+            return fileMethods;
+        case OBJ_PROCESS:
+            return processesMethods;
+        case OBJ_ENUM:
+            return enumMethods;
+        case OBJ_ENUM_VALUE:
+            return enumValueMethods;
+        case OBJ_NATIVE_LIB:
+            return nativeLibMethods;
+        case OBJ_TASK:
+            return taskMethods;
+        case OBJ_GENERATOR:
+            return generatorMethods;
+        case OBJ_ERROR:
+            return errorMethods;
+        default:
+            return NULL;
+    }
+}
+
 static bool invoke(ObjString *name, int argCount)
 {
     Value receiver = peek(argCount);
@@ -928,26 +1357,19 @@ static bool invoke(ObjString *name, int argCount)
     }
     else if (hasExtension(receiver, name))
         return callExtension(receiver, name, argCount);
-    else if (IS_LIST(receiver))
-        return listMethods(name->chars, argCount + 1);
-    else if (IS_DICT(receiver))
-        return dictMethods(name->chars, argCount + 1);
-    else if (IS_STRING(receiver))
-        return stringMethods(name->chars, argCount + 1);
-    else if (IS_BYTES(receiver))
-        return bytesMethods(name->chars, argCount + 1);
-    else if (IS_FILE(receiver))
-        return fileMethods(name->chars, argCount + 1);
-    else if (IS_PROCESS(receiver))
-        return processesMethods(name->chars, argCount + 1);
-    else if (IS_ENUM(receiver))
-        return enumMethods(name->chars, argCount + 1);
-    else if (IS_ENUM_VALUE(receiver))
-        return enumValueMethods(name->chars, argCount + 1);
-    else if (IS_NATIVE_LIB(receiver))
-        return nativeLibMethods(name->chars, argCount + 1);
-    else if (IS_TASK(receiver))
-        return taskMethods(name->chars, argCount + 1);
+
+    MethodsFn methods = builtinMethods(receiver);
+    if (methods != NULL)
+    {
+        if (!vm.counters)
+            return methods(name->chars, argCount + 1);
+
+        ObjType type = OBJ_TYPE(receiver);
+        uint64_t start = cube_clock();
+        bool result = methods(name->chars, argCount + 1);
+        countMethod(type, name, cube_clock() - start);
+        return result;
+    }
 
     if (!IS_INSTANCE(receiver))
     {
@@ -959,7 +1381,7 @@ static bool invoke(ObjString *name, int argCount)
 
     // First look for a field which may shadow a method.
     Value value;
-    if (tableGet(&instance->fields, name, &value))
+    if (getInstanceField(instance, name, &value))
     {
         ThreadFrame *threadFrame = currentThread();
         threadFrame->ctf->stackTop[-argCount - 1] = value;
@@ -980,11 +1402,16 @@ static bool bindMethod(ObjClass *klass, ObjString *name)
     //     return false;
     // }
 
+    // Inherited methods bind as well
     Value method;
-    if (!tableGet(&klass->methods, name, &method))
+    while (!tableGet(&klass->methods, name, &method))
     {
-        runtimeError("Undefined property (bind) '%s'.", name->chars);
-        return false;
+        klass = klass->super;
+        if (klass == NULL)
+        {
+            runtimeError("Undefined property (bind) '%s'.", name->chars);
+            return false;
+        }
     }
 
     ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
@@ -1058,7 +1485,7 @@ static bool instanceContains(Value container, Value item, Value *result)
     ObjString *name = AS_STRING(item);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value))
+    if (getInstanceField(instance, name, &value))
     {
         *result = TRUE_VAL;
         return true;
@@ -1097,6 +1524,16 @@ static ObjUpvalue *captureUpvalue(Value *local)
     return createdUpvalue;
 }
 
+// Captures a local that is never reassigned: the upvalue is born closed, so
+// it skips the open list and needs no OP_CLOSE_UPVALUE
+static ObjUpvalue *captureValue(Value value)
+{
+    ObjUpvalue *upvalue = newUpvalue(NULL);
+    upvalue->closed = value;
+    upvalue->location = &upvalue->closed;
+    return upvalue;
+}
+
 static void closeUpvalues(Value *last)
 {
     ThreadFrame *threadFrame = currentThread();
@@ -1109,34 +1546,60 @@ static void closeUpvalues(Value *last)
     }
 }
 
+// Finds the innermost try block around the instruction each frame is
+// executing, from the top of the stack down to the frame 'limit'
+static int findTry(TaskFrame *ctf, int limit, int *handler)
+{
+    for (int i = ctf->frameCount - 1; i >= limit; i--)
+    {
+        CallFrame *frame = &ctf->frames[i];
+        Chunk *chunk = &frame->closure->function->chunk;
+        int instruction = (int)(frame->ip - chunk->code - 1);
+        for (int j = 0; j < chunk->tryCount; j++)
+        {
+            TryRegion *region = &chunk->tries[j];
+            if (instruction >= region->start && instruction < region->end)
+            {
+                *handler = region->handler;
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
 static bool checkTry(CallFrame *frame)
 {
     ThreadFrame *threadFrame = currentThread();
-    if (threadFrame->ctf->tryFrame != NULL)
-    {
-        uint8_t *ip = threadFrame->ctf->tryFrame->ip;
-        CallFrame *savedFrame = threadFrame->ctf->tryFrame->frame;
-        popTry();
+    TaskFrame *ctf = threadFrame->ctf;
+
+    // Errors raised inside a native callback are only handled here if the
+    // callback has its own try, otherwise they unwind back to the native.
+    int handler;
+    int target = findTry(ctf, ctf->callbackFrameCount, &handler);
+    if (target < 0 && (ctf->callbackFrameCount > 0 || ctf->generator))
+        return false;
 
-        while (savedFrame != frame)
+    if (target >= 0)
+    {
+        frame = &ctf->frames[ctf->frameCount - 1];
+        while (ctf->frameCount - 1 > target)
         {
-            // CallFrame *frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
-            // threadFrame->frame = frame;
             closeUpvalues(frame->slots);
-            threadFrame->ctf->frameCount--;
+            ctf->frameCount--;
 
-            if (threadFrame->ctf->frameCount == threadFrame->ctf->currentFrameCount)
+            if (ctf->frameCount == ctf->currentFrameCount)
             {
-                threadFrame->ctf->currentScriptName = vm.scriptName;
-                threadFrame->ctf->currentFrameCount = -1;
+                ctf->currentScriptName = vm.scriptName;
+                ctf->currentFrameCount = -1;
             }
 
-            threadFrame->ctf->stackTop = frame->slots;
+            ctf->stackTop = frame->slots;
 
-            frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
+            frame = &ctf->frames[ctf->frameCount - 1];
         }
 
-        frame->ip = ip;
+        frame->ip = frame->closure->function->chunk.code + handler;
 
         bool hasCatch = READ_BYTE() == OP_TRUE;
 
@@ -1148,9 +1611,13 @@ static bool checkTry(CallFrame *frame)
             push(OBJ_VAL(closure));
             for (int i = 0; i < closure->upvalueCount; i++)
             {
-                uint8_t isLocal = READ_BYTE();
+                uint8_t kind = READ_BYTE();
                 uint16_t index = READ_SHORT();
-                if (isLocal)
+                if (kind == CAPTURE_VALUE)
+                {
+                    closure->upvalues[i] = captureValue(frame->slots[index]);
+                }
+                else if (kind == CAPTURE_LOCAL)
                 {
                     closure->upvalues[i] = captureUpvalue(frame->slots + index);
                 }
@@ -1160,21 +1627,24 @@ static bool checkTry(CallFrame *frame)
                 }
             }
 
-            push(STRING_VAL(threadFrame->ctf->error));
+            // The error object owns the captured stack and renders it on demand
+            push(OBJ_VAL(newError(ctf->error)));
         }
+        else
+            freeErrorInfo(ctf->error);
 
-        mp_free(threadFrame->ctf->error);
-        threadFrame->ctf->error = NULL;
+        ctf->error = NULL;
 
         return true;
     }
     else
     {
         resetStack();
-        fputs(threadFrame->ctf->error, stderr);
+        fflush(stdout);
+        fputs(errorTrace(ctf->error), stderr);
         fputs("\n", stderr);
-        mp_free(threadFrame->ctf->error);
-        threadFrame->ctf->error = NULL;
+        freeErrorInfo(ctf->error);
+        ctf->error = NULL;
         vm.repl = NULL_VAL;
         vm.print = true;
     }
@@ -1205,7 +1675,7 @@ static void defineProperty(ObjString *name)
         if (isStatic)
             tableSet(&klass->staticFields, name, value);
         else
-            tableSet(&klass->fields, name, value);
+            updateClassField(klass, name, value);
     }
     else if (IS_ENUM(peek(1)))
     {
@@ -1838,6 +2308,29 @@ bool subscriptDict(Value dictValue, Value indexValue, Value *result)
     return true;
 }
 
+bool subscriptSet(Value setValue, Value indexValue, Value *result)
+{
+    if (!IS_NUMBER(indexValue))
+    {
+        runtimeError("Set index must be a number.");
+        return false;
+    }
+
+    ObjSet *set = AS_SET(setValue);
+    int index = AS_NUMBER(indexValue);
+
+    if (index < 0)
+        index = set->values.count + index;
+    if (index >= 0 && index < set->values.count)
+    {
+        *result = set->values.values[index];
+        return true;
+    }
+
+    runtimeError("Set index out of bounds.");
+    return false;
+}
+
 bool subscriptEnum(Value enumValue, Value indexValue, Value *result)
 {
     if (!IS_STRING(indexValue) && !IS_NUMBER(indexValue))
@@ -1933,6 +2426,15 @@ bool subscript(Value container, Value indexValue, Value *result)
     {
         return subscriptDict(container, indexValue, result);
     }
+    else if (IS_SET(container))
+    {
+        return subscriptSet(container, indexValue, result);
+    }
+    else if (IS_GENERATOR(container))
+    {
+        *result = AS_GENERATOR(container)->current;
+        return true;
+    }
     else if (IS_ENUM(container))
     {
         return subscriptEnum(container, indexValue, result);
@@ -2398,6 +2900,7 @@ next:
     {
         TaskFrame *task = threadFrame->ctf;
         threadFrame->ctf = threadFrame->ctf->next;
+        mp_free(task->frames);
         mp_free(task->name);
         mp_free(task);
     }
@@ -2472,6 +2975,9 @@ analyse:
 
 InterpretResult checkContinue(ThreadFrame **threadFrame, CallFrame **frame)
 {
+    if (profileTick)
+        sampleProfile((*threadFrame)->ctf, NULL);
+
     if (!vm.running)
     {
         return INTERPRET_OK;
@@ -2491,6 +2997,10 @@ InterpretResult checkContinue(ThreadFrame **threadFrame, CallFrame **frame)
     {
         if (!checkTry(*frame))
             return INTERPRET_RUNTIME_ERROR;
+
+        // The catch may be in a caller of the frame that raised the error
+        *frame = &(*threadFrame)->ctf->frames[(*threadFrame)->ctf->frameCount - 1];
+        (*threadFrame)->frame = *frame;
     }
 
     if (vm.debug)
@@ -2513,6 +3023,9 @@ InterpretResult checkContinue(ThreadFrame **threadFrame, CallFrame **frame)
         }
     }
 
+    if (vm.counters)
+        countInstruction(*frame);
+
 #ifdef DEBUG_TRACE_EXECUTION
     {
         printf("Thread: %d, Task: %s\n", (*threadFrame)->id, (*threadFrame)->ctf->name);
@@ -2532,9 +3045,49 @@ InterpretResult checkContinue(ThreadFrame **threadFrame, CallFrame **frame)
     return INTERPRET_CONTINUE;
 }
 
+// Operators are only overloaded on instances, so the common case is decided
+// without leaving the loop
+#define INSTANCE_OPERATION(op) (IS_INSTANCE(peek(1)) && instanceOperation(op))
+#define INSTANCE_OPERATION_AT(op, caller) (IS_INSTANCE(caller) && instanceOperationAt(op, caller))
+#define INSTANCE_OPERATION_UNARY(op) (IS_INSTANCE(peek(0)) && instanceOperationUnary(op))
+
+// Cheap check done before every instruction: with a single runnable task, no
+// pending error and no debugger the scheduler has nothing to do, so only the
+// current frame needs refreshing
+static inline bool canSkipScheduler(ThreadFrame *threadFrame, CallFrame **frame)
+{
+    TaskFrame *ctf = threadFrame->ctf;
+    if (!vm.running || vm.debug || vm.counters || vm.skipWaitingTasks || profileTick || ctf->error != NULL ||
+        ctf->endTime > 0 || ctf->finished || ctf->aborted || ctf->busy)
+        return false;
+
+    if (!ctf->secure && (ctf != threadFrame->taskFrame || ctf->next != NULL))
+        return false;
+
+#ifdef DEBUG_TRACE_EXECUTION
+    return false;
+#endif
+
+    *frame = &ctf->frames[ctf->frameCount - 1];
+    threadFrame->frame = *frame;
+    return true;
+}
+
+// 'return f(x)' reuses the frame of a plain function when the callee is a
+// closure, any other call is made normally and returned by OP_RETURN
+static inline bool canTailCall(TaskFrame *ctf, CallFrame *frame, Value callee)
+{
+    if (!IS_CLOSURE(callee) || ctf->eval)
+        return false;
+
+    ObjClosure *closure = AS_CLOSURE(callee);
+    return closure->instance == NULL && !closure->function->generator && !frame->closure->function->generator &&
+           frame->type == CALL_FRAME_TYPE_FUNCTION && !frame->require && frame->nextModule == NULL;
+}
+
 InterpretResult run()
 {
-    ThreadFrame *threadFrame;
+    ThreadFrame *threadFrame = currentThread();
     CallFrame *frame;
     InterpretResult loopResult;
     uint8_t instruction;
@@ -2551,9 +3104,12 @@ InterpretResult run()
 #define DISPATCH()                                                                                                     \
     do                                                                                                                 \
     {                                                                                                                  \
-        loopResult = checkContinue(&threadFrame, &frame);                                                              \
-        if (loopResult != INTERPRET_CONTINUE)                                                                          \
-            return loopResult;                                                                                         \
+        if (!canSkipScheduler(threadFrame, &frame))                                                                    \
+        {                                                                                                              \
+            loopResult = checkContinue(&threadFrame, &frame);                                                          \
+            if (loopResult != INTERPRET_CONTINUE)                                                                      \
+                return loopResult;                                                                                     \
+        }                                                                                                              \
         goto *dispatchTable[instruction = READ_BYTE()];                                                                \
     } while (false)
 #define INTERPRET_LOOP DISPATCH();
@@ -2564,9 +3120,12 @@ InterpretResult run()
 #define DISPATCH() goto loop
 #define INTERPRET_LOOP                                                                                                 \
     loop:                                                                                                              \
-    loopResult = checkContinue(&threadFrame, &frame);                                                                  \
-    if (loopResult != INTERPRET_CONTINUE)                                                                              \
-        return loopResult;                                                                                             \
+    if (!canSkipScheduler(threadFrame, &frame))                                                                        \
+    {                                                                                                                  \
+        loopResult = checkContinue(&threadFrame, &frame);                                                              \
+        if (loopResult != INTERPRET_CONTINUE)                                                                          \
+            return loopResult;                                                                                         \
+    }                                                                                                                  \
     switch (instruction = READ_BYTE())
 
 #endif
@@ -2625,7 +3184,7 @@ InterpretResult run()
                     I = i + strlen(find);
                     l = L - I;
                     M = L - strlen(find) + paste->length;
-                    memcpy(str + i + paste->length, str + I, l);
+                    memmove(str + i + paste->length, str + I, l);
                     memcpy(str + i, paste->chars, paste->length);
                     str[M] = '\0';
 
@@ -2711,6 +3270,76 @@ InterpretResult run()
 
                 DISPATCH();
             }
+            OPCASE(RANGE) :
+            {
+                Value ex = pop();
+                Value stop = pop();
+                Value step = pop();
+                Value start = pop();
+
+                if (IS_NULL(stop))
+                {
+                    stop = step;
+                    step = NULL_VAL;
+                }
+
+                if (IS_NULL(step))
+                {
+                    step = getIncrement(start, stop);
+                }
+
+                if (!IS_INCREMENTAL(start) || !IS_INCREMENTAL(stop) || !IS_INCREMENTAL(step))
+                {
+                    runtimeError("Can only expand numbers and characters.");
+                    if (!checkTry(frame))
+                        return INTERPRET_RUNTIME_ERROR;
+                    else
+                        DISPATCH();
+                }
+
+                ObjGenerator *generator = newGenerator(GENERATOR_RANGE);
+                generator->start = start;
+                generator->step = step;
+                generator->stop = stop;
+                generator->exclusive = AS_BOOL(ex);
+                push(OBJ_VAL(generator));
+                DISPATCH();
+            }
+
+            OPCASE(ITER) :
+            {
+                Value index = pop();
+                Value container = pop();
+                bool has = false;
+                if (!iterate(container, index, &has))
+                {
+                    if (!checkTry(frame))
+                        return INTERPRET_RUNTIME_ERROR;
+                    else
+                        DISPATCH();
+                }
+                frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
+                push(BOOL_VAL(has));
+                DISPATCH();
+            }
+
+            OPCASE(YIELD) :
+            {
+                if (!threadFrame->ctf->generator || threadFrame->ctf->frameCount != 1)
+                {
+                    runtimeError("Can only yield inside a generator.");
+                    if (!checkTry(frame))
+                        return INTERPRET_RUNTIME_ERROR;
+                    else
+                        DISPATCH();
+                }
+
+                threadFrame->ctf->result = pop();
+                // Value of the yield expression once the generator is resumed
+                push(NULL_VAL);
+                return INTERPRET_OK;
+            }
+
             OPCASE(POP) : pop();
             DISPATCH();
 
@@ -2733,7 +3362,7 @@ InterpretResult run()
             OPCASE(SET_LOCAL) :
             {
                 uint16_t slot = READ_SHORT();
-                if (instanceOperationAt("=", frame->slots[slot]))
+                if (INSTANCE_OPERATION_AT("=", frame->slots[slot]))
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 else
                     frame->slots[slot] = peek(0);
@@ -2850,9 +3479,9 @@ InterpretResult run()
                 if (frame->instance != NULL)
                 {
                     Value value;
-                    if (tableGet(&frame->instance->fields, name, &value))
+                    if (getInstanceField(frame->instance, name, &value))
                     {
-                        tableSet(&frame->instance->fields, name, peek(0));
+                        setInstanceField(frame->instance, name, peek(0));
                         DISPATCH();
                     }
                     else if (tableGet(&frame->instance->klass->staticFields, name, &value))
@@ -3001,13 +3630,32 @@ InterpretResult run()
                     ObjInstance *instance = AS_INSTANCE(peek(0));
                     ObjString *name = READ_STRING();
                     Value value;
-                    if (tableGet(&instance->fields, name, &value))
+                    if (getCachedField(frame, instance, name, &value))
                     {
                         pop(); // Instance.
                         push(value);
                         DISPATCH();
                     }
 
+                    // Classes with a '.' method compute the fields they do not have
+                    Value method;
+                    ObjClass *selected;
+                    ObjString *dot = AS_STRING(STRING_VAL("."));
+                    if (!findMethod(instance->klass, name, &method, &selected) &&
+                        findMethod(instance->klass, dot, &method, &selected))
+                    {
+                        push(OBJ_VAL(name));
+                        if (!invokeFromClass(selected, dot, 1, instance))
+                        {
+                            if (!checkTry(frame))
+                                return INTERPRET_RUNTIME_ERROR;
+                            else
+                                DISPATCH();
+                        }
+                        frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
+                        DISPATCH();
+                    }
+
                     if (!bindMethod(instance->klass, name))
                     {
                         if (!checkTry(frame))
@@ -3069,7 +3717,7 @@ InterpretResult run()
                     ObjInstance *instance = AS_INSTANCE(peek(0));
                     ObjString *name = READ_STRING();
                     Value value;
-                    if (tableGet(&instance->fields, name, &value))
+                    if (getCachedField(frame, instance, name, &value))
                     {
                         push(value);
                         DISPATCH();
@@ -3144,7 +3792,7 @@ InterpretResult run()
                 else
                 {
                     ObjInstance *instance = AS_INSTANCE(peek(1));
-                    tableSet(&instance->fields, READ_STRING(), peek(0));
+                    setCachedField(frame, instance, READ_STRING(), peek(0));
                 }
 
                 Value value = pop();
@@ -3172,7 +3820,7 @@ InterpretResult run()
 
             OPCASE(EQUAL) :
             {
-                if (instanceOperation("=="))
+                if (INSTANCE_OPERATION("=="))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3188,7 +3836,7 @@ InterpretResult run()
 
             OPCASE(NOT_EQUAL) :
             {
-                if (instanceOperation("!="))
+                if (INSTANCE_OPERATION("!="))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3204,7 +3852,7 @@ InterpretResult run()
 
             OPCASE(GREATER) :
             {
-                if (instanceOperation(">"))
+                if (INSTANCE_OPERATION(">"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3216,7 +3864,7 @@ InterpretResult run()
             }
             OPCASE(GREATER_EQUAL) :
             {
-                if (instanceOperation(">="))
+                if (INSTANCE_OPERATION(">="))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3228,7 +3876,7 @@ InterpretResult run()
             }
             OPCASE(LESS) :
             {
-                if (instanceOperation("<"))
+                if (INSTANCE_OPERATION("<"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3240,7 +3888,7 @@ InterpretResult run()
             }
             OPCASE(LESS_EQUAL) :
             {
-                if (instanceOperation("<="))
+                if (INSTANCE_OPERATION("<="))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3340,11 +3988,11 @@ InterpretResult run()
                 }
                 else
                 {
-                    if (istrue && instanceOperation(".+"))
+                    if (istrue && INSTANCE_OPERATION(".+"))
                     {
                         frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                     }
-                    else if (instanceOperation("+"))
+                    else if (INSTANCE_OPERATION("+"))
                     {
                         frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                     }
@@ -3363,11 +4011,11 @@ InterpretResult run()
             OPCASE(SUBTRACT) :
             {
                 istrue = READ_BYTE() == OP_TRUE;
-                if (istrue && instanceOperation(".-"))
+                if (istrue && INSTANCE_OPERATION(".-"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
-                else if (instanceOperation("-"))
+                else if (INSTANCE_OPERATION("-"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3439,7 +4087,7 @@ InterpretResult run()
             }
             OPCASE(INC) :
             {
-                if (instanceOperationUnary("++"))
+                if (INSTANCE_OPERATION_UNARY("++"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3460,7 +4108,7 @@ InterpretResult run()
             }
             OPCASE(DEC) :
             {
-                if (instanceOperationUnary("--"))
+                if (INSTANCE_OPERATION_UNARY("--"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3482,11 +4130,11 @@ InterpretResult run()
             OPCASE(MULTIPLY) :
             {
                 istrue = READ_BYTE() == OP_TRUE;
-                if (istrue && instanceOperation(".*"))
+                if (istrue && INSTANCE_OPERATION(".*"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
-                else if (instanceOperation("*"))
+                else if (INSTANCE_OPERATION("*"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3602,11 +4250,11 @@ InterpretResult run()
             OPCASE(DIVIDE) :
             {
                 istrue = READ_BYTE() == OP_TRUE;
-                if (istrue && instanceOperation("./"))
+                if (istrue && INSTANCE_OPERATION("./"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
-                else if (instanceOperation("/"))
+                else if (INSTANCE_OPERATION("/"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3737,11 +4385,11 @@ InterpretResult run()
             OPCASE(MOD) :
             {
                 istrue = READ_BYTE() == OP_TRUE;
-                if (istrue && instanceOperation(".%"))
+                if (istrue && INSTANCE_OPERATION(".%"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
-                else if (instanceOperation("%"))
+                else if (INSTANCE_OPERATION("%"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3805,11 +4453,11 @@ InterpretResult run()
             OPCASE(POW) :
             {
                 istrue = READ_BYTE() == OP_TRUE;
-                if (istrue && instanceOperation(".^"))
+                if (istrue && INSTANCE_OPERATION(".^"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
-                else if (instanceOperation("^"))
+                else if (INSTANCE_OPERATION("^"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3872,7 +4520,7 @@ InterpretResult run()
 
             OPCASE(SHIFT_LEFT) :
             {
-                if (instanceOperation("<<"))
+                if (INSTANCE_OPERATION("<<"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3887,7 +4535,7 @@ InterpretResult run()
 
             OPCASE(SHIFT_RIGHT) :
             {
-                if (instanceOperation(">>"))
+                if (INSTANCE_OPERATION(">>"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3902,7 +4550,7 @@ InterpretResult run()
 
             OPCASE(BINARY_AND) :
             {
-                if (instanceOperation("&"))
+                if (INSTANCE_OPERATION("&"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3926,7 +4574,7 @@ InterpretResult run()
 
             OPCASE(BINARY_OR) :
             {
-                if (instanceOperation("|"))
+                if (INSTANCE_OPERATION("|"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3950,7 +4598,7 @@ InterpretResult run()
 
             OPCASE(UNARY_NOT) :
             {
-                if (instanceOperationUnary("~"))
+                if (INSTANCE_OPERATION_UNARY("~"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -3970,7 +4618,7 @@ InterpretResult run()
             OPCASE(IN) :
             {
                 istrue = READ_BYTE() == OP_TRUE;
-                if ((!istrue && instanceOperation("in")) || (istrue && instanceOperation("not_in")))
+                if ((!istrue && INSTANCE_OPERATION("in")) || (istrue && INSTANCE_OPERATION("not_in")))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -4011,6 +4659,10 @@ InterpretResult run()
                                 DISPATCH();
                         }
                     }
+                    else if (IS_SET(container))
+                    {
+                        result = BOOL_VAL(setContains(AS_SET(container), item));
+                    }
                     else if (IS_DICT(container))
                     {
                         if (!dictContains(container, item, &result))
@@ -4123,7 +4775,7 @@ InterpretResult run()
 
             OPCASE(NOT) :
             {
-                if (instanceOperationUnary("!"))
+                if (INSTANCE_OPERATION_UNARY("!"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -4133,7 +4785,7 @@ InterpretResult run()
             }
             OPCASE(NEGATE) :
             {
-                if (instanceOperationUnary("-"))
+                if (INSTANCE_OPERATION_UNARY("-"))
                 {
                     frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
                 }
@@ -4339,11 +4991,20 @@ InterpretResult run()
                 pop();
                 push(OBJ_VAL(closure));
 
+                if (!reserveFrame(threadFrame->ctf))
+                {
+                    if (!checkTry(frame))
+                        return INTERPRET_RUNTIME_ERROR;
+                    else
+                        DISPATCH();
+                }
+
                 threadFrame->ctf->currentFrameCount = threadFrame->ctf->frameCount;
 
                 frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount++];
                 frame->ip = closure->function->chunk.code;
                 frame->closure = closure;
+                frame->constants = closure->function->chunk.constants.values;
                 frame->slots = threadFrame->ctf->stackTop - 1;
                 frame->module = module;
                 frame->type = CALL_FRAME_TYPE_MODULE;
@@ -4422,11 +5083,20 @@ InterpretResult run()
                 pop();
                 push(OBJ_VAL(closure));
 
+                if (!reserveFrame(threadFrame->ctf))
+                {
+                    if (!checkTry(frame))
+                        return INTERPRET_RUNTIME_ERROR;
+                    else
+                        DISPATCH();
+                }
+
                 threadFrame->ctf->currentFrameCount = threadFrame->ctf->frameCount;
 
                 frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount++];
                 frame->ip = closure->function->chunk.code;
                 frame->closure = closure;
+                frame->constants = closure->function->chunk.constants.values;
                 frame->slots = threadFrame->ctf->stackTop - 1;
                 frame->module = module;
                 frame->type = CALL_FRAME_TYPE_MODULE;
@@ -4680,11 +5350,20 @@ InterpretResult run()
                 pop();
                 push(OBJ_VAL(closure));
 
+                if (!reserveFrame(threadFrame->ctf))
+                {
+                    if (!checkTry(frame))
+                        return INTERPRET_RUNTIME_ERROR;
+                    else
+                        DISPATCH();
+                }
+
                 threadFrame->ctf->currentFrameCount = threadFrame->ctf->frameCount;
 
                 frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount++];
                 frame->ip = closure->function->chunk.code;
                 frame->closure = closure;
+                frame->constants = closure->function->chunk.constants.values;
                 frame->slots = threadFrame->ctf->stackTop - 1;
                 frame->type = CALL_FRAME_TYPE_MODULE;
                 frame->module = module;
@@ -4806,6 +5485,7 @@ InterpretResult run()
                 DISPATCH();
             }
 
+            OPCASE(TAIL_CALL) :
             OPCASE(CALL) :
             {
                 int argCount = READ_BYTE();
@@ -4813,6 +5493,29 @@ InterpretResult run()
                 threadFrame->ctf->unpackCount = 0;
 
                 Value callee = peek(argCount);
+                if (instruction == OP_TAIL_CALL && canTailCall(threadFrame->ctf, frame, callee))
+                {
+                    // The callee and its arguments replace the returning frame,
+                    // which is then reused as if this frame had made the call
+                    CallFrame caller = *frame;
+                    Value *args = threadFrame->ctf->stackTop - argCount - 1;
+                    closeUpvalues(frame->slots);
+                    memmove(frame->slots, args, sizeof(Value) * (argCount + 1));
+                    threadFrame->ctf->stackTop = frame->slots + argCount + 1;
+                    threadFrame->ctf->frameCount--;
+                    threadFrame->frame = &caller;
+
+                    bool called = call(AS_CLOSURE(callee), argCount, NULL, NULL);
+                    frame = &threadFrame->ctf->frames[threadFrame->ctf->frameCount - 1];
+                    threadFrame->frame = frame;
+                    if (!called)
+                    {
+                        if (!checkTry(frame))
+                            return INTERPRET_RUNTIME_ERROR;
+                    }
+                    DISPATCH();
+                }
+
                 if (IS_CLOSURE(callee) && AS_CLOSURE(callee)->instance != NULL)
                 {
                     ObjClosure *closure = AS_CLOSURE(callee);
@@ -4926,14 +5629,28 @@ InterpretResult run()
             OPCASE(CLOSURE) :
             {
                 ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+                // Nothing to capture, so a lambda evaluated in a loop reuses
+                // the closure built the first time
+                if (function->shared != NULL && function->shared->module == frame->module)
+                {
+                    push(OBJ_VAL(function->shared));
+                    DISPATCH();
+                }
+
                 ObjClosure *closure = newClosure(function);
                 closure->module = frame->module;
+                if (function->upvalueCount == 0)
+                    function->shared = closure;
                 push(OBJ_VAL(closure));
                 for (int i = 0; i < closure->upvalueCount; i++)
                 {
-                    uint8_t isLocal = READ_BYTE();
+                    uint8_t kind = READ_BYTE();
                     uint16_t index = READ_SHORT();
-                    if (isLocal)
+                    if (kind == CAPTURE_VALUE)
+                    {
+                        closure->upvalues[i] = captureValue(frame->slots[index]);
+                    }
+                    else if (kind == CAPTURE_LOCAL)
                     {
                         closure->upvalues[i] = captureUpvalue(frame->slots + index);
                     }
@@ -4970,6 +5687,21 @@ InterpretResult run()
                     threadFrame->ctf->currentFrameCount = -1;
                 }
 
+                if (threadFrame->ctf->callbackFrameCount > 0 &&
+                    threadFrame->ctf->frameCount == threadFrame->ctf->callbackFrameCount)
+                {
+                    threadFrame->ctf->stackTop = frame->slots;
+                    push(result);
+                    return INTERPRET_OK;
+                }
+
+                if (threadFrame->ctf->generator && threadFrame->ctf->frameCount == 0)
+                {
+                    threadFrame->ctf->result = result;
+                    threadFrame->ctf->finished = true;
+                    return INTERPRET_OK;
+                }
+
                 if (threadFrame->ctf->frameCount == 0)
                 {
                     threadFrame->ctf->result = result;
@@ -5209,15 +5941,16 @@ InterpretResult run()
 
                 // Add the context to the frames stack
 
-                CallFrame *frame = &tf->frames[tf->frameCount++];
-                frame->closure = closure;
-                frame->ip = closure->function->chunk.code;
-                frame->module = threadFrame->frame->module;
-                frame->type = CALL_FRAME_TYPE_FUNCTION;
-                frame->nextModule = NULL;
-                frame->require = false;
+                CallFrame *taskCall = &tf->frames[tf->frameCount++];
+                taskCall->closure = closure;
+                taskCall->constants = closure->function->chunk.constants.values;
+                taskCall->ip = closure->function->chunk.code;
+                taskCall->module = threadFrame->frame->module;
+                taskCall->type = CALL_FRAME_TYPE_FUNCTION;
+                taskCall->nextModule = NULL;
+                taskCall->require = false;
 
-                frame->slots = tf->stackTop - 1;
+                taskCall->slots = tf->stackTop - 1;
 
                 ObjList *args = initList();
                 tf->currentArgs = OBJ_VAL(args);
@@ -5346,21 +6079,6 @@ InterpretResult run()
                 DISPATCH();
             }
 
-            OPCASE(TRY) :
-            {
-                uint16_t catch = READ_SHORT();
-                pushTry(frame, catch);
-                DISPATCH();
-            }
-
-            OPCASE(CLOSE_TRY) :
-            {
-                uint16_t end = READ_SHORT();
-                frame->ip += end;
-                popTry();
-                DISPATCH();
-            }
-
             OPCASE(SECURE_START) :
             {
                 threadFrame->ctf->secure = true;
@@ -5424,7 +6142,6 @@ InterpretResult run()
                 uint8_t pos = READ_BYTE();
                 Value val = pop();
 
-                ThreadFrame *threadFrame = currentThread();
                 threadFrame->ctf->stackTop[-(1 + pos)] = val;
                 DISPATCH();
             }
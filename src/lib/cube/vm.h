@@ -11,8 +11,10 @@
     vm.gc = false
 #define RESTORE_GC vm.gc = __gc;
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT16_COUNT)
+// Frames start at FRAMES_MIN and grow on demand up to vm.maxFrames
+#define FRAMES_MIN 64
+#define FRAMES_MAX 100000
+#define STACK_MAX (FRAMES_MIN * UINT16_COUNT)
 
 typedef enum
 {
@@ -23,6 +25,7 @@ typedef enum
 typedef struct
 {
     ObjClosure *closure;
+    Value *constants;
     uint8_t *ip;
     Value *slots;
     ObjInstance *instance;
@@ -33,17 +36,11 @@ typedef struct
     bool require;
 } CallFrame;
 
-typedef struct TryFrame_t
-{
-    uint8_t *ip;
-    CallFrame *frame;
-    struct TryFrame_t *next;
-} TryFrame;
-
 typedef struct TaskFrame_t
 {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame *frames;
     int frameCount;
+    int frameCapacity;
     Value stack[STACK_MAX];
     Value *stackTop;
     Value currentArgs;
@@ -62,12 +59,13 @@ typedef struct TaskFrame_t
     bool secure;
     bool autoDestroy;
     struct TaskFrame_t *parent;
-    char *error;
+    ErrorInfo *error;
     uint64_t endTime;
     uint64_t startTime;
-    TryFrame *tryFrame;
     void *threadFrame;
     int unpackCount;
+    int callbackFrameCount;
+    bool generator;
 } TaskFrame;
 
 typedef enum
@@ -91,6 +89,15 @@ typedef struct ThreadFrame_t
     InterpretResult result;
 } ThreadFrame;
 
+// Set by 'cube --bench', read by the benchmark module
+typedef struct
+{
+    bool enabled;
+    int runs;
+    int warmup;
+    const char *output;
+} BenchOptions;
+
 typedef struct
 {
     ThreadFrame threadFrames[MAX_THREADS];
@@ -121,6 +128,7 @@ typedef struct
 
     size_t bytesAllocated;
     size_t nextGC;
+    uint32_t classCount;
 
     Obj *objects;
 
@@ -131,10 +139,13 @@ typedef struct
     Value repl;
     bool print;
     bool debug;
+    bool counters;
+    int maxFrames;
     bool continueDebug;
     bool waitingDebug;
     bool forceInclude;
     DebugInfo debugInfo;
+    BenchOptions bench;
 } VM;
 
 extern VM vm;
@@ -154,6 +165,9 @@ InterpretResult compileCode(const char *source, const char *path, const char *ou
 void push(Value value);
 Value pop();
 Value peek(int distance);
+bool callFunction(Value callee, int argCount, Value *args, Value *result);
+bool nextGenerator(ObjGenerator *generator, bool *produced);
+void freeGenerator(ObjGenerator *generator);
 
 bool isFalsey(Value value);
 void runtimeError(const char *format, ...);
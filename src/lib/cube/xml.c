@@ -0,0 +1,943 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "mempool.h"
+#include "vm.h"
+#include "xml.h"
+
+typedef enum
+{
+    XML_START,
+    XML_END,
+    XML_TEXT,
+    XML_DECLARATION,
+    XML_DOCTYPE,
+    XML_DONE,
+    XML_MORE, // The token is cut at the end of the window
+    XML_ERROR
+} XmlEvent;
+
+typedef struct
+{
+    char *chars;
+    int length;
+    int capacity;
+} XmlBuffer;
+
+// Names point into the window, values into the scratch buffer
+typedef struct
+{
+    const char *name;
+    int nameLength;
+    int value;
+    int valueLength;
+    bool hasValue;
+} XmlAttribute;
+
+typedef struct
+{
+    char *data; // The whole text, or the window of the file read so far
+    int length;
+    int current;
+    int capacity;
+    FILE *file;
+    bool eof;
+    int lines; // Lines dropped from the window, for the error position
+    ObjList *unclose;
+
+    XmlBuffer names; // The open tags, NUL separated
+    int *open;
+    int depth;
+    int openCapacity;
+    bool pendingEnd; // An empty or unclosed tag still has to end
+
+    // The current event, valid until the next one
+    const char *name;
+    int nameLength;
+    XmlBuffer scratch; // Decoded text and attribute values
+    XmlAttribute *attributes;
+    int attributeCount;
+    int attributeCapacity;
+
+    char *error;
+    int errorSize;
+} XmlParser;
+
+static XmlEvent parseError(XmlParser *parser, const char *message)
+{
+    int line = parser->lines + 1;
+    int column = 1;
+    for (int i = 0; i < parser->current && i < parser->length; i++)
+    {
+        if (parser->data[i] == '\n')
+        {
+            line++;
+            column = 1;
+        }
+        else
+            column++;
+    }
+    snprintf(parser->error, parser->errorSize, "%s at line %d, column %d", message, line, column);
+    return XML_ERROR;
+}
+
+// Reached the end of the window in the middle of a token
+static XmlEvent needMore(XmlParser *parser)
+{
+    if (parser->file != NULL && !parser->eof)
+        return XML_MORE;
+    parser->current = parser->length;
+    return parseError(parser, "Unexpected end of document");
+}
+
+static void appendBuffer(XmlBuffer *buffer, const char *chars, int length)
+{
+    if (buffer->length + length + 1 > buffer->capacity)
+    {
+        int capacity = buffer->capacity < 64 ? 64 : buffer->capacity;
+        while (capacity < buffer->length + length + 1)
+            capacity *= 2;
+        buffer->chars = (char *)mp_realloc(buffer->chars, capacity);
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->chars + buffer->length, chars, length);
+    buffer->length += length;
+    buffer->chars[buffer->length] = '\0';
+}
+
+static void appendUtf8(XmlBuffer *buffer, uint32_t code)
+{
+    char bytes[4];
+    int length;
+    if (code < 0x80)
+    {
+        bytes[0] = (char)code;
+        length = 1;
+    }
+    else if (code < 0x800)
+    {
+        bytes[0] = (char)(0xC0 | (code >> 6));
+        bytes[1] = (char)(0x80 | (code & 0x3F));
+        length = 2;
+    }
+    else if (code < 0x10000)
+    {
+        bytes[0] = (char)(0xE0 | (code >> 12));
+        bytes[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        bytes[2] = (char)(0x80 | (code & 0x3F));
+        length = 3;
+    }
+    else
+    {
+        bytes[0] = (char)(0xF0 | (code >> 18));
+        bytes[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+        bytes[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+        bytes[3] = (char)(0x80 | (code & 0x3F));
+        length = 4;
+    }
+    appendBuffer(buffer, bytes, length);
+}
+
+static bool decodeEntity(XmlBuffer *buffer, const char *name, int length)
+{
+    if (length == 2 && memcmp(name, "lt", 2) == 0)
+        appendBuffer(buffer, "<", 1);
+    else if (length == 2 && memcmp(name, "gt", 2) == 0)
+        appendBuffer(buffer, ">", 1);
+    else if (length == 3 && memcmp(name, "amp", 3) == 0)
+        appendBuffer(buffer, "&", 1);
+    else if (length == 4 && memcmp(name, "quot", 4) == 0)
+        appendBuffer(buffer, "\"", 1);
+    else if (length == 4 && memcmp(name, "apos", 4) == 0)
+        appendBuffer(buffer, "'", 1);
+    else if (length > 1 && name[0] == '#')
+    {
+        bool hex = name[1] == 'x' || name[1] == 'X';
+        uint32_t code = 0;
+        int i = hex ? 2 : 1;
+        if (i == length)
+            return false;
+        for (; i < length; i++)
+        {
+            char c = name[i];
+            if (c >= '0' && c <= '9')
+                code = code * (hex ? 16 : 10) + (c - '0');
+            else if (hex && c >= 'a' && c <= 'f')
+                code = code * 16 + (c - 'a' + 10);
+            else if (hex && c >= 'A' && c <= 'F')
+                code = code * 16 + (c - 'A' + 10);
+            else
+                return false;
+            if (code > 0x10FFFF)
+                return false;
+        }
+        appendUtf8(buffer, code);
+    }
+    else
+        return false;
+    return true;
+}
+
+// Unknown entities, as the HTML ones, are kept as they are
+static void appendDecoded(XmlBuffer *buffer, const char *chars, int length)
+{
+    const char *end = chars + length;
+    while (chars < end)
+    {
+        const char *amp = (const char *)memchr(chars, '&', end - chars);
+        if (amp == NULL)
+        {
+            appendBuffer(buffer, chars, (int)(end - chars));
+            return;
+        }
+        appendBuffer(buffer, chars, (int)(amp - chars));
+
+        const char *semicolon = amp + 1;
+        while (semicolon < end && semicolon - amp <= 10 && *semicolon != ';')
+            semicolon++;
+        if (semicolon < end && *semicolon == ';' && decodeEntity(buffer, amp + 1, (int)(semicolon - amp - 1)))
+            chars = semicolon + 1;
+        else
+        {
+            appendBuffer(buffer, "&", 1);
+            chars = amp + 1;
+        }
+    }
+}
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline bool isNameChar(char c)
+{
+    return !isSpace(c) && c != '/' && c != '>' && c != '<' && c != '=' && c != '?' && c != '"' && c != '\'';
+}
+
+static inline void skipSpace(XmlParser *parser)
+{
+    while (parser->current < parser->length && isSpace(parser->data[parser->current]))
+        parser->current++;
+}
+
+static bool startsWith(XmlParser *parser, const char *prefix, int length)
+{
+    return parser->length - parser->current >= length && memcmp(parser->data + parser->current, prefix, length) == 0;
+}
+
+// The offset of 'needle' at or after 'from', -1 when it is not in
+// the window
+static int findText(XmlParser *parser, int from, const char *needle, int length)
+{
+    const char *data = parser->data;
+    int last = parser->length - length;
+    for (int i = from; i <= last; i++)
+    {
+        const char *c = (const char *)memchr(data + i, needle[0], last - i + 1);
+        if (c == NULL)
+            return -1;
+        i = (int)(c - data);
+        if (memcmp(c, needle, length) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static bool isUnclosed(XmlParser *parser, const char *name, int length)
+{
+    if (parser->unclose == NULL)
+        return false;
+    for (int i = 0; i < parser->unclose->values.count; i++)
+    {
+        Value value = parser->unclose->values.values[i];
+        if (IS_STRING(value) && AS_STRING(value)->length == length && memcmp(AS_CSTRING(value), name, length) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void openTag(XmlParser *parser, const char *name, int length)
+{
+    if (parser->depth == parser->openCapacity)
+    {
+        parser->openCapacity = parser->openCapacity < 16 ? 16 : parser->openCapacity * 2;
+        parser->open = (int *)mp_realloc(parser->open, sizeof(int) * parser->openCapacity);
+    }
+    parser->open[parser->depth++] = parser->names.length;
+    appendBuffer(&parser->names, name, length);
+    appendBuffer(&parser->names, "", 1);
+
+    parser->name = parser->names.chars + parser->open[parser->depth - 1];
+    parser->nameLength = length;
+}
+
+// The name stays in the buffer until the next tag opens
+static XmlEvent closeTag(XmlParser *parser)
+{
+    parser->depth--;
+    parser->names.length = parser->open[parser->depth];
+    parser->name = parser->names.chars + parser->names.length;
+    parser->nameLength = (int)strlen(parser->name);
+    return XML_END;
+}
+
+static void addAttribute(XmlParser *parser, const char *name, int length)
+{
+    if (parser->attributeCount == parser->attributeCapacity)
+    {
+        parser->attributeCapacity = parser->attributeCapacity < 8 ? 8 : parser->attributeCapacity * 2;
+        parser->attributes =
+            (XmlAttribute *)mp_realloc(parser->attributes, sizeof(XmlAttribute) * parser->attributeCapacity);
+    }
+    XmlAttribute *attribute = &parser->attributes[parser->attributeCount++];
+    attribute->name = name;
+    attribute->nameLength = length;
+    attribute->value = 0;
+    attribute->valueLength = 0;
+    attribute->hasValue = false;
+}
+
+// Reads the attributes up to '>', '/>' or, in the declaration, '?>'.
+// Values may be quoted with either quote or, leniently, not at all
+static XmlEvent parseAttributes(XmlParser *parser, bool declaration, bool *empty)
+{
+    *empty = false;
+    for (;;)
+    {
+        skipSpace(parser);
+        if (parser->current >= parser->length)
+            return needMore(parser);
+
+        char c = parser->data[parser->current];
+        if (c == '>' && !declaration)
+        {
+            parser->current++;
+            return XML_START;
+        }
+        if (c == '/' || c == '?')
+        {
+            if (parser->current + 1 >= parser->length)
+                return needMore(parser);
+            if (parser->data[parser->current + 1] != '>' || (c == '?') != declaration)
+                return parseError(parser, "Unexpected character in tag");
+            parser->current += 2;
+            *empty = true;
+            return XML_START;
+        }
+        if (!isNameChar(c))
+            return parseError(parser, "Expected an attribute name");
+
+        int start = parser->current;
+        while (parser->current < parser->length && isNameChar(parser->data[parser->current]))
+            parser->current++;
+        if (parser->current >= parser->length)
+            return needMore(parser);
+        addAttribute(parser, parser->data + start, parser->current - start);
+
+        skipSpace(parser);
+        if (parser->current >= parser->length)
+            return needMore(parser);
+        if (parser->data[parser->current] != '=')
+            continue;
+        parser->current++;
+        skipSpace(parser);
+        if (parser->current >= parser->length)
+            return needMore(parser);
+
+        c = parser->data[parser->current];
+        int end;
+        if (c == '"' || c == '\'')
+        {
+            start = ++parser->current;
+            const char *quote = (const char *)memchr(parser->data + start, c, parser->length - start);
+            if (quote == NULL)
+                return needMore(parser);
+            end = (int)(quote - parser->data);
+            parser->current = end + 1;
+        }
+        else
+        {
+            start = parser->current;
+            while (parser->current < parser->length && !isSpace(parser->data[parser->current]) &&
+                   parser->data[parser->current] != '>')
+                parser->current++;
+            if (parser->current >= parser->length)
+                return needMore(parser);
+            end = parser->current;
+        }
+
+        // The scratch buffer may move, so the value is kept as an offset
+        XmlAttribute *attribute = &parser->attributes[parser->attributeCount - 1];
+        attribute->value = parser->scratch.length;
+        appendDecoded(&parser->scratch, parser->data + start, end - start);
+        appendBuffer(&parser->scratch, "", 1);
+        attribute->valueLength = parser->scratch.length - attribute->value - 1;
+        attribute->hasValue = true;
+    }
+}
+
+static XmlEvent parseStartTag(XmlParser *parser)
+{
+    parser->current++;
+    int start = parser->current;
+    while (parser->current < parser->length && isNameChar(parser->data[parser->current]))
+        parser->current++;
+    if (parser->current >= parser->length)
+        return needMore(parser);
+    if (parser->current == start)
+        return parseError(parser, "Expected a tag name");
+
+    const char *name = parser->data + start;
+    int length = parser->current - start;
+
+    bool empty;
+    XmlEvent event = parseAttributes(parser, false, &empty);
+    if (event != XML_START)
+        return event;
+
+    openTag(parser, name, length);
+    parser->pendingEnd = empty || isUnclosed(parser, name, length);
+    return XML_START;
+}
+
+// Returns XML_DONE when the tag is skipped, a stray closing tag of an
+// unclosed element
+static XmlEvent parseEndTag(XmlParser *parser)
+{
+    int tag = parser->current;
+    parser->current += 2;
+    int start = parser->current;
+    while (parser->current < parser->length && isNameChar(parser->data[parser->current]))
+        parser->current++;
+    int end = parser->current;
+    skipSpace(parser);
+    if (parser->current >= parser->length)
+        return needMore(parser);
+    if (parser->data[parser->current] != '>')
+        return parseError(parser, "Expected '>'");
+    parser->current++;
+
+    const char *name = parser->data + start;
+    int length = end - start;
+    if (parser->depth > 0)
+    {
+        const char *top = parser->names.chars + parser->open[parser->depth - 1];
+        if ((int)strlen(top) == length && memcmp(top, name, length) == 0)
+            return closeTag(parser);
+    }
+    if (isUnclosed(parser, name, length))
+        return XML_DONE;
+
+    parser->current = tag;
+    return parseError(parser, parser->depth > 0 ? "Mismatched closing tag" : "Unexpected closing tag");
+}
+
+static bool isDoctype(const char *chars)
+{
+    const char *doctype = "DOCTYPE";
+    for (int i = 0; i < 7; i++)
+    {
+        if (chars[i] != doctype[i] && chars[i] != doctype[i] - 'A' + 'a')
+            return false;
+    }
+    return true;
+}
+
+// <!DOCTYPE ...> and the other declarations, with an optional internal
+// subset in brackets
+static XmlEvent parseDeclaration(XmlParser *parser)
+{
+    int start = parser->current + 2;
+    int nesting = 0;
+    char quote = '\0';
+    for (int i = start; i < parser->length; i++)
+    {
+        char c = parser->data[i];
+        if (quote != '\0')
+        {
+            if (c == quote)
+                quote = '\0';
+        }
+        else if (c == '"' || c == '\'')
+            quote = c;
+        else if (c == '[')
+            nesting++;
+        else if (c == ']')
+            nesting--;
+        else if (c == '>' && nesting <= 0)
+        {
+            parser->current = i + 1;
+            if (i - start < 7 || !isDoctype(parser->data + start))
+                return XML_DONE;
+
+            start += 7;
+            while (start < i && isSpace(parser->data[start]))
+                start++;
+            int end = i;
+            while (end > start && isSpace(parser->data[end - 1]))
+                end--;
+            appendBuffer(&parser->scratch, parser->data + start, end - start);
+            return XML_DOCTYPE;
+        }
+    }
+    return needMore(parser);
+}
+
+// Processing instructions are skipped, but for the XML declaration
+static XmlEvent parseInstruction(XmlParser *parser)
+{
+    if (parser->length - parser->current >= 6 &&
+        memcmp(parser->data + parser->current + 2, "xml", 3) == 0 && isSpace(parser->data[parser->current + 5]))
+    {
+        parser->current += 5;
+        bool empty;
+        XmlEvent event = parseAttributes(parser, true, &empty);
+        if (event != XML_START)
+            return event;
+        if (!empty)
+            return parseError(parser, "Expected '?>'");
+        return XML_DECLARATION;
+    }
+
+    int end = findText(parser, parser->current + 2, "?>", 2);
+    if (end < 0)
+        return needMore(parser);
+    parser->current = end + 2;
+    return XML_DONE;
+}
+
+// Whitespace only text is skipped
+static XmlEvent parseText(XmlParser *parser)
+{
+    int start = parser->current;
+    const char *less = (const char *)memchr(parser->data + start, '<', parser->length - start);
+    int end = less != NULL ? (int)(less - parser->data) : parser->length;
+    if (less == NULL && parser->file != NULL && !parser->eof)
+        return XML_MORE;
+    parser->current = end;
+
+    for (int i = start; i < end; i++)
+    {
+        if (!isSpace(parser->data[i]))
+        {
+            if (parser->depth == 0)
+            {
+                parser->current = i;
+                return parseError(parser, "Text outside the root element");
+            }
+            appendDecoded(&parser->scratch, parser->data + start, end - start);
+            return XML_TEXT;
+        }
+    }
+    return XML_DONE;
+}
+
+static XmlEvent scanEvent(XmlParser *parser)
+{
+    parser->scratch.length = 0;
+    parser->attributeCount = 0;
+    appendBuffer(&parser->scratch, "", 0);
+
+    if (parser->pendingEnd)
+    {
+        parser->pendingEnd = false;
+        return closeTag(parser);
+    }
+
+    for (;;)
+    {
+        XmlEvent event;
+        if (parser->current >= parser->length)
+        {
+            if (parser->file != NULL && !parser->eof)
+                return XML_MORE;
+            if (parser->depth > 0)
+                return parseError(parser, "Unclosed tag");
+            return XML_DONE;
+        }
+
+        if (parser->data[parser->current] != '<')
+            event = parseText(parser);
+        else if (parser->length - parser->current < 2)
+            return needMore(parser);
+        else if (parser->data[parser->current + 1] == '/')
+            event = parseEndTag(parser);
+        else if (parser->data[parser->current + 1] == '?')
+            event = parseInstruction(parser);
+        else if (parser->data[parser->current + 1] != '!')
+            event = parseStartTag(parser);
+        else if (parser->length - parser->current < 4)
+            return needMore(parser);
+        else if (startsWith(parser, "<!--", 4))
+        {
+            int end = findText(parser, parser->current + 4, "-->", 3);
+            if (end < 0)
+                return needMore(parser);
+            parser->current = end + 3;
+            continue;
+        }
+        else if (startsWith(parser, "<![CDATA[", 9))
+        {
+            int end = findText(parser, parser->current + 9, "]]>", 3);
+            if (end < 0)
+                return needMore(parser);
+            if (parser->depth == 0)
+                return parseError(parser, "Text outside the root element");
+            appendBuffer(&parser->scratch, parser->data + parser->current + 9, end - parser->current - 9);
+            parser->current = end + 3;
+            return XML_TEXT;
+        }
+        else if (parser->length - parser->current < 9)
+            return needMore(parser);
+        else
+            event = parseDeclaration(parser);
+
+        // Skipped markup
+        if (event != XML_DONE)
+            return event;
+    }
+}
+
+// Moves the unread part of the window to the front and reads the next
+// chunk, the window grows when a single token fills it
+static bool readMore(XmlParser *parser)
+{
+    for (int i = 0; i < parser->current; i++)
+    {
+        if (parser->data[i] == '\n')
+            parser->lines++;
+    }
+    memmove(parser->data, parser->data + parser->current, parser->length - parser->current);
+    parser->length -= parser->current;
+    parser->current = 0;
+
+    if (parser->capacity - parser->length < XML_CHUNK_SIZE / 2)
+    {
+        parser->capacity = parser->capacity == 0 ? XML_CHUNK_SIZE : parser->capacity * 2;
+        parser->data = (char *)mp_realloc(parser->data, parser->capacity);
+    }
+
+    size_t read = fread(parser->data + parser->length, 1, parser->capacity - parser->length, parser->file);
+    parser->length += (int)read;
+    if (read == 0)
+    {
+        if (ferror(parser->file))
+        {
+            snprintf(parser->error, parser->errorSize, "Could not read the file");
+            return false;
+        }
+        parser->eof = true;
+    }
+    return true;
+}
+
+static XmlEvent nextEvent(XmlParser *parser)
+{
+    for (;;)
+    {
+        int start = parser->current;
+        XmlEvent event = scanEvent(parser);
+        if (event != XML_MORE)
+            return event;
+
+        parser->current = start;
+        if (!readMore(parser))
+            return XML_ERROR;
+    }
+}
+
+static void initParser(XmlParser *parser, ObjList *unclose, char *error, int errorSize)
+{
+    memset(parser, 0, sizeof(XmlParser));
+    parser->unclose = unclose;
+    parser->error = error;
+    parser->errorSize = errorSize;
+}
+
+static void freeParser(XmlParser *parser)
+{
+    if (parser->file != NULL)
+        mp_free(parser->data);
+    mp_free(parser->names.chars);
+    mp_free(parser->open);
+    mp_free(parser->scratch.chars);
+    mp_free(parser->attributes);
+}
+
+static const char *attributeValue(XmlParser *parser, XmlAttribute *attribute)
+{
+    return parser->scratch.chars + attribute->value;
+}
+
+// Dict keys have to be NUL terminated
+static void insertAttribute(XmlParser *parser, ObjDict *dict, XmlAttribute *attribute)
+{
+    char small[128];
+    char *key = attribute->nameLength < (int)sizeof(small) ? small : (char *)mp_malloc(attribute->nameLength + 1);
+    memcpy(key, attribute->name, attribute->nameLength);
+    key[attribute->nameLength] = '\0';
+
+    Value value = attribute->hasValue
+                      ? OBJ_VAL(copyString(attributeValue(parser, attribute), attribute->valueLength))
+                      : TRUE_VAL;
+    push(value);
+    insertDict(dict, key, value);
+    pop();
+
+    if (key != small)
+        mp_free(key);
+}
+
+static void setField(ObjInstance *instance, Value field, Value value)
+{
+    push(value);
+    setInstanceField(instance, AS_STRING(field), value);
+    pop();
+}
+
+static void setDocumentString(ObjDict *document, char *key, const char *chars, int length)
+{
+    Value value = OBJ_VAL(copyString(chars, length));
+    push(value);
+    insertDict(document, key, value);
+    pop();
+}
+
+static void readDeclaration(XmlParser *parser, ObjDict *document)
+{
+    for (int i = 0; i < parser->attributeCount; i++)
+    {
+        XmlAttribute *attribute = &parser->attributes[i];
+        if (!attribute->hasValue)
+            continue;
+        if (attribute->nameLength == 7 && memcmp(attribute->name, "version", 7) == 0)
+            setDocumentString(document, "version", attributeValue(parser, attribute), attribute->valueLength);
+        else if (attribute->nameLength == 8 && memcmp(attribute->name, "encoding", 8) == 0)
+            setDocumentString(document, "encoding", attributeValue(parser, attribute), attribute->valueLength);
+    }
+}
+
+// The instances are made without calling init. The text of an element is
+// gathered on a stack shared by the open elements and trimmed when it ends
+bool parseXml(const char *text, int length, ObjClass *klass, ObjList *unclose, Value *document, char *error,
+              int errorSize)
+{
+    XmlParser parser;
+    initParser(&parser, unclose, error, errorSize);
+    parser.data = (char *)text;
+    parser.length = length;
+
+    ObjDict *result = initDict();
+    push(OBJ_VAL(result));
+    insertDict(result, "version", NULL_VAL);
+    insertDict(result, "encoding", NULL_VAL);
+    insertDict(result, "doctype", NULL_VAL);
+    insertDict(result, "root", NULL_VAL);
+
+    // The field names, then an instance and its children for each open
+    // element
+    ObjList *stack = initList();
+    push(OBJ_VAL(stack));
+    const char *fieldNames[] = {"tag", "attrib", "text", "children"};
+    for (int i = 0; i < 4; i++)
+        writeValueArray(&stack->values, OBJ_VAL(copyString(fieldNames[i], (int)strlen(fieldNames[i]))));
+    Value *fields = stack->values.values;
+
+    XmlBuffer texts = {NULL, 0, 0};
+    int *textStarts = NULL;
+    int textCapacity = 0;
+    bool hasRoot = false;
+
+    XmlEvent event;
+    while ((event = nextEvent(&parser)) != XML_DONE && event != XML_ERROR)
+    {
+        fields = stack->values.values;
+        if (event == XML_START)
+        {
+            if (parser.depth == 1 && hasRoot)
+            {
+                event = parseError(&parser, "More than one root element");
+                break;
+            }
+
+            ObjInstance *instance = newInstance(klass);
+            push(OBJ_VAL(instance));
+            setField(instance, fields[0], OBJ_VAL(copyString(parser.name, parser.nameLength)));
+            setField(instance, fields[2], OBJ_VAL(copyString("", 0)));
+
+            ObjDict *attrib = initDict();
+            setField(instance, fields[1], OBJ_VAL(attrib));
+            for (int i = 0; i < parser.attributeCount; i++)
+                insertAttribute(&parser, attrib, &parser.attributes[i]);
+
+            ObjList *children = initList();
+            setField(instance, fields[3], OBJ_VAL(children));
+
+            if (parser.depth == 1)
+            {
+                insertDict(result, "root", OBJ_VAL(instance));
+                hasRoot = true;
+            }
+            else
+            {
+                ObjList *parent = AS_LIST(stack->values.values[stack->values.count - 1]);
+                writeValueArray(&parent->values, OBJ_VAL(instance));
+            }
+            writeValueArray(&stack->values, OBJ_VAL(instance));
+            writeValueArray(&stack->values, OBJ_VAL(children));
+            pop();
+
+            if (parser.depth > textCapacity)
+            {
+                textCapacity = textCapacity < 16 ? 16 : textCapacity * 2;
+                textStarts = (int *)mp_realloc(textStarts, sizeof(int) * textCapacity);
+            }
+            textStarts[parser.depth - 1] = texts.length;
+        }
+        else if (event == XML_END)
+        {
+            ObjInstance *instance = AS_INSTANCE(stack->values.values[stack->values.count - 2]);
+            int start = textStarts[parser.depth];
+            int end = texts.length;
+            while (start < end && isSpace(texts.chars[start]))
+                start++;
+            while (end > start && isSpace(texts.chars[end - 1]))
+                end--;
+            if (end > start)
+                setField(instance, fields[2], OBJ_VAL(copyString(texts.chars + start, end - start)));
+            texts.length = textStarts[parser.depth];
+            stack->values.count -= 2;
+        }
+        else if (event == XML_TEXT)
+            appendBuffer(&texts, parser.scratch.chars, parser.scratch.length);
+        else if (event == XML_DECLARATION)
+            readDeclaration(&parser, result);
+        else if (event == XML_DOCTYPE)
+            setDocumentString(result, "doctype", parser.scratch.chars, parser.scratch.length);
+    }
+
+    mp_free(texts.chars);
+    mp_free(textStarts);
+    freeParser(&parser);
+    pop();
+    pop();
+
+    if (event == XML_ERROR)
+        return false;
+    *document = OBJ_VAL(result);
+    return true;
+}
+
+static bool callHandler(Value handler, int argCount, Value *args, bool *stopped)
+{
+    Value result;
+    if (!callFunction(handler, argCount, args, &result))
+        return false;
+    if (IS_BOOL(result) && !AS_BOOL(result))
+        *stopped = true;
+    return true;
+}
+
+bool streamXml(FILE *file, Value onStart, Value onEnd, Value onText, ObjList *unclose, bool *stopped, char *error,
+               int errorSize)
+{
+    XmlParser parser;
+    initParser(&parser, unclose, error, errorSize);
+    parser.file = file;
+    *stopped = false;
+
+    bool ok = true;
+    while (ok && !*stopped)
+    {
+        XmlEvent event = nextEvent(&parser);
+        if (event == XML_DONE)
+            break;
+        if (event == XML_ERROR)
+        {
+            ok = false;
+            break;
+        }
+
+        Value args[2];
+        if (event == XML_START && !IS_NULL(onStart))
+        {
+            args[0] = OBJ_VAL(copyString(parser.name, parser.nameLength));
+            push(args[0]);
+            ObjDict *attrib = initDict();
+            args[1] = OBJ_VAL(attrib);
+            push(args[1]);
+            for (int i = 0; i < parser.attributeCount; i++)
+                insertAttribute(&parser, attrib, &parser.attributes[i]);
+            ok = callHandler(onStart, 2, args, stopped);
+            pop();
+            pop();
+        }
+        else if (event == XML_END && !IS_NULL(onEnd))
+        {
+            args[0] = OBJ_VAL(copyString(parser.name, parser.nameLength));
+            push(args[0]);
+            ok = callHandler(onEnd, 1, args, stopped);
+            pop();
+        }
+        else if (event == XML_TEXT && !IS_NULL(onText))
+        {
+            args[0] = OBJ_VAL(copyString(parser.scratch.chars, parser.scratch.length));
+            push(args[0]);
+            ok = callHandler(onText, 1, args, stopped);
+            pop();
+        }
+
+        // The callback already raised its error
+        if (!ok)
+            error[0] = '\0';
+    }
+
+    freeParser(&parser);
+    return ok;
+}
+
+// '&' and '<' always, '"' in attribute values
+ObjString *escapeXml(ObjString *string, bool attribute)
+{
+    const char *chars = string->chars;
+    int length = string->length;
+    int extra = 0;
+    for (int i = 0; i < length; i++)
+    {
+        if (chars[i] == '&')
+            extra += 4;
+        else if (chars[i] == '<')
+            extra += 3;
+        else if (chars[i] == '"' && attribute)
+            extra += 5;
+    }
+    if (extra == 0)
+        return string;
+
+    char *escaped = ALLOCATE(char, length + extra + 1);
+    int j = 0;
+    for (int i = 0; i < length; i++)
+    {
+        const char *entity = NULL;
+        if (chars[i] == '&')
+            entity = "&amp;";
+        else if (chars[i] == '<')
+            entity = "&lt;";
+        else if (chars[i] == '"' && attribute)
+            entity = "&quot;";
+
+        if (entity == NULL)
+            escaped[j++] = chars[i];
+        else
+        {
+            int size = (int)strlen(entity);
+            memcpy(escaped + j, entity, size);
+            j += size;
+        }
+    }
+    escaped[j] = '\0';
+    return takeString(escaped, j);
+}
@@ -0,0 +1,27 @@
+#ifndef CUBE_XML_h
+#define CUBE_XML_h
+#include <stdio.h>
+
+#include "object.h"
+
+// Streams read the file in chunks of this size, a single tag may grow the
+// window past it
+#define XML_CHUNK_SIZE 65536
+
+// Parses a whole document into a dict with 'version', 'encoding' and
+// 'doctype' from the prolog, and 'root', the tree of 'klass' instances with
+// the fields tag, attrib, text and children. Tags listed in 'unclose' never
+// take children or a closing tag, as the HTML void elements
+bool parseXml(const char *text, int length, ObjClass *klass, ObjList *unclose, Value *document, char *error,
+              int errorSize);
+
+// Reads the file in chunks and calls onStart(tag, attrib), onEnd(tag) and
+// onText(text) as the elements go by, null callbacks are skipped. Stops
+// early when a callback returns false. On failure 'error' is empty when a
+// callback raised the error itself
+bool streamXml(FILE *file, Value onStart, Value onEnd, Value onText, ObjList *unclose, bool *stopped, char *error,
+               int errorSize);
+
+ObjString *escapeXml(ObjString *string, bool attribute);
+
+#endif
@@ -16,6 +16,7 @@ typedef struct
     MYSQL *db;
     char *message;
     bool closed;
+    bool columnar;
     cube_native_var *data;
 } DB;
 
@@ -92,12 +93,42 @@ void prepare_db(DB *db)
     db->data = NULL;
 }
 
+cube_native_var *field_value(MYSQL_FIELD *field, char *value, unsigned long length)
+{
+    if (value == NULL || field->type == MYSQL_TYPE_NULL)
+        return NATIVE_NULL();
+    else if (IS_NUM(field->type))
+        return NATIVE_NUMBER(atof(value));
+    else if (field->type == MYSQL_TYPE_BIT)
+        return NATIVE_BYTES_COPY(length, (unsigned char *)value);
+    return NATIVE_STRING_COPY(value);
+}
+
+// Columnar results name each column once and keep one list per column:
+// {"columns": [names], "values": [[first column], [second column], ...]}
+cube_native_var *new_columns(MYSQL_FIELD *fields, int num_fields)
+{
+    cube_native_var *names = NATIVE_LIST();
+    cube_native_var *values = NATIVE_LIST();
+    for (int i = 0; i < num_fields; i++)
+    {
+        ADD_NATIVE_LIST(names, NATIVE_STRING_COPY(fields[i].name));
+        ADD_NATIVE_LIST(values, NATIVE_LIST());
+    }
+
+    cube_native_var *result = NATIVE_DICT();
+    ADD_NATIVE_DICT(result, (char *)"columns", names);
+    ADD_NATIVE_DICT(result, (char *)"values", values);
+    return result;
+}
+
 extern "C"
 {
     EXPORTED int opendb(char *host, char *user, char *passwd, char *name, bool create)
     {
         DB db;
         db.closed = false;
+        db.columnar = false;
         db.message = NULL;
         db.data = NULL;
         db.db = mysql_init(NULL);
@@ -180,6 +211,23 @@ extern "C"
             return true;
         }
 
+        MYSQL_FIELD *fields = mysql_fetch_fields(result);
+        if (db->columnar)
+        {
+            db->data = new_columns(fields, num_fields);
+            cube_native_var *values = db->data->dict[1];
+
+            MYSQL_ROW row;
+            while ((row = mysql_fetch_row(result)))
+            {
+                unsigned long *len = mysql_fetch_lengths(result);
+                for (int i = 0; i < num_fields; i++)
+                    ADD_NATIVE_LIST(values->list[i], field_value(&fields[i], row[i], len[i]));
+            }
+            mysql_free_result(result);
+            return true;
+        }
+
         if (db->data == NULL)
             db->data = NATIVE_NULL();
 
@@ -190,36 +238,15 @@ extern "C"
             TO_NATIVE_LIST(list);
 
         MYSQL_ROW row;
-        MYSQL_FIELD *field;
 
         while ((row = mysql_fetch_row(result)))
         {
-            mysql_field_seek(result, 0);
             unsigned long *len = mysql_fetch_lengths(result);
 
             cube_native_var *item = NATIVE_DICT();
 
             for (int i = 0; i < num_fields; i++)
-            {
-                field = mysql_fetch_field(result);
-                if (row[i] == NULL || field->type == MYSQL_TYPE_NULL)
-                {
-                    ADD_NATIVE_DICT(item, COPY_STR(field->name), NATIVE_NULL());
-                }
-                else if (IS_NUM(field->type))
-                {
-                    double val = atof(row[i]);
-                    ADD_NATIVE_DICT(item, COPY_STR(field->name), NATIVE_NUMBER(val));
-                }
-                else if (field->type == MYSQL_TYPE_BIT)
-                {
-                    ADD_NATIVE_DICT(item, COPY_STR(field->name), NATIVE_BYTES_COPY(len[i], (unsigned char *)row[i]));
-                }
-                else
-                {
-                    ADD_NATIVE_DICT(item, COPY_STR(field->name), NATIVE_STRING_COPY(row[i]));
-                }
-            }
+                ADD_NATIVE_DICT(item, COPY_STR(fields[i].name), field_value(&fields[i], row[i], len[i]));
 
             ADD_NATIVE_LIST(list, item);
         }
@@ -228,6 +255,17 @@ extern "C"
         return true;
     }
 
+    // Makes exec keep its rows as columns instead of dicts
+    EXPORTED bool columnar(int id, bool enabled)
+    {
+        DB *db;
+        if (!getDB(id, &db))
+            return false;
+
+        db->columnar = enabled;
+        return true;
+    }
+
     EXPORTED cube_native_var *data(int id)
     {
         DB *db;
@@ -16,6 +16,7 @@ typedef struct
     PGconn *db;
     char *message;
     bool closed;
+    bool columnar;
     int lastId;
     cube_native_var *data;
 } DB;
@@ -95,6 +96,25 @@ void prepare_db(DB *db)
     db->data = NULL;
 }
 
+// Columnar results name each column once and keep one list per column:
+// {"columns": [names], "values": [[first column], [second column], ...]}
+cube_native_var *new_columns(PGresult *res)
+{
+    int ncols = PQnfields(res);
+    cube_native_var *names = NATIVE_LIST();
+    cube_native_var *values = NATIVE_LIST();
+    for (int j = 0; j < ncols; j++)
+    {
+        ADD_NATIVE_LIST(names, NATIVE_STRING_COPY(PQfname(res, j)));
+        ADD_NATIVE_LIST(values, NATIVE_LIST());
+    }
+
+    cube_native_var *result = NATIVE_DICT();
+    ADD_NATIVE_DICT(result, (char *)"columns", names);
+    ADD_NATIVE_DICT(result, (char *)"values", values);
+    return result;
+}
+
 extern "C"
 {
     EXPORTED int opendb(char *host, char *user, char *passwd, char *name, bool create)
@@ -110,6 +130,7 @@ extern "C"
 
         DB db;
         db.closed = false;
+        db.columnar = false;
         db.message = NULL;
         db.data = NULL;
         db.db = PQconnectdb(ss.str().c_str());
@@ -189,6 +210,28 @@ extern "C"
 
         db->lastId = PQoidValue(res);
 
+        if (db->columnar)
+        {
+            db->data = new_columns(res);
+            cube_native_var *values = db->data->dict[1];
+
+            int rows = PQntuples(res);
+            for (int j = 0; j < values->size; j++)
+            {
+                cube_native_var *column = values->list[j];
+                for (int i = 0; i < rows; i++)
+                {
+                    if (PQgetisnull(res, i, j))
+                        ADD_NATIVE_LIST(column, NATIVE_NULL());
+                    else
+                        ADD_NATIVE_LIST(column, NATIVE_STRING_COPY(PQgetvalue(res, i, j)));
+                }
+            }
+
+            PQclear(res);
+            return true;
+        }
+
         cube_native_var *list = NULL;
 
         if (db->data == NULL)
@@ -245,6 +288,17 @@ extern "C"
         return true;
     }
 
+    // Makes exec keep its rows as columns instead of dicts
+    EXPORTED bool columnar(int id, bool enabled)
+    {
+        DB *db;
+        if (!getDB(id, &db))
+            return false;
+
+        db->columnar = enabled;
+        return true;
+    }
+
     EXPORTED cube_native_var *data(int id)
     {
         DB *db;
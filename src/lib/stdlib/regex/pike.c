@@ -0,0 +1,912 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pike.h"
+
+typedef enum
+{
+    OP_CHAR,
+    OP_ANY,
+    OP_CLASS,
+    OP_MATCH,
+    OP_JMP,
+    OP_SPLIT,
+    OP_SAVE,
+    OP_BOL,
+    OP_EOL,
+    OP_WORD,
+    OP_NOT_WORD
+} rx_op;
+
+// CHAR: x is the byte. CLASS: x is the class. JMP: x is the target.
+// SPLIT: x is the preferred target and y the other one. SAVE: x is the slot
+typedef struct
+{
+    int op;
+    int x;
+    int y;
+} rx_inst;
+
+typedef struct
+{
+    unsigned char bits[32];
+} rx_class;
+
+typedef struct
+{
+    int pc;
+    int *captures;
+} rx_thread;
+
+typedef struct
+{
+    rx_thread *threads;
+    int *captures;
+    int count;
+} rx_list;
+
+// Memory for a search, kept with the program so repeated searches do not
+// allocate
+typedef struct
+{
+    rx_list lists[2];
+    unsigned int *marks;
+    unsigned int generation;
+    int *captures;
+} rx_workspace;
+
+struct rx_program
+{
+    rx_inst *code;
+    int length;
+    rx_class *classes;
+    int classCount;
+    int groups;
+    int first;
+    bool anchored;
+    rx_workspace *workspace;
+};
+
+typedef enum
+{
+    NODE_CHAR,
+    NODE_ANY,
+    NODE_CLASS,
+    NODE_BOL,
+    NODE_EOL,
+    NODE_WORD,
+    NODE_NOT_WORD,
+    NODE_EMPTY,
+    NODE_CAT,
+    NODE_ALT,
+    NODE_GROUP,
+    NODE_REPEAT
+} rx_node_type;
+
+// CHAR: value is the byte. CLASS: value is the class. GROUP: value is the
+// group, -1 when it does not capture. REPEAT: min and max, -1 for no max
+typedef struct rx_node
+{
+    rx_node_type type;
+    int value;
+    int min;
+    int max;
+    bool greedy;
+    struct rx_node *left;
+    struct rx_node *right;
+    struct rx_node *allocated;
+} rx_node;
+
+typedef struct
+{
+    const char *pattern;
+    int position;
+    bool ignoreCase;
+    bool failed;
+    char *error;
+    int errorSize;
+    rx_node *nodes;
+    rx_program *program;
+    int codeCapacity;
+    int classCapacity;
+} rx_parser;
+
+static void fail(rx_parser *parser, const char *message)
+{
+    if (parser->failed)
+        return;
+    parser->failed = true;
+    snprintf(parser->error, parser->errorSize, "%s at position %d", message, parser->position);
+}
+
+static rx_node *newNode(rx_parser *parser, rx_node_type type)
+{
+    rx_node *node = (rx_node *)calloc(1, sizeof(rx_node));
+    node->type = type;
+    node->allocated = parser->nodes;
+    parser->nodes = node;
+    return node;
+}
+
+static int addClass(rx_parser *parser, rx_class *cls)
+{
+    rx_program *program = parser->program;
+    if (program->classCount == parser->classCapacity)
+    {
+        parser->classCapacity = parser->classCapacity == 0 ? 8 : parser->classCapacity * 2;
+        program->classes = (rx_class *)realloc(program->classes, sizeof(rx_class) * parser->classCapacity);
+    }
+    program->classes[program->classCount] = *cls;
+    return program->classCount++;
+}
+
+static void setBit(rx_class *cls, int c)
+{
+    cls->bits[c >> 3] |= (unsigned char)(1 << (c & 7));
+}
+
+static bool hasBit(const rx_class *cls, int c)
+{
+    return (cls->bits[c >> 3] & (1 << (c & 7))) != 0;
+}
+
+static bool isWord(int c)
+{
+    return isalnum(c) || c == '_';
+}
+
+// Adds the set of a \d, \w or \s style escape, false for other letters
+static bool addEscapeSet(rx_class *cls, char escape)
+{
+    int kind = tolower((unsigned char)escape);
+    if (kind != 'd' && kind != 'w' && kind != 's')
+        return false;
+
+    bool negate = isupper((unsigned char)escape) != 0;
+    for (int c = 0; c < 256; c++)
+    {
+        bool in;
+        if (kind == 'd')
+            in = isdigit(c) != 0;
+        else if (kind == 'w')
+            in = isWord(c);
+        else
+            in = c == ' ' || (c >= '\t' && c <= '\r');
+        if (in != negate)
+            setBit(cls, c);
+    }
+    return true;
+}
+
+static int escapedChar(char escape)
+{
+    switch (escape)
+    {
+        case 'n':
+            return '\n';
+        case 't':
+            return '\t';
+        case 'r':
+            return '\r';
+        case 'f':
+            return '\f';
+        case 'v':
+            return '\v';
+        case '0':
+            return '\0';
+        default:
+            return (unsigned char)escape;
+    }
+}
+
+static void addChar(rx_parser *parser, rx_class *cls, int c)
+{
+    setBit(cls, c);
+    if (parser->ignoreCase && isalpha(c))
+    {
+        setBit(cls, tolower(c));
+        setBit(cls, toupper(c));
+    }
+}
+
+static rx_node *parseAlternation(rx_parser *parser);
+
+static rx_node *parseClass(rx_parser *parser)
+{
+    const char *p = parser->pattern;
+    rx_class cls;
+    memset(&cls, 0, sizeof(cls));
+
+    bool negate = false;
+    if (p[parser->position] == '^')
+    {
+        negate = true;
+        parser->position++;
+    }
+
+    bool first = true;
+    while (p[parser->position] != ']' || first)
+    {
+        first = false;
+        if (p[parser->position] == '\0')
+        {
+            fail(parser, "Missing ']'");
+            return NULL;
+        }
+
+        int low = (unsigned char)p[parser->position++];
+        if (low == '\\')
+        {
+            char escape = p[parser->position];
+            if (escape == '\0')
+            {
+                fail(parser, "Trailing '\\'");
+                return NULL;
+            }
+            parser->position++;
+            if (addEscapeSet(&cls, escape))
+                continue;
+            low = escapedChar(escape);
+        }
+
+        int high = low;
+        if (p[parser->position] == '-' && p[parser->position + 1] != ']' && p[parser->position + 1] != '\0')
+        {
+            parser->position++;
+            high = (unsigned char)p[parser->position++];
+            if (high == '\\' && p[parser->position] != '\0')
+                high = escapedChar(p[parser->position++]);
+            if (high < low)
+            {
+                fail(parser, "Invalid range");
+                return NULL;
+            }
+        }
+
+        for (int c = low; c <= high; c++)
+            addChar(parser, &cls, c);
+    }
+    parser->position++;
+
+    if (negate)
+    {
+        for (int i = 0; i < 32; i++)
+            cls.bits[i] = (unsigned char)~cls.bits[i];
+    }
+
+    rx_node *node = newNode(parser, NODE_CLASS);
+    node->value = addClass(parser, &cls);
+    return node;
+}
+
+static rx_node *charNode(rx_parser *parser, int c)
+{
+    if (parser->ignoreCase && isalpha(c))
+    {
+        rx_class cls;
+        memset(&cls, 0, sizeof(cls));
+        addChar(parser, &cls, c);
+        rx_node *node = newNode(parser, NODE_CLASS);
+        node->value = addClass(parser, &cls);
+        return node;
+    }
+
+    rx_node *node = newNode(parser, NODE_CHAR);
+    node->value = c;
+    return node;
+}
+
+static rx_node *parseAtom(rx_parser *parser)
+{
+    const char *p = parser->pattern;
+    char c = p[parser->position++];
+    switch (c)
+    {
+        case '(': {
+            int group = -1;
+            if (p[parser->position] == '?' && p[parser->position + 1] == ':')
+                parser->position += 2;
+            else
+                group = parser->program->groups++;
+
+            rx_node *node = newNode(parser, NODE_GROUP);
+            node->value = group;
+            node->left = parseAlternation(parser);
+            if (p[parser->position] != ')')
+            {
+                fail(parser, "Missing ')'");
+                return NULL;
+            }
+            parser->position++;
+            return node;
+        }
+        case '[':
+            return parseClass(parser);
+        case '.':
+            return newNode(parser, NODE_ANY);
+        case '^':
+            return newNode(parser, NODE_BOL);
+        case '$':
+            return newNode(parser, NODE_EOL);
+        case '*':
+        case '+':
+        case '?':
+            parser->position--;
+            fail(parser, "Nothing to repeat");
+            return NULL;
+        case '\\': {
+            char escape = p[parser->position];
+            if (escape == '\0')
+            {
+                fail(parser, "Trailing '\\'");
+                return NULL;
+            }
+            parser->position++;
+            if (escape == 'b')
+                return newNode(parser, NODE_WORD);
+            if (escape == 'B')
+                return newNode(parser, NODE_NOT_WORD);
+
+            rx_class cls;
+            memset(&cls, 0, sizeof(cls));
+            if (addEscapeSet(&cls, escape))
+            {
+                rx_node *node = newNode(parser, NODE_CLASS);
+                node->value = addClass(parser, &cls);
+                return node;
+            }
+            return charNode(parser, escapedChar(escape));
+        }
+        default:
+            return charNode(parser, (unsigned char)c);
+    }
+}
+
+static bool parseNumber(rx_parser *parser, int *value)
+{
+    const char *p = parser->pattern;
+    if (!isdigit((unsigned char)p[parser->position]))
+        return false;
+
+    *value = 0;
+    while (isdigit((unsigned char)p[parser->position]))
+    {
+        *value = *value * 10 + (p[parser->position++] - '0');
+        if (*value > 1000)
+        {
+            fail(parser, "Repetition count too large");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads {n}, {n,} or {n,m}. Anything else leaves the '{' as a literal
+static bool parseCount(rx_parser *parser, int *min, int *max)
+{
+    int start = parser->position;
+    parser->position++;
+    if (!parseNumber(parser, min))
+    {
+        parser->position = start;
+        return false;
+    }
+
+    *max = *min;
+    if (parser->pattern[parser->position] == ',')
+    {
+        parser->position++;
+        if (!parseNumber(parser, max))
+            *max = -1;
+    }
+
+    if (parser->failed || parser->pattern[parser->position] != '}')
+    {
+        parser->position = start;
+        return false;
+    }
+    parser->position++;
+
+    if (*max >= 0 && *max < *min)
+    {
+        fail(parser, "Invalid repetition count");
+        return false;
+    }
+    return true;
+}
+
+static rx_node *parseRepeat(rx_parser *parser)
+{
+    rx_node *atom = parseAtom(parser);
+    while (atom != NULL && !parser->failed)
+    {
+        const char *p = parser->pattern;
+        int min, max;
+        char c = p[parser->position];
+        if (c == '*')
+        {
+            min = 0;
+            max = -1;
+        }
+        else if (c == '+')
+        {
+            min = 1;
+            max = -1;
+        }
+        else if (c == '?')
+        {
+            min = 0;
+            max = 1;
+        }
+        else if (c == '{')
+        {
+            if (!parseCount(parser, &min, &max))
+                break;
+            parser->position--;
+        }
+        else
+            break;
+        parser->position++;
+
+        if (atom->type == NODE_BOL || atom->type == NODE_EOL || atom->type == NODE_WORD ||
+            atom->type == NODE_NOT_WORD)
+        {
+            fail(parser, "Nothing to repeat");
+            return NULL;
+        }
+
+        rx_node *node = newNode(parser, NODE_REPEAT);
+        node->min = min;
+        node->max = max;
+        node->greedy = true;
+        if (p[parser->position] == '?')
+        {
+            node->greedy = false;
+            parser->position++;
+        }
+        node->left = atom;
+        atom = node;
+    }
+    return atom;
+}
+
+static rx_node *parseConcatenation(rx_parser *parser)
+{
+    rx_node *node = newNode(parser, NODE_EMPTY);
+    const char *p = parser->pattern;
+    while (!parser->failed && p[parser->position] != '\0' && p[parser->position] != '|' &&
+           p[parser->position] != ')')
+    {
+        rx_node *next = parseRepeat(parser);
+        if (next == NULL)
+            return NULL;
+
+        if (node->type == NODE_EMPTY)
+            node = next;
+        else
+        {
+            rx_node *cat = newNode(parser, NODE_CAT);
+            cat->left = node;
+            cat->right = next;
+            node = cat;
+        }
+    }
+    return node;
+}
+
+static rx_node *parseAlternation(rx_parser *parser)
+{
+    rx_node *node = parseConcatenation(parser);
+    while (node != NULL && !parser->failed && parser->pattern[parser->position] == '|')
+    {
+        parser->position++;
+        rx_node *alt = newNode(parser, NODE_ALT);
+        alt->left = node;
+        alt->right = parseConcatenation(parser);
+        if (alt->right == NULL)
+            return NULL;
+        node = alt;
+    }
+    return node;
+}
+
+static int emit(rx_parser *parser, int op, int x, int y)
+{
+    rx_program *program = parser->program;
+    if (program->length >= RX_MAX_PROGRAM)
+    {
+        fail(parser, "Pattern too large");
+        return 0;
+    }
+    if (program->length == parser->codeCapacity)
+    {
+        parser->codeCapacity = parser->codeCapacity == 0 ? 32 : parser->codeCapacity * 2;
+        program->code = (rx_inst *)realloc(program->code, sizeof(rx_inst) * parser->codeCapacity);
+    }
+
+    rx_inst *inst = &program->code[program->length];
+    inst->op = op;
+    inst->x = x;
+    inst->y = y;
+    return program->length++;
+}
+
+// Fills the target a SPLIT does not prefer
+static void patchSplit(rx_parser *parser, int pc, bool greedy, int target)
+{
+    if (parser->failed)
+        return;
+    rx_inst *inst = &parser->program->code[pc];
+    if (greedy)
+        inst->y = target;
+    else
+    {
+        inst->y = inst->x;
+        inst->x = target;
+    }
+}
+
+static void generate(rx_parser *parser, rx_node *node)
+{
+    if (parser->failed)
+        return;
+
+    rx_program *program = parser->program;
+    switch (node->type)
+    {
+        case NODE_CHAR:
+            emit(parser, OP_CHAR, node->value, 0);
+            break;
+        case NODE_ANY:
+            emit(parser, OP_ANY, 0, 0);
+            break;
+        case NODE_CLASS:
+            emit(parser, OP_CLASS, node->value, 0);
+            break;
+        case NODE_BOL:
+            emit(parser, OP_BOL, 0, 0);
+            break;
+        case NODE_EOL:
+            emit(parser, OP_EOL, 0, 0);
+            break;
+        case NODE_WORD:
+            emit(parser, OP_WORD, 0, 0);
+            break;
+        case NODE_NOT_WORD:
+            emit(parser, OP_NOT_WORD, 0, 0);
+            break;
+        case NODE_EMPTY:
+            break;
+        case NODE_CAT:
+            generate(parser, node->left);
+            generate(parser, node->right);
+            break;
+        case NODE_ALT: {
+            int split = emit(parser, OP_SPLIT, program->length + 1, 0);
+            generate(parser, node->left);
+            int jump = emit(parser, OP_JMP, 0, 0);
+            if (parser->failed)
+                return;
+            program->code[split].y = program->length;
+            generate(parser, node->right);
+            if (parser->failed)
+                return;
+            program->code[jump].x = program->length;
+            break;
+        }
+        case NODE_GROUP:
+            if (node->value >= 0)
+                emit(parser, OP_SAVE, node->value * 2, 0);
+            generate(parser, node->left);
+            if (node->value >= 0)
+                emit(parser, OP_SAVE, node->value * 2 + 1, 0);
+            break;
+        case NODE_REPEAT: {
+            for (int i = 0; i < node->min && !parser->failed; i++)
+            {
+                if (i == node->min - 1 && node->max < 0)
+                {
+                    // x+ as x followed by a jump back
+                    int start = program->length;
+                    generate(parser, node->left);
+                    int split = emit(parser, OP_SPLIT, start, 0);
+                    patchSplit(parser, split, node->greedy, program->length);
+                    return;
+                }
+                generate(parser, node->left);
+            }
+
+            if (node->max < 0)
+            {
+                int split = emit(parser, OP_SPLIT, program->length + 1, 0);
+                generate(parser, node->left);
+                emit(parser, OP_JMP, split, 0);
+                patchSplit(parser, split, node->greedy, program->length);
+                return;
+            }
+
+            // Optional copies, failing one skips all that follow
+            int optional = node->max - node->min;
+            int *splits = (int *)malloc(sizeof(int) * (optional > 0 ? optional : 1));
+            for (int i = 0; i < optional && !parser->failed; i++)
+            {
+                splits[i] = emit(parser, OP_SPLIT, program->length + 1, 0);
+                generate(parser, node->left);
+            }
+            for (int i = 0; i < optional && !parser->failed; i++)
+                patchSplit(parser, splits[i], node->greedy, program->length);
+            free(splits);
+            break;
+        }
+    }
+}
+
+// Follows the SAVEs at the start of the program to find what every match
+// must begin with
+static void analyze(rx_program *program)
+{
+    program->first = -1;
+    program->anchored = false;
+
+    int pc = 0;
+    while (pc < program->length && program->code[pc].op == OP_SAVE)
+        pc++;
+    if (pc >= program->length)
+        return;
+
+    if (program->code[pc].op == OP_CHAR)
+        program->first = program->code[pc].x;
+    else if (program->code[pc].op == OP_BOL)
+        program->anchored = true;
+}
+
+rx_program *rx_compile(const char *pattern, char *error, int errorSize)
+{
+    rx_parser parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.pattern = pattern;
+    parser.error = error;
+    parser.errorSize = errorSize;
+    parser.program = (rx_program *)calloc(1, sizeof(rx_program));
+    parser.program->groups = 1;
+
+    if (strncmp(pattern, "(?i)", 4) == 0)
+    {
+        parser.ignoreCase = true;
+        parser.position = 4;
+    }
+
+    rx_node *root = parseAlternation(&parser);
+    if (!parser.failed && pattern[parser.position] == ')')
+        fail(&parser, "Unmatched ')'");
+
+    if (!parser.failed && root != NULL)
+    {
+        emit(&parser, OP_SAVE, 0, 0);
+        generate(&parser, root);
+        emit(&parser, OP_SAVE, 1, 0);
+        emit(&parser, OP_MATCH, 0, 0);
+    }
+
+    while (parser.nodes != NULL)
+    {
+        rx_node *next = parser.nodes->allocated;
+        free(parser.nodes);
+        parser.nodes = next;
+    }
+
+    if (parser.failed || root == NULL)
+    {
+        rx_free(parser.program);
+        return NULL;
+    }
+
+    analyze(parser.program);
+    return parser.program;
+}
+
+void rx_free(rx_program *program)
+{
+    if (program == NULL)
+        return;
+
+    rx_workspace *workspace = program->workspace;
+    if (workspace != NULL)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            free(workspace->lists[i].threads);
+            free(workspace->lists[i].captures);
+        }
+        free(workspace->marks);
+        free(workspace->captures);
+        free(workspace);
+    }
+
+    free(program->code);
+    free(program->classes);
+    free(program);
+}
+
+int rx_groups(const rx_program *program)
+{
+    return program->groups;
+}
+
+static rx_workspace *getWorkspace(rx_program *program)
+{
+    if (program->workspace != NULL)
+        return program->workspace;
+
+    int slots = program->groups * 2;
+    rx_workspace *workspace = (rx_workspace *)calloc(1, sizeof(rx_workspace));
+    for (int i = 0; i < 2; i++)
+    {
+        workspace->lists[i].threads = (rx_thread *)malloc(sizeof(rx_thread) * program->length);
+        workspace->lists[i].captures = (int *)malloc(sizeof(int) * program->length * slots);
+    }
+    workspace->marks = (unsigned int *)calloc(program->length, sizeof(unsigned int));
+    workspace->captures = (int *)malloc(sizeof(int) * slots);
+    program->workspace = workspace;
+    return workspace;
+}
+
+typedef struct
+{
+    const rx_program *program;
+    const char *text;
+    int length;
+    int slots;
+    unsigned int *marks;
+} rx_search_state;
+
+static bool atWordBoundary(const rx_search_state *state, int sp)
+{
+    bool before = sp > 0 && isWord((unsigned char)state->text[sp - 1]);
+    bool after = sp < state->length && isWord((unsigned char)state->text[sp]);
+    return before != after;
+}
+
+// Adds the thread at 'pc' and everything reachable from it without reading
+// a byte, each pc at most once per position
+static void addThread(rx_search_state *state, rx_list *list, int pc, int *captures, int sp, unsigned int generation)
+{
+    if (state->marks[pc] == generation)
+        return;
+    state->marks[pc] = generation;
+
+    const rx_inst *inst = &state->program->code[pc];
+    switch (inst->op)
+    {
+        case OP_JMP:
+            addThread(state, list, inst->x, captures, sp, generation);
+            break;
+        case OP_SPLIT:
+            addThread(state, list, inst->x, captures, sp, generation);
+            addThread(state, list, inst->y, captures, sp, generation);
+            break;
+        case OP_SAVE: {
+            int old = captures[inst->x];
+            captures[inst->x] = sp;
+            addThread(state, list, pc + 1, captures, sp, generation);
+            captures[inst->x] = old;
+            break;
+        }
+        case OP_BOL:
+            if (sp == 0)
+                addThread(state, list, pc + 1, captures, sp, generation);
+            break;
+        case OP_EOL:
+            if (sp == state->length)
+                addThread(state, list, pc + 1, captures, sp, generation);
+            break;
+        case OP_WORD:
+            if (atWordBoundary(state, sp))
+                addThread(state, list, pc + 1, captures, sp, generation);
+            break;
+        case OP_NOT_WORD:
+            if (!atWordBoundary(state, sp))
+                addThread(state, list, pc + 1, captures, sp, generation);
+            break;
+        default: {
+            rx_thread *thread = &list->threads[list->count];
+            thread->pc = pc;
+            thread->captures = list->captures + list->count * state->slots;
+            memcpy(thread->captures, captures, sizeof(int) * state->slots);
+            list->count++;
+            break;
+        }
+    }
+}
+
+bool rx_search(const rx_program *program, const char *text, int length, int start, int *captures)
+{
+    if (start < 0 || start > length)
+        return false;
+
+    rx_workspace *workspace = getWorkspace((rx_program *)program);
+    rx_search_state state;
+    state.program = program;
+    state.text = text;
+    state.length = length;
+    state.slots = program->groups * 2;
+    state.marks = workspace->marks;
+
+    // Each position gets its own mark generation
+    if (workspace->generation > 0xF0000000u - (unsigned int)length)
+    {
+        memset(workspace->marks, 0, sizeof(unsigned int) * program->length);
+        workspace->generation = 0;
+    }
+    unsigned int base = workspace->generation + 1;
+    workspace->generation = base + (unsigned int)(length - start) + 1;
+
+    rx_list *current = &workspace->lists[0];
+    rx_list *next = &workspace->lists[1];
+    current->count = 0;
+
+    bool matched = false;
+    for (int sp = start; sp <= length; sp++)
+    {
+        if (!matched && (!program->anchored || sp == 0))
+        {
+            if (current->count == 0 && program->first >= 0)
+            {
+                const char *found = (const char *)memchr(text + sp, program->first, length - sp);
+                if (found == NULL)
+                    break;
+                sp = (int)(found - text);
+            }
+
+            for (int i = 0; i < state.slots; i++)
+                workspace->captures[i] = -1;
+            addThread(&state, current, 0, workspace->captures, sp, base + (unsigned int)(sp - start));
+        }
+        if (current->count == 0)
+        {
+            if (matched || program->anchored)
+                break;
+            continue;
+        }
+
+        next->count = 0;
+        int c = sp < length ? (unsigned char)text[sp] : -1;
+        unsigned int generation = base + (unsigned int)(sp - start) + 1;
+        for (int i = 0; i < current->count; i++)
+        {
+            rx_thread *thread = &current->threads[i];
+            const rx_inst *inst = &program->code[thread->pc];
+            bool step = false;
+            switch (inst->op)
+            {
+                case OP_CHAR:
+                    step = c == inst->x;
+                    break;
+                case OP_ANY:
+                    step = c >= 0 && c != '\n';
+                    break;
+                case OP_CLASS:
+                    step = c >= 0 && hasBit(&program->classes[inst->x], c);
+                    break;
+                case OP_MATCH:
+                    // Threads after this one have lower priority
+                    matched = true;
+                    memcpy(captures, thread->captures, sizeof(int) * state.slots);
+                    i = current->count;
+                    break;
+            }
+            if (step)
+                addThread(&state, next, thread->pc + 1, thread->captures, sp + 1, generation);
+        }
+
+        rx_list *swap = current;
+        current = next;
+        next = swap;
+    }
+
+    workspace->lists[0].count = 0;
+    workspace->lists[1].count = 0;
+    return matched;
+}
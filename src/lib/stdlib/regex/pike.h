@@ -0,0 +1,30 @@
+#ifndef CUBE_REGEX_PIKE_h
+#define CUBE_REGEX_PIKE_h
+
+#include <stdbool.h>
+
+// Regular expressions compiled to a small program and run by a Pike VM,
+// which follows every alternative at once. The time is linear in the
+// length of the text whatever the pattern, with leftmost-first (Perl like)
+// submatches.
+//
+// Syntax: literals, '.', [sets] with ranges and negation, \d \w \s \D \W
+// \S, \b \B, anchors ^ and $, (groups), (?:non capturing groups),
+// alternation '|', the quantifiers * + ? {n} {n,} {n,m} and their lazy
+// forms (*? and so on). A leading (?i) ignores case.
+#define RX_MAX_PROGRAM 16384
+
+typedef struct rx_program rx_program;
+
+rx_program *rx_compile(const char *pattern, char *error, int errorSize);
+void rx_free(rx_program *program);
+
+// Number of capture groups, group 0 (the whole match) included
+int rx_groups(const rx_program *program);
+
+// Looks for the leftmost match at or after 'start'. On success 'captures'
+// holds a start and an end offset for each group, -1 when a group took no
+// part in the match
+bool rx_search(const rx_program *program, const char *text, int length, int start, int *captures);
+
+#endif
@@ -1,137 +1,379 @@
 #include <cube/cubeext.h>
-#include <re.h>
+#include <stdio.h>
 
-typedef struct pattern_st
+#include "pike.h"
+
+// Compiled programs by id, the same pattern always gets the same id
+typedef struct
 {
-    re_t pattern;
+    char *pattern;
     int id;
-    struct pattern_st *next;
-} pattern_t;
+} pattern_entry;
 
-typedef struct match_st
+typedef struct
 {
-    char *match;
-    int idx;
+    char *chars;
     int length;
-    struct match_st *next;
-} match_t;
+    int capacity;
+} text_buffer;
+
+rx_program **programs = NULL;
+int programCount = 0;
+int programCapacity = 0;
+
+pattern_entry *entries = NULL;
+int entryCapacity = 0;
+
+char lastErrorText[256];
+
+static unsigned int hashPattern(const char *pattern)
+{
+    unsigned int hash = 2166136261u;
+    for (const char *c = pattern; *c != '\0'; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static pattern_entry *findEntry(pattern_entry *table, int capacity, const char *pattern)
+{
+    unsigned int index = hashPattern(pattern) & (capacity - 1);
+    while (table[index].pattern != NULL && strcmp(table[index].pattern, pattern) != 0)
+        index = (index + 1) & (capacity - 1);
+    return &table[index];
+}
+
+static void growEntries()
+{
+    int capacity = entryCapacity == 0 ? 16 : entryCapacity * 2;
+    pattern_entry *table = (pattern_entry *)calloc(capacity, sizeof(pattern_entry));
+    for (int i = 0; i < entryCapacity; i++)
+    {
+        if (entries[i].pattern != NULL)
+            *findEntry(table, capacity, entries[i].pattern) = entries[i];
+    }
+    free(entries);
+    entries = table;
+    entryCapacity = capacity;
+}
+
+static rx_program *getProgram(int id)
+{
+    if (id < 0 || id >= programCount)
+        return NULL;
+    return programs[id];
+}
 
-match_t *matchs = NULL;
-pattern_t *patterns = NULL;
+static void appendText(text_buffer *buffer, const char *chars, int length)
+{
+    if (buffer->length + length + 1 > buffer->capacity)
+    {
+        int capacity = buffer->capacity < 64 ? 64 : buffer->capacity;
+        while (capacity < buffer->length + length + 1)
+            capacity *= 2;
+        buffer->chars = (char *)realloc(buffer->chars, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->chars + buffer->length, chars, length);
+    buffer->length += length;
+    buffer->chars[buffer->length] = '\0';
+}
+
+static cube_native_var *substring(const char *text, int start, int end)
+{
+    if (start < 0 || end < start)
+        return NATIVE_NULL();
+
+    char *chars = (char *)malloc(end - start + 1);
+    memcpy(chars, text + start, end - start);
+    chars[end - start] = '\0';
+    return NATIVE_STRING(chars);
+}
+
+// Where the next search starts, one past an empty match so it can not be
+// found again
+static int nextStart(int *captures)
+{
+    return captures[1] > captures[0] ? captures[1] : captures[1] + 1;
+}
 
 EXPORTED void cube_init()
 {
-    matchs = NULL;
-    patterns = NULL;
+    programs = NULL;
+    programCount = 0;
+    programCapacity = 0;
+    entries = NULL;
+    entryCapacity = 0;
+    lastErrorText[0] = '\0';
 }
 
 EXPORTED void cube_release()
 {
-    pattern_t *curP = NULL;
-    while (patterns != NULL)
+    for (int i = 0; i < programCount; i++)
+        rx_free(programs[i]);
+    free(programs);
+    programs = NULL;
+    programCount = 0;
+    programCapacity = 0;
+
+    for (int i = 0; i < entryCapacity; i++)
+        free(entries[i].pattern);
+    free(entries);
+    entries = NULL;
+    entryCapacity = 0;
+}
+
+// Not called through compile, the cube executable exports a compile of its
+// own and the dynamic linker resolves calls from here to that one
+static int compilePattern(const char *pattern)
+{
+    if (pattern == NULL)
+        return -1;
+
+    if (entryCapacity > 0)
     {
-        curP = patterns;
-        patterns = curP->next;
-        free(curP);
+        pattern_entry *entry = findEntry(entries, entryCapacity, pattern);
+        if (entry->pattern != NULL)
+            return entry->id;
     }
 
-    match_t *curM = NULL;
-    while (matchs != NULL)
+    rx_program *program = rx_compile(pattern, lastErrorText, sizeof(lastErrorText));
+    if (program == NULL)
+        return -1;
+
+    if (programCount == programCapacity)
     {
-        curM = matchs;
-        matchs = curM->next;
-        free(curM->match);
-        free(curM);
+        programCapacity = programCapacity == 0 ? 8 : programCapacity * 2;
+        programs = (rx_program **)realloc(programs, sizeof(rx_program *) * programCapacity);
     }
+    programs[programCount] = program;
+
+    if ((programCount + 1) * 4 > entryCapacity * 3)
+        growEntries();
+    pattern_entry *entry = findEntry(entries, entryCapacity, pattern);
+    entry->pattern = COPY_STR(pattern);
+    entry->id = programCount;
+
+    return programCount++;
 }
 
+// Returns the id of the compiled pattern, -1 when it does not compile
 EXPORTED int compile(const char *pattern)
 {
-    pattern_t *p = malloc(sizeof(pattern_t));
-    p->next = patterns;
-    if (p->next == NULL)
-        p->id = 0;
-    else
-        p->id = p->next->id + 1;
-    p->pattern = re_compile(pattern);
-    patterns = p;
-    return p->id;
+    return compilePattern(pattern);
 }
 
-EXPORTED char *match(const char *pattern, const char *text)
+EXPORTED char *lastError()
 {
-    int match_length;
-    int match_idx = re_match(pattern, text, &match_length);
-    if (match_idx == -1)
-        return NULL;
+    return lastErrorText;
+}
+
+EXPORTED int groupCount(int id)
+{
+    rx_program *program = getProgram(id);
+    if (program == NULL)
+        return -1;
+    return rx_groups(program) - 1;
+}
 
-    match_t *m = malloc(sizeof(match_t));
-    m->next = matchs;
-    m->idx = match_idx;
-    m->length = match_length;
-    m->match = malloc(sizeof(char) * (match_length + 1));
-    memcpy(m->match, &text[match_idx], match_length);
-    m->match[match_length] = '\0';
+EXPORTED bool test(int id, const char *text)
+{
+    rx_program *program = getProgram(id);
+    if (program == NULL || text == NULL)
+        return false;
 
-    matchs = m;
-    return m->match;
+    int captures[2 * 64];
+    int *spans = rx_groups(program) <= 64 ? captures : (int *)malloc(sizeof(int) * 2 * rx_groups(program));
+    bool found = rx_search(program, text, strlen(text), 0, spans);
+    if (spans != captures)
+        free(spans);
+    return found;
 }
 
-EXPORTED char *matchp(int id, const char *text)
+// The offsets [start, end] of every group of the first match at or after
+// 'start', -1 for groups that did not take part, null without a match
+EXPORTED cube_native_var *search(int id, const char *text, int start)
 {
-    pattern_t *p = patterns;
-    while (p != NULL && p->id != id)
+    rx_program *program = getProgram(id);
+    if (program == NULL || text == NULL)
+        return NATIVE_NULL();
+
+    int slots = rx_groups(program) * 2;
+    int *captures = (int *)malloc(sizeof(int) * slots);
+    cube_native_var *result;
+    if (rx_search(program, text, strlen(text), start, captures))
     {
-        p = p->next;
+        result = NATIVE_LIST();
+        for (int i = 0; i < slots; i++)
+            ADD_NATIVE_LIST(result, NATIVE_NUMBER(captures[i]));
     }
+    else
+        result = NATIVE_NULL();
 
-    if (p == NULL)
-        return NULL;
+    free(captures);
+    return result;
+}
 
-    int match_length;
-    int match_idx = re_matchp(p->pattern, text, &match_length);
-    if (match_idx == -1)
-        return NULL;
+EXPORTED cube_native_var *matchp(int id, const char *text)
+{
+    rx_program *program = getProgram(id);
+    if (program == NULL || text == NULL)
+        return NATIVE_NULL();
 
-    match_t *m = malloc(sizeof(match_t));
-    m->next = matchs;
-    m->idx = match_idx;
-    m->length = match_length;
-    m->match = malloc(sizeof(char) * (match_length + 1));
-    memcpy(m->match, &text[match_idx], match_length);
-    m->match[match_length] = '\0';
+    int *captures = (int *)malloc(sizeof(int) * rx_groups(program) * 2);
+    cube_native_var *result;
+    if (rx_search(program, text, strlen(text), 0, captures))
+        result = substring(text, captures[0], captures[1]);
+    else
+        result = NATIVE_NULL();
+    free(captures);
+    return result;
+}
 
-    matchs = m;
-    return m->match;
+EXPORTED cube_native_var *match(const char *pattern, const char *text)
+{
+    return matchp(compilePattern(pattern), text);
 }
 
-EXPORTED cube_native_var *matchAll(char *pattern, const char *text)
+// Every match in one call. Patterns with groups give the list of their
+// groups for each match, the others the matched text
+EXPORTED cube_native_var *findAll(int id, const char *text)
 {
     cube_native_var *list = NATIVE_LIST();
+    rx_program *program = getProgram(id);
+    if (program == NULL || text == NULL)
+        return list;
 
-    int id = compile(pattern);
-
-    char *txt = (char *)text;
-    char *res = matchp(id, txt);
-    while (res != NULL)
+    int groups = rx_groups(program);
+    int length = strlen(text);
+    int *captures = (int *)malloc(sizeof(int) * groups * 2);
+    int start = 0;
+    while (start <= length && rx_search(program, text, length, start, captures))
     {
-        ADD_NATIVE_LIST(list, NATIVE_STRING_COPY(res));
-        txt = txt + (matchs->idx + matchs->length);
-        res = matchp(id, txt);
+        if (groups == 1)
+            ADD_NATIVE_LIST(list, substring(text, captures[0], captures[1]));
+        else
+        {
+            cube_native_var *item = NATIVE_LIST();
+            for (int i = 1; i < groups; i++)
+                ADD_NATIVE_LIST(item, substring(text, captures[i * 2], captures[i * 2 + 1]));
+            ADD_NATIVE_LIST(list, item);
+        }
+        start = nextStart(captures);
     }
+
+    free(captures);
     return list;
 }
 
 EXPORTED cube_native_var *matchpAll(int id, const char *text)
 {
     cube_native_var *list = NATIVE_LIST();
-    char *txt = (char *)text;
-    char *res = matchp(id, txt);
-    while (res != NULL)
+    rx_program *program = getProgram(id);
+    if (program == NULL || text == NULL)
+        return list;
+
+    int length = strlen(text);
+    int *captures = (int *)malloc(sizeof(int) * rx_groups(program) * 2);
+    int start = 0;
+    while (start <= length && rx_search(program, text, length, start, captures))
     {
-        ADD_NATIVE_LIST(list, NATIVE_STRING_COPY(res));
-        txt = txt + (matchs->idx + matchs->length);
-        res = matchp(id, txt);
+        ADD_NATIVE_LIST(list, substring(text, captures[0], captures[1]));
+        start = nextStart(captures);
     }
+
+    free(captures);
     return list;
-}
\ No newline at end of file
+}
+
+EXPORTED cube_native_var *matchAll(const char *pattern, const char *text)
+{
+    return matchpAll(compilePattern(pattern), text);
+}
+
+// Replaces up to 'count' matches (all of them when 'count' is not
+// positive). $0 to $9 in 'replacement' insert a group, $$ a '$'
+EXPORTED cube_native_var *replace(int id, const char *text, const char *replacement, int count)
+{
+    rx_program *program = getProgram(id);
+    if (program == NULL || text == NULL)
+        return NATIVE_NULL();
+    if (replacement == NULL)
+        replacement = "";
+
+    int groups = rx_groups(program);
+    int length = strlen(text);
+    int *captures = (int *)malloc(sizeof(int) * groups * 2);
+    text_buffer buffer = {NULL, 0, 0};
+    appendText(&buffer, "", 0);
+
+    int copied = 0;
+    int start = 0;
+    int replaced = 0;
+    while ((count <= 0 || replaced < count) && start <= length &&
+           rx_search(program, text, length, start, captures))
+    {
+        appendText(&buffer, text + copied, captures[0] - copied);
+        for (const char *c = replacement; *c != '\0'; c++)
+        {
+            if (c[0] == '$' && c[1] == '$')
+            {
+                appendText(&buffer, "$", 1);
+                c++;
+            }
+            else if (c[0] == '$' && c[1] >= '0' && c[1] <= '9')
+            {
+                int group = c[1] - '0';
+                if (group < groups && captures[group * 2] >= 0)
+                    appendText(&buffer, text + captures[group * 2], captures[group * 2 + 1] - captures[group * 2]);
+                c++;
+            }
+            else
+                appendText(&buffer, c, 1);
+        }
+
+        copied = captures[1];
+        start = nextStart(captures);
+        if (captures[1] == captures[0] && captures[1] < length)
+        {
+            appendText(&buffer, text + copied, 1);
+            copied++;
+        }
+        replaced++;
+    }
+    appendText(&buffer, text + copied, length - copied);
+
+    free(captures);
+    return NATIVE_STRING(buffer.chars);
+}
+
+// The text between matches, at most 'limit' splits when it is positive
+EXPORTED cube_native_var *split(int id, const char *text, int limit)
+{
+    cube_native_var *list = NATIVE_LIST();
+    rx_program *program = getProgram(id);
+    if (program == NULL || text == NULL)
+        return list;
+
+    int length = strlen(text);
+    int *captures = (int *)malloc(sizeof(int) * rx_groups(program) * 2);
+    int copied = 0;
+    int start = 0;
+    int splits = 0;
+    while ((limit <= 0 || splits < limit) && start <= length && rx_search(program, text, length, start, captures))
+    {
+        start = nextStart(captures);
+        if (captures[1] == captures[0] && (captures[0] == 0 || captures[0] == length))
+            continue;
+
+        ADD_NATIVE_LIST(list, substring(text, copied, captures[0]));
+        copied = captures[1];
+        splits++;
+    }
+    ADD_NATIVE_LIST(list, substring(text, copied, length));
+
+    free(captures);
+    return list;
+}
@@ -5,19 +5,51 @@
  * @Last Modified time: 2021-09-24 22:16:57
  */
 #include <cube/cubeext.h>
+#include <math.h>
 #include <sqlite3.h>
 #include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+// Prepared statements kept per database, the whole cache is dropped when it
+// grows past this
+#define STATEMENT_CACHE_SIZE 64
+
+typedef enum
+{
+    ROWS_DICT,
+    ROWS_TUPLE,
+    ROWS_COLUMNS
+} RowFormat;
+
 typedef struct
 {
     sqlite3 *db;
     char *message;
+    std::string *error; // Copy of an error that has to outlive later calls
     bool closed;
+    bool columnar;
     cube_native_var *data;
+    std::unordered_map<std::string, sqlite3_stmt *> *statements;
 } DB;
 
+typedef struct
+{
+    int db;
+    std::string sql;
+    sqlite3_stmt *stmt;
+    bool done;
+    bool closed;
+} Cursor;
+
 std::vector<DB> dbs;
+std::vector<Cursor> cursors;
+
+// Column names handed out as dict keys. The VM never frees native keys, so
+// each name is kept once here instead of copied per cell
+std::unordered_set<std::string> columnNames;
 
 void free_cube_native_var(cube_native_var *var, bool skipFirst, bool skipInterns)
 {
@@ -74,6 +106,14 @@ bool getDB(int id, DB **db)
     return !dbs[id].closed;
 }
 
+bool getCursor(int id, Cursor **cursor)
+{
+    if (id < 0 || id >= cursors.size())
+        return false;
+    *cursor = &cursors[id];
+    return !cursors[id].closed;
+}
+
 void prepare_db(DB *db)
 {
     if (db->message)
@@ -91,12 +131,249 @@ void prepare_db(DB *db)
     db->data = NULL;
 }
 
+void clear_statements(DB *db)
+{
+    for (auto &entry : *db->statements)
+        sqlite3_finalize(entry.second);
+    db->statements->clear();
+}
+
+// Returns the statement for 'sql' ready to be bound, preparing it only the
+// first time it is seen
+sqlite3_stmt *get_statement(DB *db, const char *sql)
+{
+    auto it = db->statements->find(sql);
+    if (it != db->statements->end())
+    {
+        sqlite3_reset(it->second);
+        sqlite3_clear_bindings(it->second);
+        return it->second;
+    }
+
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        db->message = (char *)sqlite3_errmsg(db->db);
+        return NULL;
+    }
+
+    if (db->statements->size() >= STATEMENT_CACHE_SIZE)
+        clear_statements(db);
+    (*db->statements)[sql] = stmt;
+    return stmt;
+}
+
+// Keeps the current error, sqlite3_errmsg() only lasts until the next call
+void keep_error(DB *db)
+{
+    *db->error = sqlite3_errmsg(db->db);
+    db->message = (char *)db->error->c_str();
+}
+
+// Cursors own their statement while open, it goes back to the cache when
+// they are closed
+void release_statement(DB *db, const std::string &sql, sqlite3_stmt *stmt)
+{
+    if (db->statements->find(sql) != db->statements->end() || db->statements->size() >= STATEMENT_CACHE_SIZE)
+    {
+        sqlite3_finalize(stmt);
+        return;
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    (*db->statements)[sql] = stmt;
+}
+
+int bind_value(sqlite3_stmt *stmt, int index, cube_native_var *value)
+{
+    switch (value->type)
+    {
+        case TYPE_VOID:
+        case TYPE_NULL:
+            return sqlite3_bind_null(stmt, index);
+        case TYPE_BOOL:
+            return sqlite3_bind_int(stmt, index, AS_NATIVE_BOOL(value) ? 1 : 0);
+        case TYPE_NUMBER: {
+            double number = AS_NATIVE_NUMBER(value);
+            if (number == floor(number) && fabs(number) < 9007199254740992.0)
+                return sqlite3_bind_int64(stmt, index, (sqlite3_int64)number);
+            return sqlite3_bind_double(stmt, index, number);
+        }
+        case TYPE_STRING:
+            return sqlite3_bind_text(stmt, index, AS_NATIVE_STRING(value), -1, SQLITE_TRANSIENT);
+        case TYPE_BYTES:
+            return sqlite3_bind_blob(stmt, index, AS_NATIVE_BYTES(value).bytes, AS_NATIVE_BYTES(value).length,
+                                     SQLITE_TRANSIENT);
+        default:
+            return SQLITE_MISMATCH;
+    }
+}
+
+// A list binds by position (?), a dict by name (:name, @name or $name)
+bool bind_params(DB *db, sqlite3_stmt *stmt, cube_native_var *params)
+{
+    if (params == NULL)
+        return true;
+
+    int rc = SQLITE_OK;
+    if (IS_NATIVE_LIST(params))
+    {
+        if (params->size > sqlite3_bind_parameter_count(stmt))
+            rc = SQLITE_RANGE;
+        for (int i = 0; i < params->size && rc == SQLITE_OK; i++)
+            rc = bind_value(stmt, i + 1, params->list[i]);
+    }
+    else if (IS_NATIVE_DICT(params))
+    {
+        static const char prefixes[] = {':', '@', '$'};
+        for (int i = 0; i < params->size && rc == SQLITE_OK; i++)
+        {
+            cube_native_var *value = params->dict[i];
+            int index = 0;
+            for (int j = 0; j < 3 && index == 0; j++)
+            {
+                std::string name = prefixes[j] + std::string(value->key);
+                index = sqlite3_bind_parameter_index(stmt, name.c_str());
+            }
+            if (index == 0)
+                rc = SQLITE_RANGE;
+            else
+                rc = bind_value(stmt, index, value);
+        }
+    }
+    else if (params->type != TYPE_NULL && params->type != TYPE_VOID)
+        rc = bind_value(stmt, 1, params);
+
+    if (rc == SQLITE_OK)
+        return true;
+
+    if (rc == SQLITE_MISMATCH)
+        db->message = (char *)"Unsupported parameter type";
+    else if (rc == SQLITE_RANGE)
+        db->message = (char *)"Parameter does not match the statement";
+    else
+        keep_error(db);
+    return false;
+}
+
+cube_native_var *column_value(sqlite3_stmt *stmt, int col)
+{
+    switch (sqlite3_column_type(stmt, col))
+    {
+        case SQLITE_INTEGER:
+            return NATIVE_NUMBER((double)sqlite3_column_int64(stmt, col));
+        case SQLITE_FLOAT:
+            return NATIVE_NUMBER(sqlite3_column_double(stmt, col));
+        case SQLITE_TEXT:
+            return NATIVE_STRING_COPY((const char *)sqlite3_column_text(stmt, col));
+        case SQLITE_BLOB: {
+            const void *data = sqlite3_column_blob(stmt, col);
+            int len = sqlite3_column_bytes(stmt, col);
+            return NATIVE_BYTES_COPY(len, (unsigned char *)data);
+        }
+        default:
+            return NATIVE_NULL();
+    }
+}
+
+char *column_name(sqlite3_stmt *stmt, int col)
+{
+    const char *name = sqlite3_column_name(stmt, col);
+    return (char *)columnNames.insert(name == NULL ? "" : name).first->c_str();
+}
+
+// Columnar results name each column once and keep one list per column:
+// {"columns": [names], "values": [[first column], [second column], ...]}
+cube_native_var *new_columns(sqlite3_stmt *stmt)
+{
+    int colCount = sqlite3_column_count(stmt);
+    cube_native_var *names = NATIVE_LIST();
+    cube_native_var *values = NATIVE_LIST();
+    for (int col = 0; col < colCount; col++)
+    {
+        ADD_NATIVE_LIST(names, NATIVE_STRING_COPY(column_name(stmt, col)));
+        ADD_NATIVE_LIST(values, NATIVE_LIST());
+    }
+
+    cube_native_var *result = NATIVE_DICT();
+    ADD_NATIVE_DICT(result, (char *)"columns", names);
+    ADD_NATIVE_DICT(result, (char *)"values", values);
+    return result;
+}
+
+void add_columns(cube_native_var *result, sqlite3_stmt *stmt)
+{
+    cube_native_var *values = result->dict[1];
+    for (int col = 0; col < values->size; col++)
+        ADD_NATIVE_LIST(values->list[col], column_value(stmt, col));
+}
+
+// The current row as a dict of column names or, for tuples, as a list in
+// column order
+cube_native_var *read_row(sqlite3_stmt *stmt, bool tuple)
+{
+    int colCount = sqlite3_column_count(stmt);
+    cube_native_var *row = tuple ? NATIVE_LIST() : NATIVE_DICT();
+    for (int col = 0; col < colCount; col++)
+    {
+        if (tuple)
+            ADD_NATIVE_LIST(row, column_value(stmt, col));
+        else
+            ADD_NATIVE_DICT(row, column_name(stmt, col), column_value(stmt, col));
+    }
+    return row;
+}
+
+// Steps the statement to the end keeping the rows for data()
+bool run_statement(DB *db, sqlite3_stmt *stmt)
+{
+    if (db->columnar && sqlite3_column_count(stmt) > 0)
+        db->data = new_columns(stmt);
+
+    int rc = sqlite3_step(stmt);
+    while (rc == SQLITE_ROW)
+    {
+        if (sqlite3_column_count(stmt) == 0)
+            break;
+
+        if (db->columnar)
+            add_columns(db->data, stmt);
+        else
+        {
+            if (db->data == NULL)
+                db->data = NATIVE_LIST();
+            ADD_NATIVE_LIST(db->data, read_row(stmt, false));
+        }
+        rc = sqlite3_step(stmt);
+    }
+
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+    {
+        db->message = (char *)sqlite3_errmsg(db->db);
+        sqlite3_reset(stmt);
+        return false;
+    }
+
+    sqlite3_reset(stmt);
+    return true;
+}
+
+bool run_sql(DB *db, const char *sql)
+{
+    sqlite3_stmt *stmt = get_statement(db, sql);
+    if (stmt == NULL)
+        return false;
+    return run_statement(db, stmt);
+}
+
 extern "C"
 {
     EXPORTED int open(char *path, bool create)
     {
         DB db;
         db.closed = false;
+        db.columnar = false;
         db.message = NULL;
         db.data = NULL;
         // int rc = sqlite3_open(path, &db.db);
@@ -108,6 +385,8 @@ extern "C"
         if (rc != SQLITE_OK)
             return -1;
 
+        db.statements = new std::unordered_map<std::string, sqlite3_stmt *>();
+        db.error = new std::string();
         dbs.push_back(db);
         return dbs.size() - 1;
     }
@@ -120,6 +399,21 @@ extern "C"
 
         prepare_db(db);
 
+        for (Cursor &cursor : cursors)
+        {
+            if (cursor.db == id && !cursor.closed)
+            {
+                sqlite3_finalize(cursor.stmt);
+                cursor.closed = true;
+            }
+        }
+
+        clear_statements(db);
+        delete db->statements;
+        db->statements = NULL;
+        delete db->error;
+        db->error = NULL;
+
         sqlite3_close(db->db);
 
         db->closed = true;
@@ -133,74 +427,240 @@ extern "C"
             return false;
 
         prepare_db(db);
+        return run_sql(db, sql);
+    }
 
-        cube_native_var *list = NULL;
+    EXPORTED bool executeParams(int id, char *sql, cube_native_var *params)
+    {
+        DB *db;
+        if (!getDB(id, &db))
+            return false;
 
-        sqlite3_stmt *stmt = NULL;
-        int rc = sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL);
-        if (rc != SQLITE_OK)
-        {
-            db->message = (char *)sqlite3_errmsg(db->db);
+        prepare_db(db);
+
+        sqlite3_stmt *stmt = get_statement(db, sql);
+        if (stmt == NULL)
+            return false;
+
+        if (!bind_params(db, stmt, params))
             return false;
+
+        return run_statement(db, stmt);
+    }
+
+    // Runs 'sql' once for each parameter set in 'rows' with a single
+    // transaction around them, unless one is already open. Returns how many
+    // rows were run or -1, in which case nothing was kept
+    EXPORTED int executeBatch(int id, char *sql, cube_native_var *rows)
+    {
+        DB *db;
+        if (!getDB(id, &db))
+            return -1;
+
+        prepare_db(db);
+
+        // Taken out of the cache like a cursor's, so that nothing run while
+        // the batch is open can finalize it
+        sqlite3_stmt *stmt = get_statement(db, sql);
+        if (stmt == NULL)
+            return -1;
+        db->statements->erase(sql);
+
+        bool own = sqlite3_get_autocommit(db->db) != 0;
+        if (own && sqlite3_exec(db->db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+        {
+            keep_error(db);
+            release_statement(db, sql, stmt);
+            return -1;
         }
 
-        int rowCount = 0;
-        rc = sqlite3_step(stmt);
-        while (rc != SQLITE_DONE && rc != SQLITE_OK)
+        int count = 0;
+        bool ok = true;
+        for (int i = 0; i < rows->size && ok; i++)
         {
-            rowCount++;
-            int colCount = sqlite3_column_count(stmt);
-            if (colCount == 0)
-                break;
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+            ok = bind_params(db, stmt, rows->list[i]);
+            if (ok)
+            {
+                int rc;
+                do
+                {
+                    rc = sqlite3_step(stmt);
+                } while (rc == SQLITE_ROW);
 
-            if (db->data == NULL)
-                db->data = NATIVE_NULL();
+                ok = rc == SQLITE_DONE;
+                if (!ok)
+                    keep_error(db);
+            }
+            if (ok)
+                count++;
+        }
+        sqlite3_reset(stmt);
+        release_statement(db, sql, stmt);
 
-            if (list == NULL)
-                list = db->data;
+        if (own)
+        {
+            if (ok && sqlite3_exec(db->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+            {
+                keep_error(db);
+                ok = false;
+            }
+            if (!ok)
+                sqlite3_exec(db->db, "ROLLBACK", NULL, NULL, NULL);
+        }
 
-            if (!IS_NATIVE_LIST(list))
-                TO_NATIVE_LIST(list);
+        return ok ? count : -1;
+    }
 
-            cube_native_var *item = NATIVE_DICT();
+    EXPORTED bool beginTransaction(int id)
+    {
+        DB *db;
+        if (!getDB(id, &db))
+            return false;
+
+        prepare_db(db);
+        return run_sql(db, "BEGIN");
+    }
+
+    EXPORTED bool commitTransaction(int id)
+    {
+        DB *db;
+        if (!getDB(id, &db))
+            return false;
+
+        prepare_db(db);
+        return run_sql(db, "COMMIT");
+    }
+
+    EXPORTED bool rollbackTransaction(int id)
+    {
+        DB *db;
+        if (!getDB(id, &db))
+            return false;
+
+        prepare_db(db);
+        return run_sql(db, "ROLLBACK");
+    }
+
+    // Opens a cursor over the rows of 'sql', nothing is read until fetchRows()
+    EXPORTED int openCursor(int id, char *sql, cube_native_var *params)
+    {
+        DB *db;
+        if (!getDB(id, &db))
+            return -1;
 
-            for (int colIndex = 0; colIndex < colCount; colIndex++)
+        prepare_db(db);
+
+        sqlite3_stmt *stmt = get_statement(db, sql);
+        if (stmt == NULL)
+            return -1;
+        db->statements->erase(sql);
+
+        Cursor cursor;
+        cursor.db = id;
+        cursor.sql = sql;
+        cursor.stmt = stmt;
+        cursor.done = false;
+        cursor.closed = false;
+
+        if (!bind_params(db, stmt, params))
+        {
+            release_statement(db, cursor.sql, stmt);
+            return -1;
+        }
+
+        for (size_t i = 0; i < cursors.size(); i++)
+        {
+            if (cursors[i].closed)
             {
-                int type = sqlite3_column_type(stmt, colIndex);
-                const char *columnName = sqlite3_column_name(stmt, colIndex);
-                if (type == SQLITE_INTEGER)
-                {
-                    int valInt = sqlite3_column_int(stmt, colIndex);
-                    ADD_NATIVE_DICT(item, COPY_STR(columnName), NATIVE_NUMBER(valInt));
-                }
-                else if (type == SQLITE_FLOAT)
-                {
-                    double valDouble = sqlite3_column_double(stmt, colIndex);
-                    ADD_NATIVE_DICT(item, COPY_STR(columnName), NATIVE_NUMBER(valDouble));
-                }
-                else if (type == SQLITE_TEXT)
-                {
-                    const unsigned char *valChar = sqlite3_column_text(stmt, colIndex);
-                    ADD_NATIVE_DICT(item, COPY_STR(columnName), NATIVE_STRING_COPY((const char *)valChar));
-                }
-                else if (type == SQLITE_BLOB)
-                {
-                    const void *data = sqlite3_column_blob(stmt, colIndex);
-                    int len = sqlite3_column_bytes(stmt, colIndex);
-                    ADD_NATIVE_DICT(item, COPY_STR(columnName), NATIVE_BYTES_COPY(len, (unsigned char *)data));
-                }
-                else if (type == SQLITE_NULL)
+                cursors[i] = cursor;
+                return i;
+            }
+        }
+
+        cursors.push_back(cursor);
+        return cursors.size() - 1;
+    }
+
+    // Reads up to 'count' rows (all that are left when 'count' is not
+    // positive) in a RowFormat. No rows means the cursor is exhausted
+    EXPORTED cube_native_var *fetchRows(int id, int count, int format)
+    {
+        Cursor *cursor;
+        if (!getCursor(id, &cursor))
+            return NATIVE_NULL();
+
+        DB *db;
+        if (!getDB(cursor->db, &db))
+            return NATIVE_NULL();
+
+        cube_native_var *list = format == ROWS_COLUMNS ? new_columns(cursor->stmt) : NATIVE_LIST();
+        for (int i = 0; (count <= 0 || i < count) && !cursor->done; i++)
+        {
+            int rc = sqlite3_step(cursor->stmt);
+            if (rc == SQLITE_ROW)
+            {
+                if (format == ROWS_COLUMNS)
+                    add_columns(list, cursor->stmt);
+                else
+                    ADD_NATIVE_LIST(list, read_row(cursor->stmt, format == ROWS_TUPLE));
+            }
+            else
+            {
+                cursor->done = true;
+                if (rc != SQLITE_DONE)
                 {
-                    ADD_NATIVE_DICT(item, COPY_STR(columnName), NATIVE_NULL());
+                    db->message = (char *)sqlite3_errmsg(db->db);
+                    free_all_cube_native_var(list);
+                    return NATIVE_NULL();
                 }
             }
-
-            ADD_NATIVE_LIST(list, item);
-            rc = sqlite3_step(stmt);
         }
 
-        rc = sqlite3_finalize(stmt);
-        return rc == SQLITE_OK;
+        return list;
+    }
+
+    EXPORTED cube_native_var *cursorColumns(int id)
+    {
+        Cursor *cursor;
+        if (!getCursor(id, &cursor))
+            return NATIVE_NULL();
+
+        cube_native_var *list = NATIVE_LIST();
+        int colCount = sqlite3_column_count(cursor->stmt);
+        for (int col = 0; col < colCount; col++)
+            ADD_NATIVE_LIST(list, NATIVE_STRING_COPY(column_name(cursor->stmt, col)));
+        return list;
+    }
+
+    EXPORTED bool closeCursor(int id)
+    {
+        Cursor *cursor;
+        if (!getCursor(id, &cursor))
+            return false;
+
+        DB *db;
+        if (getDB(cursor->db, &db))
+            release_statement(db, cursor->sql, cursor->stmt);
+        else
+            sqlite3_finalize(cursor->stmt);
+
+        cursor->stmt = NULL;
+        cursor->closed = true;
+        return true;
+    }
+
+    // Makes exec and executeParams keep their rows as columns instead of
+    // dicts
+    EXPORTED bool columnar(int id, bool enabled)
+    {
+        DB *db;
+        if (!getDB(id, &db))
+            return false;
+
+        db->columnar = enabled;
+        return true;
     }
 
     EXPORTED cube_native_var *data(int id)
@@ -234,4 +694,4 @@ extern "C"
 
         return sqlite3_last_insert_rowid(db->db);
     }
-}
\ No newline at end of file
+}